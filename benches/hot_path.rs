@@ -0,0 +1,227 @@
+//! Benchmarks for the key-to-exec hot path and config loading.
+//!
+//! Run with `make bench`. `make bench-baseline` records a named baseline under
+//! `target/criterion`, and `make bench-compare` reports every benchmark that
+//! moved relative to it.
+use arc_swap::ArcSwap;
+use clefd::chord_state::{ChordKey, ChordState, MOD_CONTROL_L, MOD_SUPER_L};
+use clefd::key_table::KeyTable;
+use clefd::keybindings::Keybindings;
+use clefd::keyboard_client::KeyboardClient;
+use clefd::keymap_cache;
+use clefd::spawner::Spawner;
+use clefd::stats;
+use clefd::trace_ring::MatchResult;
+use clefd::user_config::UserConfig;
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::fs;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::thread;
+use tempfile::NamedTempFile;
+use xkbcommon::xkb;
+use xkbcommon::xkb::{keysyms, Keycode, Keysym};
+
+/// Config sizes to benchmark parsing and reloading with.
+const CONFIG_SIZES: [usize; 4] = [10, 100, 1_000, 10_000];
+
+/// Modifiers combined to generate distinct chords.
+const MODIFIERS: [&str; 10] = [
+    "Super_L",
+    "Control_L",
+    "Alt_L",
+    "Shift_L",
+    "Hyper_L",
+    "Meta_L",
+    "Super_R",
+    "Control_R",
+    "Alt_R",
+    "Shift_R",
+];
+
+fn init_keymap() -> xkb::Keymap {
+    keymap_cache::default_keymap()
+}
+
+/// Generates a config with `bindings` distinct chords.
+fn generate_config(bindings: usize) -> String {
+    let mut config = String::new();
+
+    for i in 0..bindings {
+        let letter = (b'a' + (i % 26) as u8) as char;
+        let mask = i / 26;
+        assert!(mask < 1 << MODIFIERS.len(), "Too many bindings requested");
+
+        for (bit, modifier) in MODIFIERS.iter().enumerate() {
+            if mask & (1 << bit) != 0 {
+                let _ = write!(config, "{}+", modifier);
+            }
+        }
+        let _ = writeln!(
+            config,
+            "{}: notify-send 'binding {}' \"{}\"",
+            letter, i, letter
+        );
+    }
+
+    config
+}
+
+fn write_config(content: &str) -> NamedTempFile {
+    let file = NamedTempFile::new().expect("Failed to create temporary file");
+    fs::write(file.path(), content).expect("Failed to write config");
+    file
+}
+
+fn bench_chord_state(c: &mut Criterion) {
+    let keymap = init_keymap();
+    let key_table = KeyTable::new(&keymap);
+    let super_l = keymap.key_by_name("LWIN").unwrap();
+    let control_l = keymap.key_by_name("LCTL").unwrap();
+    let w = keymap.key_by_name("AD02").unwrap();
+    let modifier = |keycode: Keycode| key_table.get(keycode).unwrap().modifier();
+
+    let mut group = c.benchmark_group("chord_state");
+
+    group.bench_function("add_remove_key", |b| {
+        let mut state = ChordState::new();
+        b.iter(|| {
+            state.add_key(black_box(w), 0);
+            state.remove_key(black_box(w), 0);
+        })
+    });
+
+    group.bench_function("press_release_chord", |b| {
+        let mut state = ChordState::new();
+        b.iter(|| {
+            state.add_key(super_l, modifier(super_l));
+            state.add_key(control_l, modifier(control_l));
+            state.add_key(w, 0);
+            let chord = state.get_keychord(&key_table);
+            state.remove_key(w, 0);
+            state.remove_key(control_l, modifier(control_l));
+            state.remove_key(super_l, modifier(super_l));
+            black_box(chord)
+        })
+    });
+
+    group.bench_function("get_keychord", |b| {
+        let mut state = ChordState::new();
+        state.add_key(super_l, modifier(super_l));
+        state.add_key(control_l, modifier(control_l));
+        state.add_key(w, 0);
+        b.iter(|| black_box(state.get_keychord(&key_table)))
+    });
+
+    group.finish();
+}
+
+fn bench_parsing(c: &mut Criterion) {
+    let mut group = c.benchmark_group("parse_line");
+    for (name, line) in [
+        ("simple", "Super_L+w: firefox"),
+        (
+            "quoted",
+            "Control_L + Alt_L + Shift_L + Return: notify-send 'hello world' \"say \\\"hi\\\"\"",
+        ),
+        ("comment", "# just a comment"),
+    ] {
+        group.bench_with_input(BenchmarkId::from_parameter(name), line, |b, line| {
+            b.iter(|| black_box(UserConfig::parse_line(black_box(line), 0)))
+        });
+    }
+    group.finish();
+
+    let mut group = c.benchmark_group("read_config");
+    for size in CONFIG_SIZES {
+        let file = write_config(&generate_config(size));
+        group.throughput(Throughput::Elements(size as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &file, |b, file| {
+            b.iter(|| UserConfig::read_config(file.path()).unwrap())
+        });
+    }
+    group.finish();
+}
+
+fn bench_reload(c: &mut Criterion) {
+    let lookup = ChordKey::new(MOD_SUPER_L, Keysym::new(keysyms::KEY_a));
+    let mut group = c.benchmark_group("reload_config_with_readers");
+
+    for size in CONFIG_SIZES {
+        let file = write_config(&generate_config(size));
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+        let stop = Arc::new(AtomicBool::new(false));
+
+        // Readers hammer the snapshot the way the event thread does.
+        let readers: Vec<_> = (0..2)
+            .map(|_| {
+                let keybindings = keybindings.clone();
+                let stop = stop.clone();
+                thread::spawn(move || {
+                    while !stop.load(Ordering::Relaxed) {
+                        black_box(keybindings.load().get(&lookup).cloned());
+                    }
+                })
+            })
+            .collect();
+
+        group.throughput(Throughput::Elements(size as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &file, |b, file| {
+            b.iter(|| UserConfig::reload_config(file.path(), &keybindings).unwrap())
+        });
+
+        stop.store(true, Ordering::Relaxed);
+        for reader in readers {
+            reader.join().unwrap();
+        }
+    }
+
+    group.finish();
+}
+
+fn bench_exec_action(c: &mut Criterion) {
+    let keymap = init_keymap();
+    let file = write_config("Control_L+x: /bin/true\n");
+    let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+    UserConfig::reload_config(file.path(), &keybindings).unwrap();
+
+    let mut kb_client = KeyboardClient::new(
+        keybindings,
+        ChordState::new(),
+        KeyTable::new(&keymap),
+        Spawner::new().unwrap(),
+    );
+    // Every iteration must really spawn, never wait for a job slot.
+    kb_client.set_max_jobs(usize::MAX);
+
+    let mut group = c.benchmark_group("exec_action");
+
+    let miss = ChordKey::new(MOD_CONTROL_L, Keysym::new(keysyms::KEY_y));
+    group.bench_function("lookup_miss", |b| {
+        b.iter(|| kb_client.exec_action(black_box(&miss), stats::monotonic_usec()))
+    });
+
+    let hit = ChordKey::new(MOD_CONTROL_L, Keysym::new(keysyms::KEY_x));
+    group.bench_function("lookup_and_spawn", |b| {
+        b.iter(|| {
+            let result = kb_client
+                .exec_action(black_box(&hit), stats::monotonic_usec())
+                .unwrap();
+            assert_eq!(result, MatchResult::Run);
+            kb_client.reap_exited();
+        })
+    });
+
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    bench_chord_state,
+    bench_parsing,
+    bench_reload,
+    bench_exec_action
+);
+criterion_main!(benches);
@@ -0,0 +1,72 @@
+//! Replays a key event trace recorded with `clefd --record` and reports the
+//! throughput, per-event cost and heap allocations of the event handler.
+//!
+//! Usage: `cargo run --release --example replay -- <TRACE> [CONFIG] [ROUNDS]`
+//!
+//! Without a config no binding matches, which measures the pure chord
+//! tracking cost. Commands in the given config are really spawned, so use one
+//! whose commands are harmless, e.g. `/bin/true`. After the first round the
+//! handler should not allocate at all.
+use anyhow::{anyhow, Result};
+use arc_swap::ArcSwap;
+use clefd::alloc_count::{self, CountingAlloc};
+use clefd::chord_state::ChordState;
+use clefd::key_table::KeyTable;
+use clefd::keybindings::Keybindings;
+use clefd::keyboard_client::KeyboardClient;
+use clefd::keymap_cache::Rmlvo;
+use clefd::recording;
+use clefd::spawner::Spawner;
+use clefd::user_config::UserConfig;
+use std::collections::HashMap;
+use std::path::PathBuf;
+use std::sync::Arc;
+use xkbcommon::xkb;
+
+#[global_allocator]
+static ALLOCATOR: CountingAlloc = CountingAlloc;
+
+fn main() -> Result<()> {
+    let mut args = std::env::args().skip(1);
+    let trace = args
+        .next()
+        .map(PathBuf::from)
+        .ok_or_else(|| anyhow!("Usage: replay <TRACE> [CONFIG] [ROUNDS]"))?;
+    let config = args.next().map(PathBuf::from);
+    let rounds: usize = args.next().map(|n| n.parse()).transpose()?.unwrap_or(10);
+
+    let events = recording::load(&trace)?;
+
+    let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+    let keymap = Rmlvo::from_env().compile(&context)?;
+
+    let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+    if let Some(config) = &config {
+        UserConfig::reload_config(config, &keybindings)?;
+    }
+
+    let mut kb_client = KeyboardClient::new(
+        keybindings,
+        ChordState::new(),
+        KeyTable::new(&keymap),
+        Spawner::new()?,
+    );
+
+    println!("Replaying {} events, {} rounds", events.len(), rounds);
+    for round in 1..=rounds {
+        let (report, allocations) =
+            alloc_count::count_allocations(|| recording::replay(&mut kb_client, &events));
+        kb_client.reap_exited();
+        println!(
+            "round {:>3}: {:>12.0} events/s, {:>8.1?} per event, {} allocations",
+            round,
+            report.events_per_sec(),
+            report.per_event(),
+            allocations
+        );
+    }
+
+    print!("{}", kb_client.stats().report());
+
+    Ok(())
+}
@@ -0,0 +1,710 @@
+//! Soaks a running daemon with synthetic key presses from virtual keyboards
+//! and reports its trigger latency, CPU and memory use, and leaked zombies
+//! and file descriptors as JSON lines.
+//!
+//! Usage: `make soak`, or
+//! `cargo run --release --example soak -- --daemon target/release/clefd`
+//!
+//! The harness creates keyboards through `/dev/uinput`, starts the daemon
+//! binary with a private config and cache directory and only its own
+//! keyboards allowed, and presses F13 to F24 at a fixed rate. Most of these
+//! keys are bound to `@fifo` actions writing to a FIFO the harness reads, which
+//! times every press until its binding fired; one key spawns `/bin/true` to
+//! exercise spawning and reaping. While keys are pressed, the config is
+//! replaced at a fixed interval and a batch of keyboards is plugged in at a
+//! quarter of the run and removed again at three quarters. Every config
+//! generation writes its number into the FIFO payloads, so each reload
+//! changes real bindings and the harness sees which generations fired.
+//!
+//! Every second a `sample` line reports the daemon's CPU use, resident memory,
+//! open descriptors and zombie children, and a final `summary` line the
+//! latency percentiles and totals, including how many reloads published
+//! bindings that fired. The harness fails if descriptors or zombies were left
+//! behind, if no binding fired at all, or if no reload ever took effect.
+//!
+//! This needs write access to `/dev/uinput`, read access to the input devices
+//! and a running udev. The injected keys also reach the running session, so
+//! use a test machine or a VT without a compositor.
+use anyhow::{anyhow, bail, Context, Result};
+use clap::Parser;
+use clefd::key_table::KeyTable;
+use clefd::keymap_cache::Rmlvo;
+use nix::sys::signal::{self, Signal};
+use nix::unistd::Pid;
+use std::collections::HashSet;
+use std::ffi::CString;
+use std::fmt::Write as _;
+use std::fs::{self, File, OpenOptions};
+use std::io::{BufRead, BufReader, Write};
+use std::os::fd::AsRawFd;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::OpenOptionsExt;
+use std::path::{Path, PathBuf};
+use std::process::{Child, Command};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+use xkbcommon::xkb;
+
+/// The name of every virtual keyboard, which the daemon is restricted to.
+const DEVICE_NAME: &str = "clefd soak keyboard";
+
+/// The evdev codes of F13 to F24, which no physical keyboard sends.
+const KEYS: std::ops::RangeInclusive<u16> = 183..=194;
+
+/// The version of the output format.
+const FORMAT_VERSION: u32 = 1;
+
+/// How long a press may go unanswered before it counts as lost.
+const LOST_AFTER: Duration = Duration::from_secs(1);
+
+/// How long keyboards take to be tagged by udev and opened by the daemon.
+const SETTLE: Duration = Duration::from_secs(1);
+
+/// Every how many presses the spawning key is pressed.
+const SPAWN_EVERY: u64 = 10;
+
+const EV_SYN: u16 = 0x00;
+const EV_KEY: u16 = 0x01;
+const SYN_REPORT: u16 = 0;
+const BUS_VIRTUAL: u16 = 0x06;
+
+nix::ioctl_none!(ui_dev_create, b'U', 1);
+nix::ioctl_none!(ui_dev_destroy, b'U', 2);
+nix::ioctl_write_ptr!(ui_dev_setup, b'U', 3, libc::uinput_setup);
+nix::ioctl_write_int!(ui_set_evbit, b'U', 100);
+nix::ioctl_write_int!(ui_set_keybit, b'U', 101);
+
+#[derive(Parser, Debug)]
+#[command(about = "Soaks the clefd daemon with synthetic key presses.")]
+struct Args {
+    /// The daemon binary to soak.
+    #[arg(long, value_name = "PATH", default_value = "target/release/clefd")]
+    daemon: PathBuf,
+
+    /// How long to press keys, in seconds.
+    #[arg(long, value_name = "SECS", default_value_t = 60)]
+    duration: u64,
+
+    /// Key presses per second, spread over all plugged-in keyboards.
+    #[arg(long, value_name = "N", default_value_t = 1000)]
+    rate: u64,
+
+    /// How many keyboards to plug in at once during the run.
+    #[arg(long, value_name = "N", default_value_t = 16)]
+    keyboards: usize,
+
+    /// How often to replace the config, in milliseconds (0 to never).
+    #[arg(long, value_name = "MS", default_value_t = 500)]
+    reload_interval: u64,
+
+    /// Write the report to PATH instead of stdout.
+    #[arg(long, value_name = "PATH")]
+    output: Option<PathBuf>,
+}
+
+/// A virtual keyboard, removed again when dropped.
+struct VirtualKeyboard {
+    file: File,
+}
+
+impl VirtualKeyboard {
+    /// Creates a keyboard with every key of the main block, so udev tags it
+    /// as a keyboard.
+    fn create() -> Result<Self> {
+        let file = OpenOptions::new()
+            .write(true)
+            .custom_flags(libc::O_NONBLOCK)
+            .open("/dev/uinput")
+            .context("Failed to open /dev/uinput")?;
+        let fd = file.as_raw_fd();
+
+        let mut setup: libc::uinput_setup = unsafe { std::mem::zeroed() };
+        setup.id.bustype = BUS_VIRTUAL;
+        setup.id.vendor = 0x1234;
+        setup.id.product = 0x5678;
+        for (dst, src) in setup.name.iter_mut().zip(DEVICE_NAME.bytes()) {
+            *dst = src as libc::c_char;
+        }
+
+        // SAFETY: the descriptor is an open uinput device and `setup` lives
+        // across the calls.
+        unsafe {
+            ui_set_evbit(fd, EV_KEY.into())?;
+            for key in 1..=255 {
+                ui_set_keybit(fd, key)?;
+            }
+            ui_dev_setup(fd, &setup)?;
+            ui_dev_create(fd)?;
+        }
+        Ok(Self { file })
+    }
+
+    /// Presses and releases a key, each followed by a report.
+    fn tap(&mut self, key: u16) -> Result<()> {
+        let zero = libc::timeval {
+            tv_sec: 0,
+            tv_usec: 0,
+        };
+        let event = |type_, code, value| libc::input_event {
+            time: zero,
+            type_,
+            code,
+            value,
+        };
+        let events = [
+            event(EV_KEY, key, 1),
+            event(EV_SYN, SYN_REPORT, 0),
+            event(EV_KEY, key, 0),
+            event(EV_SYN, SYN_REPORT, 0),
+        ];
+        // SAFETY: input_event is plain old data.
+        let bytes = unsafe {
+            std::slice::from_raw_parts(events.as_ptr().cast::<u8>(), std::mem::size_of_val(&events))
+        };
+        self.file.write_all(bytes).context("Failed to inject key")
+    }
+}
+
+impl Drop for VirtualKeyboard {
+    fn drop(&mut self) {
+        // SAFETY: the descriptor is an open uinput device.
+        let _ = unsafe { ui_dev_destroy(self.file.as_raw_fd()) };
+    }
+}
+
+/// The presses still waiting for their binding, one at most per key.
+#[derive(Default)]
+struct Pending {
+    sent: Vec<Option<Instant>>,
+    latencies_us: Vec<u64>,
+    received: u64,
+    lost: u64,
+    /// The config generations whose bindings have fired.
+    generations: HashSet<u64>,
+}
+
+impl Pending {
+    /// Drops presses that went unanswered for too long.
+    fn expire(&mut self, now: Instant) {
+        for sent in &mut self.sent {
+            if sent.is_some_and(|sent| now - sent > LOST_AFTER) {
+                *sent = None;
+                self.lost += 1;
+            }
+        }
+    }
+}
+
+/// One measurement of the daemon's resource use.
+#[derive(Debug, Clone, Copy)]
+struct Sample {
+    elapsed: f64,
+    cpu_percent: f64,
+    rss_kib: u64,
+    fds: usize,
+    zombies: usize,
+}
+
+impl Sample {
+    fn to_json(self) -> String {
+        format!(
+            "{{\"type\":\"sample\",\"elapsed_s\":{:.3},\"cpu_percent\":{:.2},\"rss_kib\":{},\
+             \"fds\":{},\"zombies\":{}}}",
+            self.elapsed, self.cpu_percent, self.rss_kib, self.fds, self.zombies
+        )
+    }
+}
+
+/// Reads the resource use of a process from `/proc`.
+struct ProcessProbe {
+    pid: u32,
+    clock_ticks: f64,
+    last: Option<(Instant, u64)>,
+}
+
+impl ProcessProbe {
+    fn new(pid: u32) -> Self {
+        // SAFETY: sysconf(3) has no preconditions.
+        let clock_ticks = unsafe { libc::sysconf(libc::_SC_CLK_TCK) } as f64;
+        Self {
+            pid,
+            clock_ticks,
+            last: None,
+        }
+    }
+
+    /// Returns the fields of a `/proc/PID/stat` file after the command name,
+    /// starting with the state.
+    fn stat_fields(pid: &str) -> Option<Vec<String>> {
+        let stat = fs::read_to_string(format!("/proc/{}/stat", pid)).ok()?;
+        let (_, rest) = stat.rsplit_once(')')?;
+        Some(rest.split_whitespace().map(String::from).collect())
+    }
+
+    /// Returns the user and system time of the process in clock ticks.
+    fn cpu_ticks(&self) -> Option<u64> {
+        let fields = Self::stat_fields(&self.pid.to_string())?;
+        let utime: u64 = fields.get(11)?.parse().ok()?;
+        let stime: u64 = fields.get(12)?.parse().ok()?;
+        Some(utime + stime)
+    }
+
+    fn rss_kib(&self) -> Option<u64> {
+        let status = fs::read_to_string(format!("/proc/{}/status", self.pid)).ok()?;
+        status
+            .lines()
+            .find_map(|line| line.strip_prefix("VmRSS:"))
+            .and_then(|rss| rss.trim().trim_end_matches("kB").trim().parse().ok())
+    }
+
+    fn fds(&self) -> usize {
+        fs::read_dir(format!("/proc/{}/fd", self.pid)).map_or(0, |dir| dir.count())
+    }
+
+    /// Counts the children of the process that exited but were not reaped.
+    fn zombies(&self) -> usize {
+        let Ok(procs) = fs::read_dir("/proc") else {
+            return 0;
+        };
+        let ppid = self.pid.to_string();
+        procs
+            .filter_map(|entry| entry.ok())
+            .filter_map(|entry| Self::stat_fields(&entry.file_name().to_string_lossy()))
+            .filter(|fields| fields.first().map(String::as_str) == Some("Z"))
+            .filter(|fields| fields.get(1) == Some(&ppid))
+            .count()
+    }
+
+    /// Measures the process, its CPU use averaged since the last sample.
+    fn sample(&mut self, start: Instant) -> Sample {
+        let now = Instant::now();
+        let ticks = self.cpu_ticks().unwrap_or(0);
+        let cpu_percent = match self.last {
+            Some((then, last_ticks)) => {
+                let busy = ticks.saturating_sub(last_ticks) as f64 / self.clock_ticks;
+                100.0 * busy / (now - then).as_secs_f64()
+            }
+            None => 0.0,
+        };
+        self.last = Some((now, ticks));
+
+        Sample {
+            elapsed: (now - start).as_secs_f64(),
+            cpu_percent,
+            rss_kib: self.rss_kib().unwrap_or(0),
+            fds: self.fds(),
+            zombies: self.zombies(),
+        }
+    }
+}
+
+/// The private directories and files of one soak run.
+struct Workspace {
+    dir: tempfile::TempDir,
+    config_path: PathBuf,
+    fifo_path: PathBuf,
+}
+
+impl Workspace {
+    fn new() -> Result<Self> {
+        let dir = tempfile::tempdir()?;
+        let config_dir = dir.path().join("config").join("clefd");
+        fs::create_dir_all(&config_dir)?;
+        fs::create_dir_all(dir.path().join("cache"))?;
+
+        let fifo_path = dir.path().join("soak.fifo");
+        let fifo = CString::new(fifo_path.as_os_str().as_bytes())?;
+        // SAFETY: the path is a valid C string.
+        if unsafe { libc::mkfifo(fifo.as_ptr(), 0o600) } != 0 {
+            return Err(std::io::Error::last_os_error()).context("Failed to create FIFO");
+        }
+
+        Ok(Self {
+            config_path: config_dir.join("clefdrc"),
+            fifo_path,
+            dir,
+        })
+    }
+
+    /// Replaces the config the way editors do, by renaming a new file into
+    /// place.
+    ///
+    /// # Arguments
+    /// * `keys` - The keysym names of the keys, the last one spawning.
+    /// * `generation` - Written into every `@fifo` payload, so each reload
+    ///   changes real bindings and the reader sees which config fired.
+    fn write_config(&self, keys: &[String], generation: u64) -> Result<()> {
+        let mut config = format!("# Generation {}\n", generation);
+        let (spawn_key, fifo_keys) = keys.split_last().ok_or_else(|| anyhow!("No keys"))?;
+        for (i, key) in fifo_keys.iter().enumerate() {
+            writeln!(
+                config,
+                "{} : @fifo {} k{}.{}",
+                key,
+                self.fifo_path.display(),
+                i,
+                generation
+            )?;
+        }
+        writeln!(config, "{} : /bin/true", spawn_key)?;
+
+        let tmp = self.config_path.with_file_name(".clefdrc.tmp");
+        fs::write(&tmp, config)?;
+        fs::rename(&tmp, &self.config_path)?;
+        Ok(())
+    }
+
+    fn start_daemon(&self, daemon: &Path) -> Result<Daemon> {
+        let child = Command::new(daemon)
+            .arg("--allow-device")
+            .arg(DEVICE_NAME)
+            .arg("--ignore-session")
+            .env("XDG_CONFIG_HOME", self.dir.path().join("config"))
+            .env("XDG_CACHE_HOME", self.dir.path().join("cache"))
+            .env(
+                "RUST_LOG",
+                std::env::var("RUST_LOG").unwrap_or_else(|_| "warn".into()),
+            )
+            .spawn()
+            .context(format!("Failed to start {:?}", daemon))?;
+        Ok(Daemon(Some(child)))
+    }
+}
+
+/// The daemon under test, stopped when dropped so an early return does not
+/// leave it running after the workspace is removed.
+struct Daemon(Option<Child>);
+
+impl Daemon {
+    fn id(&self) -> u32 {
+        self.0.as_ref().map_or(0, Child::id)
+    }
+
+    /// Asks the daemon to exit with SIGTERM and reaps it.
+    fn stop(mut self) -> Result<()> {
+        match self.0.take() {
+            Some(child) => Self::terminate(child),
+            None => Ok(()),
+        }
+    }
+
+    fn terminate(mut child: Child) -> Result<()> {
+        signal::kill(Pid::from_raw(child.id() as i32), Signal::SIGTERM)?;
+        let killed_by = Instant::now() + Duration::from_secs(5);
+        while child.try_wait()?.is_none() {
+            if Instant::now() > killed_by {
+                child.kill()?;
+                child.wait()?;
+                bail!("The daemon did not exit within 5 s of SIGTERM");
+            }
+            thread::sleep(Duration::from_millis(10));
+        }
+        Ok(())
+    }
+}
+
+impl Drop for Daemon {
+    fn drop(&mut self) {
+        if let Some(child) = self.0.take() {
+            if let Err(e) = Self::terminate(child) {
+                eprintln!("Failed to stop the daemon: {:#}", e);
+            }
+        }
+    }
+}
+
+/// Resolves the evdev codes of [`KEYS`] to keysym names in the current
+/// keymap, skipping keys without a keysym.
+fn key_names() -> Result<Vec<(u16, String)>> {
+    let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+    let keymap = Rmlvo::from_env().compile(&context)?;
+    let table = KeyTable::new(&keymap);
+
+    let keys: Vec<(u16, String)> = KEYS
+        .filter_map(|code| {
+            let entry = table.get((u32::from(code) + 8).into())?;
+            (entry.name() != "NoSymbol" && !entry.is_modifier())
+                .then(|| (code, entry.name().to_string()))
+        })
+        .collect();
+    if keys.len() < 2 {
+        bail!("The keymap binds fewer than two of F13 to F24");
+    }
+    Ok(keys)
+}
+
+/// Reads the FIFO and matches every line to the press that caused it.
+fn spawn_reader(fifo: File, pending: Arc<Mutex<Pending>>) -> JoinHandle<()> {
+    thread::spawn(move || {
+        for line in BufReader::new(fifo).lines() {
+            let Ok(line) = line else { break };
+            if line == "done" {
+                break;
+            }
+            let Some((index, generation)) = line
+                .strip_prefix('k')
+                .and_then(|payload| payload.split_once('.'))
+                .and_then(|(i, g)| Some((i.parse::<usize>().ok()?, g.parse::<u64>().ok()?)))
+            else {
+                continue;
+            };
+
+            let now = Instant::now();
+            let mut pending = pending.lock().unwrap();
+            if let Some(sent) = pending.sent.get_mut(index).and_then(Option::take) {
+                pending.latencies_us.push((now - sent).as_micros() as u64);
+                pending.received += 1;
+            }
+            pending.generations.insert(generation);
+        }
+    })
+}
+
+/// Samples the daemon every second until stopped.
+fn spawn_sampler(
+    mut probe: ProcessProbe,
+    start: Instant,
+    stop: Arc<AtomicBool>,
+    out: Arc<Mutex<Box<dyn Write + Send>>>,
+) -> JoinHandle<Vec<Sample>> {
+    thread::spawn(move || {
+        let mut samples = Vec::new();
+        while !stop.load(Ordering::Relaxed) {
+            let sample = probe.sample(start);
+            let _ = writeln!(out.lock().unwrap(), "{}", sample.to_json());
+            samples.push(sample);
+            thread::sleep(Duration::from_secs(1));
+        }
+        samples
+    })
+}
+
+/// Returns the `q` quantile of sorted values.
+fn percentile(sorted: &[u64], q: f64) -> u64 {
+    if sorted.is_empty() {
+        return 0;
+    }
+    let rank = ((sorted.len() - 1) as f64 * q).round() as usize;
+    sorted[rank]
+}
+
+fn main() -> Result<()> {
+    let args = Args::parse();
+    let out: Box<dyn Write + Send> = match &args.output {
+        Some(path) => Box::new(File::create(path)?),
+        None => Box::new(std::io::stdout()),
+    };
+    let out = Arc::new(Mutex::new(out));
+
+    let keys = key_names()?;
+    let names: Vec<String> = keys.iter().map(|(_, name)| name.clone()).collect();
+    let (spawn_code, _) = *keys.last().unwrap();
+    let fifo_codes: Vec<u16> = keys[..keys.len() - 1]
+        .iter()
+        .map(|(code, _)| *code)
+        .collect();
+
+    let workspace = Workspace::new()?;
+    let mut generation = 0;
+    workspace.write_config(&names, generation)?;
+
+    // Keep a writer open, so the reader never sees the end of the FIFO while
+    // the daemon reopens it.
+    let fifo = OpenOptions::new()
+        .read(true)
+        .custom_flags(libc::O_NONBLOCK)
+        .open(&workspace.fifo_path)?;
+    let mut fifo_writer = OpenOptions::new().write(true).open(&workspace.fifo_path)?;
+    // SAFETY: the descriptor is open; clearing O_NONBLOCK makes reads wait.
+    unsafe { libc::fcntl(fifo.as_raw_fd(), libc::F_SETFL, 0) };
+
+    let pending = Arc::new(Mutex::new(Pending {
+        sent: vec![None; fifo_codes.len()],
+        ..Pending::default()
+    }));
+    let reader = spawn_reader(fifo, pending.clone());
+
+    let mut keyboard = VirtualKeyboard::create()?;
+    thread::sleep(SETTLE);
+    let daemon = workspace.start_daemon(&args.daemon)?;
+    let mut probe = ProcessProbe::new(daemon.id());
+
+    // Wait until the daemon has opened the keyboard and fires bindings.
+    let ready_by = Instant::now() + Duration::from_secs(10);
+    loop {
+        pending.lock().unwrap().sent[0] = Some(Instant::now());
+        keyboard.tap(fifo_codes[0])?;
+        thread::sleep(Duration::from_millis(100));
+        if pending.lock().unwrap().received > 0 {
+            break;
+        }
+        if Instant::now() > ready_by {
+            bail!("The daemon did not fire a binding within 10 s");
+        }
+    }
+    *pending.lock().unwrap() = Pending {
+        sent: vec![None; fifo_codes.len()],
+        ..Pending::default()
+    };
+
+    let start = Instant::now();
+    let baseline = probe.sample(start);
+    let stop = Arc::new(AtomicBool::new(false));
+    let sampler = spawn_sampler(probe, start, stop.clone(), out.clone());
+
+    let duration = Duration::from_secs(args.duration);
+    let interval = Duration::from_secs_f64(1.0 / args.rate.max(1) as f64);
+    let reload_interval = Duration::from_millis(args.reload_interval);
+    let mut hotplugged: Vec<VirtualKeyboard> = Vec::new();
+    let mut hotplug_ready = None;
+    let mut hotplugs = 0;
+    let mut reloads = 0;
+    let mut presses = 0u64;
+    let mut spawns = 0u64;
+    let mut throttled = 0u64;
+    let mut next_key = 0;
+    let mut next_press = start;
+    let mut next_reload = start + reload_interval;
+
+    while start.elapsed() < duration {
+        let now = Instant::now();
+        if args.reload_interval > 0 && now >= next_reload {
+            generation += 1;
+            workspace.write_config(&names, generation)?;
+            reloads += 1;
+            next_reload += reload_interval;
+        }
+        if hotplugs == 0 && now - start >= duration / 4 {
+            for _ in 0..args.keyboards {
+                hotplugged.push(VirtualKeyboard::create()?);
+            }
+            hotplug_ready = Some(now + SETTLE);
+            hotplugs += 1;
+        }
+        if hotplugs == 1 && now - start >= duration * 3 / 4 {
+            hotplugged.clear();
+            hotplug_ready = None;
+            hotplugs += 1;
+        }
+
+        // Spread presses over every keyboard the daemon has had time to open.
+        let device = match hotplug_ready {
+            Some(ready) if now >= ready => (presses as usize) % (hotplugged.len() + 1),
+            _ => 0,
+        };
+        let target = match device {
+            0 => &mut keyboard,
+            n => &mut hotplugged[n - 1],
+        };
+
+        presses += 1;
+        if presses % SPAWN_EVERY == 0 {
+            target.tap(spawn_code)?;
+            spawns += 1;
+        } else {
+            // Only press keys whose last press was answered, so every line
+            // read from the FIFO matches exactly one press.
+            let mut pending = pending.lock().unwrap();
+            pending.expire(now);
+            let free = (0..fifo_codes.len())
+                .map(|i| (next_key + i) % fifo_codes.len())
+                .find(|&i| pending.sent[i].is_none());
+            match free {
+                Some(i) => {
+                    pending.sent[i] = Some(Instant::now());
+                    drop(pending);
+                    target.tap(fifo_codes[i])?;
+                    next_key = i + 1;
+                }
+                None => throttled += 1,
+            }
+        }
+
+        next_press += interval;
+        if let Some(wait) = next_press.checked_duration_since(Instant::now()) {
+            thread::sleep(wait);
+        }
+    }
+    let elapsed = start.elapsed();
+
+    // Give the last presses, children and removed keyboards time to settle.
+    drop(hotplugged);
+    thread::sleep(LOST_AFTER + SETTLE);
+    stop.store(true, Ordering::Relaxed);
+    let samples = sampler.join().map_err(|_| anyhow!("Sampler panicked"))?;
+    let mut probe = ProcessProbe::new(daemon.id());
+    let last = probe.sample(start);
+
+    daemon.stop()?;
+    writeln!(fifo_writer, "done")?;
+    reader.join().map_err(|_| anyhow!("Reader panicked"))?;
+
+    let mut pending = pending.lock().unwrap();
+    let outstanding = pending.sent.iter().filter(|sent| sent.is_some()).count() as u64;
+    let lost = pending.lost + outstanding;
+    pending.latencies_us.sort_unstable();
+    let latencies = &pending.latencies_us;
+
+    let cpu_mean = match samples.len() {
+        0 | 1 => 0.0,
+        n => samples[1..].iter().map(|s| s.cpu_percent).sum::<f64>() / (n - 1) as f64,
+    };
+    let rss_max = samples.iter().map(|s| s.rss_kib).max().unwrap_or(0);
+    let zombies_max = samples.iter().map(|s| s.zombies).max().unwrap_or(0);
+    let leaked_fds = last.fds.saturating_sub(baseline.fds);
+    // A reload only counts once a binding of its config has fired, which
+    // shows the daemon published a new table for it.
+    let published = pending.generations.iter().filter(|&&g| g > 0).count();
+    let ok = pending.received > 0
+        && (reloads == 0 || published > 0)
+        && leaked_fds == 0
+        && last.zombies == 0;
+
+    writeln!(
+        out.lock().unwrap(),
+        "{{\"type\":\"summary\",\"version\":{},\"duration_s\":{:.3},\"rate\":{},\
+         \"keyboards\":{},\"presses\":{},\"spawns\":{},\"throttled\":{},\"received\":{},\
+         \"lost\":{},\"latency_us\":{{\"p50\":{},\"p99\":{},\"max\":{}}},\
+         \"cpu_percent_mean\":{:.2},\"rss_kib\":{{\"start\":{},\"max\":{},\"end\":{}}},\
+         \"fds\":{{\"start\":{},\"end\":{}}},\"zombies\":{{\"max\":{},\"end\":{}}},\
+         \"reloads\":{},\"reloads_published\":{},\"ok\":{}}}",
+        FORMAT_VERSION,
+        elapsed.as_secs_f64(),
+        args.rate,
+        args.keyboards,
+        presses,
+        spawns,
+        throttled,
+        pending.received,
+        lost,
+        percentile(latencies, 0.50),
+        percentile(latencies, 0.99),
+        latencies.last().copied().unwrap_or(0),
+        cpu_mean,
+        baseline.rss_kib,
+        rss_max.max(last.rss_kib),
+        last.rss_kib,
+        baseline.fds,
+        last.fds,
+        zombies_max.max(last.zombies),
+        last.zombies,
+        reloads,
+        published,
+        ok
+    )?;
+
+    if !ok {
+        bail!(
+            "Soak failed: {} bindings fired, {} of {} reloads published, {} descriptors \
+             and {} zombies leaked",
+            pending.received,
+            published,
+            reloads,
+            leaked_fds,
+            last.zombies
+        );
+    }
+    Ok(())
+}
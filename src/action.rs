@@ -0,0 +1,429 @@
+//! Provides pre-parsed, ready-to-spawn commands for keybindings.
+//!
+//! Binding values are tokenized once when the config is loaded, using a small
+//! shell-like grammar: words are separated by whitespace, single quotes keep
+//! their contents literally, double quotes allow `\"`, `\\`, `\$` and `` \` ``
+//! escapes, and a backslash outside quotes escapes the next character. No
+//! variable expansion, globbing or pipelines are performed; the resulting
+//! argv is handed straight to the spawned program.
+//!
+//! An [`Action`] is immutable once built, so the event thread only needs to
+//! clone an `Arc<Action>` out of the keybindings table before spawning it.
+//! Besides the argv itself, an action keeps it packed as NUL-terminated words
+//! back to back, which is the wire format of the spawner's launcher.
+//!
+//! When the bindings are loaded, [`Action::resolve`] looks a bare program
+//! name up in PATH once, so spawning can exec its absolute path directly.
+//!
+//! Commands whose first word starts with `@` name a [`Builtin`] action, which
+//! the daemon carries out itself instead of spawning a process:
+//!
+//! - `@fifo PATH WORDS...` writes the words and a newline to the FIFO at PATH.
+//! - `@socket PATH WORDS...` sends the words as one datagram to the Unix
+//!   socket at PATH.
+use crate::path_search::ProgramResolver;
+use crate::scheduler::JobPolicy;
+use anyhow::{anyhow, Result};
+use std::ffi::{CString, OsStr};
+use std::os::unix::ffi::OsStrExt;
+use std::path::{Path, PathBuf};
+
+/// Maximum number of words in a command, so spawning can keep the argv
+/// pointer array on the stack.
+pub const MAX_ARGV: usize = 255;
+
+/// An action the daemon carries out without spawning a process.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum Builtin {
+    /// Writes the payload, terminated by a newline, to a FIFO.
+    Fifo { path: PathBuf, payload: Box<[u8]> },
+    /// Sends the payload as a single datagram to a Unix socket.
+    Socket { path: PathBuf, payload: Box<[u8]> },
+}
+
+impl Builtin {
+    /// Recognizes a built-in action from the words of a command.
+    ///
+    /// # Returns
+    /// `None` for external commands, or an error for an unknown or
+    /// incomplete built-in.
+    fn from_argv(argv: &[CString]) -> Result<Option<Self>> {
+        let name = argv[0].to_bytes();
+        if !name.starts_with(b"@") {
+            return Ok(None);
+        }
+
+        let name = String::from_utf8_lossy(name);
+        let path = argv
+            .get(1)
+            .map(|path| PathBuf::from(OsStr::from_bytes(path.to_bytes())))
+            .ok_or_else(|| anyhow!("Built-in action '{}' needs a path", name))?;
+        let payload = argv[2..]
+            .iter()
+            .map(|word| word.to_bytes())
+            .collect::<Vec<&[u8]>>()
+            .join(&b' ')
+            .into_boxed_slice();
+
+        match &*name {
+            "@fifo" => {
+                let mut line = payload.into_vec();
+                line.push(b'\n');
+                Ok(Some(Self::Fifo {
+                    path,
+                    payload: line.into(),
+                }))
+            }
+            "@socket" => Ok(Some(Self::Socket { path, payload })),
+            _ => Err(anyhow!("Unknown built-in action '{}'", name)),
+        }
+    }
+}
+
+/// A command tokenized at config load time.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Action {
+    raw: String,
+    argv: Vec<CString>,
+    packed_argv: Box<[u8]>,
+    builtin: Option<Builtin>,
+    policy: JobPolicy,
+    exec_path: Option<CString>,
+}
+
+impl Action {
+    /// Parses a binding value into an action.
+    ///
+    /// # Arguments
+    /// * `raw` - The command string as written in the config.
+    ///
+    /// # Returns
+    /// An error if the command is empty, has an unterminated quote or escape,
+    /// contains a NUL byte, names a program path that does not exist, or is
+    /// an invalid built-in action.
+    pub fn parse(raw: &str) -> Result<Self> {
+        let words = Self::tokenize(raw)?;
+
+        if words.is_empty() {
+            return Err(anyhow!("Empty command"));
+        }
+
+        if words.len() > MAX_ARGV {
+            return Err(anyhow!("Command has more than {} words", MAX_ARGV));
+        }
+
+        // Programs given by path can be checked right away; bare names are
+        // looked up in PATH when spawned.
+        if words[0].contains('/') && !Path::new(&words[0]).is_file() {
+            return Err(anyhow!("Program '{}' does not exist", words[0]));
+        }
+
+        let argv = words
+            .into_iter()
+            .map(|word| CString::new(word).map_err(|_| anyhow!("Command contains a NUL byte")))
+            .collect::<Result<Vec<CString>>>()?;
+
+        let packed_argv = argv
+            .iter()
+            .flat_map(|arg| arg.as_bytes_with_nul())
+            .copied()
+            .collect();
+        let builtin = Builtin::from_argv(&argv)?;
+
+        Ok(Self {
+            raw: raw.to_string(),
+            argv,
+            packed_argv,
+            builtin,
+            policy: JobPolicy::default(),
+            exec_path: None,
+        })
+    }
+
+    /// Rebuilds an action from its command string and packed argv, without
+    /// tokenizing the command again.
+    ///
+    /// Unlike [`Action::parse`], this does not check that the program exists;
+    /// it is meant for actions that were parsed before, such as those in the
+    /// binding cache.
+    ///
+    /// # Arguments
+    /// * `raw` - The command string as written in the config.
+    /// * `packed_argv` - The argv as returned by [`Action::packed_argv`].
+    pub fn from_packed(raw: &str, packed_argv: &[u8]) -> Result<Self> {
+        let words = packed_argv
+            .strip_suffix(&[0])
+            .ok_or_else(|| anyhow!("Packed argv is not NUL-terminated"))?;
+
+        let argv = words
+            .split(|&b| b == 0)
+            .map(|word| CString::new(word).map_err(|_| anyhow!("Command contains a NUL byte")))
+            .collect::<Result<Vec<CString>>>()?;
+
+        if argv.len() > MAX_ARGV {
+            return Err(anyhow!("Command has more than {} words", MAX_ARGV));
+        }
+        let builtin = Builtin::from_argv(&argv)?;
+
+        Ok(Self {
+            raw: raw.to_string(),
+            argv,
+            packed_argv: packed_argv.into(),
+            builtin,
+            policy: JobPolicy::default(),
+            exec_path: None,
+        })
+    }
+
+    /// Returns the command string as written in the config.
+    pub fn raw(&self) -> &str {
+        &self.raw
+    }
+
+    /// Returns the program to execute (the first word of the command).
+    pub fn program(&self) -> &CString {
+        &self.argv[0]
+    }
+
+    /// Returns the full argv, including the program as its first element.
+    pub fn argv(&self) -> &[CString] {
+        &self.argv
+    }
+
+    /// Returns the built-in action to carry out instead of spawning the argv,
+    /// if the command names one.
+    pub fn builtin(&self) -> Option<&Builtin> {
+        self.builtin.as_ref()
+    }
+
+    /// Returns how the scheduler treats triggers of this action.
+    pub fn policy(&self) -> JobPolicy {
+        self.policy
+    }
+
+    /// Replaces the scheduling policy of this action.
+    pub fn with_policy(mut self, policy: JobPolicy) -> Self {
+        self.policy = policy;
+        self
+    }
+
+    /// Returns the absolute path of the program as found in PATH, or `None`
+    /// if the program is given by path or has not been found.
+    pub fn exec_path(&self) -> Option<&CString> {
+        self.exec_path.as_ref()
+    }
+
+    /// Looks the program up in PATH, so spawning does not have to.
+    ///
+    /// Built-in actions and programs given by path are left as they are.
+    ///
+    /// # Arguments
+    /// * `resolver` - The resolver to look the program up with.
+    pub fn resolve(mut self, resolver: &mut ProgramResolver) -> Self {
+        let program = self.program().as_bytes();
+        self.exec_path = match self.builtin {
+            None if !program.contains(&b'/') => resolver.resolve(self.program()),
+            _ => None,
+        };
+        self
+    }
+
+    /// Returns the argv as NUL-terminated words back to back.
+    pub fn packed_argv(&self) -> &[u8] {
+        &self.packed_argv
+    }
+
+    /// Splits a command string into words, honoring quotes and escapes.
+    fn tokenize(raw: &str) -> Result<Vec<String>> {
+        let mut words = Vec::new();
+        let mut word = String::new();
+        let mut in_word = false;
+        let mut chars = raw.chars();
+
+        while let Some(c) = chars.next() {
+            match c {
+                c if c.is_whitespace() => {
+                    if in_word {
+                        words.push(std::mem::take(&mut word));
+                        in_word = false;
+                    }
+                }
+                '\'' => {
+                    in_word = true;
+                    loop {
+                        match chars.next() {
+                            Some('\'') => break,
+                            Some(c) => word.push(c),
+                            None => return Err(anyhow!("Unterminated single quote in '{}'", raw)),
+                        }
+                    }
+                }
+                '"' => {
+                    in_word = true;
+                    loop {
+                        match chars.next() {
+                            Some('"') => break,
+                            Some('\\') => match chars.next() {
+                                Some(c @ ('"' | '\\' | '$' | '`')) => word.push(c),
+                                Some(c) => {
+                                    word.push('\\');
+                                    word.push(c);
+                                }
+                                None => {
+                                    return Err(anyhow!("Unterminated double quote in '{}'", raw))
+                                }
+                            },
+                            Some(c) => word.push(c),
+                            None => return Err(anyhow!("Unterminated double quote in '{}'", raw)),
+                        }
+                    }
+                }
+                '\\' => {
+                    in_word = true;
+                    match chars.next() {
+                        Some(c) => word.push(c),
+                        None => return Err(anyhow!("Trailing backslash in '{}'", raw)),
+                    }
+                }
+                c => {
+                    in_word = true;
+                    word.push(c);
+                }
+            }
+        }
+
+        if in_word {
+            words.push(word);
+        }
+
+        Ok(words)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn argv_of(raw: &str) -> Vec<String> {
+        Action::parse(raw)
+            .expect("Command should parse")
+            .argv()
+            .iter()
+            .map(|arg| arg.to_str().unwrap().to_string())
+            .collect()
+    }
+
+    #[test]
+    fn parse_should_split_on_whitespace() {
+        assert_eq!(argv_of("flameshot   gui"), vec!["flameshot", "gui"]);
+    }
+
+    #[test]
+    fn parse_should_honor_quotes_and_escapes() {
+        assert_eq!(
+            argv_of(r#"notify-send 'hello world' "say \"hi\"" a\ b"#),
+            vec!["notify-send", "hello world", "say \"hi\"", "a b"]
+        );
+    }
+
+    #[test]
+    fn parse_should_keep_empty_quoted_words() {
+        assert_eq!(argv_of("printf ''"), vec!["printf", ""]);
+    }
+
+    #[test]
+    fn parse_should_fail_with_unterminated_quote() {
+        let err = Action::parse("echo 'oops").unwrap_err();
+        assert!(err.to_string().contains("Unterminated single quote"));
+    }
+
+    #[test]
+    fn parse_should_fail_with_empty_command() {
+        assert!(Action::parse("   ").is_err());
+        assert!(Action::parse("").is_err());
+    }
+
+    #[test]
+    fn parse_should_fail_with_missing_program_path() {
+        let err = Action::parse("/nonexistent/clefd-test-program").unwrap_err();
+        assert!(err.to_string().contains("does not exist"));
+    }
+
+    #[test]
+    fn parse_should_fail_with_too_many_words() {
+        let raw = "x ".repeat(MAX_ARGV + 1);
+        assert!(Action::parse(&raw).is_err());
+    }
+
+    #[test]
+    fn packed_argv_should_nul_terminate_each_word() {
+        let action = Action::parse("echo 'a b' c").unwrap();
+        assert_eq!(action.packed_argv(), b"echo\0a b\0c\0");
+    }
+
+    #[test]
+    fn from_packed_should_rebuild_parsed_action() {
+        let action = Action::parse("echo 'a b' '' c").unwrap();
+        let rebuilt = Action::from_packed(action.raw(), action.packed_argv()).unwrap();
+        assert_eq!(rebuilt, action);
+
+        assert!(Action::from_packed("echo", b"echo").is_err());
+    }
+
+    #[test]
+    fn parse_should_recognize_builtins() {
+        let fifo = Action::parse("@fifo /run/bar.fifo workspace 'next one'").unwrap();
+        assert_eq!(
+            fifo.builtin(),
+            Some(&Builtin::Fifo {
+                path: PathBuf::from("/run/bar.fifo"),
+                payload: b"workspace next one\n".as_slice().into(),
+            })
+        );
+
+        let socket = Action::parse("@socket /run/app.sock toggle").unwrap();
+        assert_eq!(
+            socket.builtin(),
+            Some(&Builtin::Socket {
+                path: PathBuf::from("/run/app.sock"),
+                payload: b"toggle".as_slice().into(),
+            })
+        );
+
+        let rebuilt = Action::from_packed(socket.raw(), socket.packed_argv()).unwrap();
+        assert_eq!(rebuilt, socket);
+        assert_eq!(Action::parse("echo hi").unwrap().builtin(), None);
+    }
+
+    #[test]
+    fn parse_should_fail_with_invalid_builtin() {
+        let err = Action::parse("@dbus org.example.Signal").unwrap_err();
+        assert!(err.to_string().contains("Unknown built-in action '@dbus'"));
+
+        let err = Action::parse("@fifo").unwrap_err();
+        assert!(err.to_string().contains("needs a path"));
+    }
+
+    #[test]
+    fn program_should_be_first_word() {
+        let action = Action::parse("/bin/echo hi").unwrap();
+        assert_eq!(action.program().to_str().unwrap(), "/bin/echo");
+        assert_eq!(action.raw(), "/bin/echo hi");
+    }
+
+    #[test]
+    fn resolve_should_only_look_up_bare_program_names() {
+        let mut resolver = ProgramResolver::with_dirs(vec![PathBuf::from("/bin")]);
+
+        let action = Action::parse("sh -c true").unwrap().resolve(&mut resolver);
+        assert_eq!(action.exec_path().unwrap().to_str().unwrap(), "/bin/sh");
+        assert_eq!(action.program().to_str().unwrap(), "sh");
+
+        let by_path = Action::parse("/bin/sh").unwrap().resolve(&mut resolver);
+        assert_eq!(by_path.exec_path(), None);
+        let builtin = Action::parse("@socket /tmp/a.sock x")
+            .unwrap()
+            .resolve(&mut resolver);
+        assert_eq!(builtin.exec_path(), None);
+    }
+}
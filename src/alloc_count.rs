@@ -0,0 +1,85 @@
+//! Provides a counting global allocator for allocation regression checks.
+//!
+//! Once the daemon is running, handling a key event should never touch the
+//! heap. Binaries that check this, such as the unit tests and the replay
+//! example, install [`CountingAlloc`] as their global allocator and wrap the
+//! code under test in [`count_allocations`]; the daemon itself keeps the
+//! system allocator.
+//!
+//! Allocations are counted per thread, so tests running in parallel, or
+//! other threads of the process, never show up in each other's counts.
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::Cell;
+
+thread_local! {
+    static ALLOCATIONS: Cell<u64> = const { Cell::new(0) };
+}
+
+/// The system allocator, counting every allocation of the calling thread.
+///
+/// Install it with
+/// `#[global_allocator] static ALLOCATOR: CountingAlloc = CountingAlloc;`.
+pub struct CountingAlloc;
+
+impl CountingAlloc {
+    fn count() {
+        // The counter is gone while the thread's locals are destroyed.
+        let _ = ALLOCATIONS.try_with(|count| count.set(count.get() + 1));
+    }
+}
+
+// SAFETY: every call is forwarded unchanged to the system allocator.
+unsafe impl GlobalAlloc for CountingAlloc {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        Self::count();
+        System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        Self::count();
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        Self::count();
+        System.realloc(ptr, layout, new_size)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+}
+
+/// Returns how many allocations the calling thread has made so far.
+///
+/// Always 0 unless [`CountingAlloc`] is the global allocator.
+pub fn allocations() -> u64 {
+    ALLOCATIONS.with(Cell::get)
+}
+
+/// Runs a closure and counts the allocations it made, reallocations included.
+///
+/// # Returns
+/// The closure's result and its number of allocations.
+pub fn count_allocations<T>(f: impl FnOnce() -> T) -> (T, u64) {
+    let before = allocations();
+    let result = f();
+    (result, allocations() - before)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn count_allocations_should_count_heap_use() {
+        let (_, none) = count_allocations(|| 40 + 2);
+        assert_eq!(none, 0);
+
+        let (mut values, one) = count_allocations(|| Vec::<u64>::with_capacity(4));
+        assert_eq!(one, 1);
+
+        let (_, grown) = count_allocations(|| values.extend(0..64));
+        assert!(grown >= 1);
+    }
+}
@@ -0,0 +1,465 @@
+//! Provides a binary snapshot of the parsed config for fast startup.
+//!
+//! After every successful load, the [`ConfigLoader`] writes the binding lines
+//! it parsed to a [`BindingCache`] under `$XDG_CACHE_HOME/clefd`. On the next
+//! start, the loader maps the cache and, if it was written by the same clefd
+//! version for the same config content, rebuilds the lines from it without
+//! tokenizing a command or looking up a keysym. Only the programs are looked
+//! up in PATH again, since it is not part of the config. A missing, stale or
+//! corrupt cache only means the config is parsed from source as before.
+//!
+//! # Format
+//! All integers are little endian. The header is the 8-byte magic `CLEFDBND`,
+//! a u32 format version, the clefd version as a u8 length and its bytes, the
+//! u64 [`content_hash`] of the config the cache was built from, and the u64
+//! hash of the body. The body is a u32 line count followed by one record per
+//! binding line: its key sequence, its job policy, then the line text, the
+//! command and its packed argv, each as a u32 length and its bytes. A key
+//! sequence is its first chord, a u32 count and that many further chords, and
+//! the u64 sequence timeout in milliseconds; each chord is its u16 modifiers
+//! and u32 keysym. A job policy is a u8 concurrency (0 unlimited, 1 single, 2
+//! coalesce), the u32 starts and u64 window in milliseconds of its rate limit
+//! (0 starts for none), its u32 queue depth, and a u8 that is 1 if its output
+//! is captured.
+//!
+//! [`ConfigLoader`]: crate::user_config::ConfigLoader
+use crate::action::Action;
+use crate::chord_state::ChordKey;
+use crate::config_parser::FileContents;
+use crate::keybindings::KeySequence;
+use crate::path_search::ProgramResolver;
+use crate::scheduler::{Concurrency, JobPolicy, Rate};
+use crate::user_config::BindingLine;
+use anyhow::{anyhow, Context, Result};
+use std::collections::HashMap;
+use std::fs;
+use std::io::ErrorKind;
+use std::num::NonZeroU32;
+use std::os::unix::ffi::OsStrExt;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::Duration;
+use xkbcommon::xkb::Keysym;
+
+/// Identifies a binding cache file.
+const MAGIC: &[u8; 8] = b"CLEFDBND";
+
+/// The current cache format version.
+const VERSION: u32 = 4;
+
+/// The clefd version that wrote a cache; chord encodings may change between
+/// releases, so a cache is only trusted by the version that wrote it.
+const CLEFD_VERSION: &str = env!("CARGO_PKG_VERSION");
+
+/// Hashes config content with 64-bit FNV-1a.
+///
+/// Unlike the standard library's hasher, the result is stable across runs and
+/// Rust releases, so it can be stored in the cache.
+pub fn content_hash(bytes: &[u8]) -> u64 {
+    bytes.iter().fold(0xcbf2_9ce4_8422_2325, |hash, &byte| {
+        (hash ^ u64::from(byte)).wrapping_mul(0x0100_0000_01b3)
+    })
+}
+
+/// A binding cache file.
+#[derive(Debug, Clone)]
+pub struct BindingCache {
+    path: PathBuf,
+}
+
+impl BindingCache {
+    /// Creates a cache stored at the given path.
+    pub fn new(path: PathBuf) -> Self {
+        Self { path }
+    }
+
+    /// Returns the cache for a config file in the user's cache directory.
+    ///
+    /// # Returns
+    /// `None` if there is no cache directory or the config has no file name.
+    pub fn for_config(config_path: &Path) -> Option<Self> {
+        let dir = dirs::cache_dir()?.join("clefd");
+        Self::in_dir(&dir, config_path)
+    }
+
+    /// Returns the cache for a config file in the given directory.
+    ///
+    /// # Returns
+    /// `None` if the config has no file name.
+    pub fn in_dir(dir: &Path, config_path: &Path) -> Option<Self> {
+        let mut file_name = config_path.file_name()?.to_os_string();
+        file_name.push(".bindings");
+
+        Some(Self::new(dir.join(file_name)))
+    }
+
+    /// Returns the cache for a file included by this cache's config.
+    ///
+    /// It lives next to this cache, named after the hash of the included
+    /// file's path, so fragments with the same file name do not collide.
+    ///
+    /// # Arguments
+    /// * `fragment_path` - The path of the included file.
+    pub fn for_fragment(&self, fragment_path: &Path) -> Self {
+        let mut file_name = self.path.as_os_str().to_os_string();
+        file_name.push(format!(
+            "-{:016x}",
+            content_hash(fragment_path.as_os_str().as_bytes())
+        ));
+        Self::new(PathBuf::from(file_name))
+    }
+
+    /// Returns the path of the cache file.
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+
+    /// Loads the cached binding lines of a config.
+    ///
+    /// # Arguments
+    /// * `source_hash` - The [`content_hash`] of the current config.
+    ///
+    /// # Returns
+    /// `None` if there is no cache, or it was built for other content or by
+    /// another clefd version. An error if the cache is corrupt.
+    pub(crate) fn load(&self, source_hash: u64) -> Result<Option<Vec<BindingLine>>> {
+        let file = match FileContents::map(&self.path) {
+            Ok(file) => file,
+            Err(e)
+                if e.downcast_ref::<std::io::Error>()
+                    .is_some_and(|e| e.kind() == ErrorKind::NotFound) =>
+            {
+                return Ok(None)
+            }
+            Err(e) => return Err(e.context(format!("Failed to read cache at {:?}", self.path))),
+        };
+
+        decode(file.as_bytes(), source_hash)
+            .context(format!("Invalid binding cache at {:?}", self.path))
+    }
+
+    /// Replaces the cache with the binding lines of a config.
+    ///
+    /// The cache is written to a temporary file and renamed into place, so a
+    /// crash never leaves a partial cache behind.
+    ///
+    /// # Arguments
+    /// * `source_hash` - The [`content_hash`] of the config the lines come from.
+    /// * `lines` - Every binding line of the config, in order.
+    pub(crate) fn store(&self, source_hash: u64, lines: &[BindingLine]) -> Result<()> {
+        if let Some(dir) = self.path.parent() {
+            fs::create_dir_all(dir).context(format!("Failed to create {:?}", dir))?;
+        }
+
+        let staged = self.staging_path();
+
+        fs::write(&staged, encode(source_hash, lines))
+            .and_then(|_| fs::rename(&staged, &self.path))
+            .context(format!("Failed to write cache at {:?}", self.path))
+    }
+
+    /// Returns the temporary file a new cache is written to.
+    ///
+    /// The suffix is appended to the whole file name, so the caches of a
+    /// config and its fragments never share a staging file.
+    fn staging_path(&self) -> PathBuf {
+        let mut staged = self.path.as_os_str().to_os_string();
+        staged.push(".tmp");
+        PathBuf::from(staged)
+    }
+}
+
+/// Serializes binding lines into the cache format.
+fn encode(source_hash: u64, lines: &[BindingLine]) -> Vec<u8> {
+    let mut body = Vec::new();
+    body.extend_from_slice(&(lines.len() as u32).to_le_bytes());
+
+    for line in lines {
+        let sequence = &line.sequence;
+        encode_chord(&mut body, sequence.first);
+        body.extend_from_slice(&(sequence.rest.len() as u32).to_le_bytes());
+        for &chord in sequence.rest.iter() {
+            encode_chord(&mut body, chord);
+        }
+        body.extend_from_slice(&(sequence.timeout.as_millis() as u64).to_le_bytes());
+        encode_policy(&mut body, line.action.policy());
+        for field in [
+            line.text.as_bytes(),
+            line.action.raw().as_bytes(),
+            line.action.packed_argv(),
+        ] {
+            body.extend_from_slice(&(field.len() as u32).to_le_bytes());
+            body.extend_from_slice(field);
+        }
+    }
+
+    let mut bytes = Vec::with_capacity(body.len() + 64);
+    bytes.extend_from_slice(MAGIC);
+    bytes.extend_from_slice(&VERSION.to_le_bytes());
+    bytes.push(CLEFD_VERSION.len() as u8);
+    bytes.extend_from_slice(CLEFD_VERSION.as_bytes());
+    bytes.extend_from_slice(&source_hash.to_le_bytes());
+    bytes.extend_from_slice(&content_hash(&body).to_le_bytes());
+    bytes.extend_from_slice(&body);
+    bytes
+}
+
+/// Appends the modifiers and keysym of a chord.
+fn encode_chord(body: &mut Vec<u8>, chord: ChordKey) {
+    body.extend_from_slice(&chord.modifiers().to_le_bytes());
+    body.extend_from_slice(&chord.keysym().raw().to_le_bytes());
+}
+
+/// Appends the concurrency, rate limit, queue depth and capture flag of a job
+/// policy.
+fn encode_policy(body: &mut Vec<u8>, policy: JobPolicy) {
+    body.push(match policy.concurrency {
+        Concurrency::Unlimited => 0,
+        Concurrency::Single => 1,
+        Concurrency::Coalesce => 2,
+    });
+    let (starts, per) = policy.rate.map_or((0, 0), |rate| {
+        (rate.starts.get(), rate.per.as_millis() as u64)
+    });
+    body.extend_from_slice(&starts.to_le_bytes());
+    body.extend_from_slice(&per.to_le_bytes());
+    body.extend_from_slice(&policy.queue.to_le_bytes());
+    body.push(u8::from(policy.capture));
+}
+
+/// Deserializes binding lines, returning `None` if the cache is stale.
+fn decode(bytes: &[u8], source_hash: u64) -> Result<Option<Vec<BindingLine>>> {
+    let mut reader = Reader(bytes);
+    let truncated = || anyhow!("Truncated binding cache");
+
+    if reader.take(MAGIC.len()).ok_or_else(truncated)? != MAGIC {
+        return Err(anyhow!("Missing binding cache header"));
+    }
+    let version = reader.u32().ok_or_else(truncated)?;
+    let clefd_len = reader.take(1).ok_or_else(truncated)?[0] as usize;
+    let clefd_version = reader.take(clefd_len).ok_or_else(truncated)?;
+    let cached_hash = reader.u64().ok_or_else(truncated)?;
+    if version != VERSION || clefd_version != CLEFD_VERSION.as_bytes() || cached_hash != source_hash
+    {
+        return Ok(None);
+    }
+
+    let checksum = reader.u64().ok_or_else(truncated)?;
+    if content_hash(reader.0) != checksum {
+        return Err(anyhow!("Binding cache checksum mismatch"));
+    }
+
+    let count = reader.u32().ok_or_else(truncated)? as usize;
+    let mut lines = Vec::with_capacity(count.min(reader.0.len()));
+    // Share one action between identical commands, as the parser does.
+    let mut actions: HashMap<(&[u8], JobPolicy), Arc<Action>> = HashMap::new();
+    // Programs are looked up again, since PATH may have changed meanwhile.
+    let mut programs = ProgramResolver::new();
+
+    for _ in 0..count {
+        let first = reader.chord().ok_or_else(truncated)?;
+        let rest_len = reader.u32().ok_or_else(truncated)? as usize;
+        let rest = (0..rest_len)
+            .map(|_| reader.chord().ok_or_else(truncated))
+            .collect::<Result<Box<[ChordKey]>>>()?;
+        let timeout = Duration::from_millis(reader.u64().ok_or_else(truncated)?);
+        let policy = reader.policy().ok_or_else(truncated)??;
+        let text = reader.field().ok_or_else(truncated)?;
+        let raw = reader.field().ok_or_else(truncated)?;
+        let packed_argv = reader.field().ok_or_else(truncated)?;
+
+        let action = match actions.get(&(raw, policy)) {
+            Some(action) => Arc::clone(action),
+            None => {
+                let action = Action::from_packed(std::str::from_utf8(raw)?, packed_argv)?;
+                let action = Arc::new(action.with_policy(policy).resolve(&mut programs));
+                actions.insert((raw, policy), Arc::clone(&action));
+                action
+            }
+        };
+
+        lines.push(BindingLine {
+            text: std::str::from_utf8(text)?.into(),
+            sequence: KeySequence {
+                first,
+                rest,
+                timeout,
+            },
+            action,
+        });
+    }
+
+    if !reader.0.is_empty() {
+        return Err(anyhow!("Trailing bytes in binding cache"));
+    }
+
+    Ok(Some(lines))
+}
+
+/// Reads little-endian fields off the front of a byte slice.
+struct Reader<'a>(&'a [u8]);
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, len: usize) -> Option<&'a [u8]> {
+        if len > self.0.len() {
+            return None;
+        }
+        let (head, rest) = self.0.split_at(len);
+        self.0 = rest;
+        Some(head)
+    }
+
+    fn u16(&mut self) -> Option<u16> {
+        Some(u16::from_le_bytes(self.take(2)?.try_into().ok()?))
+    }
+
+    fn u32(&mut self) -> Option<u32> {
+        Some(u32::from_le_bytes(self.take(4)?.try_into().ok()?))
+    }
+
+    fn u64(&mut self) -> Option<u64> {
+        Some(u64::from_le_bytes(self.take(8)?.try_into().ok()?))
+    }
+
+    /// Reads the modifiers and keysym of a chord.
+    fn chord(&mut self) -> Option<ChordKey> {
+        let modifiers = self.u16()?;
+        let keysym = self.u32()?;
+        Some(ChordKey::new(modifiers, Keysym::new(keysym)))
+    }
+
+    /// Reads a job policy, failing for an unknown concurrency.
+    fn policy(&mut self) -> Option<Result<JobPolicy>> {
+        let concurrency = match self.take(1)?[0] {
+            0 => Concurrency::Unlimited,
+            1 => Concurrency::Single,
+            2 => Concurrency::Coalesce,
+            other => {
+                return Some(Err(anyhow!(
+                    "Unknown concurrency {} in binding cache",
+                    other
+                )))
+            }
+        };
+        let starts = self.u32()?;
+        let per = Duration::from_millis(self.u64()?);
+        let queue = self.u32()?;
+        let capture = self.take(1)?[0] != 0;
+
+        Some(Ok(JobPolicy {
+            concurrency,
+            rate: NonZeroU32::new(starts).map(|starts| Rate { starts, per }),
+            queue,
+            capture,
+        }))
+    }
+
+    /// Reads a u32 length followed by that many bytes.
+    fn field(&mut self) -> Option<&'a [u8]> {
+        let len = self.u32()? as usize;
+        self.take(len)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::config_parser::{self, Parser};
+
+    fn parse_lines(content: &str) -> Vec<BindingLine> {
+        let mut parser = Parser::new();
+        config_parser::lines(content)
+            .map(|line| {
+                let (sequence, action) = parser.parse_line(&line).unwrap();
+                BindingLine {
+                    text: line.text.into(),
+                    sequence,
+                    action,
+                }
+            })
+            .collect()
+    }
+
+    #[test]
+    fn content_hash_should_be_stable() {
+        // Reference values of 64-bit FNV-1a.
+        assert_eq!(content_hash(b""), 0xcbf2_9ce4_8422_2325);
+        assert_eq!(content_hash(b"a"), 0xaf63_dc4c_8601_ec8c);
+    }
+
+    #[test]
+    fn cache_should_round_trip_binding_lines() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache = BindingCache::new(dir.path().join("nested").join("clefdrc.bindings"));
+        let lines = parse_lines(
+            "Super_L+a: notify-send 'a b'\nSuper_L+b: notify-send 'a b'\nSuper_L+x, f [250ms]: one\n\
+             Super_L+c [coalesce, rate=3/min, queue=1, capture]: notify-send 'a b'\n",
+        );
+
+        cache.store(42, &lines).unwrap();
+        let loaded = cache.load(42).unwrap().expect("Cache should be fresh");
+
+        assert_eq!(loaded.len(), lines.len());
+        for (loaded, line) in loaded.iter().zip(&lines) {
+            assert_eq!(loaded.text, line.text);
+            assert_eq!(loaded.sequence, line.sequence);
+            assert_eq!(loaded.action, line.action);
+        }
+        assert!(Arc::ptr_eq(&loaded[0].action, &loaded[1].action));
+        assert!(!Arc::ptr_eq(&loaded[0].action, &loaded[3].action));
+    }
+
+    #[test]
+    fn in_dir_should_name_the_cache_after_the_config() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache = BindingCache::in_dir(dir.path(), Path::new("/etc/clefd/clefdrc")).unwrap();
+
+        assert_eq!(cache.path(), dir.path().join("clefdrc.bindings"));
+        assert!(BindingCache::in_dir(dir.path(), Path::new("/")).is_none());
+    }
+
+    #[test]
+    fn store_should_stage_fragments_separately() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache = BindingCache::new(dir.path().join("clefdrc.bindings"));
+        let fragment = cache.for_fragment(Path::new("/etc/clefd/media.conf"));
+
+        assert_ne!(cache.staging_path(), fragment.staging_path());
+        assert_eq!(
+            cache.staging_path(),
+            dir.path().join("clefdrc.bindings.tmp")
+        );
+
+        cache.store(1, &parse_lines("Super_L+a: one")).unwrap();
+        fragment.store(2, &parse_lines("Super_L+b: two")).unwrap();
+        assert!(cache.load(1).unwrap().is_some());
+        assert!(fragment.load(2).unwrap().is_some());
+        assert!(!cache.staging_path().exists());
+    }
+
+    #[test]
+    fn load_should_ignore_missing_and_stale_caches() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache = BindingCache::new(dir.path().join("clefdrc.bindings"));
+        assert!(cache.load(1).unwrap().is_none());
+
+        cache.store(1, &parse_lines("Super_L+a: one")).unwrap();
+        assert!(cache.load(2).unwrap().is_none());
+    }
+
+    #[test]
+    fn load_should_fail_for_corrupt_caches() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache = BindingCache::new(dir.path().join("clefdrc.bindings"));
+        cache.store(7, &parse_lines("Super_L+a: one")).unwrap();
+
+        let mut bytes = fs::read(cache.path()).unwrap();
+        let last = bytes.len() - 1;
+        bytes[last] ^= 0xff;
+        fs::write(cache.path(), &bytes).unwrap();
+        assert!(cache.load(7).is_err());
+
+        fs::write(cache.path(), &bytes[..20]).unwrap();
+        assert!(cache.load(7).is_err());
+    }
+}
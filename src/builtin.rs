@@ -0,0 +1,202 @@
+//! Provides the in-process executor for built-in actions.
+//!
+//! Writing a line to a FIFO or sending a datagram to another program's socket
+//! does not need a process of its own. The [`BuiltinRunner`] carries out
+//! [`Builtin`] actions directly on the event thread: every target is opened
+//! once, kept open for later actions, and written to without blocking, so a
+//! slow or stalled reader costs the message instead of stalling key handling.
+use crate::action::Builtin;
+use anyhow::{anyhow, Context, Result};
+use std::collections::HashMap;
+use std::fs::{File, OpenOptions};
+use std::io::{self, Write};
+use std::os::unix::fs::OpenOptionsExt;
+use std::os::unix::net::UnixDatagram;
+use std::path::{Path, PathBuf};
+
+/// Carries out built-in actions, reusing the targets it has opened.
+#[derive(Debug, Default)]
+pub struct BuiltinRunner {
+    fifos: HashMap<PathBuf, File>,
+    socket: Option<UnixDatagram>,
+}
+
+impl BuiltinRunner {
+    /// Creates a runner without any open targets.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Carries out a built-in action.
+    ///
+    /// # Arguments
+    /// * `builtin` - The action to carry out.
+    ///
+    /// # Returns
+    /// An error if the target cannot be opened or would block, in which case
+    /// the message is dropped.
+    pub fn run(&mut self, builtin: &Builtin) -> Result<()> {
+        match builtin {
+            Builtin::Fifo { path, payload } => self.write_fifo(path, payload),
+            Builtin::Socket { path, payload } => self.send_datagram(path, payload),
+        }
+    }
+
+    /// Writes a message to a FIFO, reopening it once if its reader went away.
+    fn write_fifo(&mut self, path: &Path, payload: &[u8]) -> Result<()> {
+        for _ in 0..2 {
+            let fifo = match self.fifos.get_mut(path) {
+                Some(fifo) => fifo,
+                None => {
+                    let fifo = open_fifo(path)?;
+                    self.fifos.entry(path.to_path_buf()).or_insert(fifo)
+                }
+            };
+
+            // Writes of up to PIPE_BUF bytes are atomic: all or nothing.
+            match fifo.write(payload) {
+                Ok(written) if written == payload.len() => return Ok(()),
+                Ok(_) => return Err(anyhow!("Short write to FIFO {}", path.display())),
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => {
+                    return Err(anyhow!("FIFO {} is full", path.display()));
+                }
+                Err(e) if e.kind() == io::ErrorKind::BrokenPipe => {
+                    self.fifos.remove(path);
+                }
+                Err(e) => {
+                    self.fifos.remove(path);
+                    return Err(e)
+                        .with_context(|| format!("Failed to write to {}", path.display()));
+                }
+            }
+        }
+
+        Err(anyhow!("FIFO {} has no reader", path.display()))
+    }
+
+    /// Sends a message as one datagram from the runner's unbound socket.
+    fn send_datagram(&mut self, path: &Path, payload: &[u8]) -> Result<()> {
+        let socket = match &self.socket {
+            Some(socket) => socket,
+            None => {
+                let socket = UnixDatagram::unbound().context("Failed to create socket")?;
+                socket.set_nonblocking(true)?;
+                self.socket.insert(socket)
+            }
+        };
+
+        match socket.send_to(payload, path) {
+            Ok(_) => Ok(()),
+            Err(e) if e.kind() == io::ErrorKind::WouldBlock => {
+                Err(anyhow!("Socket {} is not keeping up", path.display()))
+            }
+            Err(e) => Err(e).with_context(|| format!("Failed to send to {}", path.display())),
+        }
+    }
+}
+
+/// Opens a FIFO for non-blocking writes.
+///
+/// Opening fails with ENXIO while the FIFO has no reader, so the next action
+/// simply tries again.
+fn open_fifo(path: &Path) -> Result<File> {
+    OpenOptions::new()
+        .write(true)
+        .custom_flags(libc::O_NONBLOCK | libc::O_CLOEXEC)
+        .open(path)
+        .with_context(|| format!("Failed to open FIFO {}", path.display()))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::action::Action;
+    use std::ffi::CString;
+    use std::io::Read;
+    use std::os::unix::ffi::OsStrExt;
+
+    fn builtin(command: &str) -> Builtin {
+        Action::parse(command).unwrap().builtin().unwrap().clone()
+    }
+
+    fn mkfifo(path: &Path) {
+        let path = CString::new(path.as_os_str().as_bytes()).unwrap();
+        // SAFETY: path is a valid NUL-terminated string.
+        assert_eq!(unsafe { libc::mkfifo(path.as_ptr(), 0o600) }, 0);
+    }
+
+    fn open_reader(path: &Path) -> File {
+        OpenOptions::new()
+            .read(true)
+            .custom_flags(libc::O_NONBLOCK)
+            .open(path)
+            .unwrap()
+    }
+
+    fn read_available(reader: &mut File) -> String {
+        let mut buf = [0; 256];
+        let len = reader.read(&mut buf).unwrap();
+        String::from_utf8_lossy(&buf[..len]).into_owned()
+    }
+
+    #[test]
+    fn run_should_write_lines_to_fifo() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("bar.fifo");
+        mkfifo(&path);
+        let action = builtin(&format!("@fifo {} workspace 2", path.display()));
+        let mut runner = BuiltinRunner::new();
+
+        // Nobody is reading yet, so the message is dropped.
+        assert!(runner.run(&action).is_err());
+
+        let mut reader = open_reader(&path);
+        runner.run(&action).unwrap();
+        runner.run(&action).unwrap();
+        assert_eq!(runner.fifos.len(), 1);
+
+        assert_eq!(read_available(&mut reader), "workspace 2\nworkspace 2\n");
+    }
+
+    #[test]
+    fn run_should_reopen_fifo_after_reader_restarts() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("bar.fifo");
+        mkfifo(&path);
+        let action = builtin(&format!("@fifo {} next", path.display()));
+        let mut runner = BuiltinRunner::new();
+
+        let reader = open_reader(&path);
+        runner.run(&action).unwrap();
+        drop(reader);
+
+        // The broken FIFO is closed and cannot be reopened without a reader.
+        assert!(runner.run(&action).is_err());
+        assert!(runner.fifos.is_empty());
+
+        let mut reader = open_reader(&path);
+        runner.run(&action).unwrap();
+        assert_eq!(read_available(&mut reader), "next\n");
+    }
+
+    #[test]
+    fn run_should_send_datagrams() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("app.sock");
+        let receiver = UnixDatagram::bind(&path).unwrap();
+        let mut runner = BuiltinRunner::new();
+
+        runner
+            .run(&builtin(&format!("@socket {} toggle", path.display())))
+            .unwrap();
+
+        let mut buf = [0; 64];
+        let len = receiver.recv(&mut buf).unwrap();
+        assert_eq!(&buf[..len], b"toggle");
+
+        let missing = dir.path().join("missing.sock");
+        assert!(runner
+            .run(&builtin(&format!("@socket {} toggle", missing.display())))
+            .is_err());
+    }
+}
@@ -0,0 +1,408 @@
+//! Provides bounded, non-blocking capture of what spawned children print.
+//!
+//! Children normally write to `/dev/null`. A binding with the `capture`
+//! option instead gets a pipe for its stdout and stderr. The daemon keeps the
+//! read end, made non-blocking and registered with the event loop's
+//! [`Reactor`] as [`Token::Output`], and appends whatever becomes readable to
+//! the binding's [`OutputLogs`] entry, where the control socket's `output`
+//! request finds it. Inheriting the daemon's own stdio instead would let a
+//! chatty child fill the journal's pipe and block the daemon.
+//!
+//! Memory stays bounded however much a child prints:
+//!
+//! - Each binding keeps only its last [`LOG_CAPACITY`] bytes, older output is
+//!   overwritten.
+//! - Each child contributes at most [`CHILD_OUTPUT_LIMIT`] bytes; the rest is
+//!   still read, so the child never blocks on a full pipe, but discarded and
+//!   counted.
+//! - At most [`MAX_LOGS`] bindings keep a log; the one written to least
+//!   recently makes room for a new one.
+//! - At most [`MAX_PIPES`] pipes are open per event loop. A child that
+//!   daemonizes keeps its pipe open for as long as it runs, so once the limit
+//!   is reached, further children write to `/dev/null` until pipes close.
+//!
+//! A child that prints without pause is read [`READ_BUDGET`] bytes per
+//! wakeup, after which its pipe is re-armed with the reactor, so it cannot
+//! keep the event loop from its keyboards.
+use crate::action::Action;
+use crate::reactor::{Reactor, Token};
+use anyhow::Result;
+use log::debug;
+use nix::errno::Errno;
+use std::collections::{HashMap, VecDeque};
+use std::os::fd::{AsRawFd, OwnedFd, RawFd};
+use std::sync::{Arc, Mutex};
+
+/// How many of its most recent output bytes a binding keeps.
+pub const LOG_CAPACITY: usize = 8 * 1024;
+
+/// How many bytes of a single child's output are kept.
+pub const CHILD_OUTPUT_LIMIT: usize = 64 * 1024;
+
+/// How many bindings keep an output log at once.
+pub const MAX_LOGS: usize = 64;
+
+/// How many output pipes one event loop keeps open at once.
+pub const MAX_PIPES: usize = 32;
+
+/// How many bytes are read from a pipe per wakeup.
+pub const READ_BUDGET: usize = 64 * 1024;
+
+/// The captured output of one binding.
+#[derive(Debug, Default)]
+struct Log {
+    bytes: VecDeque<u8>,
+    /// Bytes discarded because a child exceeded [`CHILD_OUTPUT_LIMIT`].
+    dropped: u64,
+    /// When this log was last written to, in appends.
+    last_write: u64,
+}
+
+/// The output logs of every capturing binding, keyed by command.
+///
+/// Shared between the event loops of several seats and the control socket.
+#[derive(Debug, Default)]
+pub struct OutputLogs {
+    logs: Mutex<LogTable>,
+}
+
+/// The logs behind the lock of [`OutputLogs`].
+#[derive(Debug, Default)]
+struct LogTable {
+    logs: HashMap<Box<str>, Log>,
+    /// Counts appends, to find the least recently written log.
+    clock: u64,
+}
+
+impl OutputLogs {
+    /// Creates empty logs.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Appends output of a binding's child, and counts the bytes that were
+    /// discarded beyond the child's limit.
+    fn append(&self, command: &str, bytes: &[u8], dropped: u64) {
+        let mut table = self.logs.lock().unwrap_or_else(|e| e.into_inner());
+        let LogTable { logs, clock } = &mut *table;
+        *clock += 1;
+
+        if !logs.contains_key(command) {
+            if logs.len() >= MAX_LOGS {
+                let oldest = logs
+                    .iter()
+                    .min_by_key(|(_, log)| log.last_write)
+                    .map(|(command, _)| command.clone());
+                if let Some(oldest) = oldest {
+                    logs.remove(&oldest);
+                }
+            }
+            logs.insert(command.into(), Log::default());
+        }
+        let Some(log) = logs.get_mut(command) else {
+            return;
+        };
+
+        let bytes = &bytes[bytes.len().saturating_sub(LOG_CAPACITY)..];
+        let overflow = (log.bytes.len() + bytes.len()).saturating_sub(LOG_CAPACITY);
+        log.bytes.drain(..overflow);
+        log.bytes.extend(bytes);
+        log.dropped += dropped;
+        log.last_write = *clock;
+    }
+
+    /// Returns the captured output of a binding.
+    ///
+    /// # Arguments
+    /// * `command` - The binding's command, as written in the config.
+    ///
+    /// # Returns
+    /// The most recent output and how many bytes were discarded beyond the
+    /// children's limit, or `None` if nothing was captured.
+    pub fn output(&self, command: &str) -> Option<(Vec<u8>, u64)> {
+        let table = self.logs.lock().unwrap_or_else(|e| e.into_inner());
+        table
+            .logs
+            .get(command)
+            .map(|log| (log.bytes.iter().copied().collect(), log.dropped))
+    }
+}
+
+/// How far a pipe was drained.
+#[derive(Debug, PartialEq, Eq)]
+enum Drained {
+    /// Everything available was read.
+    Empty,
+    /// The read budget ran out, possibly with output left.
+    Budget,
+    /// Every child holding the write end has exited.
+    Closed,
+}
+
+/// The read end of a capturing child's output pipe.
+struct Pipe {
+    fd: OwnedFd,
+    action: Arc<Action>,
+    /// Bytes of this child's output kept so far.
+    kept: usize,
+}
+
+impl Pipe {
+    /// Reads what is available into the logs, up to [`READ_BUDGET`] bytes.
+    fn drain(&mut self, logs: &OutputLogs) -> Drained {
+        let mut buf = [0u8; 4096];
+        let mut budget = READ_BUDGET;
+        while budget > 0 {
+            let len = budget.min(buf.len());
+            match nix::unistd::read(&self.fd, &mut buf[..len]) {
+                Ok(0) => return Drained::Closed,
+                Ok(len) => {
+                    budget -= len;
+                    let keep = len.min(CHILD_OUTPUT_LIMIT - self.kept);
+                    self.kept += keep;
+                    logs.append(self.action.raw(), &buf[..keep], (len - keep) as u64);
+                }
+                Err(Errno::EAGAIN) => return Drained::Empty,
+                Err(Errno::EINTR) => continue,
+                Err(e) => {
+                    debug!("Failed to read output of '{}': {}", self.action.raw(), e);
+                    return Drained::Closed;
+                }
+            }
+        }
+        Drained::Budget
+    }
+}
+
+/// Reads the output pipes of one event loop's children into shared logs.
+pub struct OutputCapture {
+    pipes: HashMap<RawFd, Pipe>,
+    unregistered: Vec<RawFd>,
+    logs: Arc<OutputLogs>,
+}
+
+impl Default for OutputCapture {
+    fn default() -> Self {
+        Self::new(Arc::new(OutputLogs::new()))
+    }
+}
+
+impl OutputCapture {
+    /// Creates a capture that appends to the given logs.
+    pub fn new(logs: Arc<OutputLogs>) -> Self {
+        Self {
+            pipes: HashMap::new(),
+            unregistered: Vec::new(),
+            logs,
+        }
+    }
+
+    /// Returns the logs this capture appends to.
+    pub fn logs(&self) -> &Arc<OutputLogs> {
+        &self.logs
+    }
+
+    /// Returns whether [`MAX_PIPES`] pipes are open, so a new child's output
+    /// cannot be captured.
+    pub fn is_full(&self) -> bool {
+        self.pipes.len() >= MAX_PIPES
+    }
+
+    /// Starts reading the output of a newly spawned child.
+    ///
+    /// # Arguments
+    /// * `fd` - The non-blocking read end of the child's output pipe.
+    /// * `action` - The action the child runs.
+    pub fn track(&mut self, fd: OwnedFd, action: &Arc<Action>) {
+        self.unregistered.push(fd.as_raw_fd());
+        self.pipes.insert(
+            fd.as_raw_fd(),
+            Pipe {
+                fd,
+                action: Arc::clone(action),
+                kept: 0,
+            },
+        );
+    }
+
+    /// Registers the pipes tracked since the last call.
+    ///
+    /// A pipe leaves the reactor by itself once it is closed.
+    ///
+    /// # Arguments
+    /// * `reactor` - The event loop to register with.
+    pub fn register_new(&mut self, reactor: &Reactor) -> Result<()> {
+        for fd in self.unregistered.drain(..) {
+            if let Some(pipe) = self.pipes.get(&fd) {
+                reactor.register(&pipe.fd, Token::Output(fd))?;
+            }
+        }
+        Ok(())
+    }
+
+    /// Drains a pipe that has become readable, closing it once every child
+    /// holding its write end has exited.
+    ///
+    /// # Arguments
+    /// * `fd` - The pipe's descriptor, from its [`Token::Output`].
+    /// * `reactor` - The reactor the pipe is registered with, to re-arm it
+    ///   when its read budget runs out.
+    ///
+    /// # Returns
+    /// `true` if the descriptor belonged to a tracked pipe.
+    pub fn read(&mut self, fd: RawFd, reactor: &Reactor) -> bool {
+        let Some(pipe) = self.pipes.get_mut(&fd) else {
+            return false;
+        };
+
+        let open = match pipe.drain(&self.logs) {
+            Drained::Empty => true,
+            Drained::Budget => match reactor.rearm(&pipe.fd, Token::Output(fd)) {
+                Ok(()) => true,
+                Err(e) => {
+                    debug!("{:#}", e);
+                    false
+                }
+            },
+            Drained::Closed => false,
+        };
+        if !open {
+            // Closing the pipe also removes it from the reactor.
+            self.pipes.remove(&fd);
+            self.unregistered.retain(|&unregistered| unregistered != fd);
+        }
+        true
+    }
+
+    /// Drains every pipe, up to its read budget, without waiting for it to
+    /// be polled.
+    ///
+    /// This is for callers that drive the client without an event loop.
+    pub fn read_all(&mut self) {
+        let logs = &self.logs;
+        self.pipes
+            .retain(|_, pipe| pipe.drain(logs) != Drained::Closed);
+        let pipes = &self.pipes;
+        self.unregistered.retain(|fd| pipes.contains_key(fd));
+    }
+
+    /// Returns the number of pipes that are still open.
+    pub fn len(&self) -> usize {
+        self.pipes.len()
+    }
+
+    /// Returns whether every pipe has been closed.
+    pub fn is_empty(&self) -> bool {
+        self.pipes.is_empty()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Write;
+    use std::os::unix::net::UnixStream;
+    use std::time::Duration;
+
+    fn action(command: &str) -> Arc<Action> {
+        Arc::new(Action::parse(command).unwrap())
+    }
+
+    /// Returns a non-blocking stream tracked by a capture and its other end.
+    fn tracked(capture: &mut OutputCapture, command: &str) -> (RawFd, UnixStream) {
+        let (read, write) = UnixStream::pair().unwrap();
+        read.set_nonblocking(true).unwrap();
+        let fd = read.as_raw_fd();
+        capture.track(OwnedFd::from(read), &action(command));
+        (fd, write)
+    }
+
+    #[test]
+    fn read_should_append_output_until_closed() {
+        let reactor = Reactor::new().unwrap();
+        let mut capture = OutputCapture::default();
+        let (fd, mut write) = tracked(&mut capture, "/bin/echo a");
+
+        write.write_all(b"hello\n").unwrap();
+        assert!(capture.read(fd, &reactor));
+        assert_eq!(capture.len(), 1);
+        write.write_all(b"world\n").unwrap();
+        drop(write);
+        assert!(capture.read(fd, &reactor));
+        assert!(capture.is_empty());
+        assert!(!capture.read(fd, &reactor));
+
+        assert_eq!(
+            capture.logs().output("/bin/echo a"),
+            Some((b"hello\nworld\n".to_vec(), 0))
+        );
+        assert_eq!(capture.logs().output("/bin/echo b"), None);
+    }
+
+    #[test]
+    fn read_should_bound_output_per_child_and_binding() {
+        let reactor = Reactor::new().unwrap();
+        let mut capture = OutputCapture::default();
+        let (fd, mut write) = tracked(&mut capture, "/bin/echo a");
+
+        let chunk = [b'x'; 1024];
+        for _ in 0..CHILD_OUTPUT_LIMIT / chunk.len() + 4 {
+            write.write_all(&chunk).unwrap();
+            capture.read(fd, &reactor);
+        }
+        drop(write);
+        capture.read(fd, &reactor);
+
+        let (bytes, dropped) = capture.logs().output("/bin/echo a").unwrap();
+        assert_eq!(bytes.len(), LOG_CAPACITY);
+        assert_eq!(dropped, 4 * chunk.len() as u64);
+    }
+
+    #[test]
+    fn read_should_rearm_pipes_beyond_the_read_budget() {
+        let mut reactor = Reactor::new().unwrap();
+        let mut capture = OutputCapture::default();
+        let (fd, mut write) = tracked(&mut capture, "yes");
+        capture.register_new(&reactor).unwrap();
+
+        write.write_all(&vec![b'y'; READ_BUDGET + 1024]).unwrap();
+        assert_eq!(reactor.wait(Some(Duration::ZERO)).unwrap(), 1);
+        assert!(capture.read(fd, &reactor));
+
+        // The rest of the output is reported by the next wait.
+        assert_eq!(reactor.wait(Some(Duration::ZERO)).unwrap(), 1);
+        assert_eq!(reactor.token(0), Token::Output(fd));
+        assert!(capture.read(fd, &reactor));
+        assert_eq!(reactor.wait(Some(Duration::ZERO)).unwrap(), 0);
+        assert_eq!(capture.len(), 1);
+    }
+
+    #[test]
+    fn is_full_should_limit_open_pipes() {
+        let mut capture = OutputCapture::default();
+        let mut streams = Vec::new();
+        for _ in 0..MAX_PIPES {
+            assert!(!capture.is_full());
+            streams.push(tracked(&mut capture, "/bin/sleep 1000"));
+        }
+        assert!(capture.is_full());
+
+        drop(streams.pop());
+        capture.read_all();
+        assert!(!capture.is_full());
+    }
+
+    #[test]
+    fn append_should_evict_least_recent_log() {
+        let logs = OutputLogs::new();
+        for i in 0..MAX_LOGS {
+            logs.append(&format!("command{}", i), b"x", 0);
+        }
+        logs.append("command0", b"y", 0);
+        logs.append("new", b"z", 0);
+
+        assert_eq!(logs.output("command0"), Some((b"xy".to_vec(), 0)));
+        assert_eq!(logs.output("command1"), None);
+        assert_eq!(logs.output("new"), Some((b"z".to_vec(), 0)));
+    }
+}
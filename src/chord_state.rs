@@ -6,99 +6,272 @@
 //! valid chords consist of one or more modifiers plus exactly one non-modifier key.
 //!
 //! The [`ChordState`] struct maintains a set of currently pressed keycodes and
-//! provides methods to add/remove keys and generate chord strings. Chord strings
-//! are normalized to a canonical format where modifiers are sorted alphabetically
-//! and separated by spaces (e.g. "Alt_L Control_L x" for Ctrl+Alt+X).
-use std::collections::HashSet;
+//! provides methods to add/remove keys and generate chord keys. A [`ChordKey`]
+//! is a compact, fixed-size encoding of a chord: a bitmask of the held
+//! modifiers plus the single non-modifier keysym (e.g. `Alt_L | Control_L` and
+//! `x` for Ctrl+Alt+X). Building and hashing one never touches the heap.
+use crate::key_table::KeyTable;
+use std::fmt;
 use xkbcommon::xkb;
 use xkbcommon::xkb::{keysyms, Keysym};
 
-const MAX_PRESSED_KEYS: usize = 16;
+/// Number of distinct XKB keycodes tracked (evdev's KEY_MAX plus the offset of
+/// 8 fits comfortably below this).
+const MAX_KEYCODES: usize = 1024;
+const KEYSET_WORDS: usize = MAX_KEYCODES / 64;
+
+/// Modifier bits used in [`ChordKey::modifiers`]. Left and right variants are
+/// kept distinct, matching the key names users write in their config.
+pub const MOD_SHIFT_L: u16 = 1 << 0;
+pub const MOD_SHIFT_R: u16 = 1 << 1;
+pub const MOD_CONTROL_L: u16 = 1 << 2;
+pub const MOD_CONTROL_R: u16 = 1 << 3;
+pub const MOD_ALT_L: u16 = 1 << 4;
+pub const MOD_ALT_R: u16 = 1 << 5;
+pub const MOD_META_L: u16 = 1 << 6;
+pub const MOD_META_R: u16 = 1 << 7;
+pub const MOD_SUPER_L: u16 = 1 << 8;
+pub const MOD_SUPER_R: u16 = 1 << 9;
+pub const MOD_HYPER_L: u16 = 1 << 10;
+pub const MOD_HYPER_R: u16 = 1 << 11;
+pub const MOD_CAPS_LOCK: u16 = 1 << 12;
+pub const MOD_SHIFT_LOCK: u16 = 1 << 13;
+
+/// Keysyms of every modifier, indexed by bit position in the modifier mask.
+const MODIFIER_KEYSYMS: [u32; 14] = [
+    keysyms::KEY_Shift_L,
+    keysyms::KEY_Shift_R,
+    keysyms::KEY_Control_L,
+    keysyms::KEY_Control_R,
+    keysyms::KEY_Alt_L,
+    keysyms::KEY_Alt_R,
+    keysyms::KEY_Meta_L,
+    keysyms::KEY_Meta_R,
+    keysyms::KEY_Super_L,
+    keysyms::KEY_Super_R,
+    keysyms::KEY_Hyper_L,
+    keysyms::KEY_Hyper_R,
+    keysyms::KEY_Caps_Lock,
+    keysyms::KEY_Shift_Lock,
+];
+
+/// A canonical, allocation-free representation of a key chord.
+///
+/// Two chords are equal when they hold the same set of modifiers and the same
+/// non-modifier keysym, regardless of the order the keys were pressed in.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct ChordKey {
+    modifiers: u16,
+    keysym: u32,
+}
+
+impl ChordKey {
+    /// Creates a chord key from a modifier bitmask and a non-modifier keysym.
+    pub fn new(modifiers: u16, keysym: Keysym) -> Self {
+        Self {
+            modifiers,
+            keysym: keysym.raw(),
+        }
+    }
+
+    /// Returns the modifier bitmask of this chord.
+    pub fn modifiers(&self) -> u16 {
+        self.modifiers
+    }
+
+    /// Returns the non-modifier keysym of this chord.
+    pub fn keysym(&self) -> Keysym {
+        Keysym::new(self.keysym)
+    }
+}
+
+impl fmt::Display for ChordKey {
+    /// Formats the chord the way it is written in the config, e.g. `Super_L+w`.
+    /// Only used for logging, so allocating keysym names here is fine.
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        for (bit, &keysym) in MODIFIER_KEYSYMS.iter().enumerate() {
+            if self.modifiers & (1 << bit) != 0 {
+                write!(f, "{}+", xkb::keysym_get_name(Keysym::new(keysym)))?;
+            }
+        }
+        write!(f, "{}", xkb::keysym_get_name(self.keysym()))
+    }
+}
+
+/// A fixed-width set of keycodes, one bit per keycode.
+///
+/// XKB keycodes are small dense integers (evdev codes plus 8, below 1024), so
+/// a bitset gives O(1) insert/remove/lookup without hashing or allocation.
+#[derive(Debug, Clone, Default)]
+struct KeySet([u64; KEYSET_WORDS]);
+
+impl KeySet {
+    /// Inserts a keycode, returning whether it was newly inserted.
+    fn insert(&mut self, keycode: usize) -> bool {
+        let (word, mask) = (keycode / 64, 1 << (keycode % 64));
+        let inserted = self.0[word] & mask == 0;
+        self.0[word] |= mask;
+        inserted
+    }
+
+    /// Removes a keycode, returning whether it was present.
+    fn remove(&mut self, keycode: usize) -> bool {
+        let (word, mask) = (keycode / 64, 1 << (keycode % 64));
+        let present = self.0[word] & mask != 0;
+        self.0[word] &= !mask;
+        present
+    }
+
+    fn contains(&self, keycode: usize) -> bool {
+        self.0[keycode / 64] & (1 << (keycode % 64)) != 0
+    }
+
+    fn len(&self) -> usize {
+        self.0.iter().map(|word| word.count_ones() as usize).sum()
+    }
+
+    /// Returns the lowest keycode in the set.
+    fn first(&self) -> Option<usize> {
+        self.0
+            .iter()
+            .enumerate()
+            .find(|(_, &word)| word != 0)
+            .map(|(i, word)| i * 64 + word.trailing_zeros() as usize)
+    }
+}
 
 /// Manages the state of currently pressed keys for chord detection.
+///
+/// Alongside the set of pressed keycodes, the state keeps a running modifier
+/// mask and the set of held non-modifier keys, both updated on add/remove, so
+/// building a chord never has to walk every held key.
 pub struct ChordState {
-    pressed_keys: HashSet<xkb::Keycode>,
+    pressed_keys: KeySet,
+    non_modifier_keys: KeySet,
+    modifier_counts: [u8; MODIFIER_KEYSYMS.len()],
+    modifiers: u16,
 }
 
 impl ChordState {
     /// Creates a new, empty ChordState.
     pub fn new() -> Self {
         Self {
-            pressed_keys: HashSet::with_capacity(MAX_PRESSED_KEYS),
+            pressed_keys: KeySet::default(),
+            non_modifier_keys: KeySet::default(),
+            modifier_counts: [0; MODIFIER_KEYSYMS.len()],
+            modifiers: 0,
         }
     }
 
     /// Adds a keycode to the set of currently pressed keys.
-    /// The HashSet automatically handles duplicates.
-    pub fn add_key(&mut self, keycode: xkb::Keycode) {
-        if self.pressed_keys.len() >= MAX_PRESSED_KEYS {
-            eprintln!("Warning: Maximum number of pressed keys exceeded.");
+    ///
+    /// Duplicates are ignored, as are keycodes outside the supported range.
+    ///
+    /// # Arguments
+    /// * `keycode` - The XKB keycode of the pressed key.
+    /// * `modifier` - The key's modifier bit, or 0 for a non-modifier key.
+    pub fn add_key(&mut self, keycode: xkb::Keycode, modifier: u16) {
+        let index = keycode.raw() as usize;
+        if index >= MAX_KEYCODES || !self.pressed_keys.insert(index) {
             return;
         }
-        self.pressed_keys.insert(keycode);
-    }
 
-    /// Removes a keycode from the set of currently pressed keys.
-    pub fn remove_key(&mut self, keycode: xkb::Keycode) {
-        self.pressed_keys.remove(&keycode);
+        match modifier {
+            0 => {
+                self.non_modifier_keys.insert(index);
+            }
+            bit => {
+                self.modifier_counts[bit.trailing_zeros() as usize] += 1;
+                self.modifiers |= bit;
+            }
+        }
     }
 
-    /// Constructs a chord string and sends it if it's valid.
+    /// Removes a keycode from the set of currently pressed keys.
     ///
-    /// A valid chord consists of one or more modifiers and EXACTLY ONE non-modifier
-    /// key. The resulting string is canonical: modifiers are sorted alphabetically,
-    /// followed by the single non-modifier key, all space-separated.
-    pub fn get_keychord(&self, xkb_state: &xkb::State) -> Option<String> {
-        let mut modifier_names = Vec::new();
-        let mut key_names = Vec::new();
-
-        // Separate all currently pressed keys into modifiers and regular keys.
-        for &keycode in self.pressed_keys.iter() {
-            let keysym = xkb_state.key_get_one_sym(keycode);
-            let name = xkb::keysym_get_name(keysym);
-
-            if Self::is_modifier_keysym(keysym) {
-                modifier_names.push(name);
-            } else {
-                key_names.push(name);
+    /// # Arguments
+    /// * `keycode` - The XKB keycode of the released key.
+    /// * `modifier` - The key's modifier bit, or 0 for a non-modifier key.
+    pub fn remove_key(&mut self, keycode: xkb::Keycode, modifier: u16) {
+        let index = keycode.raw() as usize;
+        if index >= MAX_KEYCODES || !self.pressed_keys.remove(index) {
+            return;
+        }
+
+        match modifier {
+            0 => {
+                self.non_modifier_keys.remove(index);
+            }
+            bit => {
+                let count = &mut self.modifier_counts[bit.trailing_zeros() as usize];
+                *count = count.saturating_sub(1);
+                if *count == 0 {
+                    self.modifiers &= !bit;
+                }
             }
         }
+    }
+
+    /// Returns whether a keycode is currently pressed.
+    pub fn is_pressed(&self, keycode: xkb::Keycode) -> bool {
+        let index = keycode.raw() as usize;
+        index < MAX_KEYCODES && self.pressed_keys.contains(index)
+    }
+
+    /// Returns the number of currently pressed keys.
+    pub fn pressed_count(&self) -> usize {
+        self.pressed_keys.len()
+    }
 
+    /// Constructs a chord key if the pressed keys form a valid chord.
+    ///
+    /// A valid chord consists of zero or more modifiers and EXACTLY ONE
+    /// non-modifier key. The modifier mask is maintained incrementally, so this
+    /// only looks up the keysym of the single non-modifier key.
+    ///
+    /// # Arguments
+    /// * `key_table` - The lookup table of the active keymap.
+    pub fn get_keychord(&self, key_table: &KeyTable) -> Option<ChordKey> {
         // A valid key sequence always ends with exactly one non-modifier key.
-        if key_names.len() != 1 {
+        if self.non_modifier_keys.len() != 1 {
             return None;
         }
 
-        // Sort modifiers alphabetically for a canonical representation.
-        modifier_names.sort_unstable();
+        let keycode = self.non_modifier_keys.first()? as u32;
+        let entry = key_table.get(keycode.into())?;
 
-        // Combine the sorted modifiers and the single key name.
-        let mut chord_parts = modifier_names;
-        chord_parts.extend(key_names);
-        let keychord = chord_parts.join(" ");
+        Some(ChordKey::new(self.modifiers, entry.keysym()))
+    }
 
-        Some(keychord)
+    /// Forgets every pressed key, e.g. after the keymap changed.
+    pub fn clear(&mut self) {
+        *self = Self::new();
+    }
+
+    /// Returns the modifier bit for a keysym, or 0 if it is not a modifier.
+    pub fn modifier_bit(keysym: Keysym) -> u16 {
+        match keysym.raw() {
+            keysyms::KEY_Shift_L => MOD_SHIFT_L,
+            keysyms::KEY_Shift_R => MOD_SHIFT_R,
+            keysyms::KEY_Control_L => MOD_CONTROL_L,
+            keysyms::KEY_Control_R => MOD_CONTROL_R,
+            keysyms::KEY_Alt_L => MOD_ALT_L,
+            keysyms::KEY_Alt_R => MOD_ALT_R,
+            keysyms::KEY_Meta_L => MOD_META_L,
+            keysyms::KEY_Meta_R => MOD_META_R,
+            keysyms::KEY_Super_L => MOD_SUPER_L,
+            keysyms::KEY_Super_R => MOD_SUPER_R,
+            keysyms::KEY_Hyper_L => MOD_HYPER_L,
+            keysyms::KEY_Hyper_R => MOD_HYPER_R,
+            keysyms::KEY_Caps_Lock => MOD_CAPS_LOCK,
+            keysyms::KEY_Shift_Lock => MOD_SHIFT_LOCK,
+            _ => 0,
+        }
     }
 
     /// Checks if a given keysym is a modifier key.
     pub fn is_modifier_keysym(keysym: Keysym) -> bool {
-        matches!(
-            keysym.into(),
-            keysyms::KEY_Shift_L
-                | keysyms::KEY_Shift_R
-                | keysyms::KEY_Control_L
-                | keysyms::KEY_Control_R
-                | keysyms::KEY_Alt_L
-                | keysyms::KEY_Alt_R
-                | keysyms::KEY_Meta_L
-                | keysyms::KEY_Meta_R
-                | keysyms::KEY_Super_L
-                | keysyms::KEY_Super_R
-                | keysyms::KEY_Hyper_L
-                | keysyms::KEY_Hyper_R
-                | keysyms::KEY_Caps_Lock
-                | keysyms::KEY_Shift_Lock
-        )
+        Self::modifier_bit(keysym) != 0
     }
 }
 
@@ -108,85 +281,107 @@ mod tests {
     // use xkbcommon::xkb::{self, Keycode};
     use xkbcommon::xkb;
 
-    fn init_xkb_state() -> xkb::State {
-        // Initialize the XKB context.
-        let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
-
-        // Create a keymap from the system's current keyboard configuration.
-        let keymap = xkb::Keymap::new_from_names(
-            &context,
-            "",   // rules
-            "",   // model
-            "",   // layout
-            "",   // variant
-            None, // options
-            xkb::KEYMAP_COMPILE_NO_FLAGS,
-        )
-        .expect("Failed to create XKB keymap");
+    fn init_keymap() -> xkb::Keymap {
+        crate::keymap_cache::default_keymap()
+    }
 
-        xkb::State::new(&keymap)
+    /// Presses every named key, resolving its modifier bit through the table.
+    fn press_keys(state: &mut ChordState, keymap: &xkb::Keymap, table: &KeyTable, names: &[&str]) {
+        for name in names {
+            let keycode = keymap.key_by_name(name).unwrap();
+            state.add_key(keycode, table.get(keycode).unwrap().modifier());
+        }
     }
 
     #[test]
     fn new_should_start_with_empty_pressed_keys() {
         let state = ChordState::new();
-        assert!(state.pressed_keys.is_empty());
+        assert_eq!(state.pressed_count(), 0);
+        assert_eq!(state.modifiers, 0);
     }
 
     #[test]
     fn add_key_should_store_key_in_pressed_keys() {
-        let xkb_state = init_xkb_state();
-        let keycode = xkb_state.get_keymap().min_keycode();
+        let keymap = init_keymap();
+        let keycode = keymap.min_keycode();
         let mut state = ChordState::new();
-        state.add_key(keycode);
-        assert!(state.pressed_keys.contains(&keycode));
+        state.add_key(keycode, 0);
+        assert!(state.is_pressed(keycode));
     }
 
     #[test]
     fn add_key_should_ignore_duplicates() {
-        let xkb_state = init_xkb_state();
-        let keycode = xkb_state.get_keymap().min_keycode();
+        let keymap = init_keymap();
+        let keycode = keymap.min_keycode();
         let mut state = ChordState::new();
 
-        state.add_key(keycode);
-        state.add_key(keycode);
+        state.add_key(keycode, 0);
+        state.add_key(keycode, 0);
 
-        assert_eq!(state.pressed_keys.len(), 1);
+        assert_eq!(state.pressed_count(), 1);
     }
 
     #[test]
-    fn add_key_should_warn_when_exceeding_capacity() {
-        let xkb_state = init_xkb_state();
+    fn add_key_should_not_cap_pressed_keys() {
         let mut state = ChordState::new();
 
-        // Fill the hashset to capacity
-        for i in 0..MAX_PRESSED_KEYS {
-            let keycode = xkb_state.get_keymap().min_keycode().raw() + i as u32;
-            state.add_key(keycode.into());
+        for keycode in 8..72u32 {
+            state.add_key(keycode.into(), 0);
         }
 
-        // Verify we have exactly MAX_PRESSED_KEYS
-        assert_eq!(state.pressed_keys.len(), MAX_PRESSED_KEYS);
+        assert_eq!(state.pressed_count(), 64);
+    }
+
+    #[test]
+    fn add_key_should_ignore_out_of_range_keycodes() {
+        let mut state = ChordState::new();
+        let keycode: xkb::Keycode = (MAX_KEYCODES as u32).into();
 
-        // Try to add one more key - this should trigger the warning and not add the key
-        let extra_keycode = xkb_state.get_keymap().min_keycode().raw() + MAX_PRESSED_KEYS as u32;
-        state.add_key(extra_keycode.into());
+        state.add_key(keycode, 0);
 
-        // Verify the key was not added (still at capacity)
-        assert_eq!(state.pressed_keys.len(), MAX_PRESSED_KEYS);
-        assert!(!state.pressed_keys.contains(&extra_keycode.into()));
+        assert_eq!(state.pressed_count(), 0);
+        assert!(!state.is_pressed(keycode));
     }
 
     #[test]
     fn remove_key_should_remove_key_from_pressed_keys() {
-        let xkb_state = init_xkb_state();
-        let keycode = xkb_state.get_keymap().min_keycode();
+        let keymap = init_keymap();
+        let keycode = keymap.min_keycode();
+        let mut state = ChordState::new();
+
+        state.add_key(keycode, 0);
+        state.remove_key(keycode, 0);
+
+        assert!(!state.is_pressed(keycode));
+    }
+
+    #[test]
+    fn clear_should_forget_pressed_keys() {
+        let mut state = ChordState::new();
+        state.add_key(50u32.into(), MOD_SHIFT_L);
+        state.add_key(38u32.into(), 0);
+
+        state.clear();
+
+        assert_eq!(state.pressed_count(), 0);
+        assert_eq!(state.modifiers, 0);
+    }
+
+    #[test]
+    fn modifier_mask_should_follow_add_and_remove() {
         let mut state = ChordState::new();
+        let shift = MOD_SHIFT_L;
 
-        state.add_key(keycode);
-        state.remove_key(keycode);
+        // Two physical keys producing the same modifier keysym.
+        state.add_key(50u32.into(), shift);
+        state.add_key(51u32.into(), shift);
+        assert_eq!(state.modifiers, MOD_SHIFT_L);
 
-        assert!(!state.pressed_keys.contains(&keycode));
+        state.remove_key(50u32.into(), shift);
+        assert_eq!(state.modifiers, MOD_SHIFT_L);
+
+        state.remove_key(51u32.into(), shift);
+        assert_eq!(state.modifiers, 0);
     }
 
     #[test]
@@ -205,39 +400,50 @@ mod tests {
 
     #[test]
     fn get_keychord_should_succeed_with_valid_content() {
-        let xkb_state = init_xkb_state();
-        let keymap = xkb_state.get_keymap();
-
-        let keycodes = [
-            keymap.key_by_name("LWIN").unwrap(),
-            keymap.key_by_name("AD02").unwrap(),
-        ];
-
+        let keymap = init_keymap();
+        let table = KeyTable::new(&keymap);
         let mut state = ChordState::new();
-        state.pressed_keys = keycodes.into_iter().collect();
+        press_keys(&mut state, &keymap, &table, &["LWIN", "AD02"]);
 
-        let keychord = state.get_keychord(&xkb_state);
+        let keychord = state.get_keychord(&table);
 
-        assert_eq!(state.pressed_keys.len(), 2);
-        assert_eq!(keychord, Some(String::from("Super_L w")));
+        assert_eq!(state.pressed_count(), 2);
+        assert_eq!(
+            keychord,
+            Some(ChordKey::new(MOD_SUPER_L, Keysym::new(keysyms::KEY_w)))
+        );
     }
 
     #[test]
     fn get_keychord_multi_nonmodifiers_should_return_none() {
-        let xkb_state = init_xkb_state();
-        let keymap = xkb_state.get_keymap();
-        let keycodes = [
-            keymap.key_by_name("LWIN").unwrap(),
-            keymap.key_by_name("AE01").unwrap(),
-            keymap.key_by_name("AE02").unwrap(),
-        ];
-
-        let xkb_state = init_xkb_state();
+        let keymap = init_keymap();
+        let table = KeyTable::new(&keymap);
         let mut state = ChordState::new();
-        state.pressed_keys = keycodes.into_iter().collect();
+        press_keys(&mut state, &keymap, &table, &["LWIN", "AE01", "AE02"]);
 
-        let keychord = state.get_keychord(&xkb_state);
+        let keychord = state.get_keychord(&table);
 
         assert!(keychord.is_none());
     }
+
+    #[test]
+    fn get_keychord_should_use_remaining_non_modifier_after_release() {
+        let keymap = init_keymap();
+        let table = KeyTable::new(&keymap);
+        let mut state = ChordState::new();
+        press_keys(&mut state, &keymap, &table, &["LCTL", "AC01", "AC02"]);
+
+        state.remove_key(keymap.key_by_name("AC01").unwrap(), 0);
+
+        assert_eq!(
+            state.get_keychord(&table),
+            Some(ChordKey::new(MOD_CONTROL_L, Keysym::new(keysyms::KEY_s)))
+        );
+    }
+
+    #[test]
+    fn chord_key_should_display_in_config_syntax() {
+        let chord = ChordKey::new(MOD_CONTROL_L | MOD_ALT_L, Keysym::new(keysyms::KEY_Return));
+        assert_eq!(chord.to_string(), "Control_L+Alt_L+Return");
+    }
 }
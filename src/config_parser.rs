@@ -0,0 +1,751 @@
+//! Provides the single-pass parser for config files.
+//!
+//! A config is read into memory once with [`FileContents::read`] and
+//! validated as UTF-8 in place. [`lines`] then splits it into
+//! [`ConfigLine`]s whose text, key names and commands are all slices borrowed
+//! from that buffer, so parsing allocates nothing but the resulting
+//! [`Action`]s and the table holding them.
+//! A [`Parser`] also memoizes keysym lookups across lines, shares a single
+//! action between bindings with the same command, and resolves each program
+//! name through PATH only once.
+//!
+//! Errors point at the offending token with a 1-based line and column.
+use crate::action::Action;
+use crate::chord_state::{ChordKey, ChordState};
+use crate::keybindings::{self, BindingTable, KeySequence, DEFAULT_SEQUENCE_TIMEOUT};
+use crate::path_search::ProgramResolver;
+use crate::scheduler::{Concurrency, JobPolicy, Rate};
+use anyhow::{anyhow, Result};
+use nix::sys::mman::{self, MapFlags, MmapAdvise, ProtFlags};
+use std::collections::HashMap;
+use std::ffi::c_void;
+use std::fmt;
+use std::fs::File;
+use std::io::Read;
+use std::num::{NonZeroU32, NonZeroUsize};
+use std::path::Path;
+use std::ptr::NonNull;
+use std::sync::Arc;
+use std::time::Duration;
+use xkbcommon::xkb;
+use xkbcommon::xkb::{keysyms, Keysym};
+
+/// The contents of a file, mapped or read into memory.
+enum Contents {
+    Mapped { ptr: NonNull<c_void>, len: usize },
+    Owned(Vec<u8>),
+}
+
+/// The read-only contents of a whole file.
+///
+/// [`FileContents::read`] copies a file into memory; it does not map it.
+/// Config files are edited in place by users, editors and generators alike
+/// (`echo > clefdrc`, vim with `backupcopy=yes`), so they are always read.
+/// [`FileContents::map`] maps regular files privately instead. Truncating a
+/// mapped file while the view is alive makes reading past the new end raise
+/// `SIGBUS`, so it is only used for files the daemon itself replaces by
+/// renaming, such as its caches.
+pub struct FileContents {
+    contents: Contents,
+}
+
+// SAFETY: The mapping is read-only and owned by this value alone.
+unsafe impl Send for FileContents {}
+unsafe impl Sync for FileContents {}
+
+impl FileContents {
+    /// Reads a whole file into memory.
+    ///
+    /// The buffer is sized from the file's metadata, so a file that is not
+    /// being written to is read without reallocating.
+    ///
+    /// # Arguments
+    /// * `path` - The file to read.
+    pub fn read(path: &Path) -> Result<Self> {
+        let mut file = File::open(path)?;
+        let mut buf = Vec::with_capacity(file.metadata()?.len() as usize);
+        file.read_to_end(&mut buf)?;
+        Ok(Self {
+            contents: Contents::Owned(buf),
+        })
+    }
+
+    /// Maps a file into memory.
+    ///
+    /// The file must only ever be replaced by renaming a new one into place,
+    /// never truncated, while the view is alive.
+    ///
+    /// # Arguments
+    /// * `path` - The file to map.
+    pub fn map(path: &Path) -> Result<Self> {
+        let mut file = File::open(path)?;
+        let metadata = file.metadata()?;
+
+        let mapped = match NonZeroUsize::new(metadata.len() as usize) {
+            // SAFETY: A fresh private, read-only mapping of a file we own a
+            // descriptor for; it is unmapped exactly once on drop. Reads of
+            // the mapping only stay valid while nobody truncates the file,
+            // which callers guarantee by only mapping files that are replaced
+            // by renaming.
+            Some(length) if metadata.is_file() => unsafe {
+                mman::mmap(
+                    None,
+                    length,
+                    ProtFlags::PROT_READ,
+                    MapFlags::MAP_PRIVATE,
+                    &file,
+                    0,
+                )
+                .ok()
+                .map(|ptr| {
+                    // Parsing reads the file front to back exactly once.
+                    let _ = mman::madvise(ptr, length.get(), MmapAdvise::MADV_SEQUENTIAL);
+                    Contents::Mapped {
+                        ptr,
+                        len: length.get(),
+                    }
+                })
+            },
+            _ => None,
+        };
+
+        let contents = match mapped {
+            Some(contents) => contents,
+            None => {
+                let mut buf = Vec::new();
+                file.read_to_end(&mut buf)?;
+                Contents::Owned(buf)
+            }
+        };
+
+        Ok(Self { contents })
+    }
+
+    /// Returns the raw contents of the file.
+    pub fn as_bytes(&self) -> &[u8] {
+        match &self.contents {
+            // SAFETY: The mapping is `len` readable bytes and lives as long as
+            // `self`.
+            Contents::Mapped { ptr, len } => unsafe {
+                std::slice::from_raw_parts(ptr.as_ptr().cast::<u8>(), *len)
+            },
+            Contents::Owned(buf) => buf,
+        }
+    }
+
+    /// Returns the contents of the file as text.
+    ///
+    /// # Returns
+    /// An error with the position of the first byte that is not valid UTF-8.
+    pub fn as_str(&self) -> Result<&str> {
+        let bytes = self.as_bytes();
+
+        std::str::from_utf8(bytes).map_err(|e| {
+            let valid = &bytes[..e.valid_up_to()];
+            let line_start = valid.iter().rposition(|&b| b == b'\n').map_or(0, |i| i + 1);
+            let position = Position {
+                line: valid.iter().filter(|&&b| b == b'\n').count() + 1,
+                // Count characters, not bytes: skip UTF-8 continuation bytes.
+                column: valid[line_start..]
+                    .iter()
+                    .filter(|&&b| b & 0xc0 != 0x80)
+                    .count()
+                    + 1,
+            };
+            anyhow!("Invalid UTF-8 on {}", position)
+        })
+    }
+}
+
+impl Drop for FileContents {
+    fn drop(&mut self) {
+        if let Contents::Mapped { ptr, len } = self.contents {
+            // SAFETY: `ptr` and `len` describe a mapping made in `map`.
+            let _ = unsafe { mman::munmap(ptr, len) };
+        }
+    }
+}
+
+/// A 1-based line and column, counted in characters.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Position {
+    pub line: usize,
+    pub column: usize,
+}
+
+impl fmt::Display for Position {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "line {}, column {}", self.line, self.column)
+    }
+}
+
+/// A line that splices other files into the config instead of binding keys.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Directive<'a> {
+    /// `include PATH` splices in a single file.
+    Include(&'a str),
+    /// `include-dir DIR` splices in every file of a directory, by name.
+    IncludeDir(&'a str),
+}
+
+/// A config line that is neither blank nor a comment.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ConfigLine<'a> {
+    /// The zero-based line number.
+    pub line_num: usize,
+    /// The line without surrounding whitespace.
+    pub text: &'a str,
+    raw: &'a str,
+}
+
+impl<'a> ConfigLine<'a> {
+    /// Wraps a raw line of a config.
+    ///
+    /// # Arguments
+    /// * `raw` - The line as it appears in the file.
+    /// * `line_num` - The zero-based line number.
+    ///
+    /// # Returns
+    /// `None` for blank lines and comments.
+    pub fn new(raw: &'a str, line_num: usize) -> Option<Self> {
+        let text = raw.trim();
+
+        if text.is_empty() || text.starts_with('#') {
+            return None;
+        }
+
+        Some(Self {
+            line_num,
+            text,
+            raw,
+        })
+    }
+
+    /// Recognizes an `include` or `include-dir` line.
+    ///
+    /// # Returns
+    /// `None` for binding lines, or an error for a directive without a path.
+    pub fn directive(&self) -> Option<Result<Directive<'a>>> {
+        let (word, path) = self
+            .text
+            .split_once(char::is_whitespace)
+            .unwrap_or((self.text, ""));
+        let path = path.trim();
+        let directive = match word {
+            "include" => Directive::Include(path),
+            "include-dir" => Directive::IncludeDir(path),
+            _ => return None,
+        };
+
+        if path.is_empty() {
+            return Some(Err(anyhow!(
+                "Missing path after '{}' on {}",
+                word,
+                self.position_of(self.text)
+            )));
+        }
+        Some(Ok(directive))
+    }
+
+    /// Returns the position of a token borrowed from this line.
+    ///
+    /// Tokens that do not point into the line are reported at its end.
+    pub fn position_of(&self, token: &str) -> Position {
+        let offset = (token.as_ptr() as usize).wrapping_sub(self.raw.as_ptr() as usize);
+        let prefix = self.raw.get(..offset).unwrap_or(self.raw);
+
+        Position {
+            line: self.line_num + 1,
+            column: prefix.chars().count() + 1,
+        }
+    }
+}
+
+/// Splits a config into its binding and directive lines.
+///
+/// # Arguments
+/// * `content` - The whole config.
+pub fn lines(content: &str) -> impl Iterator<Item = ConfigLine<'_>> {
+    content
+        .lines()
+        .enumerate()
+        .filter_map(|(line_num, raw)| ConfigLine::new(raw, line_num))
+}
+
+/// Parses config lines into bindings.
+///
+/// A parser borrows from the content it parses and remembers every key name
+/// and command it has seen, so the repeated modifier names and commands of a
+/// large generated config are only resolved once.
+#[derive(Debug, Default)]
+pub struct Parser<'a> {
+    keysyms: HashMap<&'a str, Keysym>,
+    actions: HashMap<(&'a str, JobPolicy), Arc<Action>>,
+    programs: ProgramResolver,
+}
+
+impl<'a> Parser<'a> {
+    /// Creates a parser with empty lookup caches.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Parses a whole config into a binding table.
+    ///
+    /// As with reading the lines in order, the last definition of a chord wins.
+    ///
+    /// # Arguments
+    /// * `content` - The whole config.
+    ///
+    /// # Returns
+    /// The table, or the first error in the config.
+    pub fn parse_all(&mut self, content: &'a str) -> Result<BindingTable> {
+        let mut table = BindingTable::new();
+
+        for line in lines(content) {
+            let (sequence, action) = self.parse_line(&line)?;
+            keybindings::insert(&mut table, &sequence, action);
+        }
+
+        Ok(table)
+    }
+
+    /// Parses a single binding line.
+    ///
+    /// # Arguments
+    /// * `line` - The line to parse.
+    ///
+    /// # Returns
+    /// The chord sequence and its action, or an error pointing at the
+    /// offending token.
+    pub fn parse_line(&mut self, line: &ConfigLine<'a>) -> Result<(KeySequence, Arc<Action>)> {
+        // Split on first colon only.
+        let (chord, command) = line.text.split_once(':').ok_or_else(|| {
+            anyhow!(
+                "Invalid key-value pair on {}: missing ':' in '{}'",
+                line.position_of(line.text),
+                line.text
+            )
+        })?;
+
+        let chord = chord.trim();
+        let command = command.trim();
+
+        if chord.is_empty() {
+            return Err(anyhow!(
+                "Invalid key-value pair on {}: missing keychord in '{}'",
+                line.position_of(line.text),
+                line.text
+            ));
+        }
+        if command.is_empty() {
+            return Err(anyhow!(
+                "Invalid key-value pair on {}: missing command in '{}'",
+                line.position_of(&line.text[line.text.len()..]),
+                line.text
+            ));
+        }
+
+        let (sequence, policy) = self.parse_keys(line, chord)?;
+        let action = self
+            .action(command, policy)
+            .map_err(|e| anyhow!("Invalid command on {}: {}", line.position_of(command), e))?;
+
+        Ok((sequence, action))
+    }
+
+    /// Parses a key sequence, ignoring any scheduling options.
+    ///
+    /// # Arguments
+    /// * `line` - The line the sequence is part of, for error positions.
+    /// * `sequence` - The sequence, borrowed from the line.
+    pub fn parse_sequence(
+        &mut self,
+        line: &ConfigLine<'a>,
+        sequence: &'a str,
+    ) -> Result<KeySequence> {
+        self.parse_keys(line, sequence)
+            .map(|(sequence, _)| sequence)
+    }
+
+    /// Parses the key side of a binding: a ',' separated sequence of
+    /// keychords, optionally followed by ',' separated options in brackets,
+    /// e.g. `Super_L+x, f [500ms, single]`.
+    ///
+    /// An option starting with a digit is the time to wait between the chords
+    /// of a sequence; the others set the [`JobPolicy`] of the binding.
+    ///
+    /// # Arguments
+    /// * `line` - The line the keys are part of, for error positions.
+    /// * `keys` - The key side, borrowed from the line.
+    pub fn parse_keys(
+        &mut self,
+        line: &ConfigLine<'a>,
+        keys: &'a str,
+    ) -> Result<(KeySequence, JobPolicy)> {
+        let (chords, options) = match keys
+            .strip_suffix(']')
+            .and_then(|rest| rest.rsplit_once('['))
+        {
+            Some((chords, options)) => (chords.trim_end(), Some(options)),
+            None => (keys, None),
+        };
+
+        let mut chords = chords.split(',').map(str::trim);
+        // Splitting always yields at least one part.
+        let first = self.parse_chord(line, chords.next().unwrap_or_default())?;
+        let rest = chords
+            .map(|chord| self.parse_chord(line, chord))
+            .collect::<Result<Box<[ChordKey]>>>()?;
+
+        let mut timeout = DEFAULT_SEQUENCE_TIMEOUT;
+        let mut policy = JobPolicy::default();
+        for option in options
+            .into_iter()
+            .flat_map(|o| o.split(','))
+            .map(str::trim)
+        {
+            if !option.starts_with(|c: char| c.is_ascii_digit()) {
+                Self::parse_policy_option(&mut policy, option).ok_or_else(|| {
+                    anyhow!(
+                        "Invalid binding option '{}' on {}: expected e.g. 'single', \
+                         'coalesce', 'rate=5/s' or 'queue=4'",
+                        option,
+                        line.position_of(option)
+                    )
+                })?;
+            } else if rest.is_empty() {
+                return Err(anyhow!(
+                    "Timeout on {} only applies to key sequences",
+                    line.position_of(option)
+                ));
+            } else {
+                timeout = Self::parse_timeout(option).ok_or_else(|| {
+                    anyhow!(
+                        "Invalid sequence timeout '{}' on {}: expected e.g. '500ms' or '2s'",
+                        option,
+                        line.position_of(option)
+                    )
+                })?;
+            }
+        }
+
+        let sequence = KeySequence {
+            first,
+            rest,
+            timeout,
+        };
+        Ok((sequence, policy))
+    }
+
+    /// Applies a job option: `single`, `coalesce`, `rate=N/s`, `rate=N/min`,
+    /// `queue=N` or `capture`.
+    fn parse_policy_option(policy: &mut JobPolicy, option: &str) -> Option<()> {
+        match option.split_once('=') {
+            None if option == "single" => policy.concurrency = Concurrency::Single,
+            None if option == "coalesce" => policy.concurrency = Concurrency::Coalesce,
+            None if option == "capture" => policy.capture = true,
+            Some(("rate", rate)) => {
+                let (starts, per) = rate.split_once('/')?;
+                let per = match per.trim() {
+                    "s" => Duration::from_secs(1),
+                    "min" => Duration::from_secs(60),
+                    _ => return None,
+                };
+                let starts = starts.trim().parse::<NonZeroU32>().ok()?;
+                policy.rate = Some(Rate { starts, per });
+            }
+            Some(("queue", depth)) => policy.queue = depth.trim().parse().ok()?,
+            _ => return None,
+        }
+        Some(())
+    }
+
+    /// Parses a positive timeout in milliseconds (`500ms`) or seconds (`2s`).
+    fn parse_timeout(timeout: &str) -> Option<Duration> {
+        let (value, scale) = match timeout.strip_suffix("ms") {
+            Some(value) => (value, 1),
+            None => (timeout.strip_suffix('s')?, 1000),
+        };
+
+        let millis = value.trim().parse::<u64>().ok()?.checked_mul(scale)?;
+        (millis > 0).then(|| Duration::from_millis(millis))
+    }
+
+    /// Parses a '+' separated list of key names into a [`ChordKey`].
+    ///
+    /// Every name must be a valid XKB keysym name, and exactly one of them must
+    /// be a non-modifier key.
+    fn parse_chord(&mut self, line: &ConfigLine<'a>, chord: &'a str) -> Result<ChordKey> {
+        let mut modifiers = 0;
+        let mut key = None;
+
+        if chord.is_empty() {
+            return Err(anyhow!(
+                "Missing keychord in sequence on {}",
+                line.position_of(chord)
+            ));
+        }
+
+        for name in chord.split('+').map(str::trim) {
+            let keysym = self.keysym(name);
+            if keysym.raw() == keysyms::KEY_NoSymbol {
+                return Err(anyhow!(
+                    "Unknown key name '{}' on {}",
+                    name,
+                    line.position_of(name)
+                ));
+            }
+
+            match ChordState::modifier_bit(keysym) {
+                0 if key.is_some() => {
+                    return Err(anyhow!(
+                        "Keychord on {} must contain exactly one non-modifier key: '{}'",
+                        line.position_of(name),
+                        chord
+                    ))
+                }
+                0 => key = Some(keysym),
+                bit => modifiers |= bit,
+            }
+        }
+
+        key.map(|keysym| ChordKey::new(modifiers, keysym))
+            .ok_or_else(|| {
+                anyhow!(
+                    "Keychord on {} must contain exactly one non-modifier key: '{}'",
+                    line.position_of(chord),
+                    chord
+                )
+            })
+    }
+
+    /// Looks up a keysym by name, resolving each distinct name only once.
+    fn keysym(&mut self, name: &'a str) -> Keysym {
+        *self
+            .keysyms
+            .entry(name)
+            .or_insert_with(|| xkb::keysym_from_name(name, xkb::KEYSYM_NO_FLAGS))
+    }
+
+    /// Parses a command and resolves its program, sharing the action of an
+    /// identical earlier command with the same policy.
+    fn action(&mut self, command: &'a str, policy: JobPolicy) -> Result<Arc<Action>> {
+        if let Some(action) = self.actions.get(&(command, policy)) {
+            return Ok(Arc::clone(action));
+        }
+
+        let action = Action::parse(command)?
+            .with_policy(policy)
+            .resolve(&mut self.programs);
+        let action = Arc::new(action);
+        self.actions.insert((command, policy), Arc::clone(&action));
+        Ok(action)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::chord_state::MOD_SUPER_L;
+    use crate::keybindings::Binding;
+    use std::fs;
+    use tempfile::NamedTempFile;
+
+    fn parse_error(content: &str) -> String {
+        Parser::new().parse_all(content).unwrap_err().to_string()
+    }
+
+    #[test]
+    fn map_should_read_regular_and_empty_files() {
+        let file = NamedTempFile::new().unwrap();
+        assert_eq!(FileContents::map(file.path()).unwrap().as_bytes(), b"");
+
+        fs::write(file.path(), "Super_L+a: one\n").unwrap();
+        let mapped = FileContents::map(file.path()).unwrap();
+        assert_eq!(mapped.as_str().unwrap(), "Super_L+a: one\n");
+    }
+
+    #[test]
+    fn read_should_keep_contents_when_the_file_is_truncated() {
+        let file = NamedTempFile::new().unwrap();
+        fs::write(file.path(), "Super_L+a: one\n".repeat(1024)).unwrap();
+
+        let read = FileContents::read(file.path()).unwrap();
+        // Rewriting a config in place, as `echo > clefdrc` does.
+        fs::write(file.path(), "").unwrap();
+        assert_eq!(read.as_str().unwrap().lines().count(), 1024);
+    }
+
+    #[test]
+    fn as_str_should_report_invalid_utf8_position() {
+        let file = NamedTempFile::new().unwrap();
+        fs::write(file.path(), b"Super_L+a: one\nSuper_L+b: \xc3\xa9t\xff\n").unwrap();
+
+        let err = FileContents::map(file.path())
+            .unwrap()
+            .as_str()
+            .unwrap_err();
+        assert_eq!(err.to_string(), "Invalid UTF-8 on line 2, column 14");
+    }
+
+    #[test]
+    fn lines_should_skip_blanks_and_comments() {
+        let content = "# header\n\n  Super_L+a: one\n\t# indented comment\nSuper_L+b: two";
+        let parsed: Vec<(usize, &str)> = lines(content)
+            .map(|line| (line.line_num, line.text))
+            .collect();
+        assert_eq!(parsed, vec![(2, "Super_L+a: one"), (4, "Super_L+b: two")]);
+    }
+
+    #[test]
+    fn directive_should_parse_include_lines() {
+        let content = "include extra.conf\ninclude-dir  ~/conf.d\nSuper_L+a: include\ninclude\n";
+        let directives: Vec<Option<String>> = lines(content)
+            .map(|line| match line.directive() {
+                Some(Ok(directive)) => Some(format!("{:?}", directive)),
+                Some(Err(e)) => Some(e.to_string()),
+                None => None,
+            })
+            .collect();
+        assert_eq!(
+            directives,
+            vec![
+                Some("Include(\"extra.conf\")".to_string()),
+                Some("IncludeDir(\"~/conf.d\")".to_string()),
+                None,
+                Some("Missing path after 'include' on line 4, column 1".to_string()),
+            ]
+        );
+    }
+
+    #[test]
+    fn parse_all_should_report_precise_positions() {
+        assert!(parse_error("Super_L+a: one\n  invalid line")
+            .starts_with("Invalid key-value pair on line 2, column 3: missing ':'"));
+        assert!(parse_error("Super_L+a:   ")
+            .starts_with("Invalid key-value pair on line 1, column 11: missing command"));
+        assert!(parse_error(": cmd").contains("line 1, column 1: missing keychord"));
+        assert_eq!(
+            parse_error("\n\nSuper_L + nope: cmd"),
+            "Unknown key name 'nope' on line 3, column 11"
+        );
+        assert!(parse_error("Super_L+a+b: cmd").starts_with("Keychord on line 1, column 11"));
+        assert!(parse_error("Super_L+a: echo 'oops")
+            .starts_with("Invalid command on line 1, column 12"));
+        assert_eq!(
+            parse_error("Super_L+x, , f: cmd"),
+            "Missing keychord in sequence on line 1, column 11"
+        );
+        assert!(parse_error("Super_L+x, f [soon]: cmd")
+            .starts_with("Invalid binding option 'soon' on line 1, column 15"));
+        assert!(parse_error("Super_L+x, f [single, 5 days]: cmd")
+            .starts_with("Invalid sequence timeout '5 days' on line 1, column 23"));
+        assert_eq!(
+            parse_error("Super_L+x [2s]: cmd"),
+            "Timeout on line 1, column 12 only applies to key sequences"
+        );
+    }
+
+    #[test]
+    fn parse_line_should_parse_sequences_and_timeouts() {
+        let super_x = ChordKey::new(MOD_SUPER_L, Keysym::new(keysyms::KEY_x));
+        let f = ChordKey::new(0, Keysym::new(keysyms::KEY_f));
+        let mut parser = Parser::new();
+        let mut parse = |text| {
+            let line = ConfigLine::new(text, 0).unwrap();
+            parser.parse_line(&line).unwrap().0
+        };
+
+        assert_eq!(
+            parse("Super_L+w: cmd"),
+            KeySequence::chord(ChordKey::new(MOD_SUPER_L, Keysym::new(keysyms::KEY_w)))
+        );
+        assert_eq!(
+            parse("Super_L + x , f: cmd"),
+            KeySequence {
+                first: super_x,
+                rest: vec![f].into(),
+                timeout: DEFAULT_SEQUENCE_TIMEOUT,
+            }
+        );
+        assert_eq!(
+            parse("Super_L+x, f, f [250ms]: cmd").timeout,
+            Duration::from_millis(250)
+        );
+        assert_eq!(
+            parse("Super_L+x, f [2s]: cmd").timeout,
+            Duration::from_secs(2)
+        );
+    }
+
+    #[test]
+    fn parse_line_should_parse_job_policies() {
+        let mut parser = Parser::new();
+        let mut parse = |text| {
+            let line = ConfigLine::new(text, 0).unwrap();
+            parser.parse_line(&line).unwrap().1.policy()
+        };
+
+        assert_eq!(parse("Super_L+w: cmd"), JobPolicy::default());
+        assert_eq!(
+            parse("Super_L+w [single]: cmd").concurrency,
+            Concurrency::Single
+        );
+        assert_eq!(
+            parse("Super_L+x, f [500ms, coalesce, rate=2/s, queue=1, capture]: cmd"),
+            JobPolicy {
+                concurrency: Concurrency::Coalesce,
+                rate: Some(Rate {
+                    starts: NonZeroU32::new(2).unwrap(),
+                    per: Duration::from_secs(1),
+                }),
+                queue: 1,
+                capture: true,
+            }
+        );
+        assert_eq!(
+            parse("Super_L+w [rate=10/min]: cmd")
+                .rate
+                .map(|rate| rate.per),
+            Some(Duration::from_secs(60))
+        );
+
+        let line = ConfigLine::new("Super_L+w [rate=0/s]: cmd", 0).unwrap();
+        assert!(parser.parse_line(&line).is_err());
+    }
+
+    #[test]
+    fn position_of_should_count_characters() {
+        let line = ConfigLine::new("  é+a: cmd", 4).unwrap();
+        let token = &line.text[line.text.find('a').unwrap()..][..1];
+        assert_eq!(line.position_of(token), Position { line: 5, column: 5 });
+    }
+
+    #[test]
+    fn parser_should_share_identical_commands() {
+        let table = Parser::new()
+            .parse_all("Super_L+a: notify-send hi\nSuper_L+b: notify-send hi\n")
+            .unwrap();
+        let action = |keysym| match &table[&ChordKey::new(MOD_SUPER_L, Keysym::new(keysym))] {
+            Binding::Action(action) => Arc::clone(action),
+            Binding::Prefix(_) => panic!("Expected an action"),
+        };
+        assert!(Arc::ptr_eq(
+            &action(keysyms::KEY_a),
+            &action(keysyms::KEY_b)
+        ));
+    }
+
+    #[test]
+    fn parse_all_should_let_last_definition_win() {
+        let table = Parser::new()
+            .parse_all("Super_L+a: first\nSuper_L+a: second\n")
+            .unwrap();
+        assert_eq!(table.len(), 1);
+        assert_eq!(
+            table.values().next(),
+            Some(&Binding::Action(Arc::new(Action::parse("second").unwrap())))
+        );
+    }
+}
@@ -0,0 +1,838 @@
+//! Provides the runtime control socket for changing bindings without the
+//! config file.
+//!
+//! Tools connect to the [`ControlSocket`] and send one request per line.
+//! Changes are staged per connection and published in a single atomic swap
+//! of the keybindings table on `commit`, so the event thread sees either
+//! all of a batch or none of it, and nothing is parsed but the requests
+//! themselves:
+//!
+//! ```text
+//! bind <sequence>: <command>   Stage a binding, replacing an existing one.
+//! unbind <sequence>            Stage removing a binding, or every sequence
+//!                              starting with a prefix.
+//! commit                       Publish the staged changes.
+//! abort                        Drop the staged changes.
+//! list                         List all bindings, one per line, in the
+//!                              syntax `bind` takes.
+//! query <sequence>             Show what a sequence is bound to.
+//! trace [<count>]              Show the most recent key events.
+//! output <sequence>            Show what a capturing binding's commands
+//!                              printed most recently.
+//! ```
+//!
+//! Bindings and sequences use the config file syntax. Every request is
+//! answered with `ok` or `error: <reason>`, preceded by its output lines for
+//! `list`, `query`, `trace` and `output`; `query` prints the command, or
+//! `prefix` for the start of longer sequences, `trace` decodes the daemon's
+//! [`TraceRing`], oldest event first, and `output` prints each line of the
+//! binding's [`OutputLogs`] entry after `> `, followed by `dropped <n> bytes`
+//! if its children printed more than was kept. Changes still staged when a
+//! client disconnects are dropped. Runtime changes last until an edit of the
+//! config file redefines the same chords.
+use crate::action::Action;
+use crate::child_output::OutputLogs;
+use crate::config_parser::{ConfigLine, Parser};
+use crate::keybindings::{
+    self, Binding, BindingTable, KeySequence, Keybindings, DEFAULT_SEQUENCE_TIMEOUT,
+};
+use crate::reactor::{Reactor, Token};
+use crate::scheduler::{Concurrency, JobPolicy, DEFAULT_QUEUE_DEPTH};
+use crate::trace_ring::TraceRing;
+use anyhow::{anyhow, Context, Result};
+use log::{debug, info, warn};
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::fs;
+use std::io::{self, Read, Write};
+use std::os::fd::{AsFd, AsRawFd, BorrowedFd, RawFd};
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::Duration;
+
+/// Longest request line a client may send.
+const MAX_REQUEST: usize = 64 * 1024;
+
+/// How many bytes are read from a client per wakeup, so a client flooding
+/// the socket cannot keep the event thread from its keyboards.
+const READ_BUDGET: usize = 64 * 1024;
+
+/// How many reply bytes may wait for a client that does not read them before
+/// its further requests are left unanswered until it does.
+const MAX_UNSENT: usize = 256 * 1024;
+
+/// How many events `trace` shows unless asked for a count.
+const DEFAULT_TRACE_COUNT: usize = 64;
+
+/// The most events a single `trace` reply may hold, which keeps the reply
+/// well within a socket buffer.
+const MAX_TRACE_COUNT: usize = 1024;
+
+/// A staged change to the bindings.
+enum Change {
+    Bind(KeySequence, Arc<Action>),
+    Unbind(KeySequence),
+}
+
+/// A connected client.
+struct Client {
+    stream: UnixStream,
+    /// Bytes received after the last answered request line.
+    input: Vec<u8>,
+    /// Replies the socket buffer had no room for yet.
+    unsent: Vec<u8>,
+    /// Whether the client has closed its end for writing.
+    eof: bool,
+    /// Changes waiting for `commit`.
+    staged: Vec<Change>,
+}
+
+/// What a client waits for after being served.
+#[derive(Debug, PartialEq, Eq)]
+enum Served {
+    /// Its next readiness edge.
+    Edge,
+    /// Being polled again: it used up its read budget with data left.
+    Rearm,
+    /// Nothing: it disconnected and every reply was written.
+    Closed,
+}
+
+/// A Unix socket accepting control connections.
+pub struct ControlSocket {
+    listener: UnixListener,
+    path: PathBuf,
+    clients: HashMap<RawFd, Client>,
+    trace: Option<Arc<TraceRing>>,
+    output: Option<Arc<OutputLogs>>,
+}
+
+impl ControlSocket {
+    /// Binds the socket, replacing a stale socket file left at `path`.
+    ///
+    /// # Arguments
+    /// * `path` - Where to create the socket.
+    pub fn bind(path: &Path) -> Result<Self> {
+        match fs::remove_file(path) {
+            Err(e) if e.kind() != io::ErrorKind::NotFound => {
+                return Err(e).context(format!("Failed to remove stale socket {:?}", path))
+            }
+            _ => (),
+        }
+
+        let listener = UnixListener::bind(path)
+            .context(format!("Failed to bind control socket at {:?}", path))?;
+        listener
+            .set_nonblocking(true)
+            .context("Failed to make control socket non-blocking")?;
+
+        Ok(Self {
+            listener,
+            path: path.to_path_buf(),
+            clients: HashMap::new(),
+            trace: None,
+            output: None,
+        })
+    }
+
+    /// Lets clients read a trace ring with `trace` requests.
+    pub fn set_trace_ring(&mut self, trace: Arc<TraceRing>) {
+        self.trace = Some(trace);
+    }
+
+    /// Lets clients read captured output with `output` requests.
+    pub fn set_output_logs(&mut self, output: Arc<OutputLogs>) {
+        self.output = Some(output);
+    }
+
+    /// Accepts every pending connection and registers it with the reactor.
+    ///
+    /// # Arguments
+    /// * `reactor` - The reactor to register clients with, as
+    ///   [`Token::ControlClient`].
+    pub fn accept(&mut self, reactor: &Reactor) {
+        loop {
+            let stream = match self.listener.accept() {
+                Ok((stream, _)) => stream,
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => return,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(e) => {
+                    warn!("Failed to accept control connection: {}", e);
+                    return;
+                }
+            };
+
+            let fd = stream.as_raw_fd();
+            let registered = stream
+                .set_nonblocking(true)
+                .context("Failed to make control connection non-blocking")
+                .and_then(|_| reactor.register(&stream, Token::ControlClient(fd)));
+            match registered {
+                Ok(()) => {
+                    debug!("Control client connected");
+                    self.clients.insert(
+                        fd,
+                        Client {
+                            stream,
+                            input: Vec::new(),
+                            unsent: Vec::new(),
+                            eof: false,
+                            staged: Vec::new(),
+                        },
+                    );
+                }
+                Err(e) => warn!("{:#}", e),
+            }
+        }
+    }
+
+    /// Reads and answers the requests of a client, and writes the replies
+    /// it had no room for before.
+    ///
+    /// # Arguments
+    /// * `fd` - The client's descriptor, from its [`Token::ControlClient`].
+    /// * `keybindings` - The live bindings to query and change.
+    /// * `reactor` - The reactor the client is registered with.
+    pub fn handle_client(&mut self, fd: RawFd, keybindings: &Keybindings, reactor: &Reactor) {
+        let Some(client) = self.clients.get_mut(&fd) else {
+            return;
+        };
+
+        let served = client
+            .serve(keybindings, self.trace.as_deref(), self.output.as_deref())
+            .and_then(|served| {
+                if served == Served::Rearm {
+                    reactor.rearm(&client.stream, Token::ControlClient(fd))?;
+                }
+                Ok(served)
+            });
+        let open = match served {
+            Ok(served) => served != Served::Closed,
+            Err(e) => {
+                debug!("Dropping control client: {:#}", e);
+                false
+            }
+        };
+        if !open {
+            // Closing the stream also removes it from the reactor.
+            self.clients.remove(&fd);
+        }
+    }
+}
+
+impl Client {
+    /// Answers the client's requests as far as its read budget and unsent
+    /// replies allow.
+    ///
+    /// Requests are only read while every earlier reply has been written, so
+    /// a client that stops reading its replies holds on to at most
+    /// [`MAX_UNSENT`] bytes of them.
+    fn serve(
+        &mut self,
+        keybindings: &Keybindings,
+        trace: Option<&TraceRing>,
+        output: Option<&OutputLogs>,
+    ) -> Result<Served> {
+        let mut budget = READ_BUDGET;
+        let mut buf = [0u8; 4096];
+
+        loop {
+            let answered = self.answer_requests(keybindings, trace, output);
+            if answered && self.input.len() > MAX_REQUEST {
+                return Err(anyhow!("Request longer than {} bytes", MAX_REQUEST));
+            }
+            self.flush()?;
+
+            if !self.unsent.is_empty() {
+                return Ok(Served::Edge);
+            }
+            if !answered {
+                continue;
+            }
+            if self.eof {
+                return Ok(Served::Closed);
+            }
+            if budget == 0 {
+                return Ok(Served::Rearm);
+            }
+
+            let len = budget.min(buf.len());
+            match self.stream.read(&mut buf[..len]) {
+                Ok(0) => self.eof = true,
+                Ok(len) => {
+                    budget -= len;
+                    self.input.extend_from_slice(&buf[..len]);
+                }
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => return Ok(Served::Edge),
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(e) => return Err(e.into()),
+            }
+        }
+    }
+
+    /// Answers complete request lines until the unsent replies reach
+    /// [`MAX_UNSENT`].
+    ///
+    /// # Returns
+    /// `true` if every complete line was answered.
+    fn answer_requests(
+        &mut self,
+        keybindings: &Keybindings,
+        trace: Option<&TraceRing>,
+        output: Option<&OutputLogs>,
+    ) -> bool {
+        let mut replies = String::new();
+        let input = std::mem::take(&mut self.input);
+        let mut consumed = 0;
+        let mut answered = true;
+
+        while let Some(end) = input[consumed..].iter().position(|&b| b == b'\n') {
+            if self.unsent.len() + replies.len() >= MAX_UNSENT {
+                answered = false;
+                break;
+            }
+            let line = &input[consumed..consumed + end];
+            consumed += end + 1;
+
+            match std::str::from_utf8(line) {
+                Ok(request) => {
+                    self.handle_request(request.trim(), keybindings, trace, output, &mut replies)
+                }
+                Err(_) => replies.push_str("error: Request is not valid UTF-8\n"),
+            }
+        }
+
+        self.input = input;
+        self.input.drain(..consumed);
+        self.unsent.extend_from_slice(replies.as_bytes());
+        answered
+    }
+
+    /// Writes as many unsent replies as the socket buffer takes.
+    fn flush(&mut self) -> Result<()> {
+        let mut written = 0;
+        while written < self.unsent.len() {
+            match self.stream.write(&self.unsent[written..]) {
+                Ok(0) => return Err(anyhow!("Control client stopped accepting replies")),
+                Ok(len) => written += len,
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => break,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(e) => return Err(e.into()),
+            }
+        }
+        self.unsent.drain(..written);
+        Ok(())
+    }
+
+    /// Answers a single request.
+    fn handle_request(
+        &mut self,
+        request: &str,
+        keybindings: &Keybindings,
+        trace: Option<&TraceRing>,
+        output: Option<&OutputLogs>,
+        replies: &mut String,
+    ) {
+        let (command, argument) = request
+            .split_once(char::is_whitespace)
+            .map_or((request, ""), |(command, argument)| {
+                (command, argument.trim())
+            });
+
+        let result = match command {
+            "bind" => parse_binding(argument).map(|(sequence, action)| {
+                self.staged.push(Change::Bind(sequence, action));
+            }),
+            "unbind" => parse_sequence(argument).map(|sequence| {
+                self.staged.push(Change::Unbind(sequence));
+            }),
+            "commit" => {
+                let count = self.staged.len();
+                commit(keybindings, self.staged.drain(..));
+                info!("Applied {} binding changes from the control socket", count);
+                Ok(())
+            }
+            "abort" => {
+                self.staged.clear();
+                Ok(())
+            }
+            "list" => {
+                for (sequence, action) in keybindings::bindings(&keybindings.load()) {
+                    let _ = writeln!(
+                        replies,
+                        "{}{}: {}",
+                        sequence,
+                        options(&sequence, action.policy()),
+                        action.raw()
+                    );
+                }
+                Ok(())
+            }
+            "query" => parse_sequence(argument).and_then(|sequence| {
+                match keybindings::lookup(&keybindings.load(), &sequence) {
+                    Some(Binding::Action(action)) => {
+                        let _ = writeln!(replies, "{}", action.raw());
+                        Ok(())
+                    }
+                    Some(Binding::Prefix(_)) => {
+                        replies.push_str("prefix\n");
+                        Ok(())
+                    }
+                    None => Err(anyhow!("'{}' is not bound", sequence)),
+                }
+            }),
+            "trace" => trace_count(argument).and_then(|count| {
+                let trace = trace.ok_or_else(|| anyhow!("Tracing is not enabled"))?;
+                for record in trace.recent(count) {
+                    let _ = writeln!(replies, "{}", record);
+                }
+                Ok(())
+            }),
+            "output" => parse_sequence(argument).and_then(|sequence| {
+                let output = output.ok_or_else(|| anyhow!("Output capture is not enabled"))?;
+                let table = keybindings.load();
+                let action = match keybindings::lookup(&table, &sequence) {
+                    Some(Binding::Action(action)) => action,
+                    Some(Binding::Prefix(_)) => {
+                        return Err(anyhow!("'{}' is the start of longer sequences", sequence))
+                    }
+                    None => return Err(anyhow!("'{}' is not bound", sequence)),
+                };
+                if !action.policy().capture {
+                    return Err(anyhow!("'{}' does not capture its output", sequence));
+                }
+                if let Some((bytes, dropped)) = output.output(action.raw()) {
+                    for line in String::from_utf8_lossy(&bytes).lines() {
+                        let _ = writeln!(replies, "> {}", line);
+                    }
+                    if dropped > 0 {
+                        let _ = writeln!(replies, "dropped {} bytes", dropped);
+                    }
+                }
+                Ok(())
+            }),
+            "" => return,
+            _ => Err(anyhow!("Unknown request '{}'", command)),
+        };
+
+        match result {
+            Ok(()) => replies.push_str("ok\n"),
+            Err(e) => {
+                let _ = writeln!(replies, "error: {}", e);
+            }
+        }
+    }
+}
+
+/// Parses the argument of `bind`, a binding in config syntax.
+fn parse_binding(argument: &str) -> Result<(KeySequence, Arc<Action>)> {
+    let line = ConfigLine::new(argument, 0).ok_or_else(|| anyhow!("Missing binding"))?;
+    Parser::new().parse_line(&line)
+}
+
+/// Formats the bracketed options of a binding as `bind` parses them, e.g.
+/// ` [500ms, single]`, or nothing if they are all at their defaults.
+fn options(sequence: &KeySequence, policy: JobPolicy) -> String {
+    let mut options = Vec::new();
+    if !sequence.rest.is_empty() && sequence.timeout != DEFAULT_SEQUENCE_TIMEOUT {
+        let millis = sequence.timeout.as_millis();
+        options.push(match millis % 1000 {
+            0 => format!("{}s", millis / 1000),
+            _ => format!("{}ms", millis),
+        });
+    }
+    match policy.concurrency {
+        Concurrency::Unlimited => {}
+        Concurrency::Single => options.push("single".to_string()),
+        Concurrency::Coalesce => options.push("coalesce".to_string()),
+    }
+    if let Some(rate) = policy.rate {
+        let per = if rate.per == Duration::from_secs(60) {
+            "min"
+        } else {
+            "s"
+        };
+        options.push(format!("rate={}/{}", rate.starts, per));
+    }
+    if policy.queue != DEFAULT_QUEUE_DEPTH {
+        options.push(format!("queue={}", policy.queue));
+    }
+    if policy.capture {
+        options.push("capture".to_string());
+    }
+
+    if options.is_empty() {
+        String::new()
+    } else {
+        format!(" [{}]", options.join(", "))
+    }
+}
+
+/// Parses the argument of `unbind` and `query`, a key sequence.
+fn parse_sequence(argument: &str) -> Result<KeySequence> {
+    let line = ConfigLine::new(argument, 0).ok_or_else(|| anyhow!("Missing key sequence"))?;
+    Parser::new().parse_sequence(&line, line.text)
+}
+
+/// Parses the argument of `trace`, an optional number of events.
+fn trace_count(argument: &str) -> Result<usize> {
+    if argument.is_empty() {
+        return Ok(DEFAULT_TRACE_COUNT);
+    }
+    match argument.parse::<usize>() {
+        Ok(count) if count <= MAX_TRACE_COUNT => Ok(count),
+        _ => Err(anyhow!(
+            "Invalid trace count '{}': expected at most {}",
+            argument,
+            MAX_TRACE_COUNT
+        )),
+    }
+}
+
+/// Publishes a batch of changes in a single swap.
+fn commit(keybindings: &Keybindings, changes: impl IntoIterator<Item = Change>) {
+    // Prefixes shared with the published table are copied on write.
+    let mut table = BindingTable::clone(&keybindings.load());
+
+    for change in changes {
+        match change {
+            Change::Bind(sequence, action) => keybindings::insert(&mut table, &sequence, action),
+            Change::Unbind(sequence) => {
+                keybindings::remove(&mut table, &sequence);
+            }
+        }
+    }
+
+    keybindings.store(Arc::new(table));
+}
+
+impl AsFd for ControlSocket {
+    fn as_fd(&self) -> BorrowedFd<'_> {
+        self.listener.as_fd()
+    }
+}
+
+impl Drop for ControlSocket {
+    fn drop(&mut self) {
+        let _ = fs::remove_file(&self.path);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::chord_state::{ChordKey, MOD_SUPER_L};
+    use arc_swap::ArcSwap;
+    use std::io::{BufRead, BufReader};
+    use xkbcommon::xkb::{keysyms, Keysym};
+
+    /// A control socket with one connected client.
+    struct Session {
+        socket: ControlSocket,
+        reactor: Reactor,
+        client: BufReader<UnixStream>,
+        keybindings: Keybindings,
+        _dir: tempfile::TempDir,
+    }
+
+    impl Session {
+        fn new() -> Self {
+            let dir = tempfile::tempdir().unwrap();
+            let mut socket = ControlSocket::bind(&dir.path().join("control.sock")).unwrap();
+            let reactor = Reactor::new().unwrap();
+            let client = UnixStream::connect(dir.path().join("control.sock")).unwrap();
+            socket.accept(&reactor);
+
+            Self {
+                socket,
+                reactor,
+                client: BufReader::new(client),
+                keybindings: Arc::new(ArcSwap::from_pointee(HashMap::new())),
+                _dir: dir,
+            }
+        }
+
+        /// Sends requests and returns the replies up to the last `ok` or
+        /// error.
+        fn send(&mut self, requests: &str) -> Vec<String> {
+            self.client
+                .get_mut()
+                .write_all(requests.as_bytes())
+                .unwrap();
+
+            let fd = *self.socket.clients.keys().next().unwrap();
+            self.socket
+                .handle_client(fd, &self.keybindings, &self.reactor);
+
+            let answers = requests
+                .lines()
+                .filter(|line| !line.trim().is_empty())
+                .count();
+            let mut replies = Vec::new();
+            let mut answered = 0;
+            while answered < answers {
+                let mut reply = String::new();
+                self.client.read_line(&mut reply).unwrap();
+                let reply = reply.trim_end().to_string();
+                if reply == "ok" || reply.starts_with("error: ") {
+                    answered += 1;
+                }
+                replies.push(reply);
+            }
+            replies
+        }
+    }
+
+    fn chord(keysym: u32) -> ChordKey {
+        ChordKey::new(MOD_SUPER_L, Keysym::new(keysym))
+    }
+
+    #[test]
+    fn commit_should_publish_staged_changes_at_once() {
+        let mut session = Session::new();
+        let before = session.keybindings.load_full();
+
+        let replies = session.send("bind Super_L+a: one\nbind Super_L+b: two\n");
+        assert_eq!(replies, vec!["ok", "ok"]);
+        assert!(Arc::ptr_eq(&before, &session.keybindings.load_full()));
+
+        assert_eq!(session.send("commit\n"), vec!["ok"]);
+        let table = session.keybindings.load();
+        assert_eq!(table.len(), 2);
+        assert!(table.contains_key(&chord(keysyms::KEY_a)));
+
+        // Replacing and removing happen in the same swap.
+        session.send("unbind Super_L+a\nbind Super_L+b: changed\ncommit\n");
+        assert_eq!(session.send("list\n"), vec!["Super_L+b: changed", "ok"]);
+    }
+
+    #[test]
+    fn list_should_print_bindings_as_bind_takes_them() {
+        let mut session = Session::new();
+        let bindings = [
+            "Super_L+a: plain",
+            "Super_L+b [single, rate=2/s, queue=1, capture]: options",
+            "Super_L+x, f [500ms]: find",
+            "Super_L+x, g [2s, coalesce, rate=10/min]: grep",
+        ];
+        for binding in bindings {
+            assert_eq!(session.send(&format!("bind {}\n", binding)), vec!["ok"]);
+        }
+        assert_eq!(session.send("commit\n"), vec!["ok"]);
+
+        let mut listed = session.send("list\n");
+        assert_eq!(listed.pop().as_deref(), Some("ok"));
+        assert_eq!(listed, bindings);
+
+        // Feeding the listing back reproduces the table.
+        let table = session.keybindings.load_full();
+        session.keybindings.store(Arc::new(HashMap::new()));
+        for binding in &listed {
+            assert_eq!(session.send(&format!("bind {}\n", binding)), vec!["ok"]);
+        }
+        assert_eq!(session.send("commit\n"), vec!["ok"]);
+        assert_eq!(*session.keybindings.load_full(), *table);
+    }
+
+    #[test]
+    fn query_should_describe_bindings() {
+        let mut session = Session::new();
+        session.send("bind Super_L+x, f [500ms]: find\ncommit\n");
+
+        assert_eq!(session.send("query Super_L+x, f\n"), vec!["find", "ok"]);
+        assert_eq!(session.send("query Super_L+x\n"), vec!["prefix", "ok"]);
+        assert_eq!(
+            session.send("query Super_L+y\n"),
+            vec!["error: 'Super_L+y' is not bound"]
+        );
+    }
+
+    #[test]
+    fn trace_should_decode_recent_events() {
+        use crate::trace_ring::{MatchResult, TraceRecord};
+
+        let mut session = Session::new();
+        assert_eq!(
+            session.send("trace\n"),
+            vec!["error: Tracing is not enabled"]
+        );
+
+        let trace = Arc::new(TraceRing::new(16));
+        for time_usec in [1_000_000, 2_500_000] {
+            trace.record(TraceRecord {
+                time_usec,
+                keycode: 38,
+                pressed: true,
+                result: MatchResult::Miss,
+            });
+        }
+        session.socket.set_trace_ring(trace);
+
+        assert_eq!(
+            session.send("trace 1\n"),
+            vec!["2.500000 key=38 pressed miss", "ok"]
+        );
+        assert_eq!(session.send("trace\n").len(), 3);
+        assert!(session.send("trace lots\n")[0].starts_with("error: Invalid trace count"));
+    }
+
+    #[test]
+    fn output_should_show_captured_lines() {
+        use crate::child_output::OutputCapture;
+        use std::os::fd::OwnedFd;
+
+        let mut session = Session::new();
+        session
+            .send("bind Super_L+a [capture]: /bin/echo a\nbind Super_L+b: /bin/echo b\ncommit\n");
+        assert_eq!(
+            session.send("output Super_L+a\n"),
+            vec!["error: Output capture is not enabled"]
+        );
+
+        let logs = Arc::new(OutputLogs::new());
+        session.socket.set_output_logs(logs.clone());
+        assert_eq!(session.send("output Super_L+a\n"), vec!["ok"]);
+        assert_eq!(
+            session.send("output Super_L+b\n"),
+            vec!["error: 'Super_L+b' does not capture its output"]
+        );
+
+        // Feed the binding's log the way a child's pipe would.
+        let mut capture = OutputCapture::new(logs);
+        let (read, mut write) = UnixStream::pair().unwrap();
+        read.set_nonblocking(true).unwrap();
+        let action = match keybindings::lookup(
+            &session.keybindings.load(),
+            &parse_sequence("Super_L+a").unwrap(),
+        ) {
+            Some(Binding::Action(action)) => Arc::clone(action),
+            _ => panic!("Super_L+a should be bound"),
+        };
+        capture.track(OwnedFd::from(read), &action);
+        write.write_all(b"first\nsecond\n").unwrap();
+        capture.read_all();
+
+        assert_eq!(
+            session.send("output Super_L+a\n"),
+            vec!["> first", "> second", "ok"]
+        );
+    }
+
+    #[test]
+    fn requests_should_report_errors_and_abort() {
+        let mut session = Session::new();
+
+        let replies = session.send("bind Super_L+nope: cmd\nfrobnicate\nbind Super_L+a: one\n");
+        assert!(replies[0].starts_with("error: Unknown key name 'nope'"));
+        assert_eq!(replies[1], "error: Unknown request 'frobnicate'");
+        assert_eq!(replies[2], "ok");
+
+        session.send("abort\ncommit\n");
+        assert!(session.keybindings.load().is_empty());
+    }
+
+    #[test]
+    fn handle_client_should_queue_replies_larger_than_the_socket_buffer() {
+        let mut session = Session::new();
+        let mut table = BindingTable::new();
+        let command = Arc::new(Action::parse(&format!("/bin/echo {}", "x".repeat(200))).unwrap());
+        for i in 0..5000 {
+            let chord = ChordKey::new(MOD_SUPER_L, Keysym::new(0x100_0100 + i));
+            keybindings::insert(&mut table, &KeySequence::chord(chord), command.clone());
+        }
+        session.keybindings.store(Arc::new(table));
+
+        let mut client = session.client.get_ref().try_clone().unwrap();
+        client.write_all(b"list\nquery Super_L+y\n").unwrap();
+        let reader = std::thread::spawn(move || {
+            let mut lines = 0;
+            for line in session.client.lines() {
+                let line = line.unwrap();
+                if line.starts_with("error: ") {
+                    return lines;
+                }
+                lines += 1;
+            }
+            lines
+        });
+
+        let fd = *session.socket.clients.keys().next().unwrap();
+        while !reader.is_finished() {
+            session
+                .socket
+                .handle_client(fd, &session.keybindings, &session.reactor);
+            assert_eq!(session.socket.clients.len(), 1);
+            std::thread::sleep(std::time::Duration::from_millis(1));
+        }
+        assert_eq!(reader.join().unwrap(), 5001);
+    }
+
+    #[test]
+    fn handle_client_should_limit_reads_per_wakeup() {
+        let mut session = Session::new();
+        let requests = "abort\n".repeat(READ_BUDGET / 6 * 2);
+        session
+            .client
+            .get_mut()
+            .write_all(requests.as_bytes())
+            .unwrap();
+        session
+            .reactor
+            .wait(Some(std::time::Duration::ZERO))
+            .unwrap();
+
+        let fd = *session.socket.clients.keys().next().unwrap();
+        session
+            .socket
+            .handle_client(fd, &session.keybindings, &session.reactor);
+        assert!(session.socket.clients[&fd].input.len() < "abort\n".len());
+
+        // The rest of the requests is still waiting, so the client is
+        // reported again.
+        assert_eq!(
+            session
+                .reactor
+                .wait(Some(std::time::Duration::ZERO))
+                .unwrap(),
+            1
+        );
+        assert_eq!(session.reactor.token(0), Token::ControlClient(fd));
+    }
+
+    #[test]
+    fn handle_client_should_drop_overlong_requests() {
+        let mut session = Session::new();
+        let request = vec![b'x'; MAX_REQUEST + 4096];
+        session.client.get_mut().write_all(&request).unwrap();
+
+        // The request is cut off once it becomes too long, however many
+        // wakeups that takes.
+        let fd = *session.socket.clients.keys().next().unwrap();
+        for _ in 0..request.len() / READ_BUDGET + 1 {
+            session
+                .socket
+                .handle_client(fd, &session.keybindings, &session.reactor);
+        }
+        assert!(session.socket.clients.is_empty());
+    }
+
+    #[test]
+    fn handle_client_should_drop_staged_changes_on_disconnect() {
+        let mut session = Session::new();
+        session.send("bind Super_L+a: one\n");
+
+        session
+            .client
+            .get_ref()
+            .shutdown(std::net::Shutdown::Both)
+            .unwrap();
+        let fd = *session.socket.clients.keys().next().unwrap();
+        session
+            .socket
+            .handle_client(fd, &session.keybindings, &session.reactor);
+
+        assert!(session.socket.clients.is_empty());
+        assert!(session.keybindings.load().is_empty());
+    }
+}
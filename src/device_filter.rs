@@ -0,0 +1,215 @@
+//! Provides the selection of the input devices the daemon opens.
+//!
+//! libinput's udev backend opens every input device on a seat, so without a
+//! filter the event loop would wake up for every mouse movement, touchpad
+//! frame and tablet event only to drop it. A [`DeviceFilter`] is consulted
+//! whenever libinput asks to open a device and only lets devices with keys
+//! through, as tagged by udev's input_id builtin, which also covers the power
+//! buttons and media key receivers that are not full keyboards.
+//!
+//! Devices can additionally be selected with an allowlist and a denylist of
+//! [`DeviceMatch`]es on the device name or a udev property.
+use anyhow::{anyhow, Result};
+use std::fs;
+use std::os::unix::fs::MetadataExt;
+use std::path::Path;
+use std::str::FromStr;
+
+/// The udev properties set on devices with keys.
+const KEY_PROPERTIES: [&str; 2] = ["ID_INPUT_KEYBOARD", "ID_INPUT_KEY"];
+
+/// What a filter knows about a device.
+pub trait DeviceProperties {
+    /// Returns the device name as reported by the kernel.
+    fn name(&self) -> Option<String>;
+
+    /// Returns the value of a udev property.
+    fn property(&self, key: &str) -> Option<String>;
+}
+
+impl DeviceProperties for udev::Device {
+    fn name(&self) -> Option<String> {
+        // The event node itself has no name; its input device parent does.
+        let parent = self.parent()?;
+        parent
+            .attribute_value("name")
+            .map(|name| name.to_string_lossy().into_owned())
+    }
+
+    fn property(&self, key: &str) -> Option<String> {
+        self.property_value(key)
+            .map(|value| value.to_string_lossy().into_owned())
+    }
+}
+
+/// Selects devices by name or by udev property.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum DeviceMatch {
+    /// Matches devices with exactly this name.
+    Name(String),
+    /// Matches devices whose udev property `key` has the given value.
+    Property { key: String, value: String },
+}
+
+impl DeviceMatch {
+    /// Returns whether the device matches.
+    pub fn matches(&self, device: &impl DeviceProperties) -> bool {
+        match self {
+            Self::Name(name) => device.name().as_deref() == Some(name.as_str()),
+            Self::Property { key, value } => {
+                device.property(key).as_deref() == Some(value.as_str())
+            }
+        }
+    }
+}
+
+impl FromStr for DeviceMatch {
+    type Err = anyhow::Error;
+
+    /// Parses `KEY=value` as a udev property match and anything else as a
+    /// device name.
+    fn from_str(s: &str) -> Result<Self> {
+        if s.trim().is_empty() {
+            return Err(anyhow!("Empty device match"));
+        }
+
+        match s.split_once('=') {
+            Some((key, value)) if !key.is_empty() && !key.contains(' ') => Ok(Self::Property {
+                key: key.to_string(),
+                value: value.to_string(),
+            }),
+            _ => Ok(Self::Name(s.to_string())),
+        }
+    }
+}
+
+/// Decides which input devices are opened.
+#[derive(Debug, Clone, Default)]
+pub struct DeviceFilter {
+    allow: Vec<DeviceMatch>,
+    deny: Vec<DeviceMatch>,
+}
+
+impl DeviceFilter {
+    /// Creates a filter that accepts every device with keys.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Creates a filter with an allowlist and a denylist.
+    ///
+    /// # Arguments
+    /// * `allow` - If not empty, only devices matching one of these are opened.
+    /// * `deny` - Devices matching any of these are never opened.
+    pub fn with_lists(allow: Vec<DeviceMatch>, deny: Vec<DeviceMatch>) -> Self {
+        Self { allow, deny }
+    }
+
+    /// Returns whether a device should be opened.
+    pub fn accepts(&self, device: &impl DeviceProperties) -> bool {
+        let has_keys = KEY_PROPERTIES
+            .iter()
+            .any(|key| device.property(key).as_deref() == Some("1"));
+
+        has_keys
+            && (self.allow.is_empty() || self.allow.iter().any(|m| m.matches(device)))
+            && !self.deny.iter().any(|m| m.matches(device))
+    }
+
+    /// Returns whether the device node at `path` should be opened.
+    ///
+    /// Devices udev knows nothing about are opened, so a missing udev
+    /// database never costs the user their keyboard.
+    pub fn accepts_path(&self, path: &Path) -> bool {
+        let device = fs::metadata(path)
+            .and_then(|meta| udev::Device::from_devnum(udev::DeviceType::Character, meta.rdev()));
+
+        match device {
+            Ok(device) => self.accepts(&device),
+            Err(_) => true,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::collections::HashMap;
+
+    /// A device described by its name and udev properties.
+    struct FakeDevice {
+        name: &'static str,
+        properties: HashMap<&'static str, &'static str>,
+    }
+
+    impl DeviceProperties for FakeDevice {
+        fn name(&self) -> Option<String> {
+            Some(self.name.to_string())
+        }
+
+        fn property(&self, key: &str) -> Option<String> {
+            self.properties.get(key).map(|value| value.to_string())
+        }
+    }
+
+    fn keyboard(name: &'static str) -> FakeDevice {
+        FakeDevice {
+            name,
+            properties: HashMap::from([("ID_INPUT_KEYBOARD", "1"), ("ID_BUS", "usb")]),
+        }
+    }
+
+    fn mouse() -> FakeDevice {
+        FakeDevice {
+            name: "Gaming Mouse",
+            properties: HashMap::from([("ID_INPUT_MOUSE", "1")]),
+        }
+    }
+
+    fn device_match(s: &str) -> DeviceMatch {
+        s.parse().unwrap()
+    }
+
+    #[test]
+    fn accepts_should_only_open_devices_with_keys() {
+        let filter = DeviceFilter::new();
+        assert!(filter.accepts(&keyboard("AT Translated Set 2 keyboard")));
+        assert!(!filter.accepts(&mouse()));
+
+        let power_button = FakeDevice {
+            name: "Power Button",
+            properties: HashMap::from([("ID_INPUT_KEY", "1")]),
+        };
+        assert!(filter.accepts(&power_button));
+    }
+
+    #[test]
+    fn accepts_should_apply_allow_and_deny_lists() {
+        let allow = DeviceFilter::with_lists(vec![device_match("Builtin")], Vec::new());
+        assert!(allow.accepts(&keyboard("Builtin")));
+        assert!(!allow.accepts(&keyboard("External")));
+
+        let deny = DeviceFilter::with_lists(Vec::new(), vec![device_match("ID_BUS=usb")]);
+        assert!(!deny.accepts(&keyboard("External")));
+
+        // An allowlist never opens devices without keys.
+        let allow_mouse = DeviceFilter::with_lists(vec![device_match("Gaming Mouse")], Vec::new());
+        assert!(!allow_mouse.accepts(&mouse()));
+    }
+
+    #[test]
+    fn from_str_should_distinguish_names_and_properties() {
+        assert_eq!(
+            device_match("ID_VENDOR_ID=046d"),
+            DeviceMatch::Property {
+                key: "ID_VENDOR_ID".to_string(),
+                value: "046d".to_string(),
+            }
+        );
+        assert_eq!(
+            device_match("Logitech K120"),
+            DeviceMatch::Name("Logitech K120".to_string())
+        );
+        assert!("  ".parse::<DeviceMatch>().is_err());
+    }
+}
@@ -0,0 +1,508 @@
+//! Provides a direct evdev input backend as a lighter alternative to libinput.
+//!
+//! A hotkey daemon only needs key presses and releases, so this backend skips
+//! libinput's event processing entirely. It opens the keyboard nodes under
+//! `/dev/input/event*` of one seat, reads `struct input_event` batches from
+//! them with large non-blocking reads and turns `EV_KEY` events straight into
+//! [`RawKeyEvent`]s. Devices come and go through a udev monitor, and the same
+//! [`DeviceFilter`] as for libinput decides which ones are opened.
+//!
+//! When a device's kernel buffer overflows, the kernel reports `SYN_DROPPED`.
+//! Everything up to the next `SYN_REPORT` is then discarded, the actual key
+//! state is queried with `EVIOCGKEY`, and presses and releases are synthesized
+//! for every key whose state changed in between, so no key is left stuck.
+use crate::device_filter::DeviceFilter;
+use crate::key_event::RawKeyEvent;
+use crate::reactor::{Reactor, Token};
+use anyhow::{Context, Result};
+use log::{debug, info, warn};
+use nix::errno::Errno;
+use std::collections::HashMap;
+use std::fs::{File, OpenOptions};
+use std::mem;
+use std::os::fd::{AsFd, AsRawFd, BorrowedFd, RawFd};
+use std::os::unix::fs::OpenOptionsExt;
+use std::path::{Path, PathBuf};
+
+/// Number of events read from a device per system call.
+const READ_BATCH: usize = 256;
+
+/// `EV_SYN`, `EV_KEY` and the codes of `EV_SYN` from `linux/input-event-codes.h`.
+const EV_SYN: u16 = 0x00;
+const EV_KEY: u16 = 0x01;
+const SYN_REPORT: u16 = 0;
+const SYN_DROPPED: u16 = 3;
+
+/// The highest key code, `KEY_MAX`.
+const KEY_MAX: usize = 0x2ff;
+
+/// The seat devices without an `ID_SEAT` property belong to.
+const DEFAULT_SEAT: &str = "seat0";
+
+nix::ioctl_write_ptr!(eviocsclockid, b'E', 0xa0, libc::c_int);
+nix::ioctl_read_buf!(eviocgkey, b'E', 0x18, u8);
+
+/// The pressed state of every key code of a device.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+struct KeyBits([u64; KEY_MAX / 64 + 1]);
+
+impl KeyBits {
+    fn get(&self, code: usize) -> bool {
+        self.0[code / 64] & (1 << (code % 64)) != 0
+    }
+
+    fn set(&mut self, code: usize, pressed: bool) {
+        if pressed {
+            self.0[code / 64] |= 1 << (code % 64);
+        } else {
+            self.0[code / 64] &= !(1 << (code % 64));
+        }
+    }
+
+    /// Converts the byte-wise bitmap returned by `EVIOCGKEY`.
+    fn from_bytes(bytes: &[u8]) -> Self {
+        let mut bits = Self::default();
+        for (i, byte) in bytes.iter().enumerate() {
+            bits.0[i / 8] |= u64::from(*byte) << (8 * (i % 8));
+        }
+        bits
+    }
+
+    /// Returns every key code whose bit differs from `other`.
+    fn changed<'a>(&'a self, other: &'a Self) -> impl Iterator<Item = usize> + 'a {
+        (0..=KEY_MAX).filter(move |&code| self.get(code) != other.get(code))
+    }
+}
+
+/// Turns the event stream of one device into key events.
+#[derive(Debug, Default)]
+struct EventDecoder {
+    /// The keys currently held, as far as the client has been told.
+    keys: KeyBits,
+    /// Whether events are being discarded after a `SYN_DROPPED`.
+    dropped: bool,
+}
+
+impl EventDecoder {
+    /// Handles one event from the device.
+    ///
+    /// # Returns
+    /// `true` if the device must now be resynchronized with [`Self::resync`].
+    fn feed(&mut self, event: &libc::input_event, sink: &mut impl FnMut(RawKeyEvent)) -> bool {
+        match (event.type_, event.code) {
+            (EV_SYN, SYN_DROPPED) => {
+                self.dropped = true;
+                false
+            }
+            (EV_SYN, SYN_REPORT) if self.dropped => {
+                self.dropped = false;
+                true
+            }
+            _ if self.dropped => false,
+            (EV_KEY, code) if usize::from(code) <= KEY_MAX => {
+                // Autorepeat (value 2) never starts a new chord.
+                let key = u32::from(code);
+                let time_usec = time_usec(event);
+                match event.value {
+                    0 => {
+                        self.keys.set(usize::from(code), false);
+                        sink(RawKeyEvent::released(time_usec, key));
+                    }
+                    1 => {
+                        self.keys.set(usize::from(code), true);
+                        sink(RawKeyEvent::pressed(time_usec, key));
+                    }
+                    _ => (),
+                }
+                false
+            }
+            _ => false,
+        }
+    }
+
+    /// Reports every key whose state changed while events were dropped.
+    ///
+    /// # Arguments
+    /// * `current` - The key state queried from the device.
+    /// * `time_usec` - The timestamp to give the synthesized events.
+    fn resync(&mut self, current: KeyBits, time_usec: u64, sink: &mut impl FnMut(RawKeyEvent)) {
+        for code in current.changed(&self.keys) {
+            let key = code as u32;
+            if current.get(code) {
+                sink(RawKeyEvent::pressed(time_usec, key));
+            } else {
+                sink(RawKeyEvent::released(time_usec, key));
+            }
+        }
+        self.keys = current;
+    }
+
+    /// Releases every held key, e.g. when the device is unplugged.
+    fn release_all(&mut self, time_usec: u64, sink: &mut impl FnMut(RawKeyEvent)) {
+        self.resync(KeyBits::default(), time_usec, sink);
+    }
+}
+
+/// Returns the timestamp of an event in microseconds.
+fn time_usec(event: &libc::input_event) -> u64 {
+    event.time.tv_sec as u64 * 1_000_000 + event.time.tv_usec as u64
+}
+
+/// An open keyboard node.
+struct Device {
+    path: PathBuf,
+    file: File,
+    decoder: EventDecoder,
+}
+
+impl Device {
+    /// Opens a device node for non-blocking reads with monotonic timestamps.
+    fn open(path: &Path) -> Result<Self> {
+        let file = OpenOptions::new()
+            .read(true)
+            .custom_flags(libc::O_NONBLOCK | libc::O_CLOEXEC)
+            .open(path)
+            .context(format!("Failed to open {:?}", path))?;
+
+        // Timestamps must be comparable with the rest of the daemon's clock.
+        let clock = libc::CLOCK_MONOTONIC;
+        // SAFETY: The descriptor is open and the argument outlives the call.
+        unsafe { eviocsclockid(file.as_raw_fd(), &clock) }
+            .context(format!("Failed to select the clock of {:?}", path))?;
+
+        Ok(Self {
+            path: path.to_path_buf(),
+            file,
+            decoder: EventDecoder::default(),
+        })
+    }
+
+    /// Queries which keys are currently held.
+    fn key_state(&self) -> Result<KeyBits> {
+        let mut bytes = [0u8; KEY_MAX / 8 + 1];
+        // SAFETY: The descriptor is open and the buffer length is passed along.
+        unsafe { eviocgkey(self.file.as_raw_fd(), &mut bytes) }
+            .context(format!("Failed to query the keys of {:?}", self.path))?;
+        Ok(KeyBits::from_bytes(&bytes))
+    }
+
+    /// Reads and decodes events until the device has been drained.
+    ///
+    /// # Returns
+    /// An error once the device is gone or cannot be read.
+    fn read(&mut self, sink: &mut impl FnMut(RawKeyEvent)) -> Result<()> {
+        // SAFETY: input_event is plain old data, for which all zeros is valid.
+        let mut events: [libc::input_event; READ_BATCH] = unsafe { mem::zeroed() };
+
+        loop {
+            // SAFETY: The buffer is valid for its full size in bytes.
+            let buf = unsafe {
+                std::slice::from_raw_parts_mut(
+                    events.as_mut_ptr().cast::<u8>(),
+                    mem::size_of_val(&events),
+                )
+            };
+            let len = match nix::unistd::read(&self.file, buf) {
+                Ok(len) => len,
+                Err(Errno::EAGAIN) => return Ok(()),
+                Err(Errno::EINTR) => continue,
+                Err(e) => return Err(anyhow::anyhow!("Failed to read {:?}: {}", self.path, e)),
+            };
+
+            for event in &events[..len / mem::size_of::<libc::input_event>()] {
+                if self.decoder.feed(event, sink) {
+                    debug!("Events dropped on {:?}, resynchronizing", self.path);
+                    let current = self.key_state()?;
+                    self.decoder.resync(current, time_usec(event), sink);
+                }
+            }
+        }
+    }
+}
+
+/// Reads key events directly from the evdev nodes of one seat.
+pub struct EvdevBackend {
+    seat: String,
+    filter: DeviceFilter,
+    monitor: udev::MonitorSocket,
+    devices: HashMap<RawFd, Device>,
+    suspended: bool,
+}
+
+impl EvdevBackend {
+    /// Starts watching a seat for keyboards and opens the present ones.
+    ///
+    /// # Arguments
+    /// * `seat` - The udev seat whose devices to read.
+    /// * `filter` - Selects which of the seat's keyboards are opened.
+    /// * `reactor` - The reactor to register the devices with.
+    pub fn new(seat: &str, filter: DeviceFilter, reactor: &Reactor) -> Result<Self> {
+        // Listen before enumerating, so no device plugged in between is missed.
+        let monitor = udev::MonitorBuilder::new()
+            .and_then(|builder| builder.match_subsystem("input"))
+            .and_then(|builder| builder.listen())
+            .context("Failed to create udev monitor")?;
+
+        let mut backend = Self {
+            seat: seat.to_string(),
+            filter,
+            monitor,
+            devices: HashMap::new(),
+            suspended: false,
+        };
+        reactor.register(&backend, Token::Hotplug)?;
+        backend.scan(reactor)?;
+
+        Ok(backend)
+    }
+
+    /// Closes every device until [`EvdevBackend::resume`], e.g. while the
+    /// user's session is inactive.
+    ///
+    /// Hotplug events are still drained meanwhile, but open nothing.
+    pub fn suspend(&mut self) {
+        self.suspended = true;
+        // Closing the devices also removes them from the reactor.
+        self.devices.clear();
+    }
+
+    /// Opens the keyboards present on the seat again after a suspend.
+    ///
+    /// # Arguments
+    /// * `reactor` - The reactor to register the devices with.
+    pub fn resume(&mut self, reactor: &Reactor) -> Result<()> {
+        self.suspended = false;
+        self.scan(reactor)
+    }
+
+    /// Opens every keyboard of the seat that is present.
+    fn scan(&mut self, reactor: &Reactor) -> Result<()> {
+        let mut enumerator = udev::Enumerator::new().context("Failed to enumerate devices")?;
+        enumerator
+            .match_subsystem("input")
+            .context("Failed to enumerate devices")?;
+        for device in enumerator
+            .scan_devices()
+            .context("Failed to enumerate devices")?
+        {
+            self.add(&device, reactor);
+        }
+        Ok(())
+    }
+
+    /// Returns the number of open devices.
+    pub fn device_count(&self) -> usize {
+        self.devices.len()
+    }
+
+    /// Reads all pending events of a device.
+    ///
+    /// A device that fails to read, e.g. because it was unplugged, is closed
+    /// and its held keys are released.
+    ///
+    /// # Arguments
+    /// * `fd` - The descriptor of the device, from its [`Token::Device`].
+    /// * `time_usec` - The current time, for releases of a lost device.
+    /// * `sink` - Receives the decoded key events.
+    pub fn read_device(&mut self, fd: RawFd, time_usec: u64, sink: &mut impl FnMut(RawKeyEvent)) {
+        let Some(device) = self.devices.get_mut(&fd) else {
+            return;
+        };
+
+        if let Err(e) = device.read(sink) {
+            warn!("{:#}", e);
+            self.remove(fd, time_usec, sink);
+        }
+    }
+
+    /// Handles all pending hotplug events.
+    ///
+    /// # Arguments
+    /// * `reactor` - The reactor to register new devices with.
+    /// * `time_usec` - The current time, for releases of removed devices.
+    /// * `sink` - Receives releases of the keys held on removed devices.
+    pub fn handle_hotplug(
+        &mut self,
+        reactor: &Reactor,
+        time_usec: u64,
+        sink: &mut impl FnMut(RawKeyEvent),
+    ) {
+        let events: Vec<(udev::EventType, udev::Device)> = self
+            .monitor
+            .iter()
+            .map(|event| (event.event_type(), event.device()))
+            .collect();
+
+        for (event_type, device) in events {
+            match event_type {
+                udev::EventType::Add => self.add(&device, reactor),
+                udev::EventType::Remove => {
+                    let removed = self
+                        .devices
+                        .iter()
+                        .find(|(_, open)| Some(open.path.as_path()) == device.devnode())
+                        .map(|(&fd, _)| fd);
+                    if let Some(fd) = removed {
+                        self.remove(fd, time_usec, sink);
+                    }
+                }
+                _ => (),
+            }
+        }
+    }
+
+    /// Opens a device if it is a keyboard node of this seat.
+    fn add(&mut self, device: &udev::Device, reactor: &Reactor) {
+        if self.suspended {
+            return;
+        }
+        let Some(path) = device.devnode() else {
+            return;
+        };
+        let is_event_node = device.sysname().to_string_lossy().starts_with("event");
+        let seat = device
+            .property_value("ID_SEAT")
+            .map(|seat| seat.to_string_lossy().into_owned());
+        if !is_event_node || seat.as_deref().unwrap_or(DEFAULT_SEAT) != self.seat {
+            return;
+        }
+        if !self.filter.accepts(device) {
+            debug!("Ignoring input device {:?}", path);
+            return;
+        }
+        if self.devices.values().any(|open| open.path == path) {
+            return;
+        }
+
+        let opened = Device::open(path).and_then(|opened| {
+            let fd = opened.file.as_raw_fd();
+            reactor.register(&opened.file, Token::Device(fd))?;
+            Ok((fd, opened))
+        });
+        match opened {
+            Ok((fd, opened)) => {
+                info!("Reading keyboard {:?}", path);
+                self.devices.insert(fd, opened);
+            }
+            Err(e) => warn!("{:#}", e),
+        }
+    }
+
+    /// Closes a device, releasing all keys still held on it.
+    fn remove(&mut self, fd: RawFd, time_usec: u64, sink: &mut impl FnMut(RawKeyEvent)) {
+        if let Some(mut device) = self.devices.remove(&fd) {
+            info!("Keyboard {:?} removed", device.path);
+            device.decoder.release_all(time_usec, sink);
+        }
+    }
+}
+
+impl AsFd for EvdevBackend {
+    /// Returns the udev monitor socket, which becomes readable on hotplug.
+    fn as_fd(&self) -> BorrowedFd<'_> {
+        // SAFETY: The monitor owns the descriptor and lives as long as self.
+        unsafe { BorrowedFd::borrow_raw(self.monitor.as_raw_fd()) }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const KEY_A: u16 = 30;
+    const KEY_B: u16 = 48;
+
+    fn event(type_: u16, code: u16, value: i32) -> libc::input_event {
+        // SAFETY: input_event is plain old data, for which all zeros is valid.
+        let mut event: libc::input_event = unsafe { mem::zeroed() };
+        event.time.tv_sec = 1;
+        event.time.tv_usec = 5;
+        event.type_ = type_;
+        event.code = code;
+        event.value = value;
+        event
+    }
+
+    fn decode(decoder: &mut EventDecoder, events: &[libc::input_event]) -> Vec<RawKeyEvent> {
+        let mut decoded = Vec::new();
+        for event in events {
+            assert!(!decoder.feed(event, &mut |key| decoded.push(key)));
+        }
+        decoded
+    }
+
+    #[test]
+    fn feed_should_decode_presses_and_releases() {
+        let mut decoder = EventDecoder::default();
+        let decoded = decode(
+            &mut decoder,
+            &[
+                event(EV_KEY, KEY_A, 1),
+                event(EV_SYN, SYN_REPORT, 0),
+                event(EV_KEY, KEY_A, 2),
+                event(EV_KEY, KEY_A, 0),
+            ],
+        );
+
+        assert_eq!(
+            decoded,
+            vec![
+                RawKeyEvent::pressed(1_000_005, KEY_A.into()),
+                RawKeyEvent::released(1_000_005, KEY_A.into()),
+            ]
+        );
+        assert_eq!(decoder.keys, KeyBits::default());
+    }
+
+    #[test]
+    fn feed_should_discard_events_until_report_after_drop() {
+        let mut decoder = EventDecoder::default();
+        let mut decoded = Vec::new();
+        let mut sink = |key| decoded.push(key);
+
+        assert!(!decoder.feed(&event(EV_KEY, KEY_A, 1), &mut sink));
+        assert!(!decoder.feed(&event(EV_SYN, SYN_DROPPED, 0), &mut sink));
+        assert!(!decoder.feed(&event(EV_KEY, KEY_A, 0), &mut sink));
+        assert!(decoder.feed(&event(EV_SYN, SYN_REPORT, 0), &mut sink));
+
+        assert_eq!(decoded.len(), 1);
+        assert!(decoder.keys.get(KEY_A.into()));
+    }
+
+    #[test]
+    fn resync_should_report_changed_keys() {
+        let mut decoder = EventDecoder::default();
+        decode(&mut decoder, &[event(EV_KEY, KEY_A, 1)]);
+
+        // A was released and B pressed while events were dropped.
+        let mut current = KeyBits::default();
+        current.set(KEY_B.into(), true);
+        let mut decoded = Vec::new();
+        decoder.resync(current.clone(), 7, &mut |key| decoded.push(key));
+
+        assert_eq!(
+            decoded,
+            vec![
+                RawKeyEvent::released(7, KEY_A.into()),
+                RawKeyEvent::pressed(7, KEY_B.into()),
+            ]
+        );
+        assert_eq!(decoder.keys, current);
+
+        decoded.clear();
+        decoder.release_all(8, &mut |key| decoded.push(key));
+        assert_eq!(decoded, vec![RawKeyEvent::released(8, KEY_B.into())]);
+    }
+
+    #[test]
+    fn key_bits_should_convert_ioctl_bitmap() {
+        let mut bytes = [0u8; KEY_MAX / 8 + 1];
+        bytes[usize::from(KEY_A) / 8] |= 1 << (KEY_A % 8);
+        bytes[KEY_MAX / 8] |= 0x80;
+
+        let bits = KeyBits::from_bytes(&bytes);
+        assert!(bits.get(KEY_A.into()));
+        assert!(bits.get(KEY_MAX));
+        assert_eq!(bits.changed(&KeyBits::default()).count(), 2);
+    }
+}
@@ -0,0 +1,88 @@
+//! Provides the input event abstraction the keyboard handler works on.
+//!
+//! The handler only needs three things from an event: the evdev keycode,
+//! whether the key went down or up, and when the kernel saw it. [`KeyInput`]
+//! exposes exactly that, so live libinput events, recorded traces and tests
+//! all go through the same code path. [`RawKeyEvent`] is the plain-data
+//! implementation used for recordings and synthetic input.
+use input::event::keyboard::{KeyState, KeyboardEvent, KeyboardEventTrait};
+
+/// A single key press or release.
+pub trait KeyInput {
+    /// Returns the evdev keycode (without the XKB offset of 8).
+    fn key(&self) -> u32;
+
+    /// Returns whether the key was pressed or released.
+    fn key_state(&self) -> KeyState;
+
+    /// Returns the `CLOCK_MONOTONIC` timestamp of the event in microseconds.
+    fn time_usec(&self) -> u64;
+}
+
+impl KeyInput for KeyboardEvent {
+    fn key(&self) -> u32 {
+        KeyboardEventTrait::key(self)
+    }
+
+    fn key_state(&self) -> KeyState {
+        KeyboardEventTrait::key_state(self)
+    }
+
+    fn time_usec(&self) -> u64 {
+        KeyboardEventTrait::time_usec(self)
+    }
+}
+
+/// A key event as plain data.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct RawKeyEvent {
+    /// The `CLOCK_MONOTONIC` timestamp in microseconds.
+    pub time_usec: u64,
+    /// The evdev keycode.
+    pub key: u32,
+    /// Whether the key was pressed or released.
+    pub state: KeyState,
+}
+
+impl RawKeyEvent {
+    /// Creates a key press event.
+    pub fn pressed(time_usec: u64, key: u32) -> Self {
+        Self {
+            time_usec,
+            key,
+            state: KeyState::Pressed,
+        }
+    }
+
+    /// Creates a key release event.
+    pub fn released(time_usec: u64, key: u32) -> Self {
+        Self {
+            time_usec,
+            key,
+            state: KeyState::Released,
+        }
+    }
+
+    /// Copies the relevant fields out of any key event.
+    pub fn from_input<E: KeyInput>(event: &E) -> Self {
+        Self {
+            time_usec: event.time_usec(),
+            key: event.key(),
+            state: event.key_state(),
+        }
+    }
+}
+
+impl KeyInput for RawKeyEvent {
+    fn key(&self) -> u32 {
+        self.key
+    }
+
+    fn key_state(&self) -> KeyState {
+        self.state
+    }
+
+    fn time_usec(&self) -> u64 {
+        self.time_usec
+    }
+}
@@ -0,0 +1,136 @@
+//! Provides a precomputed keycode lookup table for the active keymap.
+//!
+//! Resolving a keycode through XKB on every event means a `key_get_one_sym`
+//! call, a modifier classification and, for logging, a freshly allocated
+//! keysym name. The [`KeyTable`] does all of that once per keymap: every
+//! keycode in the keymap's range maps to a [`KeyEntry`] holding its keysym,
+//! modifier bit and interned name, so the event handler only indexes an array.
+//!
+//! The table must be rebuilt whenever the keymap or layout changes.
+use crate::chord_state::ChordState;
+use xkbcommon::xkb;
+use xkbcommon::xkb::{Keycode, Keysym};
+
+/// Everything the event handler needs to know about a single keycode.
+#[derive(Debug, Clone)]
+pub struct KeyEntry {
+    keysym: Keysym,
+    modifier: u16,
+    name: Box<str>,
+}
+
+impl KeyEntry {
+    /// Returns the keysym produced by this key.
+    pub fn keysym(&self) -> Keysym {
+        self.keysym
+    }
+
+    /// Returns the modifier bit of this key, or 0 if it is not a modifier.
+    pub fn modifier(&self) -> u16 {
+        self.modifier
+    }
+
+    /// Returns whether this key is a modifier.
+    pub fn is_modifier(&self) -> bool {
+        self.modifier != 0
+    }
+
+    /// Returns the keysym name of this key.
+    pub fn name(&self) -> &str {
+        &self.name
+    }
+}
+
+/// A dense keycode to [`KeyEntry`] table built from an XKB keymap.
+#[derive(Debug, Clone)]
+pub struct KeyTable {
+    min_keycode: u32,
+    entries: Vec<KeyEntry>,
+}
+
+impl KeyTable {
+    /// Builds the lookup table for every keycode in the keymap.
+    ///
+    /// Keysyms are resolved the same way a fresh [`xkb::State`] would, i.e.
+    /// on the base level of the first layout.
+    ///
+    /// # Arguments
+    /// * `keymap` - The compiled keymap to build the table from.
+    pub fn new(keymap: &xkb::Keymap) -> Self {
+        let state = xkb::State::new(keymap);
+        let min_keycode = keymap.min_keycode().raw();
+        let max_keycode = keymap.max_keycode().raw();
+
+        let entries = (min_keycode..=max_keycode)
+            .map(|raw| {
+                let keysym = state.key_get_one_sym(raw.into());
+                KeyEntry {
+                    keysym,
+                    modifier: ChordState::modifier_bit(keysym),
+                    name: xkb::keysym_get_name(keysym).into_boxed_str(),
+                }
+            })
+            .collect();
+
+        Self {
+            min_keycode,
+            entries,
+        }
+    }
+
+    /// Looks up a keycode, returning `None` if it is outside the keymap.
+    pub fn get(&self, keycode: Keycode) -> Option<&KeyEntry> {
+        let index = keycode.raw().checked_sub(self.min_keycode)?;
+        self.entries.get(index as usize)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::chord_state::MOD_SUPER_L;
+    use xkbcommon::xkb::keysyms;
+
+    fn init_keymap() -> xkb::Keymap {
+        crate::keymap_cache::default_keymap()
+    }
+
+    #[test]
+    fn new_should_match_xkb_state_lookups() {
+        let keymap = init_keymap();
+        let state = xkb::State::new(&keymap);
+        let table = KeyTable::new(&keymap);
+
+        for raw in keymap.min_keycode().raw()..=keymap.max_keycode().raw() {
+            let keycode: Keycode = raw.into();
+            let entry = table.get(keycode).expect("Keycode should be in table");
+            assert_eq!(entry.keysym(), state.key_get_one_sym(keycode));
+        }
+    }
+
+    #[test]
+    fn get_should_classify_modifiers_and_intern_names() {
+        let keymap = init_keymap();
+        let table = KeyTable::new(&keymap);
+
+        let super_l = table.get(keymap.key_by_name("LWIN").unwrap()).unwrap();
+        assert_eq!(super_l.modifier(), MOD_SUPER_L);
+        assert_eq!(super_l.name(), "Super_L");
+
+        let w = table.get(keymap.key_by_name("AD02").unwrap()).unwrap();
+        assert!(!w.is_modifier());
+        assert_eq!(w.keysym(), Keysym::new(keysyms::KEY_w));
+        assert_eq!(w.name(), "w");
+    }
+
+    #[test]
+    fn get_should_return_none_outside_keymap() {
+        let keymap = init_keymap();
+        let table = KeyTable::new(&keymap);
+        let below = keymap.min_keycode().raw() - 1;
+        let above = keymap.max_keycode().raw() + 1;
+
+        assert!(table.get(below.into()).is_none());
+        assert!(table.get(above.into()).is_none());
+    }
+}
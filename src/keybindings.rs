@@ -1,4 +1,437 @@
+//! Provides the shared keybindings table.
+//!
+//! The table is published as an immutable snapshot behind an [`ArcSwap`]
+//! (read-copy-update). The event thread loads the current snapshot with a
+//! single atomic operation and never blocks, while config reloads build a
+//! complete new table and swap it in. A replaced snapshot is freed once the
+//! last reader holding it drops its reference.
+//!
+//! Multi-chord sequences such as `Super_L+x, f` are compiled into a prefix
+//! trie over [`ChordKey`]s: the first chord of a sequence maps to a
+//! [`Prefix`] whose own table holds the chords that may follow it. Matching a
+//! chord is a single hash lookup whether or not a sequence is in progress, and
+//! a config with only single chords yields the same flat table as before.
+use crate::action::Action;
+use crate::chord_state::ChordKey;
+use arc_swap::ArcSwap;
 use std::collections::HashMap;
-use std::sync::{Arc, RwLock};
+use std::fmt;
+use std::sync::Arc;
+use std::time::Duration;
 
-pub type Keybindings = Arc<RwLock<HashMap<String, String>>>;
+/// How long a sequence waits for its next chord unless configured otherwise.
+pub const DEFAULT_SEQUENCE_TIMEOUT: Duration = Duration::from_millis(1000);
+
+/// What a chord is bound to.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum Binding {
+    /// Completes a binding: the action runs.
+    Action(Arc<Action>),
+    /// Starts or continues a sequence: the next chord is looked up in the
+    /// prefix's table.
+    Prefix(Arc<Prefix>),
+}
+
+/// An incomplete chord sequence.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Prefix {
+    /// How long to wait for the next chord before abandoning the sequence.
+    pub timeout: Duration,
+    /// The chords that may follow this prefix.
+    pub next: BindingTable,
+    /// The longest timeout of the sequences through each chord of `next`,
+    /// which `timeout` is recomputed from whenever they change.
+    timeouts: HashMap<ChordKey, Duration>,
+}
+
+impl Prefix {
+    fn new(timeout: Duration) -> Self {
+        Self {
+            timeout,
+            next: BindingTable::new(),
+            timeouts: HashMap::new(),
+        }
+    }
+
+    /// Sets how long the sequences through a following chord wait, and
+    /// waits as long as the longest of all of them.
+    fn set_timeout(&mut self, chord: ChordKey, timeout: Option<Duration>) {
+        match timeout {
+            Some(timeout) => self.timeouts.insert(chord, timeout),
+            None => self.timeouts.remove(&chord),
+        };
+        if let Some(&longest) = self.timeouts.values().max() {
+            self.timeout = longest;
+        }
+    }
+}
+
+/// An immutable mapping from keychords to what they trigger.
+pub type BindingTable = HashMap<ChordKey, Binding>;
+
+pub type Keybindings = Arc<ArcSwap<BindingTable>>;
+
+/// A sequence of one or more chords, as written on a config line.
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+pub struct KeySequence {
+    /// The first chord, which keys the binding in the top-level table.
+    pub first: ChordKey,
+    /// The chords after the first, empty for a plain chord binding.
+    pub rest: Box<[ChordKey]>,
+    /// How long to wait between the chords of the sequence.
+    pub timeout: Duration,
+}
+
+impl KeySequence {
+    /// Creates a sequence of a single chord.
+    pub fn chord(first: ChordKey) -> Self {
+        Self {
+            first,
+            rest: Box::default(),
+            timeout: DEFAULT_SEQUENCE_TIMEOUT,
+        }
+    }
+}
+
+impl From<ChordKey> for KeySequence {
+    fn from(chord: ChordKey) -> Self {
+        Self::chord(chord)
+    }
+}
+
+impl fmt::Display for KeySequence {
+    /// Formats the sequence the way it is written in the config, e.g.
+    /// `Super_L+x, f`.
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{}", self.first)?;
+        for chord in self.rest.iter() {
+            write!(f, ", {}", chord)?;
+        }
+        Ok(())
+    }
+}
+
+/// Adds a binding to a table, compiling sequences into prefixes.
+///
+/// As with plain chords, the last definition wins: a sequence replaces an
+/// action bound to any of its prefixes, and an action replaces a sequence
+/// prefix it collides with. A prefix shared by several sequences waits as
+/// long as the longest of their timeouts, which is recomputed from the
+/// sequences left whenever one is replaced or removed.
+///
+/// # Arguments
+/// * `table` - The table to add to.
+/// * `sequence` - The chords to bind.
+/// * `action` - The action the complete sequence triggers.
+pub fn insert(table: &mut BindingTable, sequence: &KeySequence, action: Arc<Action>) {
+    /// Returns the longest timeout of the sequences now bound through
+    /// `chord`.
+    fn insert_chords(
+        table: &mut BindingTable,
+        chord: ChordKey,
+        rest: &[ChordKey],
+        timeout: Duration,
+        action: Arc<Action>,
+    ) -> Duration {
+        let Some((&next, rest)) = rest.split_first() else {
+            table.insert(chord, Binding::Action(action));
+            return timeout;
+        };
+
+        let binding = table
+            .entry(chord)
+            .or_insert_with(|| Binding::Prefix(Arc::new(Prefix::new(timeout))));
+        if let Binding::Action(_) = binding {
+            *binding = Binding::Prefix(Arc::new(Prefix::new(timeout)));
+        }
+        let Binding::Prefix(prefix) = binding else {
+            unreachable!("Binding was just made a prefix");
+        };
+
+        // Copies a prefix that is still shared with a published table.
+        let prefix = Arc::make_mut(prefix);
+        let next_timeout = insert_chords(&mut prefix.next, next, rest, timeout, action);
+        prefix.set_timeout(next, Some(next_timeout));
+        prefix.timeout
+    }
+
+    insert_chords(
+        table,
+        sequence.first,
+        &sequence.rest,
+        sequence.timeout,
+        action,
+    );
+}
+
+/// Returns what a sequence is bound to.
+///
+/// # Arguments
+/// * `table` - The table to look in.
+/// * `sequence` - The chords to look up.
+///
+/// # Returns
+/// The action or prefix the last chord of the sequence maps to, if any.
+pub fn lookup<'a>(table: &'a BindingTable, sequence: &KeySequence) -> Option<&'a Binding> {
+    let mut binding = table.get(&sequence.first)?;
+
+    for chord in sequence.rest.iter() {
+        match binding {
+            Binding::Prefix(prefix) => binding = prefix.next.get(chord)?,
+            Binding::Action(_) => return None,
+        }
+    }
+
+    Some(binding)
+}
+
+/// Removes a binding from a table.
+///
+/// Removing a sequence prefix removes every sequence that starts with it,
+/// and prefixes left without any continuation are removed as well.
+///
+/// # Arguments
+/// * `table` - The table to remove from.
+/// * `sequence` - The chords to unbind.
+///
+/// # Returns
+/// `true` if anything was bound to the sequence.
+pub fn remove(table: &mut BindingTable, sequence: &KeySequence) -> bool {
+    fn remove_chords(table: &mut BindingTable, chord: ChordKey, rest: &[ChordKey]) -> bool {
+        let Some((&next, rest)) = rest.split_first() else {
+            return table.remove(&chord).is_some();
+        };
+        let Some(Binding::Prefix(prefix)) = table.get_mut(&chord) else {
+            return false;
+        };
+
+        // Copies a prefix that is still shared with a published table.
+        let prefix = Arc::make_mut(prefix);
+        let removed = remove_chords(&mut prefix.next, next, rest);
+        if prefix.next.is_empty() {
+            table.remove(&chord);
+        } else if removed {
+            let next_timeout = match prefix.next.get(&next) {
+                Some(Binding::Prefix(next_prefix)) => Some(next_prefix.timeout),
+                Some(Binding::Action(_)) => prefix.timeouts.get(&next).copied(),
+                None => None,
+            };
+            prefix.set_timeout(next, next_timeout);
+        }
+        removed
+    }
+
+    remove_chords(table, sequence.first, &sequence.rest)
+}
+
+/// Returns every complete binding of a table, sorted by sequence.
+///
+/// Each sequence carries its own timeout, not the longest one of the
+/// prefix it shares with others.
+pub fn bindings(table: &BindingTable) -> Vec<(KeySequence, Arc<Action>)> {
+    fn collect(
+        table: &BindingTable,
+        chords: &mut Vec<ChordKey>,
+        timeouts: Option<&HashMap<ChordKey, Duration>>,
+        bindings: &mut Vec<(KeySequence, Arc<Action>)>,
+    ) {
+        for (&chord, binding) in table {
+            chords.push(chord);
+            match binding {
+                Binding::Action(action) => bindings.push((
+                    KeySequence {
+                        first: chords[0],
+                        rest: chords[1..].into(),
+                        timeout: timeouts
+                            .and_then(|timeouts| timeouts.get(&chord))
+                            .copied()
+                            .unwrap_or(DEFAULT_SEQUENCE_TIMEOUT),
+                    },
+                    Arc::clone(action),
+                )),
+                Binding::Prefix(prefix) => {
+                    collect(&prefix.next, chords, Some(&prefix.timeouts), bindings)
+                }
+            }
+            chords.pop();
+        }
+    }
+
+    let mut bindings = Vec::new();
+    collect(table, &mut Vec::new(), None, &mut bindings);
+    bindings.sort_by_cached_key(|(sequence, _)| sequence.to_string());
+    bindings
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::chord_state::{MOD_CONTROL_L, MOD_SUPER_L};
+    use xkbcommon::xkb::{keysyms, Keysym};
+
+    fn chord(keysym: u32) -> ChordKey {
+        ChordKey::new(MOD_SUPER_L, Keysym::new(keysym))
+    }
+
+    fn sequence(chords: &[ChordKey], timeout_ms: u64) -> KeySequence {
+        KeySequence {
+            first: chords[0],
+            rest: chords[1..].into(),
+            timeout: Duration::from_millis(timeout_ms),
+        }
+    }
+
+    fn action(command: &str) -> Arc<Action> {
+        Arc::new(Action::parse(command).unwrap())
+    }
+
+    fn prefix(binding: Option<&Binding>) -> &Prefix {
+        match binding {
+            Some(Binding::Prefix(prefix)) => prefix,
+            other => panic!("Expected a prefix, got {:?}", other),
+        }
+    }
+
+    #[test]
+    fn insert_should_share_prefixes_between_sequences() {
+        let (x, f, b) = (
+            chord(keysyms::KEY_x),
+            chord(keysyms::KEY_f),
+            chord(keysyms::KEY_b),
+        );
+        let mut table = BindingTable::new();
+        insert(&mut table, &sequence(&[x, f], 500), action("find"));
+        insert(&mut table, &sequence(&[x, b], 1500), action("buffers"));
+
+        assert_eq!(table.len(), 1);
+        let x_prefix = prefix(table.get(&x));
+        assert_eq!(x_prefix.timeout, Duration::from_millis(1500));
+        assert_eq!(
+            x_prefix.next.get(&f),
+            Some(&Binding::Action(action("find")))
+        );
+        assert_eq!(
+            x_prefix.next.get(&b),
+            Some(&Binding::Action(action("buffers")))
+        );
+    }
+
+    #[test]
+    fn insert_and_remove_should_recompute_prefix_timeouts() {
+        let (x, f, b) = (
+            chord(keysyms::KEY_x),
+            chord(keysyms::KEY_f),
+            chord(keysyms::KEY_b),
+        );
+        let mut table = BindingTable::new();
+        insert(&mut table, &sequence(&[x, f], 500), action("find"));
+        insert(&mut table, &sequence(&[x, b, f], 1500), action("buffers"));
+        assert_eq!(prefix(table.get(&x)).timeout, Duration::from_millis(1500));
+
+        // Rebinding the slower sequence with a shorter timeout lowers it.
+        insert(&mut table, &sequence(&[x, b, f], 300), action("buffers"));
+        let x_prefix = prefix(table.get(&x));
+        assert_eq!(x_prefix.timeout, Duration::from_millis(500));
+        assert_eq!(
+            prefix(x_prefix.next.get(&b)).timeout,
+            Duration::from_millis(300)
+        );
+
+        assert!(remove(&mut table, &sequence(&[x, f], 500)));
+        assert_eq!(prefix(table.get(&x)).timeout, Duration::from_millis(300));
+    }
+
+    #[test]
+    fn insert_should_let_last_definition_win() {
+        let (x, f) = (chord(keysyms::KEY_x), chord(keysyms::KEY_f));
+        let mut table = BindingTable::new();
+
+        insert(&mut table, &KeySequence::chord(x), action("plain"));
+        insert(&mut table, &sequence(&[x, f], 1000), action("sequence"));
+        prefix(table.get(&x));
+
+        insert(&mut table, &KeySequence::chord(x), action("plain"));
+        assert_eq!(table.get(&x), Some(&Binding::Action(action("plain"))));
+    }
+
+    #[test]
+    fn lookup_should_follow_prefixes() {
+        let (x, f, b) = (
+            chord(keysyms::KEY_x),
+            chord(keysyms::KEY_f),
+            chord(keysyms::KEY_b),
+        );
+        let mut table = BindingTable::new();
+        insert(&mut table, &sequence(&[x, f], 500), action("find"));
+
+        assert_eq!(
+            lookup(&table, &sequence(&[x, f], 500)),
+            Some(&Binding::Action(action("find")))
+        );
+        assert!(matches!(
+            lookup(&table, &KeySequence::chord(x)),
+            Some(Binding::Prefix(_))
+        ));
+        assert_eq!(lookup(&table, &sequence(&[x, b], 500)), None);
+        assert_eq!(lookup(&table, &sequence(&[x, f, b], 500)), None);
+    }
+
+    #[test]
+    fn remove_should_prune_empty_prefixes() {
+        let (x, f, b) = (
+            chord(keysyms::KEY_x),
+            chord(keysyms::KEY_f),
+            chord(keysyms::KEY_b),
+        );
+        let mut table = BindingTable::new();
+        insert(&mut table, &sequence(&[x, f], 500), action("find"));
+        insert(&mut table, &sequence(&[x, b], 500), action("buffers"));
+        let published = table.clone();
+
+        assert!(remove(&mut table, &sequence(&[x, f], 500)));
+        assert!(!remove(&mut table, &sequence(&[x, f], 500)));
+        assert_eq!(prefix(table.get(&x)).next.len(), 1);
+
+        assert!(remove(&mut table, &sequence(&[x, b], 500)));
+        assert!(table.is_empty());
+
+        // Tables sharing the prefixes are left alone.
+        assert_eq!(prefix(published.get(&x)).next.len(), 2);
+    }
+
+    #[test]
+    fn bindings_should_list_complete_sequences() {
+        let (x, f, g) = (
+            chord(keysyms::KEY_x),
+            chord(keysyms::KEY_f),
+            chord(keysyms::KEY_g),
+        );
+        let mut table = BindingTable::new();
+        insert(&mut table, &sequence(&[x, f], 500), action("find"));
+        insert(&mut table, &sequence(&[x, g], 2000), action("grep"));
+        insert(&mut table, &KeySequence::chord(f), action("plain"));
+        assert_eq!(prefix(table.get(&x)).timeout, Duration::from_millis(2000));
+
+        let listed = bindings(&table);
+        assert_eq!(
+            listed,
+            vec![
+                (KeySequence::chord(f), action("plain")),
+                (sequence(&[x, f], 500), action("find")),
+                (sequence(&[x, g], 2000), action("grep")),
+            ]
+        );
+    }
+
+    #[test]
+    fn display_should_join_chords() {
+        let sequence = sequence(
+            &[
+                ChordKey::new(MOD_CONTROL_L, Keysym::new(keysyms::KEY_x)),
+                ChordKey::new(0, Keysym::new(keysyms::KEY_f)),
+            ],
+            1000,
+        );
+        assert_eq!(sequence.to_string(), "Control_L+x, f");
+    }
+}
@@ -0,0 +1,392 @@
+//! Provides caching of the compiled XKB keymap across restarts.
+//!
+//! Compiling a keymap from rule names (RMLVO) resolves the rules file and
+//! reads and compiles dozens of files from the xkeyboard-config data, which is
+//! one of the slowest steps of startup. A [`KeymapCache`] stores the compiled
+//! keymap in its serialized text form under `$XDG_CACHE_HOME/clefd`, keyed by
+//! the rule names and a fingerprint of the XKB data, and later starts load it
+//! with `xkb_keymap_new_from_string`, which skips rules resolution and file
+//! lookups entirely.
+//!
+//! xkeyboard-config does not install its version anywhere libxkbcommon reads
+//! it from. The fingerprint therefore covers each XKB include path and the
+//! size and modification time of the rules file in it, which every package
+//! upgrade rewrites. The user's own XKB directories (`~/.config/xkb`,
+//! `~/.xkb` and `$XKB_CONFIG_EXTRA_PATH`) are edited by hand instead, so the
+//! fingerprint covers the size and modification time of every file in them.
+use crate::binding_cache::content_hash;
+use anyhow::{anyhow, Context, Result};
+use log::{debug, info, warn};
+use std::env;
+use std::fmt::Write as _;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::OnceLock;
+use std::time::UNIX_EPOCH;
+use xkbcommon::xkb;
+
+/// The rules file libxkbcommon uses when none is given.
+const DEFAULT_RULES: &str = "evdev";
+
+/// Starts the header line of a cache file.
+const HEADER: &str = "clefd-keymap-v1";
+
+/// The rules, model, layout, variant and options a keymap is compiled from.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct Rmlvo {
+    pub rules: String,
+    pub model: String,
+    pub layout: String,
+    pub variant: String,
+    pub options: Option<String>,
+}
+
+impl Rmlvo {
+    /// Returns the names libxkbcommon would use for an empty RMLVO.
+    ///
+    /// Those come from the `XKB_DEFAULT_*` environment variables; names that
+    /// are not set stay empty and fall back to the built-in defaults.
+    pub fn from_env() -> Self {
+        let var = |name| env::var(name).unwrap_or_default();
+
+        Self {
+            rules: var("XKB_DEFAULT_RULES"),
+            model: var("XKB_DEFAULT_MODEL"),
+            layout: var("XKB_DEFAULT_LAYOUT"),
+            variant: var("XKB_DEFAULT_VARIANT"),
+            options: env::var("XKB_DEFAULT_OPTIONS").ok(),
+        }
+    }
+
+    /// Compiles a keymap from these names.
+    pub fn compile(&self, context: &xkb::Context) -> Result<xkb::Keymap> {
+        xkb::Keymap::new_from_names(
+            context,
+            &self.rules,
+            &self.model,
+            &self.layout,
+            &self.variant,
+            self.options.clone(),
+            xkb::KEYMAP_COMPILE_NO_FLAGS,
+        )
+        .ok_or_else(|| anyhow!("Failed to create XKB keymap for {:?}.", self))
+    }
+
+    /// Returns the key a keymap compiled from these names is cached under.
+    ///
+    /// # Arguments
+    /// * `context` - The context whose include paths the keymap is compiled
+    ///   from.
+    pub fn cache_key(&self, context: &xkb::Context) -> u64 {
+        self.fingerprint(context.include_paths(), &user_xkb_dirs())
+    }
+
+    /// Hashes the names with the XKB data in the given include paths, walking
+    /// every file of the paths in `user_dirs`.
+    fn fingerprint<'p>(
+        &self,
+        include_paths: impl Iterator<Item = &'p Path>,
+        user_dirs: &[PathBuf],
+    ) -> u64 {
+        let rules = if self.rules.is_empty() {
+            DEFAULT_RULES
+        } else {
+            &self.rules
+        };
+
+        let mut key = String::new();
+        let _ = write!(
+            key,
+            "{}\0{}\0{}\0{}\0{:?}",
+            rules, self.model, self.layout, self.variant, self.options
+        );
+        for dir in include_paths {
+            let (len, mtime) = fs::metadata(dir.join("rules").join(rules))
+                .map(|meta| file_stamp(&meta))
+                .unwrap_or_default();
+            let _ = write!(key, "\0{}\0{}\0{}", dir.display(), len, mtime);
+            if user_dirs.iter().any(|user_dir| user_dir == dir) {
+                stamp_tree(dir, &mut key);
+            }
+        }
+
+        content_hash(key.as_bytes())
+    }
+}
+
+/// Returns the XKB directories libxkbcommon searches before the system data.
+fn user_xkb_dirs() -> Vec<PathBuf> {
+    let mut dirs = Vec::new();
+    if let Some(extra) = env::var_os("XKB_CONFIG_EXTRA_PATH") {
+        dirs.push(PathBuf::from(extra));
+    }
+    if let Some(config) = dirs::config_dir() {
+        dirs.push(config.join("xkb"));
+    }
+    if let Some(home) = dirs::home_dir() {
+        dirs.push(home.join(".xkb"));
+    }
+    dirs
+}
+
+/// Returns the size and modification time of a file.
+fn file_stamp(meta: &fs::Metadata) -> (u64, u128) {
+    let mtime = meta
+        .modified()
+        .ok()
+        .and_then(|time| time.duration_since(UNIX_EPOCH).ok())
+        .unwrap_or_default();
+    (meta.len(), mtime.as_nanos())
+}
+
+/// Appends the path, size and modification time of every file under `dir` to
+/// the key, in a stable order.
+///
+/// Symbolic links to directories are not followed, so a link loop cannot
+/// keep the walk going.
+fn stamp_tree(dir: &Path, key: &mut String) {
+    let Ok(entries) = fs::read_dir(dir) else {
+        return;
+    };
+    let mut paths: Vec<PathBuf> = entries.flatten().map(|entry| entry.path()).collect();
+    paths.sort();
+
+    for path in paths {
+        let Ok(meta) = fs::symlink_metadata(&path) else {
+            continue;
+        };
+        if meta.is_dir() {
+            stamp_tree(&path, key);
+            continue;
+        }
+        if let Ok(meta) = fs::metadata(&path) {
+            let (len, mtime) = file_stamp(&meta);
+            let _ = write!(key, "\0{}\0{}\0{}", path.display(), len, mtime);
+        }
+    }
+}
+
+/// A serialized keymap cache file.
+#[derive(Debug, Clone)]
+pub struct KeymapCache {
+    path: PathBuf,
+}
+
+impl KeymapCache {
+    /// Creates a cache stored at the given path.
+    pub fn new(path: PathBuf) -> Self {
+        Self { path }
+    }
+
+    /// Returns the cache in the user's cache directory, if there is one.
+    pub fn in_cache_dir() -> Option<Self> {
+        dirs::cache_dir().map(|dir| Self::in_dir(&dir.join("clefd")))
+    }
+
+    /// Returns the cache in the given directory.
+    pub fn in_dir(dir: &Path) -> Self {
+        Self::new(dir.join("keymap.xkb"))
+    }
+
+    /// Returns the path of the cache file.
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+
+    /// Loads the cached keymap for the given names, or compiles and caches it.
+    ///
+    /// A stale, unreadable or corrupt cache is ignored, and failing to write
+    /// the cache only costs a slower next start.
+    ///
+    /// # Arguments
+    /// * `context` - The XKB context to create the keymap in.
+    /// * `rmlvo` - The names to compile the keymap from.
+    pub fn load_or_compile(&self, context: &xkb::Context, rmlvo: &Rmlvo) -> Result<xkb::Keymap> {
+        let key = rmlvo.cache_key(context);
+
+        if let Some(keymap) = self.load(context, key) {
+            info!("Loaded XKB keymap from cache {:?}", self.path);
+            return Ok(keymap);
+        }
+
+        let keymap = rmlvo.compile(context)?;
+        if let Err(e) = self.store(key, &keymap) {
+            warn!("Failed to update keymap cache: {:#}", e);
+        }
+
+        Ok(keymap)
+    }
+
+    /// Loads the cached keymap if it was stored under `key`.
+    fn load(&self, context: &xkb::Context, key: u64) -> Option<xkb::Keymap> {
+        let content = fs::read_to_string(&self.path).ok()?;
+        let (header, keymap) = content.split_once('\n')?;
+
+        if header != Self::header(key, keymap.len()) {
+            debug!("Keymap cache {:?} is stale", self.path);
+            return None;
+        }
+
+        let keymap = xkb::Keymap::new_from_string(
+            context,
+            keymap.to_string(),
+            xkb::KEYMAP_FORMAT_TEXT_V1,
+            xkb::KEYMAP_COMPILE_NO_FLAGS,
+        );
+        if keymap.is_none() {
+            warn!("Ignoring corrupt keymap cache {:?}", self.path);
+        }
+        keymap
+    }
+
+    /// Replaces the cache with a serialized keymap.
+    fn store(&self, key: u64, keymap: &xkb::Keymap) -> Result<()> {
+        if let Some(dir) = self.path.parent() {
+            fs::create_dir_all(dir).context(format!("Failed to create {:?}", dir))?;
+        }
+
+        let keymap = keymap.get_as_string(xkb::KEYMAP_FORMAT_TEXT_V1);
+        let content = format!("{}\n{}", Self::header(key, keymap.len()), keymap);
+
+        let staged = self.path.with_extension("tmp");
+        fs::write(&staged, content)
+            .and_then(|_| fs::rename(&staged, &self.path))
+            .context(format!("Failed to write keymap cache at {:?}", self.path))
+    }
+
+    /// Formats the header line identifying the cached keymap.
+    fn header(key: u64, len: usize) -> String {
+        format!("{} {:016x} {}", HEADER, key, len)
+    }
+}
+
+/// Returns the default keymap, compiled at most once per process.
+///
+/// An [`xkb::Keymap`] cannot be shared between threads, so the compiled
+/// keymap is kept in its serialized form and every caller gets its own copy
+/// loaded from that. Tests and benchmarks use this instead of compiling the
+/// rules over and over.
+pub fn default_keymap() -> xkb::Keymap {
+    static SERIALIZED: OnceLock<String> = OnceLock::new();
+
+    let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+    let serialized = SERIALIZED.get_or_init(|| {
+        Rmlvo::from_env()
+            .compile(&context)
+            .expect("Failed to create XKB keymap")
+            .get_as_string(xkb::KEYMAP_FORMAT_TEXT_V1)
+    });
+
+    xkb::Keymap::new_from_string(
+        &context,
+        serialized.clone(),
+        xkb::KEYMAP_FORMAT_TEXT_V1,
+        xkb::KEYMAP_COMPILE_NO_FLAGS,
+    )
+    .expect("Failed to load the serialized default keymap")
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn as_string(keymap: &xkb::Keymap) -> String {
+        keymap.get_as_string(xkb::KEYMAP_FORMAT_TEXT_V1)
+    }
+
+    #[test]
+    fn load_or_compile_should_populate_cache() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache = KeymapCache::new(dir.path().join("clefd").join("keymap.xkb"));
+        let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+        let rmlvo = Rmlvo::default();
+
+        let compiled = cache.load_or_compile(&context, &rmlvo).unwrap();
+        assert!(cache.path().is_file());
+
+        let cached = cache.load_or_compile(&context, &rmlvo).unwrap();
+        assert_eq!(as_string(&cached), as_string(&compiled));
+    }
+
+    #[test]
+    fn load_or_compile_should_prefer_cached_keymap() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache = KeymapCache::new(dir.path().join("keymap.xkb"));
+        let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+        let rmlvo = Rmlvo::default();
+
+        // Store a different keymap under the key of the default names; if it
+        // comes back, the rules were not compiled again.
+        let other = Rmlvo {
+            layout: "de".to_string(),
+            ..Rmlvo::default()
+        }
+        .compile(&context)
+        .unwrap();
+        cache.store(rmlvo.cache_key(&context), &other).unwrap();
+
+        let loaded = cache.load_or_compile(&context, &rmlvo).unwrap();
+        assert_eq!(as_string(&loaded), as_string(&other));
+    }
+
+    #[test]
+    fn load_or_compile_should_ignore_stale_and_corrupt_caches() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache = KeymapCache::new(dir.path().join("keymap.xkb"));
+        let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+        let rmlvo = Rmlvo::default();
+        let expected = as_string(&rmlvo.compile(&context).unwrap());
+        let key = rmlvo.cache_key(&context);
+
+        for content in [
+            format!("{}\nnot a keymap", KeymapCache::header(key ^ 1, 12)),
+            format!("{}\nnot a keymap", KeymapCache::header(key, 12)),
+            "garbage".to_string(),
+        ] {
+            fs::write(cache.path(), content).unwrap();
+            let keymap = cache.load_or_compile(&context, &rmlvo).unwrap();
+            assert_eq!(as_string(&keymap), expected);
+        }
+    }
+
+    #[test]
+    fn cache_key_should_depend_on_names() {
+        let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+        let us = Rmlvo {
+            layout: "us".to_string(),
+            ..Rmlvo::default()
+        };
+        let de = Rmlvo {
+            layout: "de".to_string(),
+            ..Rmlvo::default()
+        };
+
+        assert_eq!(us.cache_key(&context), us.clone().cache_key(&context));
+        assert_ne!(us.cache_key(&context), de.cache_key(&context));
+    }
+
+    #[test]
+    fn cache_key_should_depend_on_user_xkb_files() {
+        let dir = tempfile::tempdir().unwrap();
+        let symbols = dir.path().join("symbols");
+        fs::create_dir(&symbols).unwrap();
+        fs::write(symbols.join("custom"), "partial alphanumeric_keys").unwrap();
+
+        let rmlvo = Rmlvo::default();
+        let key = |user_dirs: &[PathBuf]| rmlvo.fingerprint([dir.path()].into_iter(), user_dirs);
+        let user_dirs = [dir.path().to_path_buf()];
+        let (system, user) = (key(&[]), key(&user_dirs));
+        assert_eq!(key(&user_dirs), user);
+
+        fs::write(symbols.join("custom"), "partial alphanumeric_keys\n").unwrap();
+        assert_eq!(key(&[]), system);
+        assert_ne!(key(&user_dirs), user);
+    }
+
+    #[test]
+    fn default_keymap_should_match_fresh_compile() {
+        let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+        let fresh = Rmlvo::from_env().compile(&context).unwrap();
+        assert_eq!(as_string(&default_keymap()), as_string(&fresh));
+    }
+}
@@ -0,0 +1,264 @@
+//! Provides the opt-in real-time latency mode.
+//!
+//! Under heavy load the event threads compete with every other runnable
+//! thread for the CPU, and pages swapped out while the daemon idles add
+//! milliseconds of fault handling before a binding fires. The latency mode
+//! moves the event threads to `SCHED_FIFO`, optionally pins them to a set of
+//! CPUs, and locks the daemon's memory once its tables are built.
+//!
+//! Nothing of this leaks into spawned commands: the real-time policy is set
+//! with `SCHED_RESET_ON_FORK`, so children start with normal scheduling,
+//! memory locks are never inherited across `fork`, and the [`Spawner`]
+//! clones children with the CPU mask the daemon started with, which their own
+//! children inherit in turn.
+//!
+//! Every step degrades gracefully. When the service limits (`LimitRTPRIO=`,
+//! `LimitMEMLOCK=`) do not allow a step, it fails with an error naming the
+//! limit, and the caller logs it and carries on at normal priority.
+//!
+//! [`Spawner`]: crate::spawner::Spawner
+use anyhow::{anyhow, Context, Result};
+use nix::sys::mman::{mlockall, MlockAllFlags};
+use std::fmt;
+use std::io;
+use std::mem;
+use std::str::FromStr;
+
+/// The `SCHED_FIFO` priority of the event threads unless configured otherwise.
+///
+/// Low enough to stay below the kernel's threaded interrupt handlers (50).
+pub const DEFAULT_RT_PRIORITY: i32 = 10;
+
+/// A set of CPUs, as accepted by `sched_setaffinity(2)`.
+#[derive(Clone, Copy)]
+pub struct CpuMask(libc::cpu_set_t);
+
+impl CpuMask {
+    /// Returns the CPUs the calling thread may run on.
+    pub fn current() -> Result<Self> {
+        Self::of(0)
+    }
+
+    /// Returns the CPUs a thread or process may run on.
+    ///
+    /// # Arguments
+    /// * `tid` - The thread or process, or 0 for the calling thread.
+    pub fn of(tid: libc::pid_t) -> Result<Self> {
+        // SAFETY: cpu_set_t is plain data, valid when zeroed.
+        let mut set: libc::cpu_set_t = unsafe { mem::zeroed() };
+        // SAFETY: set is a writable cpu_set_t of the given size.
+        if unsafe { libc::sched_getaffinity(tid, mem::size_of_val(&set), &mut set) } != 0 {
+            return Err(io::Error::last_os_error()).context("Failed to read CPU affinity");
+        }
+        Ok(Self(set))
+    }
+
+    /// Returns whether the mask contains a CPU.
+    pub fn contains(&self, cpu: usize) -> bool {
+        // SAFETY: set is a valid cpu_set_t; out of range CPUs are rejected.
+        cpu < libc::CPU_SETSIZE as usize && unsafe { libc::CPU_ISSET(cpu, &self.0) }
+    }
+
+    /// Restricts a thread or process to the CPUs of this mask.
+    ///
+    /// # Arguments
+    /// * `tid` - The thread or process, or 0 for the calling thread.
+    pub fn apply(&self, tid: libc::pid_t) -> io::Result<()> {
+        // SAFETY: self.0 is a valid cpu_set_t of the given size.
+        if unsafe { libc::sched_setaffinity(tid, mem::size_of_val(&self.0), &self.0) } != 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+}
+
+impl fmt::Debug for CpuMask {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_set()
+            .entries((0..libc::CPU_SETSIZE as usize).filter(|&cpu| self.contains(cpu)))
+            .finish()
+    }
+}
+
+/// A list of CPUs such as `2`, `0,2` or `0-3,6`.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct CpuList(Vec<usize>);
+
+impl CpuList {
+    /// Returns the CPUs in the list.
+    pub fn cpus(&self) -> &[usize] {
+        &self.0
+    }
+
+    /// Converts the list into a mask.
+    pub fn mask(&self) -> CpuMask {
+        // SAFETY: cpu_set_t is plain data, valid when zeroed.
+        let mut set: libc::cpu_set_t = unsafe { mem::zeroed() };
+        for &cpu in &self.0 {
+            // SAFETY: parsing rejected CPUs beyond CPU_SETSIZE.
+            unsafe { libc::CPU_SET(cpu, &mut set) };
+        }
+        CpuMask(set)
+    }
+}
+
+impl FromStr for CpuList {
+    type Err = anyhow::Error;
+
+    fn from_str(s: &str) -> Result<Self> {
+        let invalid = || anyhow!("Invalid CPU list '{}': expected e.g. '2' or '0-3,6'", s);
+        let mut cpus = Vec::new();
+
+        for part in s.split(',').map(str::trim) {
+            let (first, last) = part.split_once('-').unwrap_or((part, part));
+            let first = first.trim().parse::<usize>().map_err(|_| invalid())?;
+            let last = last.trim().parse::<usize>().map_err(|_| invalid())?;
+            if first > last || last >= libc::CPU_SETSIZE as usize {
+                return Err(invalid());
+            }
+            cpus.extend(first..=last);
+        }
+
+        cpus.sort_unstable();
+        cpus.dedup();
+        Ok(Self(cpus))
+    }
+}
+
+/// How an event thread is scheduled in latency mode.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct LatencyMode {
+    /// The `SCHED_FIFO` priority, or `None` to keep normal scheduling.
+    pub priority: Option<i32>,
+    /// The CPUs to pin the thread to, or `None` to leave it unpinned.
+    pub cpus: Option<CpuList>,
+}
+
+impl LatencyMode {
+    /// Pins the calling thread to the configured CPUs, if any.
+    ///
+    /// # Returns
+    /// The CPU mask the thread had before, which children should get back,
+    /// or `None` if no CPUs are configured.
+    pub fn pin_current_thread(&self) -> Result<Option<CpuMask>> {
+        let Some(cpus) = &self.cpus else {
+            return Ok(None);
+        };
+
+        let original = CpuMask::current()?;
+        cpus.mask()
+            .apply(0)
+            .with_context(|| format!("Failed to pin to CPUs {:?}", cpus.0))?;
+        Ok(Some(original))
+    }
+
+    /// Moves the calling thread to `SCHED_FIFO` at the configured priority,
+    /// if any.
+    ///
+    /// The policy is reset for children, so spawned commands run with normal
+    /// scheduling.
+    pub fn raise_current_thread(&self) -> Result<()> {
+        let Some(priority) = self.priority else {
+            return Ok(());
+        };
+
+        let param = libc::sched_param {
+            sched_priority: priority,
+        };
+        let policy = libc::SCHED_FIFO | libc::SCHED_RESET_ON_FORK;
+        // SAFETY: param is a valid sched_param; 0 is the calling thread.
+        if unsafe { libc::sched_setscheduler(0, policy, &param) } != 0 {
+            return Err(io::Error::last_os_error()).with_context(|| {
+                format!(
+                    "Failed to set SCHED_FIFO priority {} (raise LimitRTPRIO= \
+                     or grant CAP_SYS_NICE)",
+                    priority
+                )
+            });
+        }
+        Ok(())
+    }
+}
+
+/// Returns whether the memory lock limit is unlimited.
+fn memlock_unlimited() -> bool {
+    let mut limit = libc::rlimit {
+        rlim_cur: 0,
+        rlim_max: 0,
+    };
+    // SAFETY: limit is a writable rlimit.
+    let status = unsafe { libc::getrlimit(libc::RLIMIT_MEMLOCK, &mut limit) };
+    status == 0 && limit.rlim_cur == libc::RLIM_INFINITY
+}
+
+/// Locks the daemon's memory, so it is never paged out.
+///
+/// Pages mapped later are only locked as well when `RLIMIT_MEMLOCK` is
+/// unlimited; under a finite limit, locking future mappings would make
+/// allocations fail once the limit is reached.
+///
+/// # Returns
+/// Whether future mappings are locked too, or an error if even the
+/// current mappings exceed the limit.
+pub fn lock_memory() -> Result<bool> {
+    let future = memlock_unlimited();
+    let flags = if future {
+        MlockAllFlags::MCL_CURRENT | MlockAllFlags::MCL_FUTURE
+    } else {
+        MlockAllFlags::MCL_CURRENT
+    };
+
+    mlockall(flags).context("Failed to lock memory (raise LimitMEMLOCK=)")?;
+    Ok(future)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn cpu_list_should_parse_ranges() {
+        let list: CpuList = "3, 0-1,1".parse().unwrap();
+        assert_eq!(list.cpus(), &[0, 1, 3]);
+
+        let mask = list.mask();
+        assert!(mask.contains(0) && mask.contains(3));
+        assert!(!mask.contains(2));
+
+        assert!("".parse::<CpuList>().is_err());
+        assert!("3-1".parse::<CpuList>().is_err());
+        assert!("1-x".parse::<CpuList>().is_err());
+    }
+
+    #[test]
+    fn pin_current_thread_should_return_original_mask() {
+        let original = CpuMask::current().unwrap();
+        let cpu = (0..libc::CPU_SETSIZE as usize)
+            .find(|&cpu| original.contains(cpu))
+            .unwrap();
+        let mode = LatencyMode {
+            priority: None,
+            cpus: Some(cpu.to_string().parse().unwrap()),
+        };
+
+        // Tests run on their own threads, so pinning this one is harmless.
+        let before = mode.pin_current_thread().unwrap().unwrap();
+        assert_eq!(format!("{:?}", before), format!("{:?}", original));
+        assert_eq!(
+            format!("{:?}", CpuMask::current().unwrap()),
+            format!("{{{}}}", cpu)
+        );
+    }
+
+    #[test]
+    fn raise_current_thread_should_report_refused_priority() {
+        // Priority 0 is invalid for SCHED_FIFO, so this fails with or
+        // without privileges.
+        let mode = LatencyMode {
+            priority: Some(0),
+            cpus: None,
+        };
+        let err = mode.raise_current_thread().unwrap_err();
+        assert!(err.to_string().contains("LimitRTPRIO"));
+    }
+}
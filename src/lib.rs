@@ -1,4 +1,31 @@
+pub mod action;
+pub mod alloc_count;
+pub mod binding_cache;
+pub mod builtin;
+pub mod child_output;
 pub mod chord_state;
+pub mod config_parser;
+pub mod control;
+pub mod device_filter;
+pub mod evdev_backend;
+pub mod key_event;
+pub mod key_table;
 pub mod keybindings;
 pub mod keyboard_client;
+pub mod keymap_cache;
+pub mod latency;
+pub mod path_search;
+pub mod reactor;
+pub mod reaper;
+pub mod recording;
+pub mod scheduler;
+pub mod session;
+pub mod spawner;
+pub mod stats;
+pub mod trace_ring;
 pub mod user_config;
+
+/// Unit tests count their allocations, see [`alloc_count`].
+#[cfg(test)]
+#[global_allocator]
+static ALLOCATOR: alloc_count::CountingAlloc = alloc_count::CountingAlloc;
@@ -1,92 +1,263 @@
-use anyhow::{anyhow, Context, Result};
+use anyhow::{anyhow, Result};
+use arc_swap::ArcSwap;
 use clap::Parser;
-use clefd::keyboard_client::KeyboardClient;
+use clefd::binding_cache::BindingCache;
+use clefd::child_output::OutputLogs;
+use clefd::control::ControlSocket;
+use clefd::device_filter::{DeviceFilter, DeviceMatch};
+use clefd::key_table::KeyTable;
+use clefd::keyboard_client::{EventSources, InputBackend, KeyboardClient, DEFAULT_SEAT};
+use clefd::keymap_cache::{KeymapCache, Rmlvo};
+use clefd::latency::{self, CpuList, LatencyMode, DEFAULT_RT_PRIORITY};
+use clefd::reactor::{Shutdown, SignalPipe};
+use clefd::recording::Recorder;
+use clefd::spawner::Spawner;
+use clefd::stats::{Stats, StatsSocket};
+use clefd::trace_ring::TraceRing;
 use clefd::user_config::UserConfig;
 use clefd::{chord_state::ChordState, keybindings::Keybindings};
-use log::info;
-use signal_hook::{
-    consts::{SIGINT, SIGTERM},
-    iterator::Signals,
-};
+use log::{error, info, warn};
+use signal_hook::consts::{SIGINT, SIGTERM, SIGUSR1};
 use std::collections::HashMap;
-use std::process::Child;
-use std::sync::atomic::{AtomicBool, Ordering};
-use std::sync::mpsc::{channel, Sender};
-use std::sync::{Arc, RwLock};
+use std::path::PathBuf;
+use std::sync::mpsc::Sender;
+use std::sync::Arc;
 use std::thread;
 use xkbcommon::xkb;
 
-#[derive(Parser, Debug)]
+#[derive(Parser, Debug, Default)]
 #[command(version, about = "A keyboard shortcut manager daemon.", long_about = None)]
 struct Args {
-    // Empty implementation.
+    /// Spawn commands through a pre-forked launcher process, so the daemon
+    /// itself never forks.
+    #[arg(long)]
+    launcher: bool,
+
+    /// Run at most this many spawned commands at once per seat. Further
+    /// triggers wait in their binding's queue or are dropped. Defaults to 32.
+    #[arg(long, value_name = "N")]
+    max_jobs: Option<usize>,
+
+    /// Latency mode: run the event threads with SCHED_FIFO priority and lock
+    /// the daemon's memory. Spawned commands keep normal scheduling. Needs
+    /// LimitRTPRIO= and LimitMEMLOCK= (or CAP_SYS_NICE and CAP_IPC_LOCK).
+    #[arg(long, env = "CLEFD_REALTIME")]
+    realtime: bool,
+
+    /// The SCHED_FIFO priority of the event threads in latency mode.
+    #[arg(
+        long,
+        value_name = "PRIO",
+        default_value_t = DEFAULT_RT_PRIORITY,
+        value_parser = clap::value_parser!(i32).range(1..=99),
+        env = "CLEFD_REALTIME_PRIORITY"
+    )]
+    realtime_priority: i32,
+
+    /// Pin the event threads to these CPUs, e.g. 2 or 0-3,6.
+    #[arg(long, value_name = "CPUS", env = "CLEFD_CPU_AFFINITY")]
+    cpu_affinity: Option<CpuList>,
+
+    /// Serve latency statistics to every client connecting to this Unix
+    /// socket. Statistics are also logged on SIGUSR1.
+    #[arg(long, value_name = "PATH")]
+    stats_socket: Option<PathBuf>,
+
+    /// Accept binding changes and queries on this Unix socket, applied to
+    /// the live bindings without touching the config file.
+    #[arg(long, value_name = "PATH")]
+    control_socket: Option<PathBuf>,
+
+    /// Record every key event to a binary trace at this path, for offline
+    /// replay with `cargo run --release --example replay`.
+    #[arg(long, value_name = "PATH")]
+    record: Option<PathBuf>,
+
+    /// Serve the keyboards of this seat. Repeat to serve several seats from
+    /// one daemon, each on its own thread. Defaults to seat0.
+    #[arg(long = "seat", value_name = "NAME")]
+    seats: Vec<String>,
+
+    /// Only open keyboards matching this device name or udev property
+    /// (KEY=value). Repeat to allow several devices.
+    #[arg(long = "allow-device", value_name = "MATCH")]
+    allow_devices: Vec<DeviceMatch>,
+
+    /// Never open keyboards matching this device name or udev property
+    /// (KEY=value). Repeat to deny several devices.
+    #[arg(long = "deny-device", value_name = "MATCH")]
+    deny_devices: Vec<DeviceMatch>,
+
+    /// Read key events through libinput (the default) or straight from the
+    /// evdev device nodes, which skips libinput's event processing.
+    #[arg(long, value_name = "libinput|evdev", default_value = "libinput")]
+    backend: InputBackend,
+
+    /// Keep reading a seat's keyboards while another user's logind session
+    /// is active on it, instead of suspending them.
+    #[arg(long)]
+    ignore_session: bool,
+
+    /// Keep the binding and keymap caches in this directory. Defaults to
+    /// $XDG_CACHE_HOME/clefd; caching is off when none is known.
+    #[arg(long, value_name = "DIR")]
+    cache_dir: Option<PathBuf>,
 }
 
-fn run(keep_running: Arc<AtomicBool>, ready_tx: Option<Sender<()>>) -> Result<()> {
+fn run(args: &Args, shutdown: Arc<Shutdown>, ready_tx: Option<Sender<()>>) -> Result<()> {
     // Init info logging.
     let _ = env_logger::Builder::from_env(env_logger::Env::default().default_filter_or("info"))
         .is_test(cfg!(test)) // Disable logs during testing.
         .try_init();
 
-    // Set up an atomic boolean to control the main loop.
-    // This allows us to gracefully shut down from a signal handler.
-    let keep_running_handler = keep_running.clone();
-
-    // Register a signal handler for SIGINT and SIGTERM to ensure graceful shutdowns.
-    let mut signals =
-        Signals::new(&[SIGINT, SIGTERM]).context("Failed to register signal handlers.")?;
-
-    // Spawn a thread to listen for signals.
-    std::thread::spawn(move || {
-        for sig in signals.forever() {
-            info!("\nReceived signal {:?}, shutting down daemon...", sig);
-            keep_running_handler.store(false, Ordering::SeqCst);
-        }
-    });
+    let seats = if args.seats.is_empty() {
+        vec![DEFAULT_SEAT.to_string()]
+    } else {
+        args.seats.clone()
+    };
 
-    // Setup reaper thread.
-    let (tx, rx) = channel::<Child>();
-
-    thread::spawn(move || {
-        for mut child in rx {
-            let _ = child.wait();
-        }
-    });
+    // Start the launchers first, while the daemon is still small and has no
+    // other threads. Every seat gets its own spawner.
+    let spawners = seats
+        .iter()
+        .map(|_| {
+            if args.launcher {
+                Spawner::with_launcher()
+            } else {
+                Spawner::new()
+            }
+        })
+        .collect::<Result<Vec<Spawner>>>()?;
+
+    // SIGINT and SIGTERM wake the event loop through a self-pipe, which then
+    // shuts down gracefully.
+    let signals = SignalPipe::new(&[SIGINT, SIGTERM])?;
+    let stats_signal = SignalPipe::new(&[SIGUSR1])?;
+    let stats_socket = args
+        .stats_socket
+        .as_deref()
+        .map(StatsSocket::bind)
+        .transpose()?;
+    let mut control_socket = args
+        .control_socket
+        .as_deref()
+        .map(ControlSocket::bind)
+        .transpose()?;
 
     info!("Daemon started...");
 
     // Initialize the XKB context.
     let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
 
-    // Create a keymap from the system's current keyboard configuration.
-    let keymap = xkb::Keymap::new_from_names(
-        &context,
-        "",   // rules
-        "",   // model
-        "",   // layout
-        "",   // variant
-        None, // options
-        xkb::KEYMAP_COMPILE_NO_FLAGS,
-    )
-    .ok_or_else(|| anyhow!("Failed to create XKB keymap."))?;
-
-    // Create an XKB state object from the keymap.
-    let xkb_state = xkb::State::new(&keymap);
+    // Create a keymap from the system's current keyboard configuration,
+    // reusing the one compiled on an earlier start if nothing changed.
+    let rmlvo = Rmlvo::from_env();
+    let keymap = match args.cache_dir.as_deref().map(KeymapCache::in_dir) {
+        Some(cache) => cache.load_or_compile(&context, &rmlvo)?,
+        None => rmlvo.compile(&context)?,
+    };
+
+    // Precompute the keycode lookup table for this keymap.
+    let key_table = KeyTable::new(&keymap);
 
     // Parse config from XDG_CONFIG.
     let config_dir =
         dirs::config_dir().ok_or_else(|| anyhow!("Could not determine user config directory."))?;
     let config_path = config_dir.join("clefd").join("clefdrc");
 
-    let chord_state = ChordState::new();
-
-    let keybindings: Keybindings = Arc::new(RwLock::new(HashMap::new()));
+    let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
 
     // Start user config file watcher.
-    let _watcher = UserConfig::start_watcher(config_path, keybindings.clone())
-        .expect("Failed to start watcher thread.");
+    let cache = args
+        .cache_dir
+        .as_deref()
+        .and_then(|dir| BindingCache::in_dir(dir, &config_path));
+    let config_watcher = UserConfig::start_watcher(config_path, keybindings.clone(), cache)
+        .expect("Failed to start config watcher.");
+
+    // Every seat tracks its own held keys and pending sequences, but they
+    // share the keybindings, the keymap's lookup table, the statistics, the
+    // event trace and the captured output.
+    let stats = Arc::new(Stats::new());
+    let trace = Arc::new(TraceRing::default());
+    let output_logs = Arc::new(OutputLogs::new());
+    if let Some(control_socket) = &mut control_socket {
+        control_socket.set_trace_ring(trace.clone());
+        control_socket.set_output_logs(output_logs.clone());
+    }
+    let device_filter =
+        DeviceFilter::with_lists(args.allow_devices.clone(), args.deny_devices.clone());
+    let mut clients = seats.iter().zip(spawners).map(|(seat, spawner)| {
+        let mut kb_client = KeyboardClient::new(
+            keybindings.clone(),
+            ChordState::new(),
+            key_table.clone(),
+            spawner,
+        );
+        kb_client.set_seat(seat);
+        kb_client.set_stats(stats.clone());
+        kb_client.set_trace_ring(trace.clone());
+        kb_client.set_output_logs(output_logs.clone());
+        kb_client.set_device_filter(device_filter.clone());
+        kb_client.set_backend(args.backend);
+        kb_client.set_follow_session(!args.ignore_session);
+        if let Some(max_jobs) = args.max_jobs {
+            kb_client.set_max_jobs(max_jobs);
+        }
+        if args.realtime || args.cpu_affinity.is_some() {
+            kb_client.set_latency_mode(LatencyMode {
+                priority: args.realtime.then_some(args.realtime_priority),
+                cpus: args.cpu_affinity.clone(),
+            });
+        }
+        kb_client
+    });
+
+    // The first seat runs on this thread and also serves signals, stats and
+    // config reloads. Unwrapping is safe: there is at least one seat.
+    let mut kb_client = clients.next().unwrap();
+    if let Some(path) = &args.record {
+        info!("Recording key events to {:?}", path);
+        kb_client.set_recorder(Recorder::create(path)?);
+    }
+
+    let mut seat_threads = Vec::new();
+    for mut kb_client in clients {
+        let mut sources = EventSources::shutdown_only(shutdown.clone());
+        let spawned = thread::Builder::new()
+            .name(format!("clefd-{}", kb_client.seat()))
+            .spawn(move || {
+                if let Err(e) = kb_client.keyboard_event_listener(&mut sources) {
+                    error!("Event loop of {} failed: {:?}", kb_client.seat(), e);
+                }
+            });
+
+        match spawned {
+            Ok(handle) => seat_threads.push(handle),
+            Err(e) => {
+                shutdown.request();
+                return Err(anyhow!("Failed to start seat thread: {}", e));
+            }
+        }
+    }
+
+    let mut sources = EventSources {
+        shutdown: shutdown.clone(),
+        signals: Some(signals),
+        stats_signal: Some(stats_signal),
+        stats_socket,
+        config_watcher: Some(config_watcher),
+        control_socket,
+    };
 
-    let mut kb_client = KeyboardClient::new(keybindings.clone(), chord_state, tx);
+    // Every table is built by now, so lock it in memory before serving keys.
+    if args.realtime {
+        match latency::lock_memory() {
+            Ok(true) => info!("Locked all current and future memory"),
+            Ok(false) => info!("Locked current memory; LimitMEMLOCK= is finite"),
+            Err(e) => warn!("Latency mode: {:#}", e),
+        }
+    }
 
     // Notify tests that setup is complete via handshake.
     if let Some(tx) = ready_tx {
@@ -94,10 +265,16 @@ fn run(keep_running: Arc<AtomicBool>, ready_tx: Option<Sender<()>>) -> Result<()
     }
 
     // Run the main event loop.
-    if let Err(e) = kb_client.keyboard_event_listener(xkb_state, keep_running) {
+    if let Err(e) = kb_client.keyboard_event_listener(&mut sources) {
         eprintln!("An error occurred: {:?}", e);
     }
 
+    // Stop the other seats, whichever way this one ended.
+    shutdown.request();
+    for handle in seat_threads {
+        let _ = handle.join();
+    }
+
     info!("Daemon stopped.");
 
     Ok(())
@@ -105,48 +282,88 @@ fn run(keep_running: Arc<AtomicBool>, ready_tx: Option<Sender<()>>) -> Result<()
 
 /// Main entry point for the application.
 fn main() -> Result<()> {
-    Args::parse();
-    let keep_running = Arc::new(AtomicBool::new(true));
-    run(keep_running, None)
+    serve(Args::parse())
+}
+
+/// Runs the daemon with parsed arguments until SIGINT or SIGTERM, filling in
+/// the defaults that depend on the environment.
+///
+/// # Arguments
+/// * `args` - The command line arguments.
+fn serve(mut args: Args) -> Result<()> {
+    if args.cache_dir.is_none() {
+        args.cache_dir = dirs::cache_dir().map(|dir| dir.join("clefd"));
+    }
+    let shutdown = Arc::new(Shutdown::new()?);
+    run(&args, shutdown, None)
 }
 
 #[cfg(test)]
 mod tests {
     use super::*;
+    use std::ffi::OsStr;
     use std::sync::mpsc;
-    use std::{
-        sync::atomic::AtomicBool, sync::atomic::Ordering, sync::Arc, thread, time::Duration,
-    };
+    use std::{sync::Arc, thread, time::Duration};
 
     #[test]
     fn run_should_start_and_stop() {
-        let keep_running = Arc::new(AtomicBool::new(true));
+        let shutdown = Arc::new(Shutdown::new().unwrap());
         let (tx, rx) = mpsc::channel();
-        let kr_clone = keep_running.clone();
+        let shutdown_clone = shutdown.clone();
 
         let handle = thread::spawn(move || {
-            run(kr_clone, Some(tx)).expect("Daemon should run without setup errors.");
+            run(&Args::default(), shutdown_clone, Some(tx))
+                .expect("Daemon should run without setup errors.");
         });
 
         // Wait until run() signals it is ready.
         rx.recv_timeout(Duration::from_secs(5))
             .expect("Did not receive ready signal within 5s.");
 
-        keep_running.store(false, Ordering::SeqCst);
+        shutdown.request();
 
         handle.join().expect("Thread should join.");
 
         assert!(
-            !keep_running.load(Ordering::SeqCst),
-            "keep_running should be false after signal handler runs"
+            shutdown.is_requested(),
+            "Shutdown should stay requested after the loop exits"
         );
     }
 
     #[test]
-    fn main_should_start_and_stop_on_sigint() {
-        let handle = thread::spawn(|| super::main());
+    fn run_should_stop_every_seat() {
+        let shutdown = Arc::new(Shutdown::new().unwrap());
+        let (tx, rx) = mpsc::channel();
+        let shutdown_clone = shutdown.clone();
+        let args = Args {
+            seats: vec!["seat0".to_string(), "seat1".to_string()],
+            ..Args::default()
+        };
 
-        // Sleep until signal thread spawns.
+        let handle = thread::spawn(move || {
+            run(&args, shutdown_clone, Some(tx)).expect("Daemon should run without setup errors.");
+        });
+
+        rx.recv_timeout(Duration::from_secs(5))
+            .expect("Did not receive ready signal within 5s.");
+
+        // Joining only succeeds once the thread of the second seat stopped.
+        shutdown.request();
+        handle.join().expect("Thread should join.");
+    }
+
+    #[test]
+    fn main_should_start_and_stop_on_sigint() {
+        // Keep the caches out of ~/.cache.
+        let cache_dir = tempfile::tempdir().unwrap();
+        let args = Args::parse_from([
+            OsStr::new("clefd"),
+            OsStr::new("--cache-dir"),
+            cache_dir.path().as_os_str(),
+        ]);
+        let handle = thread::spawn(move || serve(args));
+
+        // Sleep until the signal pipe is registered.
         thread::sleep(Duration::from_millis(100));
 
         // Send SIGINT to this process via signal-hook's helper.
@@ -0,0 +1,169 @@
+//! Provides load-time resolution of program names through PATH.
+//!
+//! `posix_spawnp` searches PATH in the child on every spawn, trying to exec
+//! the program in one directory after the other. Instead, a
+//! [`ProgramResolver`] looks each bare program name up once, when bindings are
+//! loaded, and the spawner execs the absolute path directly. A program that
+//! is not in PATH is reported at load time; its bindings keep the search at
+//! spawn time, so they start working once the program is installed.
+//!
+//! Installing or removing programs does not require a config reload: the
+//! [`ConfigWatcher`] watches the PATH directories and resolves the programs
+//! created, removed or changed there again.
+//!
+//! [`ConfigWatcher`]: crate::user_config::ConfigWatcher
+use log::warn;
+use std::collections::HashMap;
+use std::ffi::{CStr, CString, OsStr};
+use std::fs;
+use std::os::unix::ffi::{OsStrExt, OsStringExt};
+use std::os::unix::fs::PermissionsExt;
+use std::path::PathBuf;
+
+/// The search path glibc uses when PATH is unset.
+pub const DEFAULT_PATH: &str = "/bin:/usr/bin";
+
+/// Returns the directories of the daemon's PATH, in search order.
+///
+/// Relative entries, which would be resolved against the daemon's working
+/// directory, are left to the search at spawn time.
+pub fn search_path() -> Vec<PathBuf> {
+    parse_search_path(std::env::var_os("PATH").as_deref())
+}
+
+fn parse_search_path(path: Option<&OsStr>) -> Vec<PathBuf> {
+    let path = path.unwrap_or(OsStr::new(DEFAULT_PATH));
+    let mut dirs: Vec<PathBuf> = Vec::new();
+
+    for dir in path.as_bytes().split(|&b| b == b':') {
+        let dir = PathBuf::from(OsStr::from_bytes(dir));
+        if dir.is_absolute() && !dirs.contains(&dir) {
+            dirs.push(dir);
+        }
+    }
+
+    dirs
+}
+
+/// Resolves program names to absolute paths, looking each name up only once.
+#[derive(Debug, Default)]
+pub struct ProgramResolver {
+    dirs: Option<Vec<PathBuf>>,
+    resolved: HashMap<Box<[u8]>, Option<CString>>,
+}
+
+impl ProgramResolver {
+    /// Creates a resolver that searches the daemon's PATH.
+    ///
+    /// PATH is only read once the first name is resolved.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Creates a resolver that searches the given directories.
+    ///
+    /// # Arguments
+    /// * `dirs` - The directories to search, in order.
+    pub fn with_dirs(dirs: Vec<PathBuf>) -> Self {
+        Self {
+            dirs: Some(dirs),
+            ..Self::default()
+        }
+    }
+
+    /// Looks a bare program name up in the search path.
+    ///
+    /// As with `execvp(3)`, the first regular file with an execute bit wins.
+    ///
+    /// # Arguments
+    /// * `program` - The program name, without any `/`.
+    ///
+    /// # Returns
+    /// The absolute path of the program, or `None` if it is not in the
+    /// search path.
+    pub fn resolve(&mut self, program: &CStr) -> Option<CString> {
+        let name = program.to_bytes();
+        if let Some(resolved) = self.resolved.get(name) {
+            return resolved.clone();
+        }
+
+        let dirs = self.dirs.get_or_insert_with(search_path);
+        let resolved = dirs
+            .iter()
+            .map(|dir| dir.join(OsStr::from_bytes(name)))
+            .find(|path| {
+                fs::metadata(path)
+                    .is_ok_and(|meta| meta.is_file() && meta.permissions().mode() & 0o111 != 0)
+            })
+            .and_then(|path| CString::new(path.into_os_string().into_vec()).ok());
+
+        if resolved.is_none() {
+            warn!(
+                "Program '{}' is not in PATH; its bindings fail until it is installed",
+                program.to_string_lossy()
+            );
+        }
+        self.resolved.insert(name.into(), resolved.clone());
+        resolved
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::path::Path;
+
+    fn name(name: &str) -> CString {
+        CString::new(name).unwrap()
+    }
+
+    fn create_program(dir: &Path, name: &str, mode: u32) {
+        let path = dir.join(name);
+        fs::write(&path, "#!/bin/sh\n").unwrap();
+        fs::set_permissions(&path, fs::Permissions::from_mode(mode)).unwrap();
+    }
+
+    #[test]
+    fn parse_search_path_should_keep_absolute_dirs_in_order() {
+        assert_eq!(
+            parse_search_path(Some(OsStr::new("/usr/bin::bin:/bin:/usr/bin"))),
+            vec![PathBuf::from("/usr/bin"), PathBuf::from("/bin")]
+        );
+        assert_eq!(
+            parse_search_path(None),
+            vec![PathBuf::from("/bin"), PathBuf::from("/usr/bin")]
+        );
+    }
+
+    #[test]
+    fn resolve_should_find_first_executable_in_path() {
+        let first = tempfile::tempdir().unwrap();
+        let second = tempfile::tempdir().unwrap();
+        create_program(first.path(), "prog", 0o644);
+        create_program(second.path(), "prog", 0o755);
+        fs::create_dir(first.path().join("dir")).unwrap();
+        let mut resolver =
+            ProgramResolver::with_dirs(vec![first.path().into(), second.path().into()]);
+
+        let expected = second.path().join("prog");
+        assert_eq!(
+            resolver.resolve(&name("prog")).unwrap().to_bytes(),
+            expected.as_os_str().as_bytes()
+        );
+        assert_eq!(resolver.resolve(&name("dir")), None);
+        assert_eq!(resolver.resolve(&name("missing")), None);
+    }
+
+    #[test]
+    fn resolve_should_remember_names() {
+        let dir = tempfile::tempdir().unwrap();
+        let mut resolver = ProgramResolver::with_dirs(vec![dir.path().into()]);
+
+        assert_eq!(resolver.resolve(&name("prog")), None);
+        create_program(dir.path(), "prog", 0o755);
+        assert_eq!(resolver.resolve(&name("prog")), None);
+        assert!(ProgramResolver::with_dirs(vec![dir.path().into()])
+            .resolve(&name("prog"))
+            .is_some());
+    }
+}
@@ -0,0 +1,364 @@
+//! Provides the single-threaded epoll reactor that drives the daemon.
+//!
+//! Every source of work (the libinput fd or the evdev device nodes and udev
+//! monitor, signal notifications, the config directory's inotify fd, the
+//! control socket and its clients, child pidfds and output pipes, the logind
+//! seat watch and a shutdown eventfd) is registered with one edge-triggered
+//! epoll instance. The event loop blocks in [`Reactor::wait`] and dispatches
+//! each ready [`Token`]; handlers must drain their source completely, since
+//! an edge is only reported once, or stop at a budget and [`Reactor::rearm`]
+//! the source so that it is reported again by the next wait.
+//!
+//! Signals are delivered through a self-pipe ([`SignalPipe`]) written by a
+//! signal-hook handler rather than a signalfd, which would require the
+//! signals to be blocked in every thread of the process.
+use anyhow::{Context, Result};
+use nix::errno::Errno;
+use nix::sys::epoll::{Epoll, EpollCreateFlags, EpollEvent, EpollFlags, EpollTimeout};
+use nix::sys::eventfd::{EfdFlags, EventFd};
+use signal_hook::SigId;
+use std::io::{self, Read};
+use std::os::fd::{AsFd, BorrowedFd, RawFd};
+use std::os::unix::net::UnixStream;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Duration;
+
+/// Maximum number of events handled per wakeup.
+const MAX_EVENTS: usize = 64;
+
+/// Identifies the source of a ready event.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Token {
+    Input,
+    Signal,
+    Config,
+    Shutdown,
+    StatsSignal,
+    StatsSocket,
+    Hotplug,
+    Control,
+    Child(RawFd),
+    Device(RawFd),
+    ControlClient(RawFd),
+    Output(RawFd),
+    Session,
+}
+
+impl Token {
+    const KIND_SHIFT: u32 = 32;
+
+    fn to_u64(self) -> u64 {
+        let (kind, payload) = match self {
+            Token::Input => (0, 0),
+            Token::Signal => (1, 0),
+            Token::Config => (2, 0),
+            Token::Shutdown => (3, 0),
+            Token::StatsSignal => (4, 0),
+            Token::StatsSocket => (5, 0),
+            Token::Child(fd) => (6, fd as u32),
+            Token::Hotplug => (7, 0),
+            Token::Device(fd) => (8, fd as u32),
+            Token::Control => (9, 0),
+            Token::ControlClient(fd) => (10, fd as u32),
+            Token::Output(fd) => (11, fd as u32),
+            Token::Session => (12, 0),
+        };
+        (kind << Self::KIND_SHIFT) | payload as u64
+    }
+
+    /// Returns the readiness a source is watched for.
+    fn interest(self) -> EpollFlags {
+        match self {
+            // Control clients are also woken once a reply that did not fit
+            // the socket buffer can be written.
+            Token::ControlClient(_) => {
+                EpollFlags::EPOLLIN | EpollFlags::EPOLLOUT | EpollFlags::EPOLLET
+            }
+            _ => EpollFlags::EPOLLIN | EpollFlags::EPOLLET,
+        }
+    }
+
+    fn from_u64(data: u64) -> Self {
+        let payload = data as u32;
+        match data >> Self::KIND_SHIFT {
+            0 => Token::Input,
+            1 => Token::Signal,
+            2 => Token::Config,
+            3 => Token::Shutdown,
+            4 => Token::StatsSignal,
+            5 => Token::StatsSocket,
+            7 => Token::Hotplug,
+            8 => Token::Device(payload as RawFd),
+            9 => Token::Control,
+            10 => Token::ControlClient(payload as RawFd),
+            11 => Token::Output(payload as RawFd),
+            12 => Token::Session,
+            _ => Token::Child(payload as RawFd),
+        }
+    }
+}
+
+/// An edge-triggered epoll instance.
+pub struct Reactor {
+    epoll: Epoll,
+    events: [EpollEvent; MAX_EVENTS],
+    ready: usize,
+}
+
+impl Reactor {
+    /// Creates a new reactor with nothing registered.
+    pub fn new() -> Result<Self> {
+        let epoll =
+            Epoll::new(EpollCreateFlags::EPOLL_CLOEXEC).context("Failed to create epoll fd")?;
+
+        Ok(Self {
+            epoll,
+            events: [EpollEvent::empty(); MAX_EVENTS],
+            ready: 0,
+        })
+    }
+
+    /// Registers a file descriptor for edge-triggered read readiness.
+    ///
+    /// Closing the descriptor automatically removes it from the reactor.
+    ///
+    /// # Arguments
+    /// * `fd` - The descriptor to watch.
+    /// * `token` - The token reported when the descriptor becomes readable.
+    pub fn register<Fd: AsFd>(&self, fd: Fd, token: Token) -> Result<()> {
+        let event = EpollEvent::new(token.interest(), token.to_u64());
+        self.epoll
+            .add(fd, event)
+            .with_context(|| format!("Failed to register {:?} with epoll", token))
+    }
+
+    /// Reports a registered descriptor again by the next wait if it is still
+    /// ready.
+    ///
+    /// A handler that stopped reading before the descriptor would block, to
+    /// bound its work per wakeup, never gets another edge for the data left;
+    /// re-arming the descriptor makes epoll check its readiness anew.
+    ///
+    /// # Arguments
+    /// * `fd` - The registered descriptor.
+    /// * `token` - The token it was registered with.
+    pub fn rearm<Fd: AsFd>(&self, fd: Fd, token: Token) -> Result<()> {
+        let mut event = EpollEvent::new(token.interest(), token.to_u64());
+        self.epoll
+            .modify(fd, &mut event)
+            .with_context(|| format!("Failed to re-arm {:?} with epoll", token))
+    }
+
+    /// Waits for events and returns how many are ready.
+    ///
+    /// An interrupted wait returns 0, so callers simply loop again.
+    ///
+    /// # Arguments
+    /// * `timeout` - How long to wait, or `None` to wait indefinitely.
+    pub fn wait(&mut self, timeout: Option<Duration>) -> Result<usize> {
+        let timeout = match timeout {
+            // Round up so short timeouts don't turn into busy loops.
+            Some(timeout) => EpollTimeout::try_from(timeout + Duration::from_micros(999))
+                .unwrap_or(EpollTimeout::MAX),
+            None => EpollTimeout::NONE,
+        };
+
+        self.ready = match self.epoll.wait(&mut self.events, timeout) {
+            Ok(n) => n,
+            Err(Errno::EINTR) => 0,
+            Err(e) => return Err(anyhow::anyhow!("epoll_wait failed: {}", e)),
+        };
+
+        Ok(self.ready)
+    }
+
+    /// Returns the token of the `index`th ready event of the last wait.
+    pub fn token(&self, index: usize) -> Token {
+        debug_assert!(index < self.ready);
+        Token::from_u64(self.events[index].data())
+    }
+}
+
+/// A self-pipe that becomes readable when one of its signals arrives.
+pub struct SignalPipe {
+    read_end: UnixStream,
+    ids: Vec<SigId>,
+}
+
+impl SignalPipe {
+    /// Installs handlers that wake the pipe for each of the given signals.
+    pub fn new(signals: &[i32]) -> Result<Self> {
+        let (read_end, write_end) = UnixStream::pair().context("Failed to create signal pipe")?;
+        read_end
+            .set_nonblocking(true)
+            .context("Failed to make signal pipe non-blocking")?;
+
+        let ids = signals
+            .iter()
+            .map(|&signal| {
+                let write_end = write_end
+                    .try_clone()
+                    .context("Failed to clone signal pipe")?;
+                signal_hook::low_level::pipe::register(signal, write_end)
+                    .with_context(|| format!("Failed to register handler for signal {}", signal))
+            })
+            .collect::<Result<Vec<SigId>>>()?;
+
+        Ok(Self { read_end, ids })
+    }
+
+    /// Drains the pipe, returning whether any signal arrived.
+    pub fn drain(&self) -> bool {
+        let mut buf = [0u8; 64];
+        let mut received = false;
+
+        loop {
+            match (&self.read_end).read(&mut buf) {
+                Ok(0) => return received,
+                Ok(_) => received = true,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(_) => return received,
+            }
+        }
+    }
+}
+
+impl AsFd for SignalPipe {
+    fn as_fd(&self) -> BorrowedFd<'_> {
+        self.read_end.as_fd()
+    }
+}
+
+impl Drop for SignalPipe {
+    fn drop(&mut self) {
+        for &id in &self.ids {
+            signal_hook::low_level::unregister(id);
+        }
+    }
+}
+
+/// A shutdown request that can be raised from any thread.
+///
+/// The eventfd wakes the reactor, so shutdown does not depend on a system call
+/// happening to be interrupted.
+pub struct Shutdown {
+    requested: AtomicBool,
+    waker: EventFd,
+}
+
+impl Shutdown {
+    /// Creates a shutdown handle that has not been requested yet.
+    pub fn new() -> Result<Self> {
+        let waker = EventFd::from_flags(EfdFlags::EFD_CLOEXEC | EfdFlags::EFD_NONBLOCK)
+            .context("Failed to create shutdown eventfd")?;
+
+        Ok(Self {
+            requested: AtomicBool::new(false),
+            waker,
+        })
+    }
+
+    /// Requests shutdown and wakes the reactor.
+    pub fn request(&self) {
+        self.requested.store(true, Ordering::SeqCst);
+        let _ = self.waker.write(1);
+    }
+
+    /// Returns whether shutdown has been requested.
+    pub fn is_requested(&self) -> bool {
+        self.requested.load(Ordering::SeqCst)
+    }
+}
+
+impl AsFd for Shutdown {
+    fn as_fd(&self) -> BorrowedFd<'_> {
+        self.waker.as_fd()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use signal_hook::consts::SIGUSR2;
+    use std::sync::Arc;
+    use std::thread;
+
+    #[test]
+    fn token_should_round_trip_through_u64() {
+        for token in [
+            Token::Input,
+            Token::Signal,
+            Token::Config,
+            Token::Shutdown,
+            Token::StatsSignal,
+            Token::StatsSocket,
+            Token::Hotplug,
+            Token::Child(42),
+            Token::Device(7),
+            Token::Control,
+            Token::ControlClient(9),
+            Token::Output(11),
+            Token::Session,
+        ] {
+            assert_eq!(Token::from_u64(token.to_u64()), token);
+        }
+    }
+
+    #[test]
+    fn wait_should_time_out_without_events() {
+        let mut reactor = Reactor::new().expect("Failed to create reactor");
+        let ready = reactor.wait(Some(Duration::from_millis(1))).unwrap();
+        assert_eq!(ready, 0);
+    }
+
+    #[test]
+    fn rearm_should_report_undrained_source_again() {
+        use std::io::Write;
+
+        let mut reactor = Reactor::new().unwrap();
+        let (read, mut write) = UnixStream::pair().unwrap();
+        reactor.register(&read, Token::Output(3)).unwrap();
+        write.write_all(b"data").unwrap();
+
+        assert_eq!(reactor.wait(Some(Duration::from_secs(5))).unwrap(), 1);
+        // The data was left unread, so there is no new edge...
+        assert_eq!(reactor.wait(Some(Duration::from_millis(1))).unwrap(), 0);
+
+        // ...until the source is re-armed.
+        reactor.rearm(&read, Token::Output(3)).unwrap();
+        assert_eq!(reactor.wait(Some(Duration::from_secs(5))).unwrap(), 1);
+        assert_eq!(reactor.token(0), Token::Output(3));
+    }
+
+    #[test]
+    fn shutdown_should_wake_reactor_from_another_thread() {
+        let mut reactor = Reactor::new().unwrap();
+        let shutdown = Arc::new(Shutdown::new().unwrap());
+        reactor.register(&*shutdown, Token::Shutdown).unwrap();
+
+        let remote = shutdown.clone();
+        let handle = thread::spawn(move || remote.request());
+
+        let ready = reactor.wait(Some(Duration::from_secs(5))).unwrap();
+        handle.join().unwrap();
+
+        assert_eq!(ready, 1);
+        assert_eq!(reactor.token(0), Token::Shutdown);
+        assert!(shutdown.is_requested());
+    }
+
+    #[test]
+    fn signal_pipe_should_report_raised_signal() {
+        let mut reactor = Reactor::new().unwrap();
+        let signals = SignalPipe::new(&[SIGUSR2]).unwrap();
+        reactor.register(&signals, Token::Signal).unwrap();
+
+        signal_hook::low_level::raise(SIGUSR2).unwrap();
+
+        let ready = reactor.wait(Some(Duration::from_secs(5))).unwrap();
+        assert_eq!(ready, 1);
+        assert_eq!(reactor.token(0), Token::Signal);
+        assert!(signals.drain());
+        assert!(!signals.drain(), "Pipe should be empty after draining");
+    }
+}
@@ -0,0 +1,281 @@
+//! Provides event-loop driven reaping of spawned children.
+//!
+//! Every direct child gets a pidfd (`pidfd_open(2)`), which becomes readable
+//! once the child exits. New pidfds are registered with the event loop's
+//! [`Reactor`] and ready ones are handed back to the [`Reaper`], so reaping costs
+//! O(exited children), needs no extra thread, and a long-running child can
+//! never hold up the collection of short-lived ones.
+//!
+//! On kernels without pidfd support (before 5.3) children fall back to a
+//! non-blocking `waitpid` sweep on every event loop wakeup.
+use crate::reactor::{Reactor, Token};
+use anyhow::Result;
+use log::{debug, warn};
+use nix::sys::wait::{waitpid, WaitPidFlag, WaitStatus};
+use nix::unistd::Pid;
+use std::collections::HashMap;
+use std::io;
+use std::os::fd::{AsFd, AsRawFd, BorrowedFd, FromRawFd, OwnedFd, RawFd};
+
+/// Tracks spawned children until they have been reaped.
+#[derive(Debug, Default)]
+pub struct Reaper {
+    children: HashMap<RawFd, (Pid, OwnedFd)>,
+    unregistered: Vec<RawFd>,
+    untracked: Vec<Pid>,
+    exited: Vec<Pid>,
+}
+
+impl Reaper {
+    /// Creates an empty reaper.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Starts tracking a newly spawned child.
+    ///
+    /// # Arguments
+    /// * `pid` - The PID of a direct child of this process.
+    pub fn track(&mut self, pid: Pid) {
+        match Self::pidfd_open(pid) {
+            Ok(pidfd) => {
+                self.unregistered.push(pidfd.as_raw_fd());
+                self.children.insert(pidfd.as_raw_fd(), (pid, pidfd));
+            }
+            Err(e) => {
+                debug!("pidfd_open({}) failed, falling back to waitpid: {}", pid, e);
+                self.untracked.push(pid);
+            }
+        }
+    }
+
+    /// Registers the pidfds of children tracked since the last call.
+    ///
+    /// A pidfd leaves the reactor by itself once its child is reaped and the
+    /// descriptor is closed.
+    ///
+    /// # Arguments
+    /// * `reactor` - The event loop to register with.
+    pub fn register_new(&mut self, reactor: &Reactor) -> Result<()> {
+        for fd in self.unregistered.drain(..) {
+            if let Some((_, pidfd)) = self.children.get(&fd) {
+                reactor.register(pidfd, Token::Child(fd))?;
+            }
+        }
+        Ok(())
+    }
+
+    /// Returns the pidfds of all tracked children.
+    pub fn pidfds(&self) -> impl Iterator<Item = BorrowedFd<'_>> {
+        self.children.values().map(|(_, pidfd)| pidfd.as_fd())
+    }
+
+    /// Reaps the child behind a pidfd that has become readable.
+    ///
+    /// # Returns
+    /// `true` if the descriptor belonged to a tracked child.
+    pub fn reap_pidfd(&mut self, fd: RawFd) -> bool {
+        let Some((pid, pidfd)) = self.children.remove(&fd) else {
+            return false;
+        };
+
+        match waitpid(pid, Some(WaitPidFlag::WNOHANG)) {
+            Ok(WaitStatus::StillAlive) => {
+                // Spurious wakeup; keep waiting for this child.
+                self.children.insert(fd, (pid, pidfd));
+            }
+            Ok(status) => {
+                debug!("Reaped child {}: {:?}", pid, status);
+                self.exited.push(pid);
+            }
+            Err(e) => {
+                warn!("Failed to reap child {}: {}", pid, e);
+                self.exited.push(pid);
+            }
+        }
+
+        true
+    }
+
+    /// Reaps exited children that could not get a pidfd.
+    pub fn reap_untracked(&mut self) {
+        let exited = &mut self.exited;
+        self.untracked.retain(|&pid| {
+            let alive = matches!(
+                waitpid(pid, Some(WaitPidFlag::WNOHANG)),
+                Ok(WaitStatus::StillAlive)
+            );
+            if !alive {
+                exited.push(pid);
+            }
+            alive
+        });
+    }
+
+    /// Reaps every exited child without waiting for its pidfd to be polled.
+    ///
+    /// This is for callers that drive the client without an event loop, such
+    /// as benchmarks.
+    pub fn reap_exited(&mut self) {
+        let exited = &mut self.exited;
+        self.children.retain(|_, (pid, _)| {
+            let alive = matches!(
+                waitpid(*pid, Some(WaitPidFlag::WNOHANG)),
+                Ok(WaitStatus::StillAlive)
+            );
+            if !alive {
+                exited.push(*pid);
+            }
+            alive
+        });
+        // Without an event loop the reaped pidfds are never registered.
+        let children = &self.children;
+        self.unregistered.retain(|fd| children.contains_key(fd));
+        self.reap_untracked();
+    }
+
+    /// Takes the PIDs of the children reaped since the last call.
+    pub fn take_exited(&mut self) -> impl Iterator<Item = Pid> + '_ {
+        self.exited.drain(..)
+    }
+
+    /// Returns the number of children that have not been reaped yet.
+    pub fn len(&self) -> usize {
+        self.children.len() + self.untracked.len()
+    }
+
+    /// Returns whether every child has been reaped.
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    fn pidfd_open(pid: Pid) -> io::Result<OwnedFd> {
+        // SAFETY: pidfd_open(2) takes a pid and flags by value and touches no
+        // memory of ours.
+        let fd = unsafe { libc::syscall(libc::SYS_pidfd_open, pid.as_raw(), libc::PIDFD_NONBLOCK) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        // SAFETY: pidfd_open returned a fresh descriptor that we now own.
+        Ok(unsafe { OwnedFd::from_raw_fd(fd as RawFd) })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use nix::poll::{poll, PollFd, PollFlags, PollTimeout};
+    use std::process::Command;
+    use std::time::Duration;
+
+    fn spawn_child(program: &str) -> Pid {
+        let child = Command::new(program)
+            .spawn()
+            .expect("Failed to spawn child");
+        Pid::from_raw(child.id() as i32)
+    }
+
+    #[test]
+    fn reap_pidfd_should_collect_exited_child() {
+        let mut reaper = Reaper::new();
+        reaper.track(spawn_child("/bin/true"));
+        assert_eq!(reaper.len(), 1);
+
+        // Wait for the child to exit, then reap whatever became ready.
+        while !reaper.is_empty() {
+            let ready: Vec<RawFd> = {
+                let mut fds: Vec<PollFd> = reaper
+                    .pidfds()
+                    .map(|fd| PollFd::new(fd, PollFlags::POLLIN))
+                    .collect();
+                if fds.is_empty() {
+                    reaper.reap_untracked();
+                    continue;
+                }
+                poll(&mut fds, PollTimeout::from(1000u16)).expect("poll failed");
+                fds.iter()
+                    .filter(|fd| fd.any().unwrap_or(false))
+                    .map(|fd| fd.as_fd().as_raw_fd())
+                    .collect()
+            };
+
+            for fd in ready {
+                assert!(reaper.reap_pidfd(fd));
+            }
+        }
+    }
+
+    #[test]
+    fn register_new_should_report_exit_through_reactor() {
+        let mut reactor = Reactor::new().unwrap();
+        let mut reaper = Reaper::new();
+        reaper.track(spawn_child("/bin/true"));
+        reaper.register_new(&reactor).unwrap();
+
+        while !reaper.is_empty() {
+            reaper.reap_untracked();
+            let ready = reactor.wait(Some(Duration::from_millis(100))).unwrap();
+            for i in 0..ready {
+                if let Token::Child(fd) = reactor.token(i) {
+                    assert!(reaper.reap_pidfd(fd));
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn reap_exited_should_collect_without_polling() {
+        let mut reaper = Reaper::new();
+        let pid = spawn_child("/bin/true");
+        reaper.track(pid);
+
+        let deadline = std::time::Instant::now() + Duration::from_secs(5);
+        while !reaper.is_empty() && std::time::Instant::now() < deadline {
+            reaper.reap_exited();
+            std::thread::sleep(Duration::from_millis(1));
+        }
+        assert!(reaper.is_empty());
+        assert_eq!(reaper.take_exited().collect::<Vec<_>>(), vec![pid]);
+        assert_eq!(reaper.take_exited().count(), 0);
+    }
+
+    #[test]
+    fn reap_pidfd_should_ignore_unknown_fd() {
+        let mut reaper = Reaper::new();
+        assert!(!reaper.reap_pidfd(-1));
+    }
+
+    #[test]
+    fn long_running_child_should_not_block_others() {
+        let mut reaper = Reaper::new();
+        let sleeper = Command::new("/bin/sleep").arg("30").spawn().unwrap();
+        let sleeper_pid = Pid::from_raw(sleeper.id() as i32);
+        reaper.track(sleeper_pid);
+        reaper.track(spawn_child("/bin/true"));
+
+        // Give the short-lived child time to exit, then reap it.
+        let deadline = std::time::Instant::now() + std::time::Duration::from_secs(5);
+        while reaper.len() > 1 && std::time::Instant::now() < deadline {
+            let ready: Vec<RawFd> = {
+                let mut fds: Vec<PollFd> = reaper
+                    .pidfds()
+                    .map(|fd| PollFd::new(fd, PollFlags::POLLIN))
+                    .collect();
+                poll(&mut fds, PollTimeout::from(100u16)).expect("poll failed");
+                fds.iter()
+                    .filter(|fd| fd.any().unwrap_or(false))
+                    .map(|fd| fd.as_fd().as_raw_fd())
+                    .collect()
+            };
+            for fd in ready {
+                reaper.reap_pidfd(fd);
+            }
+            reaper.reap_untracked();
+        }
+
+        assert_eq!(reaper.len(), 1, "Only the sleeper should remain");
+
+        nix::sys::signal::kill(sleeper_pid, nix::sys::signal::Signal::SIGKILL).unwrap();
+        waitpid(sleeper_pid, None).unwrap();
+    }
+}
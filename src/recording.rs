@@ -0,0 +1,260 @@
+//! Provides recording and replay of keyboard event streams.
+//!
+//! A [`Recorder`] writes every key event the listener sees to a compact binary
+//! trace, and [`replay`] feeds a loaded trace through a [`KeyboardClient`] as
+//! fast as possible to measure throughput and per-event cost offline.
+//!
+//! # Format
+//! A trace starts with the 8-byte magic `CLEFDREC` and a version byte. Each
+//! event follows as two unsigned LEB128 varints: the microseconds since the
+//! previous event (since 0 for the first one), and the evdev keycode shifted
+//! left by one with the pressed state in the low bit. Typical typing takes
+//! four to five bytes per event.
+use crate::key_event::{KeyInput, RawKeyEvent};
+use crate::keyboard_client::KeyboardClient;
+use crate::stats;
+use anyhow::{anyhow, Context, Result};
+use input::event::keyboard::KeyState;
+use std::fs::{self, File};
+use std::io::{BufWriter, Write};
+use std::path::Path;
+use std::time::{Duration, Instant};
+
+/// Identifies a trace file.
+const MAGIC: &[u8; 8] = b"CLEFDREC";
+
+/// The current trace format version.
+const VERSION: u8 = 1;
+
+/// Writes key events to a binary trace file.
+pub struct Recorder {
+    writer: BufWriter<File>,
+    last_usec: u64,
+}
+
+impl Recorder {
+    /// Creates (or truncates) a trace file and writes its header.
+    ///
+    /// # Arguments
+    /// * `path` - Where to write the trace.
+    pub fn create(path: &Path) -> Result<Self> {
+        let file =
+            File::create(path).context(format!("Failed to create recording at {:?}", path))?;
+        let mut writer = BufWriter::new(file);
+        writer.write_all(MAGIC)?;
+        writer.write_all(&[VERSION])?;
+
+        Ok(Self {
+            writer,
+            last_usec: 0,
+        })
+    }
+
+    /// Appends a single event to the trace.
+    ///
+    /// Events that go back in time are stored with a delta of 0.
+    pub fn record<E: KeyInput>(&mut self, event: &E) -> Result<()> {
+        let time_usec = event.time_usec();
+        let delta = time_usec.saturating_sub(self.last_usec);
+        self.last_usec = self.last_usec.max(time_usec);
+
+        let pressed = matches!(event.key_state(), KeyState::Pressed) as u64;
+        let mut buf = [0u8; 20];
+        let mut len = write_varint(&mut buf, delta);
+        len += write_varint(&mut buf[len..], (u64::from(event.key()) << 1) | pressed);
+
+        self.writer
+            .write_all(&buf[..len])
+            .context("Failed to write recording")
+    }
+
+    /// Flushes all buffered events to disk.
+    pub fn finish(&mut self) -> Result<()> {
+        self.writer.flush().context("Failed to flush recording")
+    }
+}
+
+/// Loads every event of a trace file into memory.
+///
+/// # Arguments
+/// * `path` - The trace to read.
+pub fn load(path: &Path) -> Result<Vec<RawKeyEvent>> {
+    let bytes = fs::read(path).context(format!("Failed to read recording at {:?}", path))?;
+    decode(&bytes).context(format!("Invalid recording at {:?}", path))
+}
+
+/// Decodes an in-memory trace.
+///
+/// # Returns
+/// An error if the header is missing or unsupported, or the last event is
+/// truncated.
+pub fn decode(bytes: &[u8]) -> Result<Vec<RawKeyEvent>> {
+    let body = bytes
+        .strip_prefix(MAGIC.as_slice())
+        .ok_or_else(|| anyhow!("Missing recording header"))?;
+    let (&version, mut body) = body
+        .split_first()
+        .ok_or_else(|| anyhow!("Missing recording version"))?;
+    if version != VERSION {
+        return Err(anyhow!("Unsupported recording version {}", version));
+    }
+
+    let mut events = Vec::new();
+    let mut time_usec: u64 = 0;
+
+    while !body.is_empty() {
+        let offset = bytes.len() - body.len();
+        let (delta, rest) =
+            read_varint(body).ok_or_else(|| anyhow!("Truncated event at byte {}", offset))?;
+        let (code, rest) =
+            read_varint(rest).ok_or_else(|| anyhow!("Truncated event at byte {}", offset))?;
+        body = rest;
+
+        time_usec = time_usec.saturating_add(delta);
+        let key = u32::try_from(code >> 1)
+            .map_err(|_| anyhow!("Keycode out of range at byte {}", offset))?;
+        events.push(if code & 1 == 1 {
+            RawKeyEvent::pressed(time_usec, key)
+        } else {
+            RawKeyEvent::released(time_usec, key)
+        });
+    }
+
+    Ok(events)
+}
+
+/// Throughput of a replayed trace.
+#[derive(Debug, Clone, Copy)]
+pub struct ReplayReport {
+    /// Number of events fed through the client.
+    pub events: usize,
+    /// Wall time spent handling them.
+    pub elapsed: Duration,
+}
+
+impl ReplayReport {
+    /// Returns the number of events handled per second.
+    pub fn events_per_sec(&self) -> f64 {
+        self.events as f64 / self.elapsed.as_secs_f64().max(f64::MIN_POSITIVE)
+    }
+
+    /// Returns the mean wall time spent per event.
+    pub fn per_event(&self) -> Duration {
+        self.elapsed
+            .checked_div(self.events.max(1) as u32)
+            .unwrap_or_default()
+    }
+}
+
+/// Feeds a trace through the client's event handler as fast as possible.
+///
+/// Each event is restamped with the current time as it is fed in, so the
+/// client's latency histograms measure the handler's own cost rather than the
+/// age of the trace. Bound commands are spawned as usual, so replay against a
+/// config whose commands are harmless. Handler errors are counted by the
+/// client's stats and do not stop the replay.
+///
+/// # Arguments
+/// * `client` - The client to drive.
+/// * `events` - The events to replay, usually from [`load`].
+pub fn replay(client: &mut KeyboardClient, events: &[RawKeyEvent]) -> ReplayReport {
+    let start = Instant::now();
+
+    for event in events {
+        let event = RawKeyEvent {
+            time_usec: stats::monotonic_usec(),
+            ..*event
+        };
+        let _ = client.keyboard_event_handler(&event);
+    }
+
+    ReplayReport {
+        events: events.len(),
+        elapsed: start.elapsed(),
+    }
+}
+
+/// Encodes `value` as an unsigned LEB128 varint, returning its length.
+fn write_varint(buf: &mut [u8], mut value: u64) -> usize {
+    let mut len = 0;
+    loop {
+        let byte = (value & 0x7f) as u8;
+        value >>= 7;
+        if value == 0 {
+            buf[len] = byte;
+            return len + 1;
+        }
+        buf[len] = byte | 0x80;
+        len += 1;
+    }
+}
+
+/// Decodes an unsigned LEB128 varint, returning it and the remaining bytes.
+fn read_varint(bytes: &[u8]) -> Option<(u64, &[u8])> {
+    let mut value: u64 = 0;
+
+    for (i, &byte) in bytes.iter().enumerate().take(10) {
+        value |= u64::from(byte & 0x7f) << (7 * i);
+        if byte & 0x80 == 0 {
+            return Some((value, &bytes[i + 1..]));
+        }
+    }
+
+    None
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn varint_should_round_trip() {
+        for value in [0, 1, 127, 128, 300, 1 << 35, u64::MAX] {
+            let mut buf = [0u8; 10];
+            let len = write_varint(&mut buf, value);
+            let (decoded, rest) = read_varint(&buf[..len]).unwrap();
+            assert_eq!(decoded, value);
+            assert!(rest.is_empty());
+        }
+    }
+
+    #[test]
+    fn recorder_should_round_trip_events() {
+        let events = vec![
+            RawKeyEvent::pressed(1_000_000, 29),
+            RawKeyEvent::pressed(1_080_000, 45),
+            RawKeyEvent::released(1_150_000, 45),
+            RawKeyEvent::released(1_200_000, 29),
+        ];
+
+        let file = tempfile::NamedTempFile::new().unwrap();
+        let mut recorder = Recorder::create(file.path()).unwrap();
+        for event in &events {
+            recorder.record(event).unwrap();
+        }
+        recorder.finish().unwrap();
+
+        assert_eq!(load(file.path()).unwrap(), events);
+
+        // Header plus roughly four bytes per event after the first.
+        let size = fs::metadata(file.path()).unwrap().len();
+        assert!(size <= 9 + 5 + 3 * 5, "Trace too large: {} bytes", size);
+    }
+
+    #[test]
+    fn decode_should_fail_with_bad_header() {
+        assert!(decode(b"NOTATRACE").is_err());
+        let mut wrong_version = MAGIC.to_vec();
+        wrong_version.push(VERSION + 1);
+        assert!(decode(&wrong_version).is_err());
+    }
+
+    #[test]
+    fn decode_should_fail_with_truncated_event() {
+        let mut bytes = MAGIC.to_vec();
+        bytes.push(VERSION);
+        bytes.extend_from_slice(&[0x80]);
+        let err = decode(&bytes).unwrap_err();
+        assert!(err.to_string().contains("Truncated event at byte 9"));
+    }
+}
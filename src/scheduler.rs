@@ -0,0 +1,430 @@
+//! Provides the job scheduler between chord matches and spawns.
+//!
+//! A held key or a bouncing switch can match the same chord many times a
+//! second. Every matched action is therefore submitted to a [`Scheduler`]
+//! first, which applies the binding's [`JobPolicy`] and a limit on the
+//! children in flight. Every seat's event loop has a scheduler of its own, so
+//! `--max-jobs` limits the children of each seat:
+//!
+//! - [`Concurrency::Single`] drops triggers while an instance is running.
+//! - [`Concurrency::Coalesce`] folds every trigger that arrives while an
+//!   instance is running into one more run after it exits.
+//! - A rate limit drops triggers beyond a number of starts per time window.
+//!   A trigger counts as a start once it is admitted, whether it starts
+//!   right away or waits in the queue.
+//! - Triggers that find every slot taken wait in a per-binding queue of
+//!   bounded depth, and are started in order as children exit.
+//!
+//! Anything beyond the bounds is dropped, so a spawn storm fills a small
+//! queue instead of the process table. Built-in actions never occupy a slot,
+//! and children of the launcher are not tracked, so only rate limits apply to
+//! them.
+use crate::action::Action;
+use nix::unistd::Pid;
+use std::collections::{HashMap, VecDeque};
+use std::num::NonZeroU32;
+use std::sync::Arc;
+use std::time::Duration;
+
+/// How many children may run at once unless configured otherwise.
+pub const DEFAULT_MAX_JOBS: usize = 32;
+
+/// How many triggers of a binding may wait for a slot unless configured
+/// otherwise.
+pub const DEFAULT_QUEUE_DEPTH: u32 = 4;
+
+/// Whether a binding may run while an earlier instance is still running.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq, Hash)]
+pub enum Concurrency {
+    /// Every trigger starts a new instance.
+    #[default]
+    Unlimited,
+    /// Triggers are dropped while an instance is running.
+    Single,
+    /// Triggers while an instance is running collapse into a single rerun.
+    Coalesce,
+}
+
+/// A limit on how often a binding starts.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct Rate {
+    /// The most starts per window.
+    pub starts: NonZeroU32,
+    /// The length of a window.
+    pub per: Duration,
+}
+
+/// How the scheduler treats the triggers of one binding.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct JobPolicy {
+    /// Whether instances may overlap.
+    pub concurrency: Concurrency,
+    /// How often the binding may start, if limited.
+    pub rate: Option<Rate>,
+    /// How many triggers may wait while every slot is taken.
+    pub queue: u32,
+    /// Whether the output of each run is captured rather than discarded.
+    pub capture: bool,
+}
+
+impl Default for JobPolicy {
+    fn default() -> Self {
+        Self {
+            concurrency: Concurrency::Unlimited,
+            rate: None,
+            queue: DEFAULT_QUEUE_DEPTH,
+            capture: false,
+        }
+    }
+}
+
+/// What the scheduler decided for a trigger.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Admission {
+    /// The action should be started now.
+    Run,
+    /// The action was queued and will be returned by [`Scheduler::next_ready`].
+    Queued,
+    /// The trigger was dropped.
+    Dropped,
+}
+
+/// The scheduling state of one binding.
+#[derive(Debug)]
+struct Job {
+    /// Keeps the action, and with it the job's key, alive.
+    action: Arc<Action>,
+    running: u32,
+    queued: u32,
+    window_start_usec: u64,
+    window_starts: u32,
+}
+
+impl Job {
+    fn is_idle(&self, now_usec: u64) -> bool {
+        let window_open = self.action.policy().rate.is_some_and(|rate| {
+            now_usec.saturating_sub(self.window_start_usec) < rate.per.as_micros() as u64
+        });
+        self.running == 0 && self.queued == 0 && !window_open
+    }
+
+    /// Returns whether the rate limit allows another start, opening a new
+    /// window if the current one has passed.
+    fn may_start(&mut self, now_usec: u64) -> bool {
+        let Some(rate) = self.action.policy().rate else {
+            return true;
+        };
+        if now_usec.saturating_sub(self.window_start_usec) >= rate.per.as_micros() as u64 {
+            self.window_start_usec = now_usec;
+            self.window_starts = 0;
+        }
+        self.window_starts < rate.starts.get()
+    }
+}
+
+/// Decides when matched actions are started.
+#[derive(Debug)]
+pub struct Scheduler {
+    max_jobs: usize,
+    in_flight: usize,
+    /// Jobs by the address of their action.
+    jobs: HashMap<usize, Job>,
+    children: HashMap<Pid, usize>,
+    /// Waiting triggers in arrival order, with the time of their key event.
+    queue: VecDeque<(usize, u64)>,
+}
+
+impl Default for Scheduler {
+    fn default() -> Self {
+        Self::new(DEFAULT_MAX_JOBS)
+    }
+}
+
+impl Scheduler {
+    /// Creates a scheduler.
+    ///
+    /// # Arguments
+    /// * `max_jobs` - How many spawned children of this event loop may run at
+    ///   once.
+    pub fn new(max_jobs: usize) -> Self {
+        Self {
+            max_jobs: max_jobs.max(1),
+            in_flight: 0,
+            jobs: HashMap::new(),
+            children: HashMap::new(),
+            queue: VecDeque::new(),
+        }
+    }
+
+    /// Returns the number of tracked children still running.
+    pub fn in_flight(&self) -> usize {
+        self.in_flight
+    }
+
+    /// Returns the number of triggers waiting to be started.
+    pub fn queued(&self) -> usize {
+        self.queue.len()
+    }
+
+    /// Decides what happens to a matched action.
+    ///
+    /// # Arguments
+    /// * `action` - The action of the matched binding.
+    /// * `event_usec` - The monotonic timestamp of the key event.
+    ///
+    /// # Returns
+    /// [`Admission::Run`] if the caller should start the action now and then
+    /// report it with [`Scheduler::started`].
+    pub fn submit(&mut self, action: &Arc<Action>, event_usec: u64) -> Admission {
+        let key = Arc::as_ptr(action) as usize;
+        if !self.jobs.contains_key(&key) {
+            // Forget bindings that went quiet, e.g. replaced by a reload.
+            self.jobs.retain(|_, job| !job.is_idle(event_usec));
+        }
+        let job = self.jobs.entry(key).or_insert_with(|| Job {
+            action: Arc::clone(action),
+            running: 0,
+            queued: 0,
+            window_start_usec: event_usec,
+            window_starts: 0,
+        });
+        let policy = action.policy();
+
+        if !job.may_start(event_usec) {
+            return Admission::Dropped;
+        }
+
+        match policy.concurrency {
+            Concurrency::Single if job.running > 0 || job.queued > 0 => return Admission::Dropped,
+            Concurrency::Coalesce if job.queued > 0 => return Admission::Dropped,
+            Concurrency::Coalesce if job.running > 0 => {
+                job.window_starts += 1;
+                job.queued += 1;
+                self.queue.push_back((key, event_usec));
+                return Admission::Queued;
+            }
+            _ => {}
+        }
+
+        if action.builtin().is_none() && self.in_flight >= self.max_jobs {
+            if job.queued >= policy.queue {
+                return Admission::Dropped;
+            }
+            job.window_starts += 1;
+            job.queued += 1;
+            self.queue.push_back((key, event_usec));
+            return Admission::Queued;
+        }
+
+        job.window_starts += 1;
+        Admission::Run
+    }
+
+    /// Records that an admitted action was started.
+    ///
+    /// # Arguments
+    /// * `action` - The action that was started.
+    /// * `pid` - The child running it, or `None` if nothing is left to track
+    ///   because it failed, ran in-process or was started by the launcher.
+    pub fn started(&mut self, action: &Arc<Action>, pid: Option<Pid>) {
+        let key = Arc::as_ptr(action) as usize;
+        let Some(job) = self.jobs.get_mut(&key) else {
+            return;
+        };
+
+        match pid {
+            Some(pid) => {
+                job.running += 1;
+                self.in_flight += 1;
+                self.children.insert(pid, key);
+            }
+            None if job.running == 0 && job.queued == 0 && job.action.policy().rate.is_none() => {
+                self.jobs.remove(&key);
+            }
+            None => {}
+        }
+    }
+
+    /// Records that a child has exited, freeing its slot.
+    ///
+    /// # Arguments
+    /// * `pid` - The reaped child, which need not have been tracked.
+    pub fn finished(&mut self, pid: Pid) {
+        let Some(key) = self.children.remove(&pid) else {
+            return;
+        };
+        self.in_flight -= 1;
+        if let Some(job) = self.jobs.get_mut(&key) {
+            job.running -= 1;
+        }
+    }
+
+    /// Takes the oldest waiting trigger that may start now.
+    ///
+    /// # Returns
+    /// The action to start and the time of the key event that triggered it.
+    /// The caller reports the start with [`Scheduler::started`].
+    pub fn next_ready(&mut self) -> Option<(Arc<Action>, u64)> {
+        let slot_free = self.in_flight < self.max_jobs;
+        let index = self.queue.iter().position(|(key, _)| {
+            let job = &self.jobs[key];
+            let spawns = job.action.builtin().is_none();
+            (slot_free || !spawns)
+                && (job.action.policy().concurrency == Concurrency::Unlimited || job.running == 0)
+        })?;
+
+        let (key, event_usec) = self.queue.remove(index)?;
+        let job = self.jobs.get_mut(&key)?;
+        job.queued -= 1;
+        // Queued triggers were counted against the rate limit when they were
+        // admitted.
+        Some((Arc::clone(&job.action), event_usec))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn action(command: &str, policy: JobPolicy) -> Arc<Action> {
+        Arc::new(Action::parse(command).unwrap().with_policy(policy))
+    }
+
+    fn policy(concurrency: Concurrency) -> JobPolicy {
+        JobPolicy {
+            concurrency,
+            ..JobPolicy::default()
+        }
+    }
+
+    /// Submits and, if admitted, starts the action as the given child.
+    fn trigger(scheduler: &mut Scheduler, action: &Arc<Action>, pid: i32) -> Admission {
+        let admission = scheduler.submit(action, 0);
+        if admission == Admission::Run {
+            scheduler.started(action, Some(Pid::from_raw(pid)));
+        }
+        admission
+    }
+
+    #[test]
+    fn submit_should_drop_single_instance_while_running() {
+        let mut scheduler = Scheduler::default();
+        let single = action("/bin/true", policy(Concurrency::Single));
+
+        assert_eq!(trigger(&mut scheduler, &single, 1), Admission::Run);
+        assert_eq!(trigger(&mut scheduler, &single, 2), Admission::Dropped);
+
+        scheduler.finished(Pid::from_raw(1));
+        assert_eq!(trigger(&mut scheduler, &single, 3), Admission::Run);
+    }
+
+    #[test]
+    fn submit_should_coalesce_triggers_into_one_rerun() {
+        let mut scheduler = Scheduler::default();
+        let coalesce = action("/bin/true", policy(Concurrency::Coalesce));
+
+        assert_eq!(trigger(&mut scheduler, &coalesce, 1), Admission::Run);
+        assert_eq!(trigger(&mut scheduler, &coalesce, 2), Admission::Queued);
+        assert_eq!(trigger(&mut scheduler, &coalesce, 3), Admission::Dropped);
+        assert_eq!(scheduler.next_ready(), None);
+
+        scheduler.finished(Pid::from_raw(1));
+        assert_eq!(
+            scheduler.next_ready().map(|(action, _)| action),
+            Some(Arc::clone(&coalesce))
+        );
+        assert_eq!(scheduler.next_ready(), None);
+    }
+
+    #[test]
+    fn submit_should_queue_up_to_depth_when_slots_are_taken() {
+        let mut scheduler = Scheduler::new(1);
+        let first = action("/bin/true", JobPolicy::default());
+        let queued = action(
+            "/bin/false",
+            JobPolicy {
+                queue: 2,
+                ..JobPolicy::default()
+            },
+        );
+
+        assert_eq!(trigger(&mut scheduler, &first, 1), Admission::Run);
+        assert_eq!(scheduler.submit(&queued, 5), Admission::Queued);
+        assert_eq!(scheduler.submit(&queued, 6), Admission::Queued);
+        assert_eq!(scheduler.submit(&queued, 7), Admission::Dropped);
+        assert_eq!(scheduler.queued(), 2);
+
+        scheduler.finished(Pid::from_raw(1));
+        let (next, event_usec) = scheduler.next_ready().unwrap();
+        assert_eq!((next, event_usec), (Arc::clone(&queued), 5));
+        scheduler.started(&queued, Some(Pid::from_raw(2)));
+        assert_eq!(scheduler.next_ready(), None);
+        assert_eq!(scheduler.in_flight(), 1);
+    }
+
+    #[test]
+    fn submit_should_enforce_rate_limits() {
+        let mut scheduler = Scheduler::default();
+        let limited = action(
+            "/bin/true",
+            JobPolicy {
+                rate: Some(Rate {
+                    starts: NonZeroU32::new(2).unwrap(),
+                    per: Duration::from_secs(1),
+                }),
+                ..JobPolicy::default()
+            },
+        );
+        let mut submit = |usec| {
+            let admission = scheduler.submit(&limited, usec);
+            scheduler.started(&limited, None);
+            admission
+        };
+
+        assert_eq!(submit(0), Admission::Run);
+        assert_eq!(submit(100), Admission::Run);
+        assert_eq!(submit(200), Admission::Dropped);
+        assert_eq!(submit(1_000_000), Admission::Run);
+    }
+
+    #[test]
+    fn submit_should_count_queued_triggers_against_rate_limits() {
+        let mut scheduler = Scheduler::new(1);
+        let blocker = action("/bin/sleep 1", JobPolicy::default());
+        let limited = action(
+            "/bin/true",
+            JobPolicy {
+                rate: Some(Rate {
+                    starts: NonZeroU32::new(1).unwrap(),
+                    per: Duration::from_secs(60),
+                }),
+                queue: 4,
+                ..JobPolicy::default()
+            },
+        );
+
+        assert_eq!(trigger(&mut scheduler, &blocker, 1), Admission::Run);
+        assert_eq!(scheduler.submit(&limited, 100), Admission::Queued);
+        for usec in 200..205 {
+            assert_eq!(scheduler.submit(&limited, usec), Admission::Dropped);
+        }
+
+        scheduler.finished(Pid::from_raw(1));
+        assert_eq!(scheduler.next_ready(), Some((Arc::clone(&limited), 100)));
+        scheduler.started(&limited, Some(Pid::from_raw(2)));
+        assert_eq!(scheduler.next_ready(), None);
+        scheduler.finished(Pid::from_raw(2));
+        assert_eq!(scheduler.submit(&limited, 400), Admission::Dropped);
+        assert_eq!(scheduler.submit(&limited, 60_000_100), Admission::Run);
+    }
+
+    #[test]
+    fn submit_should_not_limit_builtins() {
+        let mut scheduler = Scheduler::new(1);
+        let child = action("/bin/true", JobPolicy::default());
+        let builtin = action("@socket /run/app.sock toggle", JobPolicy::default());
+
+        assert_eq!(trigger(&mut scheduler, &child, 1), Admission::Run);
+        assert_eq!(scheduler.submit(&builtin, 0), Admission::Run);
+    }
+}
@@ -0,0 +1,213 @@
+//! Provides tracking of whether the user's session is active on a seat.
+//!
+//! While the user has switched to another VT or another user's session, or a
+//! greeter session has taken over the seat, key presses on it are not meant
+//! for the user's bindings. A [`SessionWatcher`] follows the seat
+//! through the state files logind keeps under `/run/systemd/seats`, the same
+//! files `sd_seat_get_active(3)` reads: the seat is active for the daemon
+//! when its `ACTIVE_UID` is the daemon's user. logind replaces a seat file
+//! by renaming a new one into place, so an inotify watch on the directory
+//! reports every change without polling or a D-Bus connection.
+//!
+//! Without logind, or for a seat logind does not manage, the seat is
+//! always considered active.
+//!
+//! A lock screen drawn inside the user's own session, as GNOME and KDE do,
+//! leaves `ACTIVE_UID` unchanged, so the seat stays active while the screen
+//! is locked. logind only publishes that state as the session's `LockedHint`
+//! property over D-Bus, not in its state files.
+use anyhow::{Context, Result};
+use log::{debug, error, info};
+use nix::errno::Errno;
+use nix::sys::inotify::{AddWatchFlags, InitFlags, Inotify};
+use std::fs;
+use std::os::fd::{AsFd, BorrowedFd};
+use std::path::{Path, PathBuf};
+
+/// Where logind keeps the state files of its seats.
+pub const SEATS_DIR: &str = "/run/systemd/seats";
+
+/// Follows whether a seat's active session belongs to one user.
+pub struct SessionWatcher {
+    inotify: Inotify,
+    seat_file: PathBuf,
+    uid: u32,
+    active: bool,
+}
+
+impl SessionWatcher {
+    /// Starts following a seat for the daemon's own user.
+    ///
+    /// # Arguments
+    /// * `seat` - The seat name, e.g. `seat0`.
+    ///
+    /// # Returns
+    /// `None` if logind is not running or the daemon runs as root, which
+    /// serves whoever uses the seat.
+    pub fn for_seat(seat: &str) -> Result<Option<Self>> {
+        // SAFETY: getuid(2) cannot fail.
+        let uid = unsafe { libc::getuid() };
+        if uid == 0 {
+            debug!("Running as root, not following sessions on {}", seat);
+            return Ok(None);
+        }
+        if !Path::new(SEATS_DIR).is_dir() {
+            debug!("logind is not running, not following sessions on {}", seat);
+            return Ok(None);
+        }
+        Self::new(Path::new(SEATS_DIR), seat, uid).map(Some)
+    }
+
+    /// Starts following a seat whose state file lives in `seats_dir`.
+    ///
+    /// # Arguments
+    /// * `seats_dir` - The directory of the seat state files.
+    /// * `seat` - The seat name.
+    /// * `uid` - The user whose session must be active.
+    pub fn new(seats_dir: &Path, seat: &str, uid: u32) -> Result<Self> {
+        let inotify = Inotify::init(InitFlags::IN_NONBLOCK | InitFlags::IN_CLOEXEC)
+            .context("Failed to create inotify instance")?;
+        inotify
+            .add_watch(
+                seats_dir,
+                AddWatchFlags::IN_CLOSE_WRITE
+                    | AddWatchFlags::IN_MOVED_TO
+                    | AddWatchFlags::IN_DELETE,
+            )
+            .context(format!("Failed to watch seats in {:?}", seats_dir))?;
+
+        let seat_file = seats_dir.join(seat);
+        let active = seat_active(&seat_file, uid);
+        info!(
+            "Following sessions on {}, currently {}",
+            seat,
+            if active { "active" } else { "inactive" }
+        );
+
+        Ok(Self {
+            inotify,
+            seat_file,
+            uid,
+            active,
+        })
+    }
+
+    /// Returns whether the user's session is the seat's active one.
+    pub fn is_active(&self) -> bool {
+        self.active
+    }
+
+    /// Drains all pending inotify events and reads the seat's state again
+    /// if it changed.
+    ///
+    /// # Returns
+    /// `true` if the seat became active or inactive.
+    pub fn handle_events(&mut self) -> bool {
+        let mut changed = false;
+        loop {
+            match self.inotify.read_events() {
+                Ok(events) => {
+                    changed |= events.iter().any(|event| {
+                        event.mask.contains(AddWatchFlags::IN_Q_OVERFLOW)
+                            || event.name.as_deref() == self.seat_file.file_name()
+                    });
+                }
+                Err(Errno::EAGAIN) => break,
+                Err(Errno::EINTR) => continue,
+                Err(e) => {
+                    error!("Session watch error: {}", e);
+                    break;
+                }
+            }
+        }
+        if !changed {
+            return false;
+        }
+
+        let active = seat_active(&self.seat_file, self.uid);
+        if active == self.active {
+            return false;
+        }
+        self.active = active;
+        true
+    }
+}
+
+impl AsFd for SessionWatcher {
+    fn as_fd(&self) -> BorrowedFd<'_> {
+        self.inotify.as_fd()
+    }
+}
+
+/// Reads whether a seat's active session belongs to a user.
+///
+/// A missing seat file means logind does not manage the seat, which is then
+/// always active.
+fn seat_active(seat_file: &Path, uid: u32) -> bool {
+    let content = match fs::read_to_string(seat_file) {
+        Ok(content) => content,
+        Err(e) => {
+            debug!("Failed to read seat state {:?}: {}", seat_file, e);
+            return true;
+        }
+    };
+
+    content
+        .lines()
+        .find_map(|line| line.strip_prefix("ACTIVE_UID="))
+        .and_then(|active_uid| active_uid.trim().parse::<u32>().ok())
+        == Some(uid)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Replaces a seat file the way logind does, by renaming a new one over
+    /// it.
+    fn write_seat(dir: &Path, active_uid: Option<u32>) {
+        let mut content = String::from("# This is private data. Do not parse.\nIS_SEAT0=1\n");
+        if let Some(uid) = active_uid {
+            content.push_str(&format!("ACTIVE=3\nACTIVE_UID={}\n", uid));
+        }
+        fs::write(dir.join(".#seat0tmp"), content).unwrap();
+        fs::rename(dir.join(".#seat0tmp"), dir.join("seat0")).unwrap();
+    }
+
+    #[test]
+    fn seat_active_should_match_active_uid() {
+        let dir = tempfile::tempdir().unwrap();
+        assert!(seat_active(&dir.path().join("seat0"), 1000));
+
+        write_seat(dir.path(), Some(1000));
+        assert!(seat_active(&dir.path().join("seat0"), 1000));
+        assert!(!seat_active(&dir.path().join("seat0"), 1001));
+
+        write_seat(dir.path(), None);
+        assert!(!seat_active(&dir.path().join("seat0"), 1000));
+    }
+
+    #[test]
+    fn handle_events_should_report_activity_changes() {
+        let dir = tempfile::tempdir().unwrap();
+        write_seat(dir.path(), Some(1000));
+        let mut watcher = SessionWatcher::new(dir.path(), "seat0", 1000).unwrap();
+        assert!(watcher.is_active());
+        assert!(!watcher.handle_events());
+
+        // A VT switch to another user's session.
+        write_seat(dir.path(), Some(1001));
+        assert!(watcher.handle_events());
+        assert!(!watcher.is_active());
+
+        // Other seats and unchanged activity are not reported.
+        fs::write(dir.path().join("seat1"), "ACTIVE_UID=1000\n").unwrap();
+        write_seat(dir.path(), Some(1002));
+        assert!(!watcher.handle_events());
+        assert!(!watcher.is_active());
+
+        write_seat(dir.path(), Some(1000));
+        assert!(watcher.handle_events());
+        assert!(watcher.is_active());
+    }
+}
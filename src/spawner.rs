@@ -0,0 +1,729 @@
+//! Provides the low-latency process spawning engine used to run actions.
+//!
+//! `std::process::Command::spawn` forks the whole daemon, so its cost grows
+//! with the daemon's address space. The [`Spawner`] instead uses
+//! `posix_spawn`, which glibc implements with `clone(CLONE_VM | CLONE_VFORK)`:
+//! no page tables are copied and the parent resumes right after the child has
+//! exec'd. Programs are exec'd by the path resolved when the config was
+//! loaded; only programs that were not found in PATH then are searched for
+//! with `posix_spawnp`. The spawn attributes (output redirected to
+//! `/dev/null`, default `SIGPIPE`/`SIGCHLD` dispositions, empty signal mask)
+//! are built once up front, and argv pointers live on the stack, so a spawn
+//! does no heap work. Only actions whose output is captured get a pipe and
+//! file actions of their own.
+//!
+//! Optionally, commands can be handed to a [`Launcher`]: a tiny helper
+//! process forked once at startup that receives argv over a `SOCK_SEQPACKET`
+//! socket and spawns it immediately. With the launcher enabled the daemon
+//! itself never forks, and the launcher reaps its own children.
+use crate::action::{Action, MAX_ARGV};
+use crate::latency::CpuMask;
+use anyhow::{anyhow, Context, Result};
+use log::{debug, info, warn};
+use nix::unistd::Pid;
+use std::fs::OpenOptions;
+use std::io;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::os::raw::c_char;
+use std::ptr;
+
+extern "C" {
+    static environ: *const *mut c_char;
+}
+
+/// Largest launcher request, i.e. the exec path and packed argv of a single
+/// action.
+const LAUNCHER_MSG_MAX: usize = 64 * 1024;
+
+/// Prebuilt `posix_spawn` file actions and attributes.
+struct SpawnAttrs {
+    file_actions: libc::posix_spawn_file_actions_t,
+    attr: libc::posix_spawnattr_t,
+}
+
+// SAFETY: The attribute objects are only ever read by posix_spawn(3) after
+// construction, and their heap buffers are owned by this struct alone.
+unsafe impl Send for SpawnAttrs {}
+
+impl SpawnAttrs {
+    /// Builds attributes that send stdout/stderr to `devnull` and give the
+    /// child default signal handling.
+    fn new(devnull: RawFd) -> io::Result<Box<Self>> {
+        // Boxed so the objects never move once initialized.
+        let mut attrs = Box::new(Self {
+            file_actions: unsafe { std::mem::zeroed() },
+            attr: unsafe { std::mem::zeroed() },
+        });
+
+        unsafe {
+            check(libc::posix_spawn_file_actions_init(&mut attrs.file_actions))?;
+            check(libc::posix_spawnattr_init(&mut attrs.attr))?;
+
+            check(libc::posix_spawn_file_actions_adddup2(
+                &mut attrs.file_actions,
+                devnull,
+                libc::STDOUT_FILENO,
+            ))?;
+            check(libc::posix_spawn_file_actions_adddup2(
+                &mut attrs.file_actions,
+                devnull,
+                libc::STDERR_FILENO,
+            ))?;
+
+            // Rust ignores SIGPIPE and the launcher ignores SIGCHLD; neither
+            // should leak into the programs we start.
+            let mut sigdefault: libc::sigset_t = std::mem::zeroed();
+            libc::sigemptyset(&mut sigdefault);
+            libc::sigaddset(&mut sigdefault, libc::SIGPIPE);
+            libc::sigaddset(&mut sigdefault, libc::SIGCHLD);
+            check(libc::posix_spawnattr_setsigdefault(
+                &mut attrs.attr,
+                &sigdefault,
+            ))?;
+
+            let mut sigmask: libc::sigset_t = std::mem::zeroed();
+            libc::sigemptyset(&mut sigmask);
+            check(libc::posix_spawnattr_setsigmask(&mut attrs.attr, &sigmask))?;
+
+            check(libc::posix_spawnattr_setflags(
+                &mut attrs.attr,
+                (libc::POSIX_SPAWN_SETSIGDEF | libc::POSIX_SPAWN_SETSIGMASK) as libc::c_short,
+            ))?;
+        }
+
+        Ok(attrs)
+    }
+
+    /// Spawns a NULL-terminated argv.
+    ///
+    /// # Arguments
+    /// * `exec_path` - The program to exec, or `None` to search PATH for
+    ///   `argv[0]`.
+    /// * `argv` - The NULL-terminated argv.
+    fn spawn(
+        &self,
+        exec_path: Option<*const c_char>,
+        argv: &[*mut c_char],
+    ) -> io::Result<libc::pid_t> {
+        self.spawn_with(&self.file_actions, exec_path, argv)
+    }
+
+    /// Spawns a NULL-terminated argv with its stdout and stderr sent to
+    /// `output` instead of `/dev/null`.
+    ///
+    /// The file actions name the descriptor, so they are built for this
+    /// spawn alone.
+    fn spawn_with_output(
+        &self,
+        output: RawFd,
+        exec_path: Option<*const c_char>,
+        argv: &[*mut c_char],
+    ) -> io::Result<libc::pid_t> {
+        let mut file_actions: libc::posix_spawn_file_actions_t = unsafe { std::mem::zeroed() };
+        check(unsafe { libc::posix_spawn_file_actions_init(&mut file_actions) })?;
+
+        let result = unsafe {
+            check(libc::posix_spawn_file_actions_adddup2(
+                &mut file_actions,
+                output,
+                libc::STDOUT_FILENO,
+            ))
+            .and_then(|()| {
+                check(libc::posix_spawn_file_actions_adddup2(
+                    &mut file_actions,
+                    output,
+                    libc::STDERR_FILENO,
+                ))
+            })
+        }
+        .and_then(|()| self.spawn_with(&file_actions, exec_path, argv));
+
+        unsafe { libc::posix_spawn_file_actions_destroy(&mut file_actions) };
+        result
+    }
+
+    fn spawn_with(
+        &self,
+        file_actions: &libc::posix_spawn_file_actions_t,
+        exec_path: Option<*const c_char>,
+        argv: &[*mut c_char],
+    ) -> io::Result<libc::pid_t> {
+        let mut pid = 0;
+        let ret = unsafe {
+            match exec_path {
+                Some(path) => libc::posix_spawn(
+                    &mut pid,
+                    path,
+                    file_actions,
+                    &self.attr,
+                    argv.as_ptr(),
+                    environ,
+                ),
+                None => libc::posix_spawnp(
+                    &mut pid,
+                    argv[0],
+                    file_actions,
+                    &self.attr,
+                    argv.as_ptr(),
+                    environ,
+                ),
+            }
+        };
+        check(ret).map(|_| pid)
+    }
+}
+
+impl Drop for SpawnAttrs {
+    fn drop(&mut self) {
+        unsafe {
+            libc::posix_spawn_file_actions_destroy(&mut self.file_actions);
+            libc::posix_spawnattr_destroy(&mut self.attr);
+        }
+    }
+}
+
+/// Converts a posix_spawn-style return code into an io::Result.
+fn check(ret: libc::c_int) -> io::Result<()> {
+    if ret == 0 {
+        Ok(())
+    } else {
+        Err(io::Error::from_raw_os_error(ret))
+    }
+}
+
+/// Opens `/dev/null` for the children's output.
+fn open_devnull() -> Result<OwnedFd> {
+    OpenOptions::new()
+        .write(true)
+        .open("/dev/null")
+        .map(OwnedFd::from)
+        .context("Failed to open /dev/null")
+}
+
+/// Opens a pipe for a child's output.
+///
+/// # Returns
+/// The non-blocking read end for the daemon and the blocking write end for
+/// the child; both are close-on-exec, which `dup2` clears in the child.
+fn open_output_pipe() -> Result<(OwnedFd, OwnedFd)> {
+    let mut fds = [0; 2];
+    if unsafe { libc::pipe2(fds.as_mut_ptr(), libc::O_CLOEXEC) } != 0 {
+        return Err(anyhow!(
+            "Failed to create output pipe: {}",
+            io::Error::last_os_error()
+        ));
+    }
+    // SAFETY: pipe2 returned two fresh descriptors that we now own.
+    let (read, write) = unsafe { (OwnedFd::from_raw_fd(fds[0]), OwnedFd::from_raw_fd(fds[1])) };
+
+    if unsafe { libc::fcntl(read.as_raw_fd(), libc::F_SETFL, libc::O_NONBLOCK) } != 0 {
+        return Err(anyhow!(
+            "Failed to make output pipe non-blocking: {}",
+            io::Error::last_os_error()
+        ));
+    }
+    Ok((read, write))
+}
+
+/// Closes every descriptor above stderr except the given ones.
+///
+/// Only makes async-signal-safe calls, so it can run in a forked child.
+fn close_fds_except(mut keep: [RawFd; 2]) {
+    keep.sort_unstable();
+    let mut first: libc::c_uint = 3;
+    for fd in keep.into_iter().map(|fd| fd as libc::c_uint) {
+        if fd > first {
+            close_fds(first, fd - 1);
+        }
+        first = first.max(fd + 1);
+    }
+    close_fds(first, libc::c_uint::MAX);
+}
+
+/// Closes the descriptors from `first` to `last`, inclusive.
+fn close_fds(first: libc::c_uint, last: libc::c_uint) {
+    // SAFETY: close_range(2) takes its arguments by value; closing
+    // descriptors the child does not use cannot break it.
+    if unsafe { libc::syscall(libc::SYS_close_range, first, last, 0) } == 0 {
+        return;
+    }
+    // Kernels before 5.9 have no close_range(2).
+    let open_max = unsafe { libc::sysconf(libc::_SC_OPEN_MAX) };
+    let last = last.min(open_max.max(0) as libc::c_uint);
+    for fd in first..=last {
+        unsafe { libc::close(fd as RawFd) };
+    }
+}
+
+/// A pre-forked helper process that spawns commands on the daemon's behalf.
+pub struct Launcher {
+    socket: OwnedFd,
+    pid: Pid,
+}
+
+impl Launcher {
+    /// Forks the launcher process.
+    ///
+    /// This should be called early, before the daemon grows and before other
+    /// threads are started. The child only makes libc calls on buffers that
+    /// were allocated before the fork.
+    pub fn start() -> Result<Self> {
+        let mut fds = [0; 2];
+        let ret = unsafe {
+            libc::socketpair(
+                libc::AF_UNIX,
+                libc::SOCK_SEQPACKET | libc::SOCK_CLOEXEC,
+                0,
+                fds.as_mut_ptr(),
+            )
+        };
+        if ret != 0 {
+            return Err(anyhow!(
+                "Failed to create launcher socket: {}",
+                io::Error::last_os_error()
+            ));
+        }
+        let (parent_end, child_end) =
+            unsafe { (OwnedFd::from_raw_fd(fds[0]), OwnedFd::from_raw_fd(fds[1])) };
+
+        // Everything the child needs is prepared before forking.
+        let devnull = open_devnull()?;
+        let attrs = SpawnAttrs::new(devnull.as_raw_fd())
+            .context("Failed to initialize launcher spawn attributes")?;
+        let mut buf = vec![0u8; LAUNCHER_MSG_MAX];
+
+        match unsafe { libc::fork() } {
+            -1 => Err(anyhow!(
+                "Failed to fork launcher: {}",
+                io::Error::last_os_error()
+            )),
+            0 => {
+                // Earlier launchers' sockets were inherited too, and would
+                // keep those launchers from seeing the daemon hang up.
+                drop(parent_end);
+                close_fds_except([child_end.as_raw_fd(), devnull.as_raw_fd()]);
+                Self::serve(child_end.as_raw_fd(), &attrs, &mut buf)
+            }
+            pid => {
+                drop(child_end);
+                info!("Started launcher process (PID {})", pid);
+                Ok(Self {
+                    socket: parent_end,
+                    pid: Pid::from_raw(pid),
+                })
+            }
+        }
+    }
+
+    /// Returns the PID of the launcher process.
+    pub fn pid(&self) -> Pid {
+        self.pid
+    }
+
+    /// Asks the launcher to spawn an action and waits for the child's PID.
+    fn spawn(&self, action: &Action) -> Result<Pid> {
+        let exec_path = action
+            .exec_path()
+            .map_or(&b"\0"[..], |path| path.as_bytes_with_nul());
+        let packed = action.packed_argv();
+        let mut iov = [
+            libc::iovec {
+                iov_base: exec_path.as_ptr().cast_mut().cast(),
+                iov_len: exec_path.len(),
+            },
+            libc::iovec {
+                iov_base: packed.as_ptr().cast_mut().cast(),
+                iov_len: packed.len(),
+            },
+        ];
+        // SAFETY: msghdr is plain data, valid when zeroed.
+        let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+        msg.msg_iov = iov.as_mut_ptr();
+        msg.msg_iovlen = iov.len();
+
+        // Both parts go out as one message, which the launcher reads whole.
+        let sent = unsafe { libc::sendmsg(self.socket.as_raw_fd(), &msg, libc::MSG_NOSIGNAL) };
+        if sent < 0 {
+            return Err(anyhow!(
+                "Failed to send command to launcher: {}",
+                io::Error::last_os_error()
+            ));
+        }
+
+        let mut reply: i32 = 0;
+        let received = unsafe {
+            libc::recv(
+                self.socket.as_raw_fd(),
+                (&mut reply as *mut i32).cast(),
+                std::mem::size_of::<i32>(),
+                0,
+            )
+        };
+        if received != std::mem::size_of::<i32>() as isize {
+            return Err(anyhow!("Launcher process exited unexpectedly"));
+        }
+
+        if reply < 0 {
+            return Err(io::Error::from_raw_os_error(-reply).into());
+        }
+
+        Ok(Pid::from_raw(reply))
+    }
+
+    /// The launcher's main loop. Never returns.
+    ///
+    /// Each request is the exec path, empty to search PATH, followed by the
+    /// packed argv, all as NUL-terminated strings back to back; each reply is
+    /// the child's PID, or a negated errno on failure.
+    fn serve(socket: RawFd, attrs: &SpawnAttrs, buf: &mut [u8]) -> ! {
+        unsafe {
+            // Follow the daemon down, and let the kernel reap our children.
+            libc::prctl(libc::PR_SET_PDEATHSIG, libc::SIGTERM);
+            libc::signal(libc::SIGCHLD, libc::SIG_IGN);
+        }
+
+        let mut argv: [*mut c_char; MAX_ARGV + 1] = [ptr::null_mut(); MAX_ARGV + 1];
+
+        loop {
+            let len = unsafe { libc::recv(socket, buf.as_mut_ptr().cast(), buf.len(), 0) };
+            if len <= 0 {
+                // The daemon closed its end (or the socket broke): exit.
+                unsafe { libc::_exit(0) };
+            }
+            let msg = &mut buf[..len as usize];
+            let base: *mut c_char = msg.as_mut_ptr().cast();
+
+            // Point the exec path and argv at the NUL-terminated words of
+            // the message.
+            let mut exec_path = None;
+            let mut argc = 0;
+            let mut start = 0;
+            for (i, &byte) in msg.iter().enumerate() {
+                if byte == 0 {
+                    let word = unsafe { base.add(start) };
+                    if start == 0 {
+                        exec_path = (i > 0).then_some(word.cast_const());
+                    } else if argc < MAX_ARGV {
+                        argv[argc] = word;
+                        argc += 1;
+                    }
+                    start = i + 1;
+                }
+            }
+            argv[argc] = ptr::null_mut();
+
+            let reply: i32 = if argc == 0 {
+                -libc::EINVAL
+            } else {
+                match attrs.spawn(exec_path, &argv[..=argc]) {
+                    Ok(pid) => pid,
+                    Err(e) => -e.raw_os_error().unwrap_or(libc::EIO),
+                }
+            };
+
+            unsafe {
+                libc::send(
+                    socket,
+                    (&reply as *const i32).cast(),
+                    std::mem::size_of::<i32>(),
+                    libc::MSG_NOSIGNAL,
+                );
+            }
+        }
+    }
+}
+
+/// The CPU masks of a spawning thread pinned by the latency mode.
+#[derive(Debug, Clone, Copy)]
+struct ChildAffinity {
+    /// The mask children get.
+    child: CpuMask,
+    /// The mask the thread is pinned to.
+    thread: CpuMask,
+}
+
+/// Spawns actions, either directly or through a [`Launcher`].
+pub struct Spawner {
+    attrs: Box<SpawnAttrs>,
+    launcher: Option<Launcher>,
+    affinity: Option<ChildAffinity>,
+    // Must outlive `attrs`, which refers to it by descriptor number.
+    _devnull: OwnedFd,
+}
+
+impl Spawner {
+    /// Creates a spawner that calls `posix_spawnp` from the daemon itself.
+    pub fn new() -> Result<Self> {
+        let devnull = open_devnull()?;
+        let attrs = SpawnAttrs::new(devnull.as_raw_fd())
+            .context("Failed to initialize spawn attributes")?;
+
+        Ok(Self {
+            attrs,
+            launcher: None,
+            affinity: None,
+            _devnull: devnull,
+        })
+    }
+
+    /// Creates a spawner that hands every action to a pre-forked launcher.
+    pub fn with_launcher() -> Result<Self> {
+        let launcher = Launcher::start()?;
+        let mut spawner = Self::new()?;
+        spawner.launcher = Some(launcher);
+        Ok(spawner)
+    }
+
+    /// Gives direct children a CPU mask other than the spawning thread's.
+    ///
+    /// Children inherit the affinity of the thread that spawns them when
+    /// they are cloned, so an event thread pinned by the latency mode widens
+    /// its own mask to the children's for the duration of each spawn. Moving
+    /// a child after it has exec'd would be too late for a command that
+    /// forks right away, such as `sh -c 'cmd &'`.
+    ///
+    /// Call this from the spawning thread once it has been pinned.
+    ///
+    /// # Arguments
+    /// * `cpus` - The mask for children, or `None` to let them inherit.
+    pub fn set_child_affinity(&mut self, cpus: Option<CpuMask>) -> Result<()> {
+        self.affinity = match cpus {
+            Some(child) => Some(ChildAffinity {
+                child,
+                thread: CpuMask::current()?,
+            }),
+            None => None,
+        };
+        Ok(())
+    }
+
+    /// Spawns an action.
+    ///
+    /// # Returns
+    /// `Some(pid)` for a direct child that the daemon must reap, or `None`
+    /// when the launcher owns (and reaps) the new process.
+    pub fn spawn(&self, action: &Action) -> Result<Option<Pid>> {
+        if let Some(launcher) = &self.launcher {
+            launcher.spawn(action)?;
+            return Ok(None);
+        }
+
+        self.spawn_direct(action, None).map(Some)
+    }
+
+    /// Spawns an action with its stdout and stderr sent to a new pipe.
+    ///
+    /// The launcher has no way to hand a pipe back, so with the launcher
+    /// enabled the action is spawned as usual and its output discarded.
+    ///
+    /// # Returns
+    /// The PID of a direct child and the non-blocking read end of its output
+    /// pipe, or `None` when the launcher owns the new process.
+    pub fn spawn_captured(&self, action: &Action) -> Result<Option<(Pid, OwnedFd)>> {
+        if let Some(launcher) = &self.launcher {
+            launcher.spawn(action)?;
+            return Ok(None);
+        }
+
+        // The write end is closed again once the child holds it.
+        let (read, write) = open_output_pipe()?;
+        let pid = self.spawn_direct(action, Some(write.as_raw_fd()))?;
+        Ok(Some((pid, read)))
+    }
+
+    /// Spawns an action from the daemon itself.
+    ///
+    /// # Arguments
+    /// * `action` - The action to spawn.
+    /// * `output` - Where the child's stdout and stderr go, or `None` for
+    ///   `/dev/null`.
+    fn spawn_direct(&self, action: &Action, output: Option<RawFd>) -> Result<Pid> {
+        let mut argv: [*mut c_char; MAX_ARGV + 1] = [ptr::null_mut(); MAX_ARGV + 1];
+        for (slot, arg) in argv.iter_mut().zip(action.argv()) {
+            *slot = arg.as_ptr().cast_mut();
+        }
+
+        let exec_path = action.exec_path().map(|path| path.as_ptr());
+        let argv = &argv[..=action.argv().len()];
+
+        if let Some(affinity) = &self.affinity {
+            if let Err(e) = affinity.child.apply(0) {
+                debug!("Failed to widen CPU affinity for a spawn: {}", e);
+            }
+        }
+        let pid = match output {
+            Some(output) => self.attrs.spawn_with_output(output, exec_path, argv),
+            None => self.attrs.spawn(exec_path, argv),
+        };
+        if let Some(affinity) = &self.affinity {
+            if let Err(e) = affinity.thread.apply(0) {
+                warn!("Failed to pin the event thread again: {}", e);
+            }
+        }
+        Ok(Pid::from_raw(pid?))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::latency::CpuList;
+    use crate::path_search::ProgramResolver;
+    use nix::sys::wait::{waitpid, WaitPidFlag, WaitStatus};
+    use std::thread;
+    use std::time::{Duration, Instant};
+
+    #[test]
+    fn spawn_should_run_direct_child() {
+        let spawner = Spawner::new().expect("Failed to create spawner");
+        let action = Action::parse("/bin/sh -c 'exit 3'").unwrap();
+
+        let pid = spawner
+            .spawn(&action)
+            .expect("Spawning /bin/sh should succeed")
+            .expect("Direct spawns should return the child PID");
+
+        assert_eq!(waitpid(pid, None).unwrap(), WaitStatus::Exited(pid, 3));
+    }
+
+    #[test]
+    fn spawn_should_give_children_and_grandchildren_original_affinity() {
+        let mut spawner = Spawner::new().expect("Failed to create spawner");
+        let original = CpuMask::current().unwrap();
+        let status = std::fs::read_to_string("/proc/thread-self/status").unwrap();
+        let allowed = |status: &str| {
+            status
+                .lines()
+                .find(|line| line.starts_with("Cpus_allowed_list:"))
+                .map(str::to_string)
+        };
+
+        // Pin this test's thread to a single CPU, as the latency mode does.
+        let cpu = (0..libc::CPU_SETSIZE as usize)
+            .find(|&cpu| original.contains(cpu))
+            .unwrap();
+        let pinned: CpuList = cpu.to_string().parse().unwrap();
+        pinned.mask().apply(0).unwrap();
+        spawner.set_child_affinity(Some(original)).unwrap();
+
+        // The shell forks grep, which reports its own mask.
+        let action =
+            Action::parse("/bin/sh -c 'grep Cpus_allowed_list /proc/self/status; :'").unwrap();
+        let (pid, read) = spawner.spawn_captured(&action).unwrap().unwrap();
+        assert_eq!(waitpid(pid, None).unwrap(), WaitStatus::Exited(pid, 0));
+        let mut buf = [0u8; 256];
+        let len = nix::unistd::read(&read, &mut buf).unwrap();
+        let output = String::from_utf8_lossy(&buf[..len]).into_owned();
+        assert_eq!(allowed(&output), allowed(&status));
+
+        // The spawning thread is pinned again.
+        let current = CpuMask::current().unwrap();
+        assert_eq!(format!("{:?}", current), format!("{:?}", pinned.mask()));
+        original.apply(0).unwrap();
+    }
+
+    #[test]
+    fn spawn_captured_should_pipe_stdout_and_stderr() {
+        let spawner = Spawner::new().expect("Failed to create spawner");
+        let action = Action::parse("/bin/sh -c 'echo out; echo err >&2'").unwrap();
+
+        let (pid, read) = spawner.spawn_captured(&action).unwrap().unwrap();
+        assert_eq!(waitpid(pid, None).unwrap(), WaitStatus::Exited(pid, 0));
+
+        // The child has exited, so the pipe holds all of its output.
+        let mut buf = [0u8; 64];
+        let len = nix::unistd::read(&read, &mut buf).unwrap();
+        assert_eq!(&buf[..len], b"out\nerr\n");
+        assert_eq!(nix::unistd::read(&read, &mut buf), Ok(0));
+    }
+
+    #[test]
+    fn spawn_should_fail_for_missing_program() {
+        let spawner = Spawner::new().expect("Failed to create spawner");
+        let action = Action::parse("clefd-definitely-not-a-program").unwrap();
+
+        assert!(spawner.spawn(&action).is_err());
+    }
+
+    /// Resolves a program that is only found in a directory outside PATH.
+    fn resolved_action(dir: &std::path::Path) -> Action {
+        use std::os::unix::fs::PermissionsExt;
+
+        let path = dir.join("clefd-test-program");
+        std::fs::write(&path, "#!/bin/sh\nexit 7\n").unwrap();
+        std::fs::set_permissions(&path, std::fs::Permissions::from_mode(0o755)).unwrap();
+
+        let mut resolver = ProgramResolver::with_dirs(vec![dir.to_path_buf()]);
+        Action::parse("clefd-test-program")
+            .unwrap()
+            .resolve(&mut resolver)
+    }
+
+    #[test]
+    fn spawn_should_exec_resolved_path() {
+        let dir = tempfile::tempdir().unwrap();
+        let action = resolved_action(dir.path());
+        let spawner = Spawner::new().expect("Failed to create spawner");
+
+        let pid = spawner.spawn(&action).unwrap().unwrap();
+        assert_eq!(waitpid(pid, None).unwrap(), WaitStatus::Exited(pid, 7));
+    }
+
+    #[test]
+    fn launchers_should_not_hold_each_others_sockets() {
+        let first = Spawner::with_launcher().expect("Failed to start launcher");
+        let second = Spawner::with_launcher().expect("Failed to start launcher");
+        let first_pid = first.launcher.as_ref().unwrap().pid();
+        let second_pid = second.launcher.as_ref().unwrap().pid();
+
+        // The second launcher was forked while the first one's socket was
+        // open, yet dropping the first spawner must still stop its launcher.
+        drop(first);
+        let stopped_by = Instant::now() + Duration::from_secs(5);
+        loop {
+            match waitpid(first_pid, Some(WaitPidFlag::WNOHANG)).unwrap() {
+                WaitStatus::StillAlive => {
+                    assert!(Instant::now() < stopped_by, "First launcher did not stop");
+                    thread::sleep(Duration::from_millis(10));
+                }
+                status => {
+                    assert_eq!(status, WaitStatus::Exited(first_pid, 0));
+                    break;
+                }
+            }
+        }
+        drop(second);
+        assert_eq!(
+            waitpid(second_pid, None).unwrap(),
+            WaitStatus::Exited(second_pid, 0)
+        );
+    }
+
+    #[test]
+    fn spawn_should_go_through_launcher() {
+        let spawner = Spawner::with_launcher().expect("Failed to start launcher");
+        let launcher_pid = spawner.launcher.as_ref().unwrap().pid();
+
+        let action = Action::parse("/bin/true").unwrap();
+        let result = spawner
+            .spawn(&action)
+            .expect("Launcher spawn should succeed");
+        assert!(
+            result.is_none(),
+            "Launcher children are reaped by the launcher"
+        );
+
+        let missing = Action::parse("clefd-definitely-not-a-program").unwrap();
+        assert!(spawner.spawn(&missing).is_err());
+
+        let dir = tempfile::tempdir().unwrap();
+        assert!(spawner.spawn(&resolved_action(dir.path())).is_ok());
+
+        // Dropping the spawner closes the socket, which stops the launcher.
+        drop(spawner);
+        assert!(matches!(
+            waitpid(launcher_pid, None).unwrap(),
+            WaitStatus::Exited(_, 0)
+        ));
+    }
+}
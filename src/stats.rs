@@ -0,0 +1,427 @@
+//! Provides lock-free latency histograms and counters for the event path.
+//!
+//! Every keyboard event carries the libinput timestamp of when the kernel saw
+//! it (`CLOCK_MONOTONIC`, in microseconds). The event loop measures how long it
+//! takes from that timestamp until a chord is matched and until its command has
+//! been spawned, and records the results in [`Histogram`]s held by [`Stats`].
+//!
+//! Histograms are log-linear in the style of HDR histograms: each power of two
+//! is split into [`SUB_BUCKETS`] linear buckets, so every recorded value is
+//! kept with a relative error below `1 / SUB_BUCKETS` at a fixed memory cost.
+//! Recording is a handful of relaxed atomic adds, so it never blocks the event
+//! loop, and a report can be rendered from any thread at any time.
+//!
+//! The event loop logs a [`Stats::report`] on `SIGUSR1`, and writes one to
+//! every client connecting to the optional [`StatsSocket`].
+use anyhow::{Context, Result};
+use log::{debug, warn};
+use std::fmt::Write as _;
+use std::fs;
+use std::io::{self, Write};
+use std::os::fd::{AsFd, BorrowedFd};
+use std::os::unix::net::UnixListener;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Duration;
+
+/// log2 of the number of linear sub-buckets per power of two.
+const SUB_BUCKET_BITS: u32 = 4;
+
+/// Number of linear sub-buckets per power of two.
+pub const SUB_BUCKETS: usize = 1 << SUB_BUCKET_BITS;
+
+/// Number of buckets needed to cover every `u64` value.
+const BUCKETS: usize = (64 - SUB_BUCKET_BITS as usize + 1) * SUB_BUCKETS;
+
+/// Percentiles included in a [`Stats::report`].
+const REPORT_PERCENTILES: [f64; 5] = [50.0, 90.0, 99.0, 99.9, 100.0];
+
+/// A fixed-size, lock-free log-linear histogram of `u64` values.
+pub struct Histogram {
+    buckets: Box<[AtomicU64]>,
+    count: AtomicU64,
+    sum: AtomicU64,
+    max: AtomicU64,
+}
+
+impl Histogram {
+    /// Creates an empty histogram.
+    pub fn new() -> Self {
+        Self {
+            buckets: (0..BUCKETS).map(|_| AtomicU64::new(0)).collect(),
+            count: AtomicU64::new(0),
+            sum: AtomicU64::new(0),
+            max: AtomicU64::new(0),
+        }
+    }
+
+    /// Records a single value.
+    pub fn record(&self, value: u64) {
+        self.buckets[Self::bucket_index(value)].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(value, Ordering::Relaxed);
+        self.max.fetch_max(value, Ordering::Relaxed);
+    }
+
+    /// Returns the number of recorded values.
+    pub fn count(&self) -> u64 {
+        self.count.load(Ordering::Relaxed)
+    }
+
+    /// Returns the largest recorded value, or 0 if nothing was recorded.
+    pub fn max(&self) -> u64 {
+        self.max.load(Ordering::Relaxed)
+    }
+
+    /// Returns the mean of the recorded values, or 0 if nothing was recorded.
+    pub fn mean(&self) -> u64 {
+        self.sum
+            .load(Ordering::Relaxed)
+            .checked_div(self.count())
+            .unwrap_or(0)
+    }
+
+    /// Returns an upper bound for the given percentile.
+    ///
+    /// # Arguments
+    /// * `percentile` - The percentile to query, from 0 to 100.
+    ///
+    /// # Returns
+    /// The highest value of the bucket containing the percentile, capped at
+    /// the largest recorded value, or 0 if nothing was recorded.
+    pub fn percentile(&self, percentile: f64) -> u64 {
+        let count = self.count();
+        if count == 0 {
+            return 0;
+        }
+
+        let rank = ((percentile.clamp(0.0, 100.0) / 100.0) * count as f64).ceil() as u64;
+        let rank = rank.max(1);
+        let mut seen = 0;
+
+        for (index, bucket) in self.buckets.iter().enumerate() {
+            seen += bucket.load(Ordering::Relaxed);
+            if seen >= rank {
+                return Self::bucket_high(index).min(self.max());
+            }
+        }
+
+        // Concurrent recording may have bumped the count past what the
+        // buckets show so far.
+        self.max()
+    }
+
+    /// Maps a value to its bucket.
+    fn bucket_index(value: u64) -> usize {
+        if value < SUB_BUCKETS as u64 {
+            return value as usize;
+        }
+
+        let exponent = 63 - value.leading_zeros();
+        let shift = exponent - SUB_BUCKET_BITS;
+        let mantissa = (value >> shift) as usize & (SUB_BUCKETS - 1);
+        (shift as usize + 1) * SUB_BUCKETS + mantissa
+    }
+
+    /// Returns the highest value that maps to a bucket.
+    fn bucket_high(index: usize) -> u64 {
+        if index < SUB_BUCKETS {
+            return index as u64;
+        }
+
+        let shift = (index / SUB_BUCKETS - 1) as u32;
+        let mantissa = (index % SUB_BUCKETS) as u64;
+        let low = (SUB_BUCKETS as u64 + mantissa) << shift;
+        low + ((1u64 << shift) - 1)
+    }
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// Counters and latency histograms for the key-to-exec path.
+///
+/// All latencies are in microseconds since the kernel timestamped the event.
+#[derive(Default)]
+pub struct Stats {
+    /// Keyboard events processed.
+    pub events: AtomicU64,
+    /// Completed chords that had a binding.
+    pub chords_matched: AtomicU64,
+    /// Completed chords without a binding.
+    pub misses: AtomicU64,
+    /// Bindings whose command could not be spawned.
+    pub spawn_failures: AtomicU64,
+    /// Built-in actions whose message was dropped.
+    pub builtin_failures: AtomicU64,
+    /// Matched actions that waited for a free job slot.
+    pub jobs_queued: AtomicU64,
+    /// Matched actions dropped by their job policy or a full queue.
+    pub jobs_dropped: AtomicU64,
+    /// Key sequences abandoned because their next chord came too late.
+    pub sequence_timeouts: AtomicU64,
+    /// Time until a completed chord was looked up.
+    pub match_latency: Histogram,
+    /// Time until the bound command was running.
+    pub spawn_latency: Histogram,
+    /// Time until a built-in action was carried out.
+    pub builtin_latency: Histogram,
+}
+
+impl Stats {
+    /// Creates empty statistics.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Increments one of the counters.
+    pub fn count(counter: &AtomicU64) {
+        counter.fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Renders all counters and histograms as human-readable text.
+    pub fn report(&self) -> String {
+        let mut report = String::new();
+
+        for (name, counter) in [
+            ("events", &self.events),
+            ("chords_matched", &self.chords_matched),
+            ("misses", &self.misses),
+            ("spawn_failures", &self.spawn_failures),
+            ("builtin_failures", &self.builtin_failures),
+            ("jobs_queued", &self.jobs_queued),
+            ("jobs_dropped", &self.jobs_dropped),
+            ("sequence_timeouts", &self.sequence_timeouts),
+        ] {
+            let _ = writeln!(report, "{}: {}", name, counter.load(Ordering::Relaxed));
+        }
+
+        for (name, histogram) in [
+            ("match_latency_us", &self.match_latency),
+            ("spawn_latency_us", &self.spawn_latency),
+            ("builtin_latency_us", &self.builtin_latency),
+        ] {
+            let _ = write!(
+                report,
+                "{}: count={} mean={}",
+                name,
+                histogram.count(),
+                histogram.mean()
+            );
+            for percentile in REPORT_PERCENTILES {
+                let _ = write!(
+                    report,
+                    " p{}={}",
+                    percentile,
+                    histogram.percentile(percentile)
+                );
+            }
+            report.push('\n');
+        }
+
+        report
+    }
+}
+
+/// A Unix socket that answers every connection with a stats report.
+///
+/// Reading the socket is enough to query the daemon, e.g.
+/// `socat - UNIX-CONNECT:$XDG_RUNTIME_DIR/clefd-stats.sock`.
+pub struct StatsSocket {
+    listener: UnixListener,
+    path: PathBuf,
+}
+
+impl StatsSocket {
+    /// How long a slow client may block the event loop while reading.
+    const WRITE_TIMEOUT: Duration = Duration::from_millis(100);
+
+    /// Binds the socket, replacing a stale socket file left at `path`.
+    ///
+    /// # Arguments
+    /// * `path` - Where to create the socket.
+    pub fn bind(path: &Path) -> Result<Self> {
+        match fs::remove_file(path) {
+            Err(e) if e.kind() != io::ErrorKind::NotFound => {
+                return Err(e).context(format!("Failed to remove stale socket {:?}", path))
+            }
+            _ => (),
+        }
+
+        let listener = UnixListener::bind(path)
+            .context(format!("Failed to bind stats socket at {:?}", path))?;
+        listener
+            .set_nonblocking(true)
+            .context("Failed to make stats socket non-blocking")?;
+
+        Ok(Self {
+            listener,
+            path: path.to_path_buf(),
+        })
+    }
+
+    /// Accepts every pending connection and writes a report to each.
+    ///
+    /// # Arguments
+    /// * `stats` - The statistics to report.
+    pub fn serve(&self, stats: &Stats) {
+        loop {
+            let mut stream = match self.listener.accept() {
+                Ok((stream, _)) => stream,
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => return,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(e) => {
+                    warn!("Failed to accept stats connection: {}", e);
+                    return;
+                }
+            };
+
+            let written = stream
+                .set_nonblocking(false)
+                .and_then(|_| stream.set_write_timeout(Some(Self::WRITE_TIMEOUT)))
+                .and_then(|_| stream.write_all(stats.report().as_bytes()));
+            if let Err(e) = written {
+                debug!("Failed to write stats report: {}", e);
+            }
+        }
+    }
+}
+
+impl AsFd for StatsSocket {
+    fn as_fd(&self) -> BorrowedFd<'_> {
+        self.listener.as_fd()
+    }
+}
+
+impl Drop for StatsSocket {
+    fn drop(&mut self) {
+        let _ = fs::remove_file(&self.path);
+    }
+}
+
+/// Returns the current `CLOCK_MONOTONIC` time in microseconds, the clock
+/// libinput uses for event timestamps.
+pub fn monotonic_usec() -> u64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    // SAFETY: `ts` is a valid timespec and CLOCK_MONOTONIC always exists.
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts) };
+    ts.tv_sec as u64 * 1_000_000 + ts.tv_nsec as u64 / 1_000
+}
+
+/// Returns the microseconds elapsed since a monotonic timestamp.
+///
+/// # Arguments
+/// * `since_usec` - A `CLOCK_MONOTONIC` timestamp in microseconds.
+pub fn elapsed_usec(since_usec: u64) -> u64 {
+    monotonic_usec().saturating_sub(since_usec)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn bucket_index_should_be_monotonic_and_in_range() {
+        let mut last = 0;
+        for shift in 0..64 {
+            let base = 1u64 << shift;
+            for value in [base, base + base / 3, base + base / 2, base | (base - 1)] {
+                let index = Histogram::bucket_index(value);
+                assert!(index < BUCKETS);
+                assert!(index >= last, "Index decreased at {}", value);
+                last = index;
+            }
+        }
+        assert_eq!(Histogram::bucket_index(u64::MAX), BUCKETS - 1);
+    }
+
+    #[test]
+    fn bucket_high_should_bound_values_within_precision() {
+        for value in [0, 1, 15, 16, 17, 100, 1_000, 123_456, 1 << 40, u64::MAX] {
+            let high = Histogram::bucket_high(Histogram::bucket_index(value));
+            assert!(high >= value);
+            assert!(
+                high - value <= value / SUB_BUCKETS as u64,
+                "Bucket for {} too wide: {}",
+                value,
+                high
+            );
+        }
+    }
+
+    #[test]
+    fn percentile_should_track_recorded_distribution() {
+        let histogram = Histogram::new();
+        for value in 1..=1000 {
+            histogram.record(value);
+        }
+
+        assert_eq!(histogram.count(), 1000);
+        assert_eq!(histogram.max(), 1000);
+        assert_eq!(histogram.mean(), 500);
+
+        let p50 = histogram.percentile(50.0);
+        assert!((500..=531).contains(&p50), "p50 was {}", p50);
+        let p99 = histogram.percentile(99.0);
+        assert!((990..=1000).contains(&p99), "p99 was {}", p99);
+        assert_eq!(histogram.percentile(100.0), 1000);
+    }
+
+    #[test]
+    fn percentile_should_be_zero_when_empty() {
+        let histogram = Histogram::new();
+        assert_eq!(histogram.percentile(99.0), 0);
+        assert_eq!(histogram.mean(), 0);
+    }
+
+    #[test]
+    fn report_should_include_counters_and_histograms() {
+        let stats = Stats::new();
+        Stats::count(&stats.events);
+        Stats::count(&stats.events);
+        Stats::count(&stats.misses);
+        Stats::count(&stats.sequence_timeouts);
+        stats.match_latency.record(42);
+
+        let report = stats.report();
+        assert!(report.contains("events: 2\n"));
+        assert!(report.contains("misses: 1\n"));
+        assert!(report.contains("sequence_timeouts: 1\n"));
+        assert!(report.contains("match_latency_us: count=1 mean=42 p50=42"));
+        assert!(report.contains("spawn_latency_us: count=0"));
+    }
+
+    #[test]
+    fn stats_socket_should_answer_with_report() {
+        use std::io::Read;
+        use std::os::unix::net::UnixStream;
+
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("stats.sock");
+        let socket = StatsSocket::bind(&path).expect("Failed to bind stats socket");
+        let stats = Stats::new();
+        Stats::count(&stats.chords_matched);
+
+        let mut client = UnixStream::connect(&path).unwrap();
+        socket.serve(&stats);
+
+        let mut report = String::new();
+        client.read_to_string(&mut report).unwrap();
+        assert!(report.contains("chords_matched: 1\n"));
+
+        drop(socket);
+        assert!(!path.exists(), "Socket file should be removed on drop");
+    }
+
+    #[test]
+    fn elapsed_usec_should_saturate_for_future_timestamps() {
+        assert_eq!(elapsed_usec(u64::MAX), 0);
+        assert!(elapsed_usec(0) > 0);
+    }
+}
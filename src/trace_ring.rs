@@ -0,0 +1,278 @@
+//! Provides the always-on binary trace of recent key events.
+//!
+//! Logging every key event at debug level costs formatting on the hot path
+//! and floods the journal once enabled. Instead, every event handler appends
+//! a fixed-size [`TraceRecord`] of the raw timestamp, keycode, key state and
+//! match result to a [`TraceRing`]: a wait-free ring of atomics that never
+//! allocates, formats or blocks, and silently overwrites its oldest records.
+//! The ring is only decoded into text when someone asks for it, e.g. with the
+//! control socket's `trace` request.
+//!
+//! Several event threads may append to one ring. Each slot carries a sequence
+//! number that is odd while a writer fills it, so a reader that races with a
+//! writer skips the slot instead of returning a torn record. Only writers a
+//! whole ring apart can collide on a slot, which a ring of thousands of
+//! records makes a non-issue for a handful of keyboards.
+use std::fmt;
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+
+/// How many records a ring keeps unless configured otherwise.
+pub const DEFAULT_TRACE_CAPACITY: usize = 4096;
+
+/// What handling a key event led to.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u8)]
+pub enum MatchResult {
+    /// The event did not complete a chord, e.g. a release or a modifier.
+    None = 0,
+    /// The keycode is not part of the keymap.
+    Unmapped = 1,
+    /// The completed chord has no binding.
+    Miss = 2,
+    /// The chord started or continued a key sequence.
+    Prefix = 3,
+    /// The bound action was started.
+    Run = 4,
+    /// The bound action waits for a free job slot.
+    Queued = 5,
+    /// The bound action was dropped by its job policy.
+    Dropped = 6,
+    /// The bound action failed to start.
+    Failed = 7,
+}
+
+impl MatchResult {
+    fn from_u8(value: u8) -> Self {
+        match value {
+            1 => Self::Unmapped,
+            2 => Self::Miss,
+            3 => Self::Prefix,
+            4 => Self::Run,
+            5 => Self::Queued,
+            6 => Self::Dropped,
+            7 => Self::Failed,
+            _ => Self::None,
+        }
+    }
+
+    /// Returns the name used in decoded traces.
+    pub fn name(self) -> &'static str {
+        match self {
+            Self::None => "-",
+            Self::Unmapped => "unmapped",
+            Self::Miss => "miss",
+            Self::Prefix => "prefix",
+            Self::Run => "run",
+            Self::Queued => "queued",
+            Self::Dropped => "dropped",
+            Self::Failed => "failed",
+        }
+    }
+}
+
+/// A decoded trace record.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct TraceRecord {
+    /// The kernel timestamp of the event in `CLOCK_MONOTONIC` microseconds.
+    pub time_usec: u64,
+    /// The XKB keycode.
+    pub keycode: u32,
+    /// Whether the key was pressed rather than released.
+    pub pressed: bool,
+    /// What handling the event led to.
+    pub result: MatchResult,
+}
+
+impl TraceRecord {
+    /// Packs everything but the timestamp into one word.
+    fn pack(&self) -> u64 {
+        u64::from(self.keycode) | u64::from(self.pressed) << 32 | (self.result as u64) << 40
+    }
+
+    fn unpack(time_usec: u64, packed: u64) -> Self {
+        Self {
+            time_usec,
+            keycode: packed as u32,
+            pressed: (packed >> 32) & 1 == 1,
+            result: MatchResult::from_u8((packed >> 40) as u8),
+        }
+    }
+}
+
+impl fmt::Display for TraceRecord {
+    /// Formats the record as `seconds.micros keycode state result`.
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "{}.{:06} key={} {} {}",
+            self.time_usec / 1_000_000,
+            self.time_usec % 1_000_000,
+            self.keycode,
+            if self.pressed { "pressed" } else { "released" },
+            self.result.name()
+        )
+    }
+}
+
+/// One record slot, guarded by its sequence number.
+#[derive(Default)]
+struct Slot {
+    /// `2 * index + 2` once the record with that index is complete, odd while
+    /// it is being written.
+    seq: AtomicU64,
+    time_usec: AtomicU64,
+    packed: AtomicU64,
+}
+
+/// A fixed-size ring of the most recent trace records.
+pub struct TraceRing {
+    slots: Box<[Slot]>,
+    mask: u64,
+    head: AtomicU64,
+}
+
+impl Default for TraceRing {
+    fn default() -> Self {
+        Self::new(DEFAULT_TRACE_CAPACITY)
+    }
+}
+
+impl TraceRing {
+    /// Creates an empty ring.
+    ///
+    /// # Arguments
+    /// * `capacity` - How many records to keep, rounded up to a power of two.
+    pub fn new(capacity: usize) -> Self {
+        let capacity = capacity.max(1).next_power_of_two();
+        Self {
+            slots: (0..capacity).map(|_| Slot::default()).collect(),
+            mask: capacity as u64 - 1,
+            head: AtomicU64::new(0),
+        }
+    }
+
+    /// Returns how many records the ring keeps.
+    pub fn capacity(&self) -> usize {
+        self.slots.len()
+    }
+
+    /// Appends a record, overwriting the oldest one once the ring is full.
+    pub fn record(&self, record: TraceRecord) {
+        let index = self.head.fetch_add(1, Ordering::Relaxed);
+        let slot = &self.slots[(index & self.mask) as usize];
+
+        slot.seq.store(2 * index + 1, Ordering::Relaxed);
+        fence(Ordering::Release);
+        slot.time_usec.store(record.time_usec, Ordering::Relaxed);
+        slot.packed.store(record.pack(), Ordering::Relaxed);
+        slot.seq.store(2 * index + 2, Ordering::Release);
+    }
+
+    /// Decodes the most recent records, oldest first.
+    ///
+    /// Records overwritten or still being written while reading are skipped.
+    ///
+    /// # Arguments
+    /// * `limit` - The most records to return.
+    pub fn recent(&self, limit: usize) -> Vec<TraceRecord> {
+        let head = self.head.load(Ordering::Acquire);
+        let count = (limit.min(self.capacity()) as u64).min(head);
+        let mut records = Vec::with_capacity(count as usize);
+
+        for index in head - count..head {
+            let slot = &self.slots[(index & self.mask) as usize];
+            let seq = slot.seq.load(Ordering::Acquire);
+            if seq != 2 * index + 2 {
+                continue;
+            }
+            let time_usec = slot.time_usec.load(Ordering::Relaxed);
+            let packed = slot.packed.load(Ordering::Relaxed);
+            fence(Ordering::Acquire);
+            if slot.seq.load(Ordering::Relaxed) == seq {
+                records.push(TraceRecord::unpack(time_usec, packed));
+            }
+        }
+
+        records
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::Arc;
+
+    fn record(time_usec: u64, result: MatchResult) -> TraceRecord {
+        TraceRecord {
+            time_usec,
+            keycode: 38,
+            pressed: true,
+            result,
+        }
+    }
+
+    #[test]
+    fn recent_should_return_records_oldest_first() {
+        let ring = TraceRing::new(8);
+        ring.record(record(1, MatchResult::Miss));
+        ring.record(record(2, MatchResult::Run));
+
+        assert_eq!(
+            ring.recent(10),
+            vec![record(1, MatchResult::Miss), record(2, MatchResult::Run)]
+        );
+        assert_eq!(ring.recent(1), vec![record(2, MatchResult::Run)]);
+    }
+
+    #[test]
+    fn record_should_overwrite_oldest_when_full() {
+        let ring = TraceRing::new(3);
+        assert_eq!(ring.capacity(), 4);
+        for time in 0..10 {
+            ring.record(record(time, MatchResult::None));
+        }
+
+        let times: Vec<u64> = ring.recent(100).iter().map(|r| r.time_usec).collect();
+        assert_eq!(times, vec![6, 7, 8, 9]);
+    }
+
+    #[test]
+    fn record_should_survive_concurrent_writers() {
+        let ring = Arc::new(TraceRing::new(4096));
+        let writers: Vec<_> = (0..4)
+            .map(|thread| {
+                let ring = Arc::clone(&ring);
+                std::thread::spawn(move || {
+                    for i in 0..1000 {
+                        ring.record(TraceRecord {
+                            time_usec: i,
+                            keycode: thread,
+                            pressed: i % 2 == 0,
+                            result: MatchResult::Prefix,
+                        });
+                    }
+                })
+            })
+            .collect();
+        for writer in writers {
+            writer.join().unwrap();
+        }
+
+        let records = ring.recent(4096);
+        assert_eq!(records.len(), 4000);
+        assert!(records
+            .iter()
+            .all(|r| r.keycode < 4 && r.pressed == (r.time_usec % 2 == 0)));
+    }
+
+    #[test]
+    fn display_should_decode_record() {
+        let record = TraceRecord {
+            time_usec: 12_000_345,
+            keycode: 38,
+            pressed: false,
+            result: MatchResult::Dropped,
+        };
+        assert_eq!(record.to_string(), "12.000345 key=38 released dropped");
+    }
+}
@@ -1,185 +1,1159 @@
 //! Provides loading and live reloading of user-defined keybinding configuration.
 //!
 //! The [`UserConfig`] struct provides a thread-safe mapping from key sequences
-//! to commands, stored in an [`Arc<RwLock<_>>`] for safe concurrent access.
-//! Configurations are loaded from a simple, human-editable file format, and
-//! the module automatically watches the file for changes, reloading keybindings
-//! on the fly. Parsing errors and I/O issues are surfaced using [`anyhow`] and
-//! logged via [`log`] to help users diagnose problems quickly.
-use crate::keybindings::Keybindings;
+//! to commands, published as an atomically swapped snapshot so readers never
+//! block on a reload.
+//! Configurations are loaded from a simple, human-editable file format that
+//! can splice in further files with `include` and `include-dir` lines, and a
+//! [`ConfigWatcher`] lets the event loop watch every file through inotify,
+//! reloading keybindings on the fly. Reloads go through a [`ConfigLoader`],
+//! which only reparses the files and lines that changed, in parallel, and
+//! patches the published table.
+//! The files themselves are read into memory once and parsed in place by
+//! [`config_parser`].
+//! Parsing errors and I/O issues are surfaced using [`anyhow`] and logged via
+//! [`log`] to help users diagnose problems quickly.
+use crate::action::Action;
+use crate::binding_cache::{self, BindingCache};
+use crate::chord_state::ChordKey;
+use crate::config_parser::{self, ConfigLine, Directive, FileContents, Parser};
+use crate::keybindings::{self, Binding, BindingTable, KeySequence, Keybindings};
+use crate::path_search::{self, ProgramResolver};
 use anyhow::{anyhow, Context, Result};
-use log::{debug, error, info};
-use notify::{RecommendedWatcher, RecursiveMode, Watcher};
-use std::collections::HashMap;
+use arc_swap::ArcSwap;
+use log::{debug, error, info, warn};
+use nix::errno::Errno;
+use nix::sys::inotify::{AddWatchFlags, InitFlags, Inotify, WatchDescriptor};
+use std::collections::{HashMap, HashSet};
+use std::ffi::{OsStr, OsString};
 use std::fs;
+use std::num::NonZeroUsize;
+use std::os::fd::{AsFd, BorrowedFd};
+use std::os::unix::ffi::OsStrExt;
 use std::path::{Path, PathBuf};
-use std::sync::mpsc;
-use std::time::{Duration, Instant};
+use std::sync::Arc;
+use std::thread;
 
 pub struct UserConfig;
 
 impl UserConfig {
-    /// Read in the config file for the first time.
-    fn read_config(config_path: &Path) -> Result<HashMap<String, String>> {
-        let content = fs::read_to_string(config_path)
-            .context(format!("Failed to read config at {:?}", config_path))?;
+    /// Reads and parses a config file, and the files it includes, into a new
+    /// binding table.
+    ///
+    /// # Arguments
+    /// * `config_path` - The config file to read.
+    pub fn read_config(config_path: &Path) -> Result<BindingTable> {
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(BindingTable::new()));
+        ConfigLoader::new().reload(config_path, &keybindings)?;
 
-        // Parse the config into a mapping of keybindings and commands to execute.
-        content
-            .lines()
-            .enumerate()
-            .filter_map(|(line_num, line)| Self::parse_line(line, line_num))
-            .collect::<Result<HashMap<String, String>>>()
+        Ok(BindingTable::clone(&keybindings.load()))
     }
 
     /// Re-parse the config file when changes are detected.
+    ///
+    /// The new table is fully built before it is published, so readers see
+    /// either the old or the new bindings, never a partial update.
     pub fn reload_config(config_path: &Path, keybindings: &Keybindings) -> Result<()> {
         info!("Reloading keybindings from {:?}", config_path);
 
         let updated_keybindings = Self::read_config(config_path)?;
 
-        // Acquire a write lock on the keybindings to replace its contents.
-        let mut guard = keybindings
-            .write()
-            .expect("Failed to acquire write lock to update keybindings.");
+        keybindings.store(Arc::new(updated_keybindings));
+        Ok(())
+    }
+
+    /// Parses a single config line into a binding.
+    ///
+    /// # Arguments
+    /// * `line` - The line to parse.
+    /// * `line_num` - The zero-based line number, used in error messages.
+    ///
+    /// # Returns
+    /// `None` for blank lines and comments, otherwise the parsed binding or
+    /// an error describing what is wrong with the line.
+    pub fn parse_line(line: &str, line_num: usize) -> Option<Result<(KeySequence, Arc<Action>)>> {
+        let line = ConfigLine::new(line, line_num)?;
+        Some(Parser::new().parse_line(&line))
+    }
+
+    /// Reads a config file into memory.
+    fn read_file(config_path: &Path) -> Result<FileContents> {
+        FileContents::read(config_path)
+            .context(format!("Failed to read config at {:?}", config_path))
+    }
+
+    /// Loads the config and starts watching it for changes.
+    ///
+    /// # Arguments
+    /// * `config_path` - The config file to load and watch.
+    /// * `keybindings` - The snapshot to publish bindings to.
+    /// * `cache` - An optional binding cache to start from and keep updated.
+    ///
+    /// # Returns
+    /// A [`ConfigWatcher`] whose descriptor the event loop must poll.
+    pub fn start_watcher(
+        config_path: PathBuf,
+        keybindings: Keybindings,
+        cache: Option<BindingCache>,
+    ) -> Result<ConfigWatcher> {
+        let mut watcher = ConfigWatcher::new(config_path, keybindings, cache)?;
+
+        // Initial reading of keybindings.
+        watcher.reload().expect("Could not reload config.");
+
+        Ok(watcher)
+    }
+}
+
+/// A config line that produced a binding.
+#[derive(Debug, Clone)]
+pub(crate) struct BindingLine {
+    pub(crate) text: Box<str>,
+    pub(crate) sequence: KeySequence,
+    pub(crate) action: Arc<Action>,
+}
+
+/// What an incremental reload did.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ReloadSummary {
+    /// Lines that had to be parsed again.
+    pub reparsed: usize,
+    /// Chords whose binding was added, replaced or removed.
+    pub changed: usize,
+    /// Key sequences bound by more than one file of the config.
+    pub conflicts: usize,
+}
+
+/// A file spliced into the config by an `include` or `include-dir` line.
+#[derive(Debug, Clone, PartialEq, Eq)]
+enum Include {
+    File(PathBuf),
+    Dir(PathBuf),
+}
+
+impl Include {
+    /// Resolves a directive's path against the directory of its file.
+    ///
+    /// # Arguments
+    /// * `directive` - The directive as written.
+    /// * `base_dir` - The directory of the file containing the directive.
+    fn new(directive: Directive<'_>, base_dir: &Path) -> Self {
+        let resolve = |path: &str| match path.strip_prefix("~/").zip(dirs::home_dir()) {
+            Some((rest, home)) => home.join(rest),
+            None => base_dir.join(path),
+        };
+
+        match directive {
+            Directive::Include(path) => Self::File(resolve(path)),
+            Directive::IncludeDir(path) => Self::Dir(resolve(path)),
+        }
+    }
+
+    /// Returns the files this include splices in, in order.
+    ///
+    /// A directory contributes its regular files that are not hidden, sorted
+    /// by name. A directory that does not exist contributes nothing.
+    fn files(&self) -> Vec<PathBuf> {
+        let dir = match self {
+            Self::File(path) => return vec![path.clone()],
+            Self::Dir(dir) => dir,
+        };
+
+        let entries = match fs::read_dir(dir) {
+            Ok(entries) => entries,
+            Err(e) => {
+                warn!("Failed to read include directory {:?}: {}", dir, e);
+                return Vec::new();
+            }
+        };
+        let mut files: Vec<PathBuf> = entries
+            .filter_map(|entry| entry.ok())
+            .filter(|entry| !entry.file_name().as_bytes().starts_with(b"."))
+            .map(|entry| entry.path())
+            .filter(|path| path.is_file())
+            .collect();
+        files.sort();
+        files
+    }
+}
+
+/// A config file read during a reload, before its bindings are parsed.
+struct ReadFile {
+    file: FileContents,
+    content_hash: u64,
+    includes: Vec<(usize, Include)>,
+}
+
+impl ReadFile {
+    /// Reads a config file and its `include` lines.
+    fn open(path: &Path) -> Result<Self> {
+        let file = UserConfig::read_file(path)?;
+        let content_hash = binding_cache::content_hash(file.as_bytes());
+        let base_dir = path.parent().unwrap_or(Path::new("."));
 
-        *guard = updated_keybindings;
+        let mut bindings = 0;
+        let mut includes = Vec::new();
+        for line in config_parser::lines(file.as_str()?) {
+            match line.directive() {
+                Some(directive) => {
+                    let directive = directive.map_err(|e| anyhow!("{} in {:?}", e, path))?;
+                    includes.push((bindings, Include::new(directive, base_dir)));
+                }
+                None => bindings += 1,
+            }
+        }
+
+        Ok(Self {
+            file,
+            content_hash,
+            includes,
+        })
+    }
+}
+
+/// The new state of a config file, computed before anything is applied.
+struct FragmentUpdate {
+    content_hash: u64,
+    lines: Vec<BindingLine>,
+    includes: Vec<(usize, Include)>,
+    reparsed: usize,
+    /// The first chords of every line that was edited, added or removed.
+    changed: HashSet<ChordKey>,
+    /// Whether the lines must be written back to the binding cache.
+    store_cache: bool,
+}
+
+/// One file of the config: the file itself or a fragment it includes.
+#[derive(Debug, Default)]
+struct Fragment {
+    content_hash: Option<u64>,
+    lines: Vec<BindingLine>,
+    /// The includes of the file, each with the number of binding lines
+    /// before it.
+    includes: Vec<(usize, Include)>,
+    /// The files each include spliced in at the last load.
+    spliced: Vec<(usize, Vec<PathBuf>)>,
+    cache: Option<BindingCache>,
+}
+
+impl Fragment {
+    /// Diffs new content of the file against the lines of its last load.
+    ///
+    /// The common prefix and suffix of the old and new lines are kept as they
+    /// are, and only the edited region in between is diffed: lines that just
+    /// moved keep their parsed action, and every other line is parsed again.
+    ///
+    /// # Arguments
+    /// * `read` - The file as just read.
+    fn update(&self, read: &ReadFile) -> Result<FragmentUpdate> {
+        let content = read.file.as_str()?;
+
+        if self.content_hash.is_none() {
+            if let Some(lines) = self.load_cache(read.content_hash) {
+                return Ok(FragmentUpdate {
+                    content_hash: read.content_hash,
+                    changed: lines.iter().map(|line| line.sequence.first).collect(),
+                    lines,
+                    includes: read.includes.clone(),
+                    reparsed: 0,
+                    store_cache: false,
+                });
+            }
+        }
+
+        let new_lines: Vec<ConfigLine> = config_parser::lines(content)
+            .filter(|line| line.directive().is_none())
+            .collect();
+
+        // Only the region between the common prefix and suffix was edited.
+        let old_lines = &self.lines;
+        let prefix = old_lines
+            .iter()
+            .zip(&new_lines)
+            .take_while(|(old, new)| *old.text == *new.text)
+            .count();
+        let suffix = old_lines[prefix..]
+            .iter()
+            .rev()
+            .zip(new_lines[prefix..].iter().rev())
+            .take_while(|(old, new)| *old.text == *new.text)
+            .count();
+        let old_edited = &old_lines[prefix..old_lines.len() - suffix];
+        let new_edited = &new_lines[prefix..new_lines.len() - suffix];
+
+        // Lines that merely moved within the edited region keep their parse.
+        let reusable: HashMap<&str, &BindingLine> =
+            old_edited.iter().map(|line| (&*line.text, line)).collect();
+
+        let mut parser = Parser::new();
+        let mut reparsed = 0;
+        let mut edited = Vec::with_capacity(new_edited.len());
+        for line in new_edited {
+            let line = match reusable.get(line.text) {
+                Some(&reused) => reused.clone(),
+                None => {
+                    reparsed += 1;
+                    let (sequence, action) = parser.parse_line(line)?;
+                    BindingLine {
+                        text: line.text.into(),
+                        sequence,
+                        action,
+                    }
+                }
+            };
+            edited.push(line);
+        }
+
+        let changed = old_edited
+            .iter()
+            .chain(&edited)
+            .map(|line| line.sequence.first)
+            .collect();
+
+        let mut lines = Vec::with_capacity(new_lines.len());
+        lines.extend_from_slice(&old_lines[..prefix]);
+        lines.extend(edited);
+        lines.extend_from_slice(&old_lines[old_lines.len() - suffix..]);
+
+        Ok(FragmentUpdate {
+            content_hash: read.content_hash,
+            lines,
+            includes: read.includes.clone(),
+            reparsed,
+            changed,
+            store_cache: true,
+        })
+    }
+
+    /// Takes over the state computed by [`Fragment::update`].
+    fn apply(&mut self, update: FragmentUpdate) {
+        self.content_hash = Some(update.content_hash);
+        self.lines = update.lines;
+        self.includes = update.includes;
+
+        if update.store_cache {
+            self.store_cache();
+        }
+    }
+
+    /// Returns the cached lines if the cache matches the file.
+    fn load_cache(&self, content_hash: u64) -> Option<Vec<BindingLine>> {
+        let cache = self.cache.as_ref()?;
+
+        match cache.load(content_hash) {
+            Ok(Some(lines)) => {
+                info!(
+                    "Loaded {} bindings from cache {:?}",
+                    lines.len(),
+                    cache.path()
+                );
+                Some(lines)
+            }
+            Ok(None) => {
+                debug!("Binding cache {:?} is stale", cache.path());
+                None
+            }
+            Err(e) => {
+                warn!("Ignoring binding cache: {:#}", e);
+                None
+            }
+        }
+    }
+
+    /// Writes the current lines to the cache, if there is one.
+    ///
+    /// A cache that cannot be written only costs a slower next start.
+    fn store_cache(&self) {
+        if let (Some(cache), Some(content_hash)) = (&self.cache, self.content_hash) {
+            if let Err(e) = cache.store(content_hash, &self.lines) {
+                warn!("Failed to update binding cache: {:#}", e);
+            }
+        }
+    }
+}
+
+/// Reloads a config incrementally.
+///
+/// A config is its file plus the fragments spliced in where the file, or a
+/// fragment, has an `include PATH` or `include-dir DIR` line; paths are
+/// relative to the including file. The loader remembers the binding lines
+/// of every file from the last successful load. On reload, only files whose
+/// content changed are parsed again, each one on its own thread, and within a
+/// file only the edited lines (see [`Fragment::update`]). The bindings of
+/// every chord that starts a changed line are then rebuilt from all lines
+/// starting with that chord, in include order (the last definition wins, as
+/// with a full parse), and patched into the current table. Saves that leave
+/// the content or the resulting bindings unchanged do not publish a new
+/// snapshot at all. A key sequence bound by more than one file is reported
+/// as a conflict; the later binding wins.
+///
+/// With a [`BindingCache`], the first load restores the lines of every file
+/// from its cache when it matches the file, and every load that parsed a file
+/// writes its cache back.
+#[derive(Debug, Default)]
+pub struct ConfigLoader {
+    root: Option<PathBuf>,
+    fragments: HashMap<PathBuf, Fragment>,
+    cache: Option<BindingCache>,
+}
+
+impl ConfigLoader {
+    /// Creates a loader that has not loaded anything yet.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Creates a loader that starts from, and keeps updating, a binding cache.
+    ///
+    /// Included fragments get caches of their own next to it.
+    ///
+    /// # Arguments
+    /// * `cache` - The cache of the config this loader will load.
+    pub fn with_cache(cache: BindingCache) -> Self {
+        Self {
+            cache: Some(cache),
+            ..Self::default()
+        }
+    }
+
+    /// Reloads the config, publishing only the bindings that changed.
+    ///
+    /// Every file of the config is read again. The first load replaces the
+    /// whole table. If any edited line fails to parse, nothing is published
+    /// and the loader keeps its previous state.
+    ///
+    /// # Arguments
+    /// * `config_path` - The config file to read.
+    /// * `keybindings` - The snapshot to patch.
+    ///
+    /// # Returns
+    /// `None` if no file of the config changed since the last load.
+    pub fn reload(
+        &mut self,
+        config_path: &Path,
+        keybindings: &Keybindings,
+    ) -> Result<Option<ReloadSummary>> {
+        self.update(config_path, None, keybindings)
+    }
+
+    /// Reloads some files of the config, publishing only the bindings that
+    /// changed.
+    ///
+    /// Files of the config that were not loaded before are read as well.
+    ///
+    /// # Arguments
+    /// * `config_path` - The config file to read.
+    /// * `files` - The files that may have changed.
+    /// * `keybindings` - The snapshot to patch.
+    ///
+    /// # Returns
+    /// `None` if none of the files changed since the last load.
+    pub fn reload_files(
+        &mut self,
+        config_path: &Path,
+        files: &HashSet<PathBuf>,
+        keybindings: &Keybindings,
+    ) -> Result<Option<ReloadSummary>> {
+        self.update(config_path, Some(files), keybindings)
+    }
+
+    /// Returns every file of the loaded config.
+    pub fn files(&self) -> impl Iterator<Item = &Path> {
+        self.fragments.keys().map(PathBuf::as_path)
+    }
+
+    /// Returns the directories of all `include-dir` lines.
+    pub fn include_dirs(&self) -> impl Iterator<Item = &Path> {
+        self.fragments
+            .values()
+            .flat_map(|fragment| &fragment.includes)
+            .filter_map(|(_, include)| match include {
+                Include::Dir(dir) => Some(dir.as_path()),
+                Include::File(_) => None,
+            })
+    }
+
+    fn update(
+        &mut self,
+        config_path: &Path,
+        stale: Option<&HashSet<PathBuf>>,
+        keybindings: &Keybindings,
+    ) -> Result<Option<ReloadSummary>> {
+        let first_load = self.root.as_deref() != Some(config_path);
+        if first_load {
+            self.fragments.clear();
+        }
+
+        // Find every file of the config, reading those that may have changed.
+        let mut layout = Vec::new();
+        let mut read = HashMap::new();
+        self.discover(config_path, stale, &mut layout, &mut read)?;
+        let included: HashSet<&PathBuf> = layout.iter().map(|(path, _)| path).collect();
+        let dropped = self.fragments.keys().any(|path| !included.contains(path));
+        let layout_changed = layout.iter().any(|(path, spliced)| {
+            self.fragments
+                .get(path)
+                .is_some_and(|fragment| fragment.spliced != *spliced)
+        });
+
+        if read.is_empty() && !dropped && !layout_changed {
+            debug!("Config content unchanged, skipping reload");
+            return Ok(None);
+        }
+
+        let updates = self.parse_files(config_path, &layout, &read)?;
+
+        let mut reparsed = 0;
+        let mut changed = HashSet::new();
+        for (path, update) in updates {
+            reparsed += update.reparsed;
+            changed.extend(update.changed.iter().copied());
+            let cache = self.fragment_cache(config_path, &path);
+            self.fragments
+                .entry(path)
+                .or_insert_with(|| Fragment {
+                    cache,
+                    ..Fragment::default()
+                })
+                .apply(update);
+        }
+
+        // Files that are no longer included take their bindings along.
+        self.fragments.retain(|path, fragment| {
+            let keep = included.contains(path);
+            if !keep {
+                changed.extend(fragment.lines.iter().map(|line| line.sequence.first));
+            }
+            keep
+        });
+        for (path, spliced) in layout {
+            if let Some(fragment) = self.fragments.get_mut(&path) {
+                fragment.spliced = spliced;
+            }
+        }
+        // Splicing files elsewhere changes which definitions win.
+        if layout_changed {
+            changed.extend(
+                self.fragments
+                    .values()
+                    .flat_map(|fragment| &fragment.lines)
+                    .map(|line| line.sequence.first),
+            );
+        }
+        self.root = Some(config_path.to_path_buf());
+
+        let conflicts = self.report_conflicts(&read);
+        let changed = if first_load {
+            self.publish_all(keybindings)
+        } else {
+            self.publish_changed(changed, keybindings)
+        };
+
+        Ok(Some(ReloadSummary {
+            reparsed,
+            changed,
+            conflicts,
+        }))
+    }
+
+    /// Walks the include tree depth first, reading every file that is new or
+    /// may have changed.
+    ///
+    /// A file included a second time, including by itself, is skipped, so
+    /// each file is spliced in where it is first included.
+    ///
+    /// # Arguments
+    /// * `path` - The file to visit.
+    /// * `stale` - The files that may have changed, or `None` for all.
+    /// * `layout` - The files visited so far in include order, each with the
+    ///   files its includes splice in.
+    /// * `read` - The files read so far whose content changed.
+    fn discover(
+        &self,
+        path: &Path,
+        stale: Option<&HashSet<PathBuf>>,
+        layout: &mut Vec<(PathBuf, Vec<(usize, Vec<PathBuf>)>)>,
+        read: &mut HashMap<PathBuf, ReadFile>,
+    ) -> Result<()> {
+        if layout.iter().any(|(file, _)| file == path) {
+            warn!("Skipping {:?}, which is included more than once", path);
+            return Ok(());
+        }
+        let index = layout.len();
+        layout.push((path.to_path_buf(), Vec::new()));
+
+        let fragment = self.fragments.get(path);
+        let includes = match fragment {
+            Some(fragment) if stale.is_some_and(|stale| !stale.contains(path)) => {
+                fragment.includes.clone()
+            }
+            _ => {
+                let file = ReadFile::open(path)?;
+                let includes = file.includes.clone();
+                if fragment.and_then(|fragment| fragment.content_hash) != Some(file.content_hash) {
+                    read.insert(path.to_path_buf(), file);
+                }
+                includes
+            }
+        };
+
+        for (position, include) in includes {
+            let files = include.files();
+            for file in &files {
+                self.discover(file, stale, layout, read)?;
+            }
+            layout[index].1.push((position, files));
+        }
         Ok(())
     }
 
-    fn parse_line(line: &str, line_num: usize) -> Option<Result<(String, String)>> {
-        let line = line.trim();
+    /// Parses the files whose content changed, in parallel when there are
+    /// several.
+    ///
+    /// # Returns
+    /// The update of every file, or the first error in include order.
+    fn parse_files(
+        &self,
+        config_path: &Path,
+        layout: &[(PathBuf, Vec<(usize, Vec<PathBuf>)>)],
+        read: &HashMap<PathBuf, ReadFile>,
+    ) -> Result<Vec<(PathBuf, FragmentUpdate)>> {
+        let new_fragments: HashMap<&PathBuf, Fragment> = read
+            .keys()
+            .filter(|path| !self.fragments.contains_key(*path))
+            .map(|path| {
+                let fragment = Fragment {
+                    cache: self.fragment_cache(config_path, path),
+                    ..Fragment::default()
+                };
+                (path, fragment)
+            })
+            .collect();
+        let jobs: Vec<(&PathBuf, &ReadFile, &Fragment)> = layout
+            .iter()
+            .filter_map(|(path, _)| {
+                let fragment = self.fragments.get(path).or(new_fragments.get(path))?;
+                read.get(path).map(|read| (path, read, fragment))
+            })
+            .collect();
+
+        let run = |(path, read, fragment): &(&PathBuf, &ReadFile, &Fragment)| {
+            fragment.update(read).map_err(|e| {
+                if path.as_path() == config_path {
+                    e
+                } else {
+                    anyhow!("{} in {:?}", e, path)
+                }
+            })
+        };
+
+        let threads = thread::available_parallelism()
+            .map_or(1, NonZeroUsize::get)
+            .min(jobs.len());
+        let results: Vec<Result<FragmentUpdate>> = if threads <= 1 {
+            jobs.iter().map(run).collect()
+        } else {
+            let chunk_size = jobs.len().div_ceil(threads);
+            thread::scope(|scope| {
+                let workers: Vec<_> = jobs
+                    .chunks(chunk_size)
+                    .map(|chunk| scope.spawn(move || chunk.iter().map(run).collect::<Vec<_>>()))
+                    .collect();
+                workers
+                    .into_iter()
+                    .flat_map(|worker| worker.join().expect("Config parser thread panicked"))
+                    .collect()
+            })
+        };
+
+        jobs.iter()
+            .zip(results)
+            .map(|((path, _, _), update)| Ok(((*path).clone(), update?)))
+            .collect()
+    }
+
+    /// Returns the binding cache of a file of the config.
+    fn fragment_cache(&self, config_path: &Path, path: &Path) -> Option<BindingCache> {
+        let cache = self.cache.as_ref()?;
+        Some(if path == config_path {
+            cache.clone()
+        } else {
+            cache.for_fragment(path)
+        })
+    }
 
-        // Ignore whitespace and comments.
-        if line.is_empty() || line.starts_with('#') {
-            return None;
+    /// Returns every binding line in include order.
+    fn flattened(&self) -> Vec<(&Path, &BindingLine)> {
+        let mut lines = Vec::new();
+        let mut visited = HashSet::new();
+        if let Some(root) = &self.root {
+            self.flatten(root, &mut visited, &mut lines);
         }
+        lines
+    }
 
-        // Split on first colon only.
-        let mut parts = line.splitn(2, ':');
-        let key_part = parts.next();
-        let value_part = parts.next();
+    fn flatten<'s>(
+        &'s self,
+        path: &'s Path,
+        visited: &mut HashSet<&'s Path>,
+        lines: &mut Vec<(&'s Path, &'s BindingLine)>,
+    ) {
+        let Some(fragment) = self.fragments.get(path) else {
+            return;
+        };
+        if !visited.insert(path) {
+            return;
+        }
 
-        if key_part.is_none() || value_part.is_none() {
-            return Some(Err(anyhow!(
-                "Invalid key-value pair on line {}: '{}'",
-                line_num + 1,
-                line
-            )));
+        let mut next = 0;
+        for (position, files) in &fragment.spliced {
+            lines.extend(
+                fragment.lines[next..*position]
+                    .iter()
+                    .map(|line| (path, line)),
+            );
+            next = *position;
+            for file in files {
+                self.flatten(file, visited, lines);
+            }
         }
+        lines.extend(fragment.lines[next..].iter().map(|line| (path, line)));
+    }
 
-        // Remove intermediate whitespace and '+' chars.
-        let key: String = key_part
-            .unwrap()
-            .trim()
-            .replace(char::is_whitespace, "")
-            .replace('+', " ");
+    /// Warns about key sequences bound by more than one file, where one of
+    /// the files was just read.
+    ///
+    /// # Returns
+    /// The number of such conflicts.
+    fn report_conflicts(&self, read: &HashMap<PathBuf, ReadFile>) -> usize {
+        let mut bound: HashMap<(ChordKey, &[ChordKey]), &Path> = HashMap::new();
+        let mut conflicts = 0;
+
+        for (path, line) in self.flattened() {
+            let sequence = &line.sequence;
+            let Some(earlier) = bound.insert((sequence.first, &sequence.rest[..]), path) else {
+                continue;
+            };
+            if earlier != path && (read.contains_key(earlier) || read.contains_key(path)) {
+                warn!(
+                    "{} in {:?} overrides its binding in {:?}",
+                    sequence, path, earlier
+                );
+                conflicts += 1;
+            }
+        }
+
+        conflicts
+    }
 
-        let value: String = value_part.unwrap().trim().to_string();
+    /// Resolves the programs of the loaded bindings through PATH again and
+    /// publishes the bindings whose program moved, appeared or went away.
+    ///
+    /// Chords rebound over the control socket are left alone: a chord is
+    /// only patched while it still holds the binding the config gave it.
+    ///
+    /// # Arguments
+    /// * `resolver` - A resolver that has not cached the programs yet.
+    /// * `programs` - The program names to resolve again, or `None` for all.
+    /// * `keybindings` - The snapshot to patch.
+    ///
+    /// # Returns
+    /// The number of chords whose binding changed.
+    pub fn refresh_programs(
+        &mut self,
+        resolver: &mut ProgramResolver,
+        programs: Option<&HashSet<OsString>>,
+        keybindings: &Keybindings,
+    ) -> usize {
+        let runs_refreshed = |line: &BindingLine| {
+            let program = OsStr::from_bytes(line.action.program().to_bytes());
+            !programs.is_some_and(|programs| !programs.contains(program))
+        };
+        let candidates: HashSet<ChordKey> = self
+            .flattened()
+            .into_iter()
+            .filter(|(_, line)| runs_refreshed(line))
+            .map(|(_, line)| line.sequence.first)
+            .collect();
+        let before = self.rebuild(&candidates);
 
-        if key.is_empty() || value.is_empty() {
-            return Some(Err(anyhow!(
-                "Invalid key-value pair on line {}: '{}'",
-                line_num + 1,
-                line
-            )));
+        // Lines sharing an action keep sharing its replacement.
+        let mut refreshed: Vec<(Arc<Action>, Arc<Action>)> = Vec::new();
+        let mut changed = HashSet::new();
+
+        for line in self
+            .fragments
+            .values_mut()
+            .flat_map(|fragment| &mut fragment.lines)
+        {
+            if !runs_refreshed(line) {
+                continue;
+            }
+
+            let action = match refreshed
+                .iter()
+                .find(|(old, _)| Arc::ptr_eq(old, &line.action))
+            {
+                Some((_, new)) => Arc::clone(new),
+                None => {
+                    let new = Arc::new(Action::clone(&line.action).resolve(resolver));
+                    refreshed.push((Arc::clone(&line.action), Arc::clone(&new)));
+                    new
+                }
+            };
+            if action != line.action {
+                line.action = action;
+                changed.insert(line.sequence.first);
+            }
         }
 
-        Some(Ok((key, value)))
+        let current = keybindings.load();
+        changed.retain(|chord| current.get(chord) == before.get(chord));
+        if changed.is_empty() {
+            return 0;
+        }
+        self.publish_changed(changed, keybindings)
     }
 
-    pub fn start_watcher(
-        config_path: PathBuf,
-        keybindings: Keybindings,
-    ) -> Result<RecommendedWatcher> {
-        // Initial reading of keybindings.
-        Self::reload_config(&config_path, &keybindings).expect("Could not reload config.");
+    /// Builds the bindings the current lines give the given chords.
+    fn rebuild(&self, chords: &HashSet<ChordKey>) -> BindingTable {
+        // A chord is rebuilt from every line that starts with it, wherever
+        // it is in the config.
+        let mut table = BindingTable::new();
+        for (_, line) in self.flattened() {
+            if chords.contains(&line.sequence.first) {
+                keybindings::insert(&mut table, &line.sequence, Arc::clone(&line.action));
+            }
+        }
+        table
+    }
 
-        // Set up a channel to receive events from the file watcher.
-        let (tx, rx) = mpsc::channel();
+    /// Patches the bindings of the given chords, rebuilt from the current
+    /// lines, into the published table.
+    ///
+    /// Chords that end up with the binding they already have are left alone,
+    /// and no snapshot is published if none changed.
+    ///
+    /// # Returns
+    /// The number of chords whose binding changed.
+    fn publish_changed(&self, changed: HashSet<ChordKey>, keybindings: &Keybindings) -> usize {
+        let mut rebuilt = self.rebuild(&changed);
+        let current = keybindings.load();
+        let mut patch: HashMap<ChordKey, Option<Binding>> = changed
+            .into_iter()
+            .map(|chord| (chord, rebuilt.remove(&chord)))
+            .collect();
+        patch.retain(|chord, binding| current.get(chord) != binding.as_ref());
+
+        let len = patch.len();
+        if patch.is_empty() {
+            debug!("No binding changed");
+            return 0;
+        }
 
-        // Create the file watcher.
-        let mut watcher = RecommendedWatcher::new(tx, notify::Config::default())
-            .context("Failed to create file watcher")?;
+        let mut table = BindingTable::clone(&current);
+        for (chord, binding) in patch {
+            match binding {
+                Some(binding) => table.insert(chord, binding),
+                None => table.remove(&chord),
+            };
+        }
+        keybindings.store(Arc::new(table));
 
-        // Register the watch path.
+        len
+    }
+
+    /// Publishes a table built from all lines, returning its size.
+    fn publish_all(&self, keybindings: &Keybindings) -> usize {
+        let mut table = BindingTable::new();
+        for (_, line) in self.flattened() {
+            keybindings::insert(&mut table, &line.sequence, Arc::clone(&line.action));
+        }
+        let len = table.len();
+        keybindings.store(Arc::new(table));
+        len
+    }
+}
+
+/// Watches the files of the config through an inotify descriptor.
+///
+/// The parent directories are watched rather than the files themselves, so
+/// editors that save by writing a new file and renaming it over the old one
+/// are picked up too. Only completed writes (`IN_CLOSE_WRITE`) and renames
+/// into place (`IN_MOVED_TO`) trigger a reload, so there is no need to sleep
+/// or debounce while an editor is still writing. Every event names the file
+/// it concerns, so only that file is read and parsed again. In the directory
+/// of an `include-dir` line, removing or renaming a file away reloads too.
+///
+/// The same descriptor watches the PATH directories. When a file is created,
+/// removed, renamed or has its mode changed there, the bindings running a
+/// program of that name are resolved again.
+pub struct ConfigWatcher {
+    inotify: Inotify,
+    config_path: PathBuf,
+    /// The directories of the config's files and includes, by watch.
+    config_dirs: HashMap<WatchDescriptor, PathBuf>,
+    path_watches: HashSet<WatchDescriptor>,
+    keybindings: Keybindings,
+    loader: ConfigLoader,
+}
+
+/// The config events that trigger a reload.
+const CONFIG_EVENTS: AddWatchFlags =
+    AddWatchFlags::IN_CLOSE_WRITE.union(AddWatchFlags::IN_MOVED_TO);
+
+/// The events in include directories that remove a file from the config.
+const REMOVAL_EVENTS: AddWatchFlags = AddWatchFlags::IN_DELETE.union(AddWatchFlags::IN_MOVED_FROM);
+
+/// The events in PATH directories that may change where a program is found.
+const PATH_EVENTS: AddWatchFlags = AddWatchFlags::IN_CREATE
+    .union(REMOVAL_EVENTS)
+    .union(AddWatchFlags::IN_MOVED_TO)
+    .union(AddWatchFlags::IN_ATTRIB);
+
+/// Extends the mask of a directory that is already watched rather than
+/// replacing it, since config and PATH directories may coincide. nix lacks a
+/// name for it.
+const MASK_ADD: AddWatchFlags = AddWatchFlags::from_bits_retain(libc::IN_MASK_ADD);
+
+impl ConfigWatcher {
+    /// Creates a non-blocking inotify watch on the config's directory.
+    ///
+    /// The directories of included files are watched once they are loaded.
+    ///
+    /// # Arguments
+    /// * `config_path` - The config file to watch.
+    /// * `keybindings` - The snapshot to publish reloaded bindings to.
+    /// * `cache` - An optional binding cache for the loader.
+    pub fn new(
+        config_path: PathBuf,
+        keybindings: Keybindings,
+        cache: Option<BindingCache>,
+    ) -> Result<Self> {
         let config_dir = config_path.parent().ok_or_else(|| {
             anyhow!(
                 "Config file path has no parent directory: {:?}",
                 config_path
             )
         })?;
+        if config_path.file_name().is_none() {
+            return Err(anyhow!(
+                "Config file path has no file name: {:?}",
+                config_path
+            ));
+        }
+
+        let inotify = Inotify::init(InitFlags::IN_NONBLOCK | InitFlags::IN_CLOEXEC)
+            .context("Failed to create inotify instance")?;
 
-        watcher
-            .watch(config_dir, RecursiveMode::NonRecursive)
+        let config_watch = inotify
+            .add_watch(config_dir, CONFIG_EVENTS | REMOVAL_EVENTS | MASK_ADD)
             .context(format!("Failed to watch config file at {:?}", config_path))?;
+        let config_dirs = HashMap::from([(config_watch, config_dir.to_path_buf())]);
 
         info!("Watching configuration file for changes: {:?}", config_path);
 
-        std::thread::spawn(move || {
-            Self::watcher_event_handler(rx, config_path, keybindings);
-        });
+        let mut path_watches = HashSet::new();
+        for dir in path_search::search_path() {
+            match inotify.add_watch(&dir, PATH_EVENTS | MASK_ADD) {
+                Ok(watch) => {
+                    path_watches.insert(watch);
+                }
+                Err(e) => debug!("Not watching PATH directory {:?}: {}", dir, e),
+            }
+        }
 
-        Ok(watcher)
+        Ok(Self {
+            inotify,
+            config_path,
+            config_dirs,
+            path_watches,
+            keybindings,
+            loader: cache.map_or_else(ConfigLoader::new, ConfigLoader::with_cache),
+        })
     }
 
-    /// Handles events on the watcher thread.
+    /// Reloads every file of the config through the incremental loader.
     ///
-    /// We want to filter on file save, and event kind `is_modify()` should be
-    /// sufficient for this. Note that different OSes send different variations
-    /// of EventKind::Modify.
-    fn watcher_event_handler(
-        receiver: mpsc::Receiver<Result<notify::Event, notify::Error>>,
-        config_path: PathBuf,
-        keybindings: Keybindings,
-    ) {
-        let mut last_reload = Instant::now() - Duration::from_secs(1);
+    /// # Returns
+    /// `true` if the published keybindings changed.
+    pub fn reload(&mut self) -> Result<bool> {
+        let summary = self.loader.reload(&self.config_path, &self.keybindings);
+        self.watch_new_dirs();
+        Ok(Self::log_summary(summary?))
+    }
 
-        for event_result in receiver {
-            let event = match event_result {
-                Ok(ev) => ev,
-                Err(e) => {
-                    error!("Configuration watch error: {:?}", e);
-                    continue;
-                }
-            };
+    /// Reloads the given files of the config through the incremental loader.
+    fn reload_files(&mut self, files: &HashSet<PathBuf>) -> Result<bool> {
+        let summary = self
+            .loader
+            .reload_files(&self.config_path, files, &self.keybindings);
+        self.watch_new_dirs();
+        Ok(Self::log_summary(summary?))
+    }
 
-            // Only handle modify events.
-            if !event.kind.is_modify() {
-                continue;
+    /// Logs what a reload did and returns whether bindings changed.
+    fn log_summary(summary: Option<ReloadSummary>) -> bool {
+        match summary {
+            Some(summary) => {
+                debug!(
+                    "Reparsed {} lines, {} bindings changed, {} conflicts",
+                    summary.reparsed, summary.changed, summary.conflicts
+                );
+                summary.changed > 0
             }
+            None => false,
+        }
+    }
 
-            let now = Instant::now();
+    /// Watches the directories of files and includes the config gained.
+    fn watch_new_dirs(&mut self) {
+        let dirs: HashSet<PathBuf> = self
+            .loader
+            .files()
+            .filter_map(Path::parent)
+            .chain(self.loader.include_dirs())
+            .map(Path::to_path_buf)
+            .collect();
 
-            // Debounce check, only reload every 50 ms.
-            if now.duration_since(last_reload) <= Duration::from_millis(50) {
-                debug!("Skipping rapid successive modify event");
+        for dir in dirs {
+            if self.config_dirs.values().any(|watched| *watched == dir) {
                 continue;
             }
+            match self
+                .inotify
+                .add_watch(&dir, CONFIG_EVENTS | REMOVAL_EVENTS | MASK_ADD)
+            {
+                Ok(watch) => {
+                    debug!("Watching config directory {:?}", dir);
+                    self.config_dirs.insert(watch, dir);
+                }
+                Err(e) => warn!("Failed to watch config directory {:?}: {}", dir, e),
+            }
+        }
+    }
 
-            // Allow the editor to finish writing.
-            std::thread::sleep(Duration::from_millis(20));
+    /// Drains all pending inotify events, then reloads the files of the
+    /// config they concerned and resolves the programs again whose names
+    /// changed in a PATH directory.
+    ///
+    /// # Returns
+    /// `true` if the published keybindings changed.
+    pub fn handle_events(&mut self) -> bool {
+        let files: HashSet<PathBuf> = self.loader.files().map(Path::to_path_buf).collect();
+        let include_dirs: HashSet<PathBuf> =
+            self.loader.include_dirs().map(Path::to_path_buf).collect();
+        let mut stale = HashSet::new();
+        let mut programs = HashSet::new();
+        let mut overflowed = false;
 
+        loop {
+            match self.inotify.read_events() {
+                Ok(events) => {
+                    for event in events {
+                        if event.mask.contains(AddWatchFlags::IN_Q_OVERFLOW) {
+                            overflowed = true;
+                            continue;
+                        }
+                        let Some(name) = event.name else {
+                            continue;
+                        };
+                        if let Some(dir) = self.config_dirs.get(&event.wd) {
+                            let path = dir.join(&name);
+                            let in_include_dir = include_dirs.contains(dir);
+                            let relevant = (event.mask.intersects(CONFIG_EVENTS)
+                                && (in_include_dir
+                                    || files.contains(&path)
+                                    || path == self.config_path))
+                                || (event.mask.intersects(REMOVAL_EVENTS) && in_include_dir);
+                            if relevant {
+                                stale.insert(path);
+                            }
+                        }
+                        if self.path_watches.contains(&event.wd)
+                            && event.mask.intersects(PATH_EVENTS)
+                        {
+                            programs.insert(name);
+                        }
+                    }
+                }
+                Err(Errno::EAGAIN) => break,
+                Err(Errno::EINTR) => continue,
+                Err(e) => {
+                    error!("Configuration watch error: {}", e);
+                    break;
+                }
+            }
+        }
+
+        let mut changed = false;
+        if overflowed || !stale.is_empty() {
             info!("Configuration file modified, reloading...");
-            if let Err(e) = Self::reload_config(&config_path, &keybindings) {
-                error!("Failed to reload keybindings: {}", e);
+            // After an overflow, any file may have changed.
+            let result = if overflowed {
+                self.reload()
             } else {
-                info!("Keybindings reloaded successfully from {:?}", config_path);
+                self.reload_files(&stale)
+            };
+            match result {
+                Ok(reloaded) => {
+                    info!(
+                        "Keybindings reloaded successfully from {:?}",
+                        self.config_path
+                    );
+                    changed |= reloaded;
+                }
+                Err(e) => error!("Failed to reload keybindings: {}", e),
             }
+        }
 
-            last_reload = now;
+        // After an overflow, any program may have moved.
+        if overflowed || !programs.is_empty() {
+            let programs = (!overflowed).then_some(&programs);
+            let refreshed = self.loader.refresh_programs(
+                &mut ProgramResolver::new(),
+                programs,
+                &self.keybindings,
+            );
+            if refreshed > 0 {
+                info!(
+                    "PATH changed, updated the programs of {} bindings",
+                    refreshed
+                );
+                changed = true;
+            }
         }
-        info!("Configuration watcher thread exiting.");
+
+        changed
+    }
+}
+
+impl AsFd for ConfigWatcher {
+    fn as_fd(&self) -> BorrowedFd<'_> {
+        self.inotify.as_fd()
     }
 }
 
 #[cfg(test)]
 mod tests {
     use super::*;
+    use crate::chord_state::{MOD_CONTROL_L, MOD_SHIFT_L, MOD_SUPER_L};
+    use arc_swap::ArcSwap;
     use std::collections::HashMap;
+    use std::ffi::CString;
+    use std::fs;
     use std::io::Write;
-    use std::sync::{Arc, RwLock};
     use tempfile::NamedTempFile;
+    use xkbcommon::xkb;
+    use xkbcommon::xkb::keysyms;
+
+    /// Returns the command a chord runs, if it is bound to an action.
+    fn raw_action(table: &BindingTable, chord: &ChordKey) -> Option<String> {
+        match table.get(chord) {
+            Some(Binding::Action(action)) => Some(action.raw().to_string()),
+            _ => None,
+        }
+    }
 
     /// Helper to create a temporary config file.
     fn create_temp_config(content: &str) -> NamedTempFile {
@@ -190,16 +1164,70 @@ mod tests {
 
     #[test]
     fn read_config_should_succeed_with_valid_file() {
-        let temp_file = create_temp_config("test_key: test_command");
+        let temp_file = create_temp_config("Super_L + w: test_command");
         let config_path = temp_file.path().to_path_buf();
         let keybindings = UserConfig::read_config(&config_path)
             .expect("Reading valid config file should succeed");
 
         let mut expected = HashMap::new();
-        expected.insert("test_key".to_string(), "test_command".to_string());
+        expected.insert(
+            ChordKey::new(MOD_SUPER_L, xkb::Keysym::new(keysyms::KEY_w)),
+            Binding::Action(Arc::new(Action::parse("test_command").unwrap())),
+        );
         assert_eq!(keybindings, expected);
     }
 
+    #[test]
+    fn parse_line_should_ignore_modifier_order() {
+        let (first, _) = UserConfig::parse_line("Control_L+Shift_L+x: cmd", 0)
+            .unwrap()
+            .unwrap();
+        let (second, _) = UserConfig::parse_line("Shift_L + Control_L + x: cmd", 0)
+            .unwrap()
+            .unwrap();
+
+        assert_eq!(first, second);
+        assert_eq!(
+            first,
+            KeySequence::chord(ChordKey::new(
+                MOD_CONTROL_L | MOD_SHIFT_L,
+                xkb::Keysym::new(keysyms::KEY_x)
+            ))
+        );
+    }
+
+    #[test]
+    fn parse_line_should_fail_with_unknown_key_name() {
+        let result = UserConfig::parse_line("Super_L+not_a_key: cmd", 0).unwrap();
+        let err = result.unwrap_err();
+        assert!(err.to_string().contains("Unknown key name 'not_a_key'"));
+    }
+
+    #[test]
+    fn parse_line_should_tokenize_command() {
+        let (_, action) = UserConfig::parse_line("Print: notify-send 'screen shot'", 0)
+            .unwrap()
+            .unwrap();
+        assert_eq!(action.argv().len(), 2);
+        assert_eq!(action.argv()[1].to_str().unwrap(), "screen shot");
+    }
+
+    #[test]
+    fn parse_line_should_fail_with_invalid_command() {
+        let result = UserConfig::parse_line("Print: echo \"unterminated", 0).unwrap();
+        let err = result.unwrap_err();
+        assert!(err.to_string().contains("Invalid command on line 1"));
+    }
+
+    #[test]
+    fn parse_line_should_fail_without_exactly_one_non_modifier() {
+        let only_modifiers = UserConfig::parse_line("Super_L+Shift_L: cmd", 0).unwrap();
+        assert!(only_modifiers.is_err());
+
+        let two_keys = UserConfig::parse_line("Super_L+a+b: cmd", 0).unwrap();
+        assert!(two_keys.is_err());
+    }
+
     #[test]
     fn read_config_should_fail_for_nonexistent_file() {
         let non_existent_path = PathBuf::from("non_existent_config.txt");
@@ -228,27 +1256,440 @@ mod tests {
 
     #[test]
     fn reload_should_update_keybindings_when_file_changes() {
-        let temp_file = create_temp_config("key1: command1\n");
+        let temp_file = create_temp_config("Super_L+a: command1\n");
         let config_path = temp_file.path().to_path_buf();
-        let keybindings: Keybindings = Arc::new(RwLock::new(HashMap::new()));
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
 
         // Load the config.
         UserConfig::reload_config(&config_path, &keybindings)
             .expect("Reloading config should succeed");
 
         // Update the config file.
-        fs::write(&config_path, "key2: command2\n").expect("Failed to write updated config file");
+        fs::write(&config_path, "Super_L+b: command2\n")
+            .expect("Failed to write updated config file");
 
         // Reload config.
         UserConfig::reload_config(&config_path, &keybindings)
             .expect("Reloading config should succeed");
 
         // Verify updated content.
-        let keybindings_reloaded = keybindings.read().unwrap();
+        let key1 = ChordKey::new(MOD_SUPER_L, xkb::Keysym::new(keysyms::KEY_a));
+        let key2 = ChordKey::new(MOD_SUPER_L, xkb::Keysym::new(keysyms::KEY_b));
+        let keybindings_reloaded = keybindings.load();
+        assert_eq!(
+            raw_action(&keybindings_reloaded, &key2).as_deref(),
+            Some("command2")
+        );
+        assert_eq!(keybindings_reloaded.get(&key1), None);
+    }
+
+    #[test]
+    fn config_watcher_should_reload_on_write_and_rename() {
+        let dir = tempfile::tempdir().expect("Failed to create temporary dir.");
+        let config_path = dir.path().join("clefdrc");
+        fs::write(&config_path, "Super_L+a: command1\n").unwrap();
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+
+        let mut watcher = UserConfig::start_watcher(config_path.clone(), keybindings.clone(), None)
+            .expect("Watcher should start");
+        assert!(!watcher.handle_events(), "Nothing changed yet");
+
+        // Unrelated files in the same directory are ignored.
+        fs::write(dir.path().join("other"), "x").unwrap();
+        assert!(!watcher.handle_events());
+
+        // In-place writes reload once the file is closed.
+        fs::write(&config_path, "Super_L+b: command2\n").unwrap();
+        assert!(watcher.handle_events());
+        let key = ChordKey::new(MOD_SUPER_L, xkb::Keysym::new(keysyms::KEY_b));
+        assert!(keybindings.load().contains_key(&key));
+
+        // Editors that save by renaming a new file into place.
+        let staged = dir.path().join("clefdrc.tmp");
+        fs::write(&staged, "Super_L+c: command3\n").unwrap();
+        assert!(!watcher.handle_events());
+        fs::rename(&staged, &config_path).unwrap();
+        assert!(watcher.handle_events());
+        let key = ChordKey::new(MOD_SUPER_L, xkb::Keysym::new(keysyms::KEY_c));
+        assert!(keybindings.load().contains_key(&key));
+    }
+
+    /// Generates numbered bindings, one per line.
+    fn numbered_config(count: usize) -> String {
+        (0..count)
+            .map(|i| {
+                format!(
+                    "Super_L+{}: command{}\n",
+                    (b'a' + (i % 26) as u8) as char,
+                    i
+                )
+            })
+            .collect()
+    }
+
+    #[test]
+    fn loader_should_reparse_only_edited_lines() {
+        let temp_file = create_temp_config("Super_L+a: one\nSuper_L+b: two\nSuper_L+c: three");
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+        let mut loader = ConfigLoader::new();
+
+        let first = loader
+            .reload(temp_file.path(), &keybindings)
+            .unwrap()
+            .unwrap();
+        assert_eq!(first.reparsed, 3);
+        assert_eq!(keybindings.load().len(), 3);
+
+        fs::write(
+            temp_file.path(),
+            "Super_L+a: one\nSuper_L+b: changed\nSuper_L+c: three\n",
+        )
+        .unwrap();
+        let summary = loader
+            .reload(temp_file.path(), &keybindings)
+            .unwrap()
+            .unwrap();
+        assert_eq!(summary.reparsed, 1);
+        assert_eq!(summary.changed, 1);
+
+        let key_b = ChordKey::new(MOD_SUPER_L, xkb::Keysym::new(keysyms::KEY_b));
+        assert_eq!(
+            raw_action(&keybindings.load(), &key_b).as_deref(),
+            Some("changed")
+        );
+    }
+
+    #[test]
+    fn loader_should_skip_swap_for_noop_saves() {
+        let temp_file = create_temp_config("Super_L+a: one\nSuper_L+b: two");
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+        let mut loader = ConfigLoader::new();
+        loader.reload(temp_file.path(), &keybindings).unwrap();
+        let before = keybindings.load_full();
+
+        // Same content: not even parsed.
+        fs::write(temp_file.path(), "Super_L+a: one\nSuper_L+b: two\n").unwrap();
+        assert_eq!(loader.reload(temp_file.path(), &keybindings).unwrap(), None);
+
+        // Only comments and whitespace changed: parsed, but nothing published.
+        fs::write(
+            temp_file.path(),
+            "# bindings\n  Super_L+a: one\n\nSuper_L+b: two\n",
+        )
+        .unwrap();
+        let summary = loader
+            .reload(temp_file.path(), &keybindings)
+            .unwrap()
+            .unwrap();
+        assert_eq!(summary.changed, 0);
+        assert!(Arc::ptr_eq(&before, &keybindings.load_full()));
+    }
+
+    #[test]
+    fn loader_should_match_full_parse_for_duplicates_and_removals() {
+        let temp_file = create_temp_config(&numbered_config(60));
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+        let mut loader = ConfigLoader::new();
+        loader.reload(temp_file.path(), &keybindings).unwrap();
+
+        let edits = [
+            // Swap two lines that bind the same chord.
+            numbered_config(60)
+                .replace("command0\n", "tmp\n")
+                .replace("Super_L+a: command26\n", "Super_L+a: command0\n"),
+            // Remove the last definition of a chord.
+            numbered_config(59),
+            // Insert in the middle and add a line at the top.
+            {
+                let base = numbered_config(60);
+                let lines: Vec<&str> = base.lines().collect();
+                format!(
+                    "Super_L+z: moved\n{}\nSuper_L+q: inserted\n{}\n",
+                    lines[..20].join("\n"),
+                    lines[20..].join("\n")
+                )
+            },
+            // Turn chords into sequence prefixes and back.
+            format!(
+                "{}Super_L+a, Super_L+b [300ms]: sequence\nSuper_L+b, c: other\n",
+                numbered_config(60)
+            ),
+            format!("{}Super_L+a, Super_L+c: sequence\n", numbered_config(60)),
+            numbered_config(60),
+        ];
+
+        for edit in edits {
+            fs::write(temp_file.path(), &edit).unwrap();
+            loader.reload(temp_file.path(), &keybindings).unwrap();
+
+            let expected = UserConfig::read_config(temp_file.path()).unwrap();
+            let actual = keybindings.load();
+            assert_eq!(**actual, expected, "Patched table differs for:\n{}", edit);
+        }
+    }
+
+    #[test]
+    fn loader_should_start_from_fresh_cache() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache = BindingCache::new(dir.path().join("clefdrc.bindings"));
+        let temp_file = create_temp_config("Super_L+a: one\nSuper_L+b: two");
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+
+        let first = ConfigLoader::with_cache(cache.clone())
+            .reload(temp_file.path(), &keybindings)
+            .unwrap()
+            .unwrap();
+        assert_eq!(first.reparsed, 2);
+        let parsed = keybindings.load_full();
+
+        // A restart with the same config parses nothing.
+        let mut loader = ConfigLoader::with_cache(cache.clone());
+        let restart = loader
+            .reload(temp_file.path(), &keybindings)
+            .unwrap()
+            .unwrap();
+        assert_eq!(restart.reparsed, 0);
+        assert_eq!(**keybindings.load(), *parsed);
+
+        // The restored lines still drive incremental reloads.
+        fs::write(temp_file.path(), "Super_L+a: one\nSuper_L+b: changed\n").unwrap();
+        let summary = loader
+            .reload(temp_file.path(), &keybindings)
+            .unwrap()
+            .unwrap();
+        assert_eq!(summary.reparsed, 1);
+        assert_eq!(summary.changed, 1);
+
+        // An edit made while the daemon was down makes the cache stale.
+        fs::write(temp_file.path(), "Super_L+c: three\n").unwrap();
+        let stale = ConfigLoader::with_cache(cache)
+            .reload(temp_file.path(), &keybindings)
+            .unwrap()
+            .unwrap();
+        assert_eq!(stale.reparsed, 1);
+        assert_eq!(keybindings.load().len(), 1);
+    }
+
+    #[test]
+    fn loader_should_keep_state_on_parse_error() {
+        let temp_file = create_temp_config("Super_L+a: one\n");
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+        let mut loader = ConfigLoader::new();
+        loader.reload(temp_file.path(), &keybindings).unwrap();
+
+        fs::write(temp_file.path(), "Super_L+a: one\nbroken line\n").unwrap();
+        assert!(loader.reload(temp_file.path(), &keybindings).is_err());
+        assert_eq!(keybindings.load().len(), 1);
+
+        fs::write(temp_file.path(), "Super_L+a: one\nSuper_L+b: two\n").unwrap();
+        let summary = loader
+            .reload(temp_file.path(), &keybindings)
+            .unwrap()
+            .unwrap();
+        assert_eq!(summary.reparsed, 1);
+        assert_eq!(keybindings.load().len(), 2);
+    }
+
+    /// Writes a config with an `include` and an `include-dir` line and returns
+    /// the directory holding it.
+    fn create_included_config() -> tempfile::TempDir {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(
+            dir.path().join("clefdrc"),
+            "Super_L+a: root\ninclude extra.conf\nSuper_L+b: root\ninclude-dir conf.d\n",
+        )
+        .unwrap();
+        fs::write(
+            dir.path().join("extra.conf"),
+            "Super_L+b: extra\nSuper_L+c: extra\n",
+        )
+        .unwrap();
+        fs::create_dir(dir.path().join("conf.d")).unwrap();
+        fs::write(dir.path().join("conf.d/10-c"), "Super_L+c: ten\n").unwrap();
+        fs::write(dir.path().join("conf.d/20-d"), "Super_L+d: twenty\n").unwrap();
+        fs::write(dir.path().join("conf.d/.hidden"), "Super_L+e: hidden\n").unwrap();
+        dir
+    }
+
+    /// Returns the command a Super_L chord runs.
+    fn super_action(keybindings: &Keybindings, key: u32) -> Option<String> {
+        raw_action(
+            &keybindings.load(),
+            &ChordKey::new(MOD_SUPER_L, xkb::Keysym::new(key)),
+        )
+    }
+
+    #[test]
+    fn loader_should_splice_includes_in_order() {
+        let dir = create_included_config();
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+        let mut loader = ConfigLoader::new();
+
+        let summary = loader
+            .reload(&dir.path().join("clefdrc"), &keybindings)
+            .unwrap()
+            .unwrap();
+        assert_eq!(summary.reparsed, 6);
+        assert_eq!(summary.conflicts, 2);
+        assert_eq!(loader.files().count(), 4);
+
+        let action = |key| super_action(&keybindings, key);
+        assert_eq!(action(keysyms::KEY_a).as_deref(), Some("root"));
+        assert_eq!(action(keysyms::KEY_b).as_deref(), Some("root"));
+        assert_eq!(action(keysyms::KEY_c).as_deref(), Some("ten"));
+        assert_eq!(action(keysyms::KEY_d).as_deref(), Some("twenty"));
+        assert_eq!(action(keysyms::KEY_e), None);
+    }
+
+    #[test]
+    fn loader_should_reparse_only_edited_fragments() {
+        let dir = create_included_config();
+        let config_path = dir.path().join("clefdrc");
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+        let mut loader = ConfigLoader::new();
+        loader.reload(&config_path, &keybindings).unwrap();
+
+        let edited = dir.path().join("conf.d/20-d");
+        fs::write(&edited, "Super_L+d: changed\n").unwrap();
+        let summary = loader
+            .reload_files(&config_path, &HashSet::from([edited]), &keybindings)
+            .unwrap()
+            .unwrap();
+        assert_eq!(summary.reparsed, 1);
+        assert_eq!(summary.changed, 1);
+        assert_eq!(
+            super_action(&keybindings, keysyms::KEY_d).as_deref(),
+            Some("changed")
+        );
+
+        // Removing a file from the directory restores what it overrode.
+        let removed = dir.path().join("conf.d/10-c");
+        fs::remove_file(&removed).unwrap();
+        let summary = loader
+            .reload_files(&config_path, &HashSet::from([removed]), &keybindings)
+            .unwrap()
+            .unwrap();
+        assert_eq!(summary.reparsed, 0);
+        assert_eq!(loader.files().count(), 3);
+        assert_eq!(
+            super_action(&keybindings, keysyms::KEY_c).as_deref(),
+            Some("extra")
+        );
+    }
+
+    #[test]
+    fn config_watcher_should_reload_included_files() {
+        let dir = create_included_config();
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+        let mut watcher =
+            UserConfig::start_watcher(dir.path().join("clefdrc"), keybindings.clone(), None)
+                .expect("Watcher should start");
+        assert!(!watcher.handle_events(), "Nothing changed yet");
+
+        // New files in an include directory are spliced in.
+        fs::write(dir.path().join("conf.d/30-e"), "Super_L+e: thirty\n").unwrap();
+        assert!(watcher.handle_events());
+        assert_eq!(
+            super_action(&keybindings, keysyms::KEY_e).as_deref(),
+            Some("thirty")
+        );
+
+        fs::write(dir.path().join("extra.conf"), "Super_L+f: extra\n").unwrap();
+        assert!(watcher.handle_events());
+        assert_eq!(
+            super_action(&keybindings, keysyms::KEY_f).as_deref(),
+            Some("extra")
+        );
+        assert_eq!(
+            super_action(&keybindings, keysyms::KEY_c).as_deref(),
+            Some("ten")
+        );
+    }
+
+    #[test]
+    fn loader_should_refresh_programs_that_changed_in_path() {
+        use std::os::unix::fs::PermissionsExt;
+
+        let temp_file = create_temp_config(
+            "Super_L+a: clefd-test-program x\nSuper_L+b: clefd-test-program y\n\
+             Super_L+c: /bin/true\n",
+        );
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+        let mut loader = ConfigLoader::new();
+        loader.reload(temp_file.path(), &keybindings).unwrap();
+
+        let exec_path = |key| match keybindings
+            .load()
+            .get(&ChordKey::new(MOD_SUPER_L, xkb::Keysym::new(key)))
+        {
+            Some(Binding::Action(action)) => action.exec_path().cloned(),
+            _ => panic!("Chord is not bound to an action"),
+        };
+        assert_eq!(exec_path(keysyms::KEY_a), None);
+
+        let dir = tempfile::tempdir().unwrap();
+        let program = dir.path().join("clefd-test-program");
+        fs::write(&program, "#!/bin/sh\n").unwrap();
+        fs::set_permissions(&program, fs::Permissions::from_mode(0o755)).unwrap();
+        let resolver = || ProgramResolver::with_dirs(vec![dir.path().to_path_buf()]);
+
+        let other = HashSet::from([OsString::from("other")]);
+        assert_eq!(
+            loader.refresh_programs(&mut resolver(), Some(&other), &keybindings),
+            0
+        );
+
+        let installed = HashSet::from([OsString::from("clefd-test-program")]);
+        assert_eq!(
+            loader.refresh_programs(&mut resolver(), Some(&installed), &keybindings),
+            2
+        );
+        let expected = CString::new(program.as_os_str().as_bytes()).unwrap();
+        assert_eq!(exec_path(keysyms::KEY_a), Some(expected.clone()));
+        assert_eq!(exec_path(keysyms::KEY_b), Some(expected));
+        assert_eq!(exec_path(keysyms::KEY_c), None);
+
+        assert_eq!(
+            loader.refresh_programs(&mut resolver(), None, &keybindings),
+            0
+        );
+    }
+
+    #[test]
+    fn refresh_programs_should_keep_runtime_bindings() {
+        use std::os::unix::fs::PermissionsExt;
+
+        let temp_file = create_temp_config(
+            "Super_L+a: clefd-test-program x\nSuper_L+b: clefd-test-program y\n",
+        );
+        let keybindings: Keybindings = Arc::new(ArcSwap::from_pointee(HashMap::new()));
+        let mut loader = ConfigLoader::new();
+        loader.reload(temp_file.path(), &keybindings).unwrap();
+
+        // Rebind Super_L+a the way the control socket does.
+        let chord = ChordKey::new(MOD_SUPER_L, xkb::Keysym::new(keysyms::KEY_a));
+        let mut table = BindingTable::clone(&keybindings.load());
+        let runtime = Arc::new(Action::parse("clefd-test-program runtime").unwrap());
+        table.insert(chord, Binding::Action(Arc::clone(&runtime)));
+        keybindings.store(Arc::new(table));
+
+        let dir = tempfile::tempdir().unwrap();
+        let program = dir.path().join("clefd-test-program");
+        fs::write(&program, "#!/bin/sh\n").unwrap();
+        fs::set_permissions(&program, fs::Permissions::from_mode(0o755)).unwrap();
+        let mut resolver = ProgramResolver::with_dirs(vec![dir.path().to_path_buf()]);
+
+        assert_eq!(
+            loader.refresh_programs(&mut resolver, None, &keybindings),
+            1
+        );
+        assert_eq!(
+            keybindings.load().get(&chord),
+            Some(&Binding::Action(runtime))
+        );
         assert_eq!(
-            keybindings_reloaded.get("key2"),
-            Some(&"command2".to_string())
+            super_action(&keybindings, keysyms::KEY_b).as_deref(),
+            Some("clefd-test-program y")
         );
-        assert_eq!(keybindings_reloaded.get("key1"), None);
     }
 }